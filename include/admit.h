@@ -0,0 +1,70 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+/*
+ * Admission control.
+ *
+ * With -A, the server watches how loaded it is: its thread count, the
+ * entries waiting in all mailboxes together and its resident memory,
+ * sampled every BVD_ADMIT_SAMPLE_MS by a timer (see timer.h).  Once any
+ * of them reaches its limit the server is overloaded, and stays so
+ * until all of them are back under BVD_ADMIT_LOW_PCT percent of their
+ * limits, so that it does not flap at the edge.
+ *
+ * While overloaded, it takes on no new work: a new connection is sent a
+ * NACK and closed right at accept, without a thread being started for
+ * it, and a LOGIN on a connection made earlier is NACKed before a
+ * mailbox is made for it.  The NACK sent at accept has msgid 0, the
+ * one of a LOGIN the LOGIN's msgid, and both have the payload
+ *
+ *   retry-after (milliseconds)
+ *
+ * which is BVD_ADMIT_RETRY_MS, plus up to as much again at random so
+ * that the refused clients do not all come back at once.  Clients that
+ * are logged in already carry on as before.
+ */
+
+#define BVD_ADMIT_SAMPLE_MS 100
+#define BVD_ADMIT_LOW_PCT 80
+#define BVD_ADMIT_RETRY_MS 1000
+
+typedef struct admit_limits {
+	long threads;	//0 for no limit
+	long queued;
+	long rss_mb;
+} ADMIT_LIMITS;
+
+/*
+ * The limits, -A on the command line.
+ */
+extern ADMIT_LIMITS admit_limits;
+
+/*
+ * Parse "threads,queued,rss_mb" into admit_limits; a 0 or a missing
+ * field is no limit.  Returns 0 on success, -1 if spec is malformed.
+ */
+int admit_parse(char *spec);
+
+/*
+ * Starts watching the load, if there is any limit.  Needs the timers.
+ */
+void admit_init(void);
+
+/*
+ * Whether the server is overloaded.
+ */
+int admit_overloaded(void);
+
+/*
+ * The payload of a NACK that refuses a client, see above.
+ * Returns a malloc'ed string, which is not NUL-terminated, and stores
+ * its length in *length.
+ */
+char *admit_retry_hint(int *length);
+
+/*
+ * Refuses a connection that was just accepted and closes it.
+ */
+void admit_refuse(int fd);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * Batched sends.
+ *
+ * A SEND_BATCH packet carries many messages in a single payload, so that
+ * a client sending lots of small messages pays for one packet header,
+ * one ACK and one trip through the server's dispatch loop per batch
+ * instead of per message.  The msgid in the packet header identifies
+ * the batch as a whole.
+ *
+ * The payload is a sequence of records.  Each record is a fixed-size
+ * record header, with fields in network byte order, followed by exactly
+ * length bytes in the same format as the payload of a SEND packet:
+ *
+ *   (handle of receiver)\r\n(message body)
+ *
+ * The server answers the whole batch with a single ACK whose msgid is
+ * the msgid of the batch and whose payload is a NACK bitmap of
+ * (count + 7) / 8 bytes: bit (i % 8) of byte (i / 8) is set if record i
+ * was not accepted (e.g. unknown recipient).  Records that were accepted
+ * get their own RRCPT or BOUNCE notices later, using the record's msgid,
+ * just like a plain SEND.  A malformed batch is NACKed as a whole.
+ */
+
+#define BVD_SEND_BATCH_PKT (BVD_BOUNCE_PKT + 1)
+
+/*
+ * Maximum number of records the server accepts in a single batch.
+ */
+#define BVD_BATCH_MAX_RECORDS 4096
+
+typedef struct {
+	uint32_t msgid;                // Unique ID of this message
+	uint32_t length;               // Length of the record data that follows
+} bvd_batch_record_header;
+
+/*
+ * A record of a received batch, as split out by bvd_batch_parse().
+ * The pointers point into the payload that was parsed, which has been
+ * modified so that handle is NUL-terminated.
+ */
+typedef struct {
+	int index;                     // Position of the record in the batch
+	int msgid;
+	char *handle;                  // Handle of the receiver
+	uint32_t id;                   // Interned handle (see intern.h), or BVD_NO_ID
+	char *body;                    // Message body
+	int length;                    // Number of bytes in body
+} BVD_BATCH_RECORD;
+
+/*
+ * Split the payload of a SEND_BATCH packet into its records.
+ *   payload - the payload, which is modified in place
+ *   length - the payload length
+ *   records - variable into which to store a malloc'ed array of records
+ *
+ * On success, the number of records is returned, and the caller is
+ * responsible for freeing the array (but not the data it points to).
+ * On a malformed payload, -1 is returned and nothing is allocated.
+ */
+int bvd_batch_parse(char *payload, size_t length, BVD_BATCH_RECORD **records);
+
+/*
+ * Append a record to a batch payload under construction.
+ *   buf, len, cap - the payload buffer, its used length and its capacity;
+ *                   the buffer is grown with realloc() as required
+ *   msgid - the ID of the message
+ *   handle - the handle of the receiver
+ *   body, length - the message body
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and errno is set.
+ */
+int bvd_batch_append(char **buf, size_t *len, size_t *cap, uint32_t msgid,
+		     char *handle, void *body, size_t length);
+
+#endif
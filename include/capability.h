@@ -0,0 +1,42 @@
+#ifndef CAPABILITY_H
+#define CAPABILITY_H
+
+/*
+ * Optional protocol capabilities, negotiated at LOGIN.
+ *
+ * A client that wants any of them sends a LOGIN payload of two lines:
+ *
+ *   (handle)\r\n(capability names separated by spaces)
+ *
+ * The server ignores names it does not know and answers with an ACK
+ * whose payload lists the capabilities it has turned on for the session,
+ * in the same space-separated form.  A LOGIN without the second line
+ * gets a plain, empty ACK, so clients that know nothing of this are
+ * unaffected.
+ */
+
+#define BVD_CAP_COALESCE 0x1	// "coalesce": ACK/RRCPT ranges, see coalesce.h
+#define BVD_CAP_LZ4 0x2		// "lz4": framed, compressed bodies, see compress.h
+#define BVD_CAP_HEARTBEAT 0x4	// "heartbeat": HEARTBEATs when quiet, see server_ext.h
+#define BVD_CAP_DEDUP 0x8	// "dedup": SENDs sent again are ACKed, not delivered, see dedup.h
+#define BVD_CAP_V2 0x10		// "v2": compact framing after the LOGIN, see wire.h
+
+/*
+ * Capabilities this server is willing to turn on.
+ */
+#define BVD_CAPS_SUPPORTED (BVD_CAP_COALESCE | BVD_CAP_LZ4 | BVD_CAP_HEARTBEAT | BVD_CAP_DEDUP | BVD_CAP_V2)
+
+/*
+ * Parse a line of space-separated capability names into a set of flags.
+ * Unknown names are ignored.
+ */
+int bvd_caps_parse(char *line);
+
+/*
+ * Format a set of flags as space-separated capability names.
+ * Returns a malloc'ed string, which is not NUL-terminated, and stores
+ * its length in *length.  If caps is 0, NULL is returned and *length is 0.
+ */
+char *bvd_caps_format(int caps, int *length);
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * libbvdclient: an asynchronous client of the Bavarde server.
+ *
+ * A BVD_CLIENT is one logged-in connection, run by an I/O thread of its
+ * own.  client_send() only queues a message and returns its msgid; the
+ * I/O thread writes what is queued as fast as the socket takes it, and
+ * whatever piles up meanwhile goes out packed into SEND_BATCH packets
+ * (see batch.h) of up to max_batch messages.  So a producer never waits
+ * for a round trip, only for the window: at most window messages may be
+ * without an outcome, and client_send() waits for room beyond that.
+ *
+ * What becomes of a message is reported to the function it was sent
+ * with, as one of
+ *   CLIENT_ACKED      the server took it
+ *   CLIENT_DELIVERED  it was delivered (an RRCPT came back)
+ *   CLIENT_BOUNCED    it could not be delivered (a BOUNCE came back)
+ *   CLIENT_NACKED     the server refused it, e.g. for an unknown receiver
+ *                     or a rate limit
+ *   CLIENT_LOST       the connection dropped after the ACK, so what
+ *                     became of it will never be known
+ * A message that was taken gets CLIENT_ACKED first, even if its RRCPT
+ * overtook the ACK, and then exactly one of the others, its outcome.
+ * A refused one gets CLIENT_NACKED only.
+ *
+ * When the connection drops, the I/O thread connects and logs in again,
+ * BVD_CLIENT_BACKOFF_MS later, then twice as long after each failed try
+ * up to BVD_CLIENT_BACKOFF_MAX_MS.  Messages the server had not ACKed
+ * are sent again on the new connection, in order, so one whose ACK was
+ * lost may arrive twice; those that were ACKed get CLIENT_LOST.  What is
+ * sent meanwhile is queued.
+ *
+ * Unless told otherwise, the client asks for the capabilities it handles
+ * itself (see capability.h): "coalesce", whose ranged notices are
+ * reported message by message; "heartbeat", which the I/O thread
+ * answers; and "v2", where the receiver of a message is named by ID
+ * once it has been named (see wire.h).  Bodies are passed through as
+ * they are, so with "lz4" the caller frames them (see compress.h).
+ *
+ * A client on the same machine as the server may connect to its
+ * Unix-domain socket instead (path), and have the connection carried
+ * over shared memory (shm, see shm.h): then the packets go through two
+ * rings, and the I/O thread makes no system call while it has something
+ * to read or room to write.
+ *
+ * The functions given to the client run on the I/O thread, without any
+ * lock of the client held, and hold up all its I/O while they run.  They
+ * may call client_send(), which there never waits for room; they must
+ * not call client_flush() or client_close().
+ *
+ * make libbvdclient builds lib/libbvdclient.a; link it with -lpthread.
+ */
+
+#define CLIENT_ACKED 1
+#define CLIENT_DELIVERED 2
+#define CLIENT_BOUNCED 3
+#define CLIENT_NACKED 4
+#define CLIENT_LOST 5
+
+#define BVD_CLIENT_CAPS "coalesce heartbeat v2"
+#define BVD_CLIENT_WINDOW 8192
+#define BVD_CLIENT_MAX_BATCH 256
+#define BVD_CLIENT_BACKOFF_MS 100
+#define BVD_CLIENT_BACKOFF_MAX_MS 5000
+
+/*
+ * How long connecting and logging in may take, and writing out what is
+ * left at client_close().
+ */
+#define BVD_CLIENT_TIMEOUT_MS 5000
+
+typedef struct bvd_client BVD_CLIENT;
+
+/*
+ * What becomes of a message, with the arg it was sent with.
+ */
+typedef void (CLIENT_RESULT_FN)(BVD_CLIENT *c, uint32_t msgid, int outcome, void *arg);
+
+/*
+ * A message delivered to the client.  from is the handle of its sender;
+ * neither it nor body may be used after the function returns.
+ */
+typedef void (CLIENT_DLVR_FN)(BVD_CLIENT *c, char *from, void *body, size_t length, void *arg);
+
+/*
+ * The connection dropped (up is 0), or is logged in again (up is 1).
+ */
+typedef void (CLIENT_STATE_FN)(BVD_CLIENT *c, int up, void *arg);
+
+typedef struct {
+	char *host;                    // unless path is given
+	int port;
+	char *handle;
+	char *caps;                    // NULL for BVD_CLIENT_CAPS, "" for none
+	int window;                    // 0 for BVD_CLIENT_WINDOW
+	int max_batch;                 // 0 for BVD_CLIENT_MAX_BATCH, 1 for no SEND_BATCHes
+	CLIENT_DLVR_FN *on_dlvr;       // may be NULL
+	CLIENT_STATE_FN *on_state;     // may be NULL
+	void *arg;                     // for on_dlvr and on_state
+	char *path;                    // the server's Unix-domain socket, or NULL
+	uint32_t shm;                  // with path: bytes of each ring (BVD_SHM_RING_SIZE
+	                               // is a good size), 0 for none
+} BVD_CLIENT_CONFIG;
+
+/*
+ * Connects and logs in, then starts the I/O thread.  The configuration
+ * is copied.
+ * Returns the client, or NULL with errno set if the first connection or
+ * LOGIN failed (ECONNREFUSED if the LOGIN was NACKed).
+ */
+BVD_CLIENT *client_open(BVD_CLIENT_CONFIG *config);
+
+/*
+ * Queues a message of length bytes for the handle to.  body is copied.
+ * fn, which may be NULL, is told what becomes of it, with arg.
+ * Returns the msgid of the message, or -1 with errno set.
+ */
+long client_send(BVD_CLIENT *c, char *to, void *body, size_t length, CLIENT_RESULT_FN *fn, void *arg);
+
+/*
+ * Waits until every message sent so far has its outcome, which takes as
+ * long as the connection stays down if it drops.
+ */
+void client_flush(BVD_CLIENT *c);
+
+/*
+ * Logs out, stops the I/O thread and frees the client.  Messages that
+ * have no outcome yet, whether sent or still queued, get CLIENT_LOST, so
+ * client_flush() first to wait for them.  No other thread may be in
+ * client_send() or client_flush() meanwhile.
+ */
+void client_close(BVD_CLIENT *c);
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdint.h>
+
+#include "mailbox.h"
+#include "batch.h"
+
+/*
+ * Cluster mode: several Bavarde processes sharing one handle space.
+ *
+ * Every node is started with the same node list (-C host:port,...) and
+ * its own position in it (-N).  Clients may log in at any node.  Handles
+ * are partitioned across the nodes by consistent hashing: the node that
+ * owns a handle keeps track of which node the handle is logged in at.
+ * Each node still has its own directory, of the handles logged in there.
+ *
+ * A SEND whose receiver is not logged in locally is forwarded: to the
+ * node the local location cache says the receiver is at, or else to
+ * the receiver's owner, which passes it on and tells the first node
+ * where the receiver is (LOCATE), so that later messages go straight
+ * there.  The owner remembers who it told, and tells them to forget
+ * (INVALIDATE) when the handle logs out or moves.  A stale cache entry
+ * costs a detour through the owner; a record is passed on at most
+ * BVD_CLUSTER_MAX_HOPS times and bounced after that.  Such a SEND is
+ * ACKed once it is on its way; if the receiver turns out not to exist
+ * anywhere, the sender gets a BOUNCE instead of a NACK.  RRCPTs and
+ * BOUNCEs find their way back to the sender the same way.
+ *
+ * Nodes talk over links: one persistent TCP connection from each node to
+ * each other node, made to the other node's client port and opened with
+ * a PEER packet carrying the sender's node index.  Everything for a node
+ * is queued in a peer mailbox (a MAILBOX not in the directory), and the
+ * link thread writes out whatever has piled up as one PEER_BATCH packet,
+ * without waiting for anything to come back.  The payload of PEER_BATCH
+ * is in the format of SEND_BATCH (see batch.h), the handle being the one
+ * the record is about and the body starting with one of the op bytes
+ * below.  When a link comes up, the node re-claims the handles logged in
+ * at it that the other node owns, so that a restarted owner relearns
+ * them.  A record that cannot be written is dropped, and a message is
+ * bounced back to its sender.
+ *
+ * Limitations: a handle may be logged in at two nodes at once (the
+ * last claim wins at the owner), and USERS lists the local handles only.
+ */
+
+#define BVD_PEER_PKT (BVD_SEND_BATCH_PKT + 4)
+#define BVD_PEER_BATCH_PKT (BVD_SEND_BATCH_PKT + 5)
+
+#define BVD_CLUSTER_MAX_NODES 64
+#define BVD_CLUSTER_VNODES 64			// points per node on the hash ring
+#define BVD_CLUSTER_MAX_HOPS 3
+#define BVD_CLUSTER_LINK_BATCH 256		// most records per PEER_BATCH
+
+/*
+ * Set in the capabilities of a peer mailbox; never negotiated.
+ */
+#define BVD_PEER_CAPS 0x40000000
+
+/*
+ * First byte of the body of a PEER_BATCH record.
+ */
+typedef enum {
+	PEER_OP_MESSAGE = 1,	// hop count (1), then a DLVR payload; for the receiver
+	PEER_OP_RRCPT,		// hop count (1); for the sender
+	PEER_OP_BOUNCE,		// hop count (1); for the sender
+	PEER_OP_CLAIM,		// the handle logged in at the sending node
+	PEER_OP_RELEASE,	// the handle logged out at the sending node
+	PEER_OP_LOCATE,		// node index (1): where the handle is logged in
+	PEER_OP_INVALIDATE	// forget where the handle is
+} PEER_OP;
+
+/*
+ * Enable cluster mode.
+ *   nodes - comma-separated host:port of every node, in the same order
+ *           on every node
+ *   self - the position of this node in the list
+ * Starts the link threads.  Returns -1 on a bad node list.
+ */
+int cluster_init(char *nodes, int self);
+
+/*
+ * Nonzero if cluster mode is enabled.
+ */
+int cluster_enabled(void);
+
+/*
+ * The node that keeps track of handle.
+ */
+int cluster_owner(char *handle);
+
+/*
+ * Tell the owner that handle logged in, or out, at this node.
+ */
+void cluster_claim(char *handle);
+void cluster_release(char *handle);
+
+/*
+ * Forward a message for a handle not logged in at this node.
+ *   from - the sender's mailbox; the reference is transferred
+ *   dlvr, length - the DLVR payload (see bvd_make_dlvr); it is freed
+ * Returns 0 if the message is on its way, or -1 if there is nowhere to
+ * send it, in which case nothing has been taken over.
+ */
+int cluster_forward(MAILBOX *from, int msgid, char *handle, char *dlvr, int length);
+
+/*
+ * Give the sender of a message its RRCPT or BOUNCE.
+ *   from - the "from" of the message; the reference is not consumed
+ *   dlvr, length - the message's DLVR payload, which names the sender
+ *                  if from is a peer mailbox
+ */
+void cluster_notify(MAILBOX *from, NOTICE_TYPE type, int msgid, char *dlvr, int length);
+
+/*
+ * Serve an incoming link, whose PEER packet carried hello,
+ * until the connection drops.
+ */
+void cluster_peer_service(int fd, char *hello);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "batch.h"
+#include "mailbox.h"
+#include "outq.h"
+
+/*
+ * Coalesced notices.
+ *
+ * A client that negotiated the "coalesce" capability (see capability.h)
+ * no longer gets one packet per bodiless ACK or RRCPT.  The server holds
+ * them back for a short while and then sends a single ranged notice
+ * covering all of them.  The msgid in the header of a ranged notice is
+ * the first msgid it covers, and the payload is a sequence of ranges,
+ * with fields in network byte order:
+ *
+ *   first, count    -- msgids first, first + 1, ..., first + count - 1
+ *
+ * NACK and BOUNCE notices are never coalesced, so the disposition of
+ * every individual message is still reported exactly.  Pending ranges
+ * are flushed before any other packet is written to the client, so the
+ * order of notices relative to other packets is preserved.
+ */
+
+#define BVD_ACK_RANGE_PKT (BVD_SEND_BATCH_PKT + 1)
+#define BVD_RRCPT_RANGE_PKT (BVD_SEND_BATCH_PKT + 2)
+
+typedef struct {
+	uint32_t first;                // First msgid of the range
+	uint32_t count;                // Number of consecutive msgids
+} bvd_msgid_range;
+
+/*
+ * Flush thresholds: a ranged notice goes out once this many msgids of
+ * one type are pending, or once the oldest has waited this long.
+ */
+#define BVD_COALESCE_MAX 256
+#define BVD_COALESCE_USEC 1000
+
+typedef struct coalescer {
+	uint32_t acks[BVD_COALESCE_MAX];
+	int num_acks;
+	uint32_t rrcpts[BVD_COALESCE_MAX];
+	int num_rrcpts;
+	struct timespec deadline;      // When the oldest pending msgid is due
+} COALESCER;
+
+/*
+ * Initialize an empty coalescer.
+ */
+void coalesce_init(COALESCER *co);
+
+/*
+ * Hold back an ACK or RRCPT notice for msgid, writing a ranged notice
+ * to out if that fills up the pending set.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and errno is set.
+ */
+int coalesce_add(COALESCER *co, OUTQ *out, NOTICE_TYPE type, uint32_t msgid);
+
+/*
+ * Write out everything pending, if anything.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and errno is set.
+ */
+int coalesce_flush(COALESCER *co, OUTQ *out);
+
+/*
+ * Returns the time by which the pending notices must be flushed,
+ * or NULL if nothing is pending.
+ */
+struct timespec *coalesce_deadline(COALESCER *co);
+
+#endif
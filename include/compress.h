@@ -0,0 +1,66 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+
+/*
+ * Compressed message bodies.
+ *
+ * A client that negotiated the "lz4" capability (see capability.h) sends
+ * and receives every message body -- the part of a SEND or DLVR payload
+ * after the \r\n -- in a framed form:
+ *
+ *   codec (1 byte), raw length (4 bytes, network byte order), data
+ *
+ * where codec is BVD_CODEC_RAW, meaning data is the body itself, or
+ * BVD_CODEC_LZ4, meaning data is the body as an LZ4 block (see lz.h).
+ * Clients are free to send small bodies raw.
+ *
+ * The server keeps every body framed in the mailbox.  Bodies from
+ * clients without the capability are compressed on the way in when they
+ * are large enough to be worth it.  A framed body is forwarded as is to
+ * a client with the capability, and unframed (decompressed if need be)
+ * only for a client without it.
+ */
+
+#define BVD_CODEC_RAW 0
+#define BVD_CODEC_LZ4 1
+
+#define BVD_FRAME_HEADER_SIZE 5
+
+/*
+ * Bodies shorter than this are not worth compressing.
+ */
+#define BVD_COMPRESS_MIN 128
+
+/*
+ * Room needed to frame a body of length bytes.  A compressed body is
+ * only kept if it is smaller than the raw one, so this is never more
+ * than the raw frame.
+ */
+#define BVD_FRAME_BOUND(length) (BVD_FRAME_HEADER_SIZE + (length))
+
+/*
+ * Frame length bytes of body into dst, which has room for
+ * BVD_FRAME_BOUND(length) bytes, compressing it if compress is
+ * non-zero and that makes it smaller.
+ * Returns the framed length.
+ */
+int bvd_frame_body(void *body, int length, int compress, void *dst);
+
+/*
+ * Check a framed body of length bytes.
+ * Returns the codec and stores the raw length in *raw_length,
+ * or returns -1 if the frame is malformed, or is compressed and claims
+ * a raw length over proto_max_payload (see protocol_ext.h).
+ */
+int bvd_frame_check(void *frame, int length, int *raw_length);
+
+/*
+ * Recover the body from a frame of length bytes into dst, which has
+ * room for the raw length reported by bvd_frame_check().
+ * Returns the raw length, or -1 if the frame is malformed.
+ */
+int bvd_unframe_body(void *frame, int length, void *dst);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+
+/*
+ * SEND deduplication.
+ *
+ * A client on a flaky network that negotiated the "dedup" capability
+ * (see capability.h) may send a SEND again, with the same msgid, when
+ * it got no answer in time.  The server remembers the msgids of the
+ * last BVD_DEDUP_WINDOW messages it took from the client, and a SEND (or
+ * a record of a SEND_BATCH) whose msgid is among them is ACKed without
+ * being delivered again.  That goes for a record whose msgid is that of
+ * one before it in the same SEND_BATCH too.  A message that was NACKed
+ * is not remembered, so sending it again is a new try.
+ *
+ * The window is a ring of the msgids, in the order they were taken, with
+ * an open-addressed table of positions in the ring to look them up by.
+ * It is a fixed 8kB, allocated for a mailbox (see mailbox_ext.h) at the
+ * first message its client sends with the capability.
+ */
+
+#define BVD_DEDUP_WINDOW 1024
+
+typedef struct dedup {
+	uint32_t ring[BVD_DEDUP_WINDOW];	//msgids, oldest at next once full
+	uint16_t table[2 * BVD_DEDUP_WINDOW];	//1 + position in ring, 0 if free
+	int next;
+	int count;
+} DEDUP;
+
+/*
+ * Initialize an empty window.
+ */
+void dedup_init(DEDUP *d);
+
+/*
+ * Returns 1 if msgid is in the window, 0 if not.
+ */
+int dedup_seen(DEDUP *d, uint32_t msgid);
+
+/*
+ * Adds msgid to the window, pushing the oldest out if it is full.
+ * Does nothing if msgid is in the window already.
+ */
+void dedup_record(DEDUP *d, uint32_t msgid);
+
+/*
+ * Takes msgid back out of the window if it is the one added last, for
+ * a message that was recorded but then not taken after all.  Whatever
+ * adding it pushed out stays out.
+ */
+void dedup_unrecord(DEDUP *d, uint32_t msgid);
+
+#endif
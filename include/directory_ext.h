@@ -0,0 +1,30 @@
+#ifndef DIRECTORY_EXT_H
+#define DIRECTORY_EXT_H
+
+#include <stdint.h>
+
+#include "directory.h"
+#include "ratelimit.h"
+
+/*
+ * Extensions to the directory interface.
+ * directory.h must not be modified, so anything added to the directory
+ * module on top of it is declared here.
+ */
+
+/*
+ * Query the directory for the handle with a given ID (see intern.h).
+ * Same as dir_lookup(), minus the hashing of the handle: the mailbox
+ * is returned with its reference count increased, or NULL if the
+ * handle is not registered.
+ */
+MAILBOX *dir_lookup_id(uint32_t id);
+
+/*
+ * Get the rate limit bucket (see ratelimit.h) of the handle with a given
+ * ID, which lasts as long as the directory, or NULL if the handle has
+ * never been registered.
+ */
+RATE_BUCKET *dir_rate_bucket(uint32_t id);
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <signal.h>
+
+#include "mailbox.h"
+
+/*
+ * Hot restart: handing a running server over to a new binary without
+ * dropping a connection.
+ *
+ * Hot restart is enabled with -U.  SIGUSR2 then makes the running server
+ * exec a new copy of its binary (the one it was started from, which may
+ * have been replaced on disk meanwhile) and hand it everything:
+ *
+ *   1. The accept loop stops, and every client service thread stops
+ *      between two packets.  This is why, with -U, the client service
+ *      threads poll before each packet.
+ *   2. Every mailbox service thread is interrupted (mb_interrupt()) and
+ *      stops between two packets as well, once it has written out what
+ *      it had coalesced.
+ *   3. Whatever is still queued in the mailboxes is taken out and written,
+ *      together with the handle and capabilities of each connection, to
+ *      a socketpair shared with the new process.  The listening socket
+ *      and the client sockets follow as SCM_RIGHTS messages.
+ *   4. The new process registers the handles, refills the mailboxes and
+ *      starts the service threads.  When it says it is ready, the old
+ *      process exits without touching the sockets.
+ *
+ * Connections whose threads do not stop within BVD_HANDOFF_TIMEOUT_MS
+ * (a stuck reader, say) are not handed over and go away with the old
+ * process.  If the new process cannot be started the old one carries on.
+ */
+
+#define BVD_HANDOFF_TIMEOUT_MS 5000
+#define BVD_HANDOFF_MAGIC 0x42564448 //"BVDH"
+#define BVD_HANDOFF_VERSION 1
+
+/*
+ * Enables hot restart.  argv is what the server was started with; the
+ * new process gets the same arguments plus -R.
+ * Returns -1 if it could not be set up.
+ */
+int handoff_init(char** argv);
+
+/*
+ * Becomes readable once SIGUSR2 has asked for a hot restart;
+ * -1 if hot restart is not enabled.  For the accept loop.
+ */
+extern int handoff_trigger_fd;
+
+/*
+ * Stops the old process (steps 1 to 3 above).  Does not return if the
+ * new process took over; returns -1 if it could not be started, in which
+ * case nothing has been stopped yet.
+ */
+int handoff_begin(int listenfd);
+
+/*
+ * Called by the new process with the socket given by -R.
+ * Takes over the sessions and returns the listening socket, or -1.
+ */
+int handoff_resume(int sock);
+
+/*
+ * For the client service thread, between packets: returns nonzero if it
+ * must stop for a hot restart, after waiting for fd to become readable
+ * or for the restart, whichever comes first.  Returns 0 at once if hot
+ * restart is not enabled.
+ */
+int handoff_requested(int fd);
+
+/*
+ * Client service threads report when they start and finish, so that the
+ * old process knows how many must stop.
+ */
+void handoff_client_started(void);
+void handoff_client_finished(void);
+
+/*
+ * Stop the calling service thread for the hot restart, leaving its
+ * connection to the new process.  mb is NULL for a client that has not
+ * logged in.  Neither function returns.
+ */
+void handoff_park_client(int fd, MAILBOX* mb, int caps);
+void handoff_park_mailbox(MAILBOX* mb);
+
+/*
+ * With -M, where one thread serves both the connection and its mailbox
+ * (see server_ext.h): the thread polls the returned fd (-1 if hot restart
+ * is not enabled) along with the rest and, once it is readable, writes
+ * out what it holds and stops with handoff_park_session(), which counts
+ * as both of the above.
+ */
+int handoff_stop_fd(void);
+void handoff_park_session(int fd, MAILBOX* mb, int caps);
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "batch.h"
+#include "mailbox.h"
+
+/*
+ * Message history.
+ *
+ * With -Y (directory), every message a client sends to a handle logged
+ * in on this server is also kept, so that a client that comes back
+ * can ask for what it sent and was sent while it was away, with a
+ * HISTORY request.
+ *
+ * Messages are appended to segment files, history-<number>.seg, of
+ * BVD_HISTORY_SEGMENT_SIZE bytes each, which are mapped into memory; the
+ * oldest is deleted once there are more than history_max_segments of
+ * them (-y on the command line).  A record is a HISTORY_RECORD followed
+ * by what a HISTORY packet carries, so a range goes out with writev()
+ * straight from the mapping.  Each record links back to the previous
+ * record of its sender and of its receiver, so the records of a handle
+ * are a chain, newest first; every BVD_HISTORY_SPARSE records of a handle,
+ * its index in memory notes the time and where the record is, so a
+ * range that ends in the past is found without walking the whole chain.
+ * At startup the index is rebuilt by reading the segments through.
+ *
+ * Recording stays off the delivery path: the client service threads
+ * only copy the record to a buffer, and a thread of its own, the
+ * appender, writes it to the segment and indexes it, within
+ * BVD_HISTORY_FLUSH_MS.  A record is copied before the message is handed
+ * to the receiver's mailbox, which may free it at once, and held until
+ * its sender tells whether the mailbox took it; one it refused is
+ * skipped.  If the appender cannot keep up, records are
+ * dropped (and counted) rather than the senders held up.  Records are
+ * in the mapping, so they survive the server but not the machine
+ * going down uncleanly; a record cut short by a crash ends its segment.
+ *
+ * Streamed SENDs (see stream.h) and messages to and from other nodes of
+ * a cluster are not kept.
+ *
+ * A HISTORY request has the payload
+ *
+ *   since (8 bytes), until (8 bytes), max (4 bytes)[, handle]
+ *
+ * in network byte order: times in milliseconds since the epoch, until
+ * excluded and 0 for no bound, and at most max messages, or
+ * BVD_HISTORY_MAX_RANGE if max is 0 or more than that.  If it names a
+ * handle, only the messages between it and the client are wanted, which
+ * are looked for among the client's last BVD_HISTORY_SCAN_MAX.  The newest
+ * messages of the range are sent back, oldest first, each as a HISTORY
+ * packet with the msgid it was sent with and the payload
+ *
+ *   time (8 bytes)(handle of sender)\r\n(handle of receiver)\r\n(body)
+ *
+ * where the body is as in a DLVR.  Then the request is ACKed with the
+ * number of messages (4 bytes, network byte order) as payload.  To page
+ * further back, ask again with until set to one past the time of the
+ * oldest one: those sent within that millisecond come again, and are
+ * told apart by their sender and msgid.  A client that is not logged in,
+ * or a server without -Y, NACKs the request.
+ */
+
+#define BVD_HISTORY_PKT (BVD_SEND_BATCH_PKT + 8)
+#define HISTORY_NOTICE_TYPE ((NOTICE_TYPE)(RRCPT_NOTICE_TYPE + 3))
+
+#define BVD_HISTORY_SEGMENT_SIZE (16 * 1024 * 1024)
+#define BVD_HISTORY_SEGMENTS 64
+#define BVD_HISTORY_SPARSE 16
+#define BVD_HISTORY_BUFFER (4 * 1024 * 1024)
+#define BVD_HISTORY_FLUSH_MS 10
+#define BVD_HISTORY_MAX_RANGE 1000
+#define BVD_HISTORY_SCAN_MAX 65536
+
+/*
+ * Messages of a range written out together (see outq_cork()).
+ */
+#define BVD_HISTORY_BATCH 64
+
+/*
+ * Bytes of the fixed part of a HISTORY request, and of the time in
+ * front of each message sent back.
+ */
+#define BVD_HISTORY_REQUEST_SIZE 20
+#define BVD_HISTORY_TIME_SIZE 8
+
+//A record, in the byte order of the machine that wrote it
+typedef struct history_record {
+	uint32_t size;		//of the whole record, a multiple of 8; 0 past the last one
+	uint32_t msgid;
+	uint64_t time_ms;
+	uint64_t prev[2];	//the previous record of the sender and of the receiver, 0 for none
+	uint16_t from_length;	//of the handles, without their \r\n
+	uint16_t to_length;
+	uint32_t frame_length;	//of the body, framed as in a DLVR
+} HISTORY_RECORD;
+
+//A request, as parsed from its payload
+typedef struct history_query {
+	uint64_t since_ms;
+	uint64_t until_ms;
+	uint32_t max;
+	char *peer;		//the handle of the other side, not NUL-terminated, or NULL for all
+	uint32_t peer_length;
+} HISTORY_QUERY;
+
+//A message of a range, pointing into the mapping
+typedef struct history_item {
+	uint32_t msgid;
+	char *head;		//time and handle lines, head_length bytes
+	uint32_t head_length;
+	char *frame;
+	uint32_t frame_length;
+} HISTORY_ITEM;
+
+//The messages of a range, whose segments stay mapped until history_release()
+typedef struct history_range {
+	HISTORY_ITEM *items;
+	int count;
+	void **segs;		//pinned
+	int num_segs;
+} HISTORY_RANGE;
+
+/*
+ * Whether history is kept, and how many segments of it at most.
+ */
+extern int history_enabled;
+extern int history_max_segments;
+
+/*
+ * Starts keeping history in dir: maps the segments found there,
+ * indexes them and starts the appender.
+ * Returns 0 on success, -1 on error.
+ */
+int history_init(char *dir);
+
+/*
+ * Records a message before it is handed to its receiver: dlvr is
+ * (handle of sender)\r\n(framed body), the DLVR payload as it is stored
+ * (see bvd_make_dlvr()).  from and to are the handle IDs of the sender
+ * and receiver, and to_handle the receiver's handle.  The message is
+ * copied.
+ *
+ * Returns the record, which the appender holds back until it is passed
+ * to history_settle(), or NULL if it was dropped.
+ */
+void *history_record(uint32_t from, uint32_t to, char *to_handle, uint32_t msgid, char *dlvr, int length);
+
+/*
+ * Settles a record returned by history_record(): it is kept if taken,
+ * i.e. the receiver's mailbox took the message, and dropped otherwise.
+ * Must be called soon, as the appender waits for it.
+ */
+void history_settle(void *held, int taken);
+
+/*
+ * Parses the payload of a HISTORY request into q, which points into it.
+ * Returns 0 on success, -1 if the payload is malformed.
+ */
+int history_parse(void *payload, uint32_t length, HISTORY_QUERY *q);
+
+/*
+ * Finds the messages of a query from the handle with ID id, pinning the
+ * segments they are in.  Returns how many there are.
+ */
+int history_range(uint32_t id, HISTORY_QUERY *q, HISTORY_RANGE *range);
+
+/*
+ * Lets go of the segments of a range, and frees it.
+ */
+void history_release(HISTORY_RANGE *range);
+
+#endif
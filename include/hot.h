@@ -0,0 +1,101 @@
+#ifndef HOT_H
+#define HOT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Heavy hitters: the handles that send and receive the most.
+ *
+ * Every message a client sends is counted, with the bytes of its body,
+ * against its sender and, if it is delivered here, its receiver, so that
+ * a handle getting hammered shows up in the STATS report (see metrics.h)
+ * before latency does.
+ *
+ * Counting stays off the locks: each connection counts into a HOT_LOCAL
+ * of its own, its sender in one counter and its receivers in a small
+ * table of BVD_HOT_LOCAL_SLOTS, indexed by handle ID, a receiver that
+ * needs the slot of another putting that one aside.  What was put aside
+ * is merged into the server-wide tables once there are
+ * BVD_HOT_LOCAL_SLOTS of them, and all of it when the sender changes,
+ * when the connection ends, and on the first message after every
+ * BVD_HOT_MERGE_MS, so that a connection that goes quiet keeps what it
+ * counted since until it sends again.
+ *
+ * The server-wide tables, of senders, bytes sent, receivers and bytes
+ * received, each keep the BVD_HOT_TRACKED handles with the highest
+ * counts, in a heap, lowest first, with a hash index by ID.  The counts
+ * of all handles are estimated with a count-min sketch of
+ * BVD_HOT_SKETCH_ROWS rows of BVD_HOT_SKETCH_WIDTH counters, and a handle
+ * that is not in the heap takes the place of the lowest one once its
+ * estimate is above that one's count.  An estimate is never under what
+ * the handle did, and over by at most what the handles it shares its
+ * counters with did; the error reported with a count is how much of it
+ * is such an estimate, counted before the handle was in the table.  Most
+ * merges only add to the sketch, the others cost O(log BVD_HOT_TRACKED).
+ * Every BVD_HOT_MERGE_MS, counts, errors and the sketch lose a
+ * 1/BVD_HOT_DECAY of themselves, so the tables follow what is hot now: a count is about
+ * BVD_HOT_DECAY times what the handle does in a merge period.
+ *
+ * Memory is constant, and messages forwarded from other nodes of a
+ * cluster are not counted; those sent to them count for their sender
+ * only.  The BVD_HOT_TOP highest of each table are in the report, as
+ *
+ *   hot_<table> handle:count:error handle:count:error ...
+ *
+ * highest first, or "-" if there are none yet.
+ */
+
+#define BVD_HOT_LOCAL_SLOTS 32
+#define BVD_HOT_TRACKED 64
+#define BVD_HOT_SKETCH_ROWS 2
+#define BVD_HOT_SKETCH_WIDTH 2048
+#define BVD_HOT_TOP 10
+#define BVD_HOT_MERGE_MS 1000
+#define BVD_HOT_DECAY 32
+
+//What a connection counted since it last merged
+typedef struct hot_slot {
+	uint32_t id;
+	uint32_t count;		//0 if the slot is free
+	uint64_t bytes;
+} HOT_SLOT;
+
+typedef struct hot_local {
+	uint32_t from;		//BVD_NO_ID before the first message
+	uint32_t from_count;
+	uint64_t from_bytes;
+	unsigned epoch;		//of the last merge
+	HOT_SLOT slots[BVD_HOT_LOCAL_SLOTS];	//by receiver ID
+	HOT_SLOT aside[BVD_HOT_LOCAL_SLOTS];	//pushed out of their slot
+	int num_aside;
+} HOT_LOCAL;
+
+/*
+ * Sets up the tables and starts decaying them.  Needs the timers.
+ */
+void hot_init(void);
+
+/*
+ * Initializes the counters of a connection.
+ */
+void hot_local_init(HOT_LOCAL *local);
+
+/*
+ * Counts a message of bytes bytes from the handle with ID from to the
+ * one with ID to, BVD_NO_ID if it is not delivered here.
+ */
+void hot_count(HOT_LOCAL *local, uint32_t from, uint32_t to, uint64_t bytes);
+
+/*
+ * Merges what a connection counted into the server-wide tables.
+ */
+void hot_flush(HOT_LOCAL *local);
+
+/*
+ * Write the highest of each table to out, in the format of the STATS
+ * report.
+ */
+void hot_report(FILE *out);
+
+#endif
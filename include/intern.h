@@ -0,0 +1,48 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Handle interning.
+ *
+ * Every handle is given a 32-bit ID the first time it is registered,
+ * dense from 0.  The directory is an array indexed by ID and every
+ * mailbox knows its ID, so that the string itself is only looked at
+ * when a packet names a handle (one hash lookup, see intern_find())
+ * and when a packet carrying it is written out (DLVR, USERS).
+ *
+ * IDs are never given back: a handle that logs in again gets its old ID,
+ * and the string returned by intern_name() stays put for the life of
+ * the process.
+ */
+
+#define BVD_NO_ID UINT32_MAX
+
+/*
+ * Initialize the intern table.  Called by dir_init().
+ */
+void intern_init(void);
+
+/*
+ * Get the ID of a handle, giving it one if it does not have one yet.
+ */
+uint32_t intern_handle(char *handle);
+
+/*
+ * Get the ID of a handle, or BVD_NO_ID if it has never been given one.
+ */
+uint32_t intern_find(char *handle);
+
+/*
+ * Get the handle with a given ID, which must have been handed out.
+ */
+char *intern_name(uint32_t id);
+
+/*
+ * Hash of a string, as used for the intern table.
+ */
+uint32_t intern_hash(const char *s, size_t len);
+
+#endif
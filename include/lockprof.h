@@ -0,0 +1,69 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdio.h>
+#include <semaphore.h>
+
+/*
+ * Lock contention profiler.
+ *
+ * The server's locks are semaphores, taken and released through
+ * BVD_LOCK() and BVD_UNLOCK() at the sites below.  Normally these are
+ * plain sem_wait() and sem_post().  Built with make lockprof (which
+ * defines BVD_LOCKPROF), each site counts, in atomics of its own:
+ *   - its acquisitions, and how many of them found the lock taken,
+ *   - the time those waited, in total and as a histogram of
+ *     BVD_LOCKPROF_BUCKETS buckets: under 1us, under 4us, and so on by
+ *     factors of 4, the last one for anything longer,
+ *   - the longest time the lock was held, and where (file:line) it was
+ *     taken for that.
+ * An uncontended acquisition costs a sem_trywait() and two reads of the
+ * monotonic clock (one at the release).  Hold times are kept per thread,
+ * for up to BVD_LOCKPROF_DEPTH locks held at once; one taken deeper than
+ * that is counted but not timed.
+ *
+ * The figures are appended to the STATS report (see metrics.h), as
+ * lock_<site>_<figure> lines.
+ */
+
+#define BVD_LOCKPROF_BUCKETS 10
+#define BVD_LOCKPROF_DEPTH 8
+
+typedef enum {
+	LOCK_DIRECTORY,                // registering and unregistering, directory.c
+	LOCK_DIR_STRIPE,               // the entries of the directory, any stripe
+	LOCK_INTERN,                   // interning a new handle, intern.c
+	LOCK_MB_REGISTRY,              // mutex2: creating and finding mailboxes, mailbox.c
+	LOCK_MAILBOX,                  // the lock of a mailbox, any of them
+	LOCK_THREAD_COUNTER,           // the thread counter's mutex
+	LOCK_HISTORY_BUFFER,           // recording a message, history.c
+	LOCK_HISTORY,                  // the history's segments and index
+	LOCK_HOT,                      // the heavy hitter tables, hot.c
+	NUM_LOCK_SITES
+} LOCK_SITE;
+
+#define BVD_LOCKPROF_STR(x) #x
+#define BVD_LOCKPROF_AT(line) __FILE__ ":" BVD_LOCKPROF_STR(line)
+
+#ifdef BVD_LOCKPROF
+#define BVD_LOCK(site, sem) lockprof_wait((site), (sem), BVD_LOCKPROF_AT(__LINE__))
+#define BVD_UNLOCK(site, sem) lockprof_post((site), (sem))
+#else
+#define BVD_LOCK(site, sem) sem_wait(sem)
+#define BVD_UNLOCK(site, sem) sem_post(sem)
+#endif
+
+/*
+ * Take and release a lock at a site, keeping count.  where is the
+ * file:line taking it.
+ */
+void lockprof_wait(LOCK_SITE site, sem_t *sem, const char *where);
+void lockprof_post(LOCK_SITE site, sem_t *sem);
+
+/*
+ * Write the figures of every site to out, in the format of the STATS
+ * report.  Writes nothing unless built with BVD_LOCKPROF.
+ */
+void lockprof_report(FILE *out);
+
+#endif
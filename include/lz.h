@@ -0,0 +1,31 @@
+#ifndef LZ_H
+#define LZ_H
+
+/*
+ * A small, fast LZ77 codec producing the LZ4 block format
+ * (token, literals, 16-bit little-endian offset, match length),
+ * so the output can be decoded by any LZ4 block decoder and vice versa.
+ * Only the block format is implemented, not the LZ4 frame format;
+ * the caller is expected to carry the uncompressed length itself.
+ */
+
+/*
+ * Worst-case size of the compressed form of length bytes.
+ */
+#define LZ_COMPRESS_BOUND(length) ((length) + (length) / 255 + 16)
+
+/*
+ * Compress length bytes from src into dst, which has room for cap bytes.
+ * Returns the compressed size, or 0 if it did not fit in cap bytes.
+ */
+int lz_compress(const void *src, int length, void *dst, int cap);
+
+/*
+ * Decompress length bytes from src into dst, which must have room for
+ * exactly raw_length bytes.  Malformed input is detected rather than
+ * trusted.
+ * Returns raw_length on success, -1 if the input is malformed.
+ */
+int lz_decompress(const void *src, int length, void *dst, int raw_length);
+
+#endif
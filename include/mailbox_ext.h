@@ -0,0 +1,207 @@
+#ifndef MAILBOX_EXT_H
+#define MAILBOX_EXT_H
+
+#include <time.h>
+#include <stdint.h>
+
+#include "mailbox.h"
+
+/*
+ * Extensions to the mailbox interface.
+ * mailbox.h must not be modified, so anything added to the mailbox
+ * module on top of it is declared here.
+ */
+
+/*
+ * A mailbox has two lanes.  Notices (ACK, NACK, RRCPT, BOUNCE and the
+ * like) go in the control lane and messages in the data lane, and
+ * whoever takes entries out gets the control lane's first, so that the
+ * answer to a request does not wait behind a backlog of deliveries.
+ * Each lane stays in the order its entries came in.  So that a steady
+ * stream of notices cannot hold messages back for good, one message
+ * goes out after every BVD_MB_CONTROL_BURST notices in a row taken
+ * while messages were waiting.
+ */
+#define BVD_MB_CONTROL_BURST 16
+
+/*
+ * One message of a batch handed to mb_add_messages().
+ * The fields have the same meaning as the arguments of mb_add_message().
+ */
+typedef struct mb_batch_message {
+	int msgid;
+	MAILBOX *from;
+	void *body;
+	int length;
+} MB_BATCH_MESSAGE;
+
+/*
+ * Add several messages to the end of the mailbox queue, in order,
+ * taking the mailbox lock only once for the whole batch.
+ *   msgs - the messages to add
+ *   count - number of messages in msgs
+ *
+ * On success, 0 is returned and ownership of every body and "from"
+ * reference is transferred to the mailbox, exactly as for mb_add_message().
+ * If the mailbox is defunct, nothing is added, -1 is returned and
+ * the caller keeps ownership of the bodies and references.
+ */
+int mb_add_messages(MAILBOX *mb, MB_BATCH_MESSAGE *msgs, int count);
+
+/*
+ * Increase the reference count on a mailbox by n, for a caller that is
+ * about to make n copies of the pointer (e.g. as the "from" field of
+ * every message in a batch).
+ */
+void mb_refn(MAILBOX *mb, int n);
+
+/*
+ * Remove the first entry from the mailbox, like mb_next_entry(), but
+ * give up waiting at the absolute (CLOCK_REALTIME) time abstime.
+ * If abstime is NULL, this is the same as mb_next_entry().
+ *
+ * Returns NULL with errno set to ETIMEDOUT if abstime passed first,
+ * or NULL with errno set to ESHUTDOWN if the mailbox is defunct.
+ */
+MAILBOX_ENTRY *mb_next_entry_timed(MAILBOX *mb, const struct timespec *abstime);
+
+/*
+ * Wake up the thread servicing the mailbox without giving it anything:
+ * from now on mb_next_entry() and mb_next_entry_timed() return NULL
+ * with errno set to EINTR, and the queue is left alone.  Used to stop
+ * the service thread between packets for a hot restart.
+ */
+void mb_interrupt(MAILBOX *mb);
+
+/*
+ * Remove the first entries from the mailbox at once, blocking until
+ * there is one like mb_next_entry_timed(), then taking whatever follows
+ * it right away under the same lock, up to max entries in all or until
+ * their bodies add up to max_bytes.  They are stored in entries in
+ * queue order, and the caller takes them over exactly as if they came
+ * from mb_next_entry().  BVD_MB_BATCH and BVD_MB_BATCH_BYTES are what
+ * the mailbox service thread takes.
+ *
+ * Returns the number of entries removed, at least 1, or -1 with errno
+ * set as mb_next_entry_timed() does when it returns NULL.
+ */
+#define BVD_MB_BATCH 64
+#define BVD_MB_BATCH_BYTES (256 * 1024)
+int mb_next_entries(MAILBOX *mb, MAILBOX_ENTRY **entries, int max, long max_bytes, const struct timespec *abstime);
+
+/*
+ * Remove up to max entries from the front of the mailbox without
+ * waiting, storing them in entries in queue order.  The caller takes
+ * over the entries exactly as if they came from mb_next_entry().
+ * Returns the number of entries removed.
+ */
+int mb_take_entries(MAILBOX *mb, MAILBOX_ENTRY **entries, int max);
+
+/*
+ * Set and get the capabilities (see capability.h) negotiated by the
+ * client that owns the mailbox, so that whoever holds the mailbox
+ * knows how the client wants to be talked to.
+ */
+void mb_set_caps(MAILBOX *mb, int caps);
+int mb_get_caps(MAILBOX *mb);
+
+/*
+ * The dedup window (see dedup.h) of the messages the owner of the
+ * mailbox sent: mb_msgid_seen() tells whether msgid is in it, and
+ * mb_msgid_record() adds it, allocating the window the first time.
+ * mb_msgid_unrecord() takes back the msgid added last, see
+ * dedup_unrecord().
+ */
+int mb_msgid_seen(MAILBOX *mb, uint32_t msgid);
+void mb_msgid_record(MAILBOX *mb, uint32_t msgid);
+void mb_msgid_unrecord(MAILBOX *mb, uint32_t msgid);
+
+/*
+ * The number of entries waiting in all mailboxes together, for
+ * admission control (see admit.h).
+ */
+long mb_queued_total(void);
+
+/*
+ * Get the interned ID (see intern.h) of the handle of a mailbox.
+ */
+uint32_t mb_get_id(MAILBOX *mb);
+
+/*
+ * Get an eventfd (created on the first call) that becomes readable
+ * whenever an entry is added to the mailbox, for a thread that waits on
+ * the mailbox and something else at once and then takes the entries with
+ * mb_take_entries().  The mailbox owns the eventfd.
+ */
+int mb_eventfd(MAILBOX *mb);
+
+/*
+ * With -T, a message that has been waiting in a mailbox for mb_ttl_ms
+ * milliseconds is taken out and bounced, through the discard hook as if
+ * the mailbox had gone away.  One timer per mailbox (see timer.h) keeps
+ * track of the oldest message.  0, the default, means no TTL.
+ */
+extern int mb_ttl_ms;
+
+/*
+ * With -B, the entries held in memory by all mailboxes together are
+ * kept to about mb_budget_mb megabytes: once a new message takes them
+ * over it, the thread that added it spills the data lanes of the
+ * coldest mailboxes, those whose owners took anything out longest ago
+ * (or never), until they are down to BVD_MB_SPILL_LOW percent of it.
+ * What is spilled is the tail of a lane, all but its first
+ * BVD_MB_SPILL_KEEP messages, which goes to an append-only file of the
+ * mailbox's own in mb_spill_dir (-D, P_tmpdir by default), unlinked as
+ * soon as it is created.  Messages that come for the mailbox meanwhile
+ * are queued behind the ones already there, and whoever queues the
+ * first of them appends them to the file, without the mailbox's lock
+ * while writing.  When whoever takes entries out gets to the end of
+ * what is in memory, the file is read back BVD_MB_SPILL_CHUNK bytes at
+ * a time; if the next messages are still being written, it waits for
+ * them.  Once it is all read back it is closed.  A stream (see
+ * stream.h) never goes to the file, as its body is on its sender's
+ * stack: only what comes after the last one in the lane is spilled, and
+ * one that comes once the lane has spilled stays in memory, with what
+ * comes after it, until the file has been read back.  Nothing changes
+ * for the callers of the mailbox: the order, the TTL and the discard
+ * hook work the same.  If the disk is full, the messages stay in
+ * memory.  A scan of the mailboxes that finds nothing to spill is not
+ * repeated for BVD_MB_SPILL_RETRY_MS, after which a timer (see timer.h)
+ * scans again if the budget is still exceeded.  0, the default, means
+ * no budget.
+ */
+extern long mb_budget_mb;
+extern char *mb_spill_dir;
+
+#define BVD_MB_SPILL_LOW 90
+#define BVD_MB_SPILL_KEEP 16
+#define BVD_MB_SPILL_CHUNK (64 * 1024)
+#define BVD_MB_SPILL_VICTIMS 8          // mailboxes picked per scan of them all
+#define BVD_MB_SPILL_RETRY_MS 100       // before scanning again after finding none
+
+/*
+ * The thread servicing a mailbox that finds it empty does not go to
+ * sleep at once if entries have lately come soon after it looked:
+ * with the mailbox's running average of how long it waited (over about
+ * the last 8 waits), if twice that is at most mb_spin_nsec (-P, 0 to
+ * always sleep), it first spins for twice the average, at least
+ * BVD_MB_SPIN_MIN_NSEC, looking again every BVD_MB_SPIN_PAUSES pause
+ * instructions, then yields the CPU BVD_MB_SPIN_YIELDS times, looking
+ * again after each.  With a single CPU it only yields.  Whoever adds an
+ * entry meanwhile posts the semaphore without a system call, as nobody
+ * sleeps on it.  A longer wait counts as 4 * mb_spin_nsec, so it takes
+ * only one to stop the spinning and a few quick ones to start it again.
+ */
+#define BVD_MB_SPIN_NSEC 100000
+#define BVD_MB_SPIN_MIN_NSEC 1000
+#define BVD_MB_SPIN_PAUSES 32
+#define BVD_MB_SPIN_YIELDS 4
+extern long mb_spin_nsec;
+
+/*
+ * The bytes of the entries held in memory by all mailboxes together,
+ * bodies and bookkeeping, not counting what is spilled.
+ */
+long mb_resident_bytes(void);
+
+#endif
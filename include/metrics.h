@@ -0,0 +1,84 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "protocol.h"
+#include "batch.h"
+
+/*
+ * Server-wide counters.
+ *
+ * Counters are plain atomics, cheap enough to bump on the hot path.
+ * A logged-in client can read them all with a STATS request, which is
+ * answered with an ACK whose payload is a text report, one
+ * "name value\r\n" line per counter followed by a few derived figures,
+ * the CPU time the server has used (cpu_usec, user and system), the
+ * handles that send and receive the most (see hot.h), and the figures
+ * of the lock profiler when it is built in (see lockprof.h).
+ */
+
+#define BVD_STATS_PKT (BVD_SEND_BATCH_PKT + 3)
+
+typedef enum {
+	METRIC_LZ_RAW_BYTES,           // raw size of bodies stored compressed
+	METRIC_LZ_STORED_BYTES,        // compressed size of those bodies
+	METRIC_LZ_COMPRESS_BYTES,      // raw bytes compressed by the server
+	METRIC_LZ_COMPRESS_NSEC,       // time spent compressing them
+	METRIC_LZ_DECOMPRESS_BYTES,    // raw bytes decompressed for legacy clients
+	METRIC_LZ_DECOMPRESS_NSEC,     // time spent decompressing them
+	METRIC_LZ_PASSTHROUGH,         // compressed bodies forwarded as is
+	METRIC_SHARD_FORWARDED,        // messages that went through a queue between shards
+	METRIC_SHARD_BATCHES,          // batches in which the routers took them off
+	METRIC_OUTQ_DEFERRED_BYTES,    // bytes for clients that the socket did not take at once
+	METRIC_OUTQ_DISCONNECTS,       // clients disconnected for not reading
+	METRIC_TIMERS_FIRED,           // timer callbacks run, see timer.h
+	METRIC_IDLE_DISCONNECTS,       // clients disconnected for saying nothing
+	METRIC_HEARTBEATS,             // heartbeats sent to quiet clients
+	METRIC_MB_EXPIRED,             // messages bounced for sitting in a mailbox too long
+	METRIC_DEDUP_CHECKED,          // messages looked up in their sender's dedup window
+	METRIC_DEDUP_SUPPRESSED,       // of those, duplicates ACKed and not delivered again
+	METRIC_RATE_REFUSED,           // packets NACKed for being over a rate limit
+	METRIC_ADMIT_OVERLOADS,        // times the server became overloaded, see admit.h
+	METRIC_ADMIT_REFUSED,          // connections and LOGINs refused while it was
+	METRIC_TRACE_DROPPED,          // packets left out of the trace, see trace.h
+	METRIC_MB_SPILLED,             // messages spilled to disk, see mailbox_ext.h
+	METRIC_MB_SPILLED_BYTES,       // bytes written for them
+	METRIC_MB_UNSPILLED,           // messages read back
+	METRIC_MB_SPILL_FAILED,        // spills the disk did not take
+	METRIC_MB_BATCHES,             // batches of entries taken out of mailboxes at once
+	METRIC_MB_BATCHED,             // entries in them
+	METRIC_OUTQ_WRITES,            // writes of packets as they are sent, see outq.h
+	METRIC_OUTQ_WRITTEN_PACKETS,   // packets handed to them
+	METRIC_HISTORY_RECORDED,       // messages written to the history, see history.h
+	METRIC_HISTORY_BYTES,          // bytes of them
+	METRIC_HISTORY_DROPPED,        // messages left out of it
+	METRIC_HISTORY_READS,          // HISTORY requests answered
+	METRIC_HISTORY_READ_MESSAGES,  // messages sent back for them
+	METRIC_MB_WAIT_SPUN,           // waits for a mailbox entry that ended spinning, see mailbox_ext.h
+	METRIC_MB_WAIT_YIELDED,        // that ended yielding the CPU
+	METRIC_MB_WAIT_PARKED,         // that went to sleep
+	NUM_METRICS
+} METRIC;
+
+/*
+ * Add v to a counter.
+ */
+void metrics_add(METRIC m, long v);
+
+/*
+ * Read a counter.
+ */
+long metrics_get(METRIC m);
+
+/*
+ * Nanoseconds from a monotonic clock, for timing things to add to counters.
+ */
+long metrics_now_nsec(void);
+
+/*
+ * Produce the text report of every counter.
+ * Returns a malloc'ed buffer, which is not NUL-terminated,
+ * and stores its length in *length.
+ */
+char *metrics_report(int *length);
+
+#endif
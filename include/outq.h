@@ -0,0 +1,133 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+#include "shm.h"
+
+/*
+ * Outbound write queues.
+ *
+ * Everything the mailbox service thread writes to its client goes through
+ * the client's OUTQ rather than straight to the socket.  A packet is
+ * written with a non-blocking send; whatever the socket does not take
+ * at once is copied to the queue, and the writer thread, which waits on
+ * an epoll set for EPOLLOUT, writes it out as the client reads.  So a
+ * client that stops reading holds up neither the mailbox service thread
+ * nor anybody else: it only costs the bytes in its queue.
+ *
+ * A queue has two lanes, like a mailbox (see mailbox_ext.h): deliveries
+ * go in the data lane and every other packet in the control lane, which
+ * goes out first, so that an ACK does not wait behind the deliveries
+ * queued for a slow reader.  A control packet never cuts into a
+ * delivery that has gone out in part, and each lane stays in order.
+ *
+ * A client is disconnected (its socket is shut down, which ends its
+ * session like a dropped connection) when
+ *   - its queue has had bytes pending for outq_deadline_ms without any
+ *     of them going out, or
+ *   - its queue (both lanes) grows past outq_limit bytes.
+ * Packets written to a disconnected client fail, so messages to it
+ * bounce.
+ *
+ * The deadline is a timer of the queue (see timer.h), which the writer
+ * thread runs.
+ *
+ * A queue writes its packets in its client's wire format (see wire.h).
+ *
+ * The few writes that still block (streamed bodies, see stream.h, and
+ * whatever a hot restart flushes) are bounded by the same deadline,
+ * which is set as the socket's SO_SNDTIMEO.
+ */
+
+#define BVD_OUTQ_DEADLINE_MS 10000
+#define BVD_OUTQ_LIMIT (8 * 1024 * 1024)
+
+/*
+ * While corked, payloads shorter than this are copied, and longer ones
+ * only pointed at.
+ */
+#define BVD_OUTQ_COPY_MAX 4096
+
+/*
+ * The deadline and size limit, -W and -O on the command line.
+ */
+extern int outq_deadline_ms;
+extern size_t outq_limit;
+
+typedef struct outq OUTQ;
+
+/*
+ * Starts the writer thread.
+ * Returns 0 on success, -1 on error.
+ */
+int outq_init(void);
+
+/*
+ * Creates the queue of a client socket, which writes in format wire.
+ */
+OUTQ *outq_open(int fd, int wire);
+
+/*
+ * Creates the queue of a client on a shared-memory transport (see
+ * shm.h), which writes to the client's ring instead of fd.  The deadline
+ * bounds blocking writes to the ring too.
+ */
+OUTQ *outq_open_shm(int fd, SHM_CONN *shm, int wire);
+
+/*
+ * Send a packet through a queue, like proto_send_packet() would, in the
+ * queue's format.  hdr is in host byte order and is not modified.
+ *
+ * On success (written or queued), 0 is returned.
+ * If the client is or gets disconnected, -1 is returned.
+ */
+int outq_send_packet(OUTQ *q, bvd_packet_header *hdr, void *payload);
+
+/*
+ * Send a packet through a queue in the given format, with the v2 flags
+ * and ID (see wire.h).  Deliveries must be in the queue's own format;
+ * other packets, like the ACK of a LOGIN, may be in v1.
+ */
+int outq_send_wire(OUTQ *q, int wire, bvd_packet_header *hdr, int flags, uint32_t id, void *payload);
+
+/*
+ * Send a packet like outq_send_wire(), with a payload in count parts,
+ * whose lengths add up to hdr->payload_length.
+ */
+int outq_send_parts(OUTQ *q, int wire, bvd_packet_header *hdr, int flags, uint32_t id, struct iovec *parts, int count);
+
+/*
+ * Gathers up the packets sent from now on, so that outq_uncork() writes
+ * them out together, with a single writev() of iovecs that point at the
+ * payloads when nothing is queued ahead of them.  Meanwhile the sends
+ * only fail if the client is already disconnected, and payloads of
+ * BVD_OUTQ_COPY_MAX bytes or more must stay as they are until
+ * outq_uncork().  Must be called by the thread that sends through the
+ * queue, which must not call outq_flush() until it uncorks.
+ */
+void outq_cork(OUTQ *q);
+
+/*
+ * Writes out, or queues, the packets gathered up since outq_cork().
+ * Returns 0 on success, -1 if the client is or gets disconnected, in
+ * which case none of them count as sent.
+ */
+int outq_uncork(OUTQ *q);
+
+/*
+ * Writes out everything queued, blocking (within the deadline) until it
+ * has all gone, for a caller about to write to the socket itself.
+ * Must be called by the thread that sends through the queue.
+ * Returns 0 on success, -1 if the client got disconnected.
+ */
+int outq_flush(OUTQ *q);
+
+/*
+ * Flushes the queue and frees it.  The socket is left open.
+ */
+void outq_close(OUTQ *q);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef PROTOCOL_EXT_H
+#define PROTOCOL_EXT_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * Extensions to the protocol module.
+ * protocol.h must not be modified, so anything added to the protocol
+ * module on top of it is declared here.
+ */
+
+/*
+ * Fill in a packet header, in host byte order, stamped with the
+ * current time.
+ */
+void proto_init_header(bvd_packet_header *hdr, uint8_t type, uint32_t msgid, uint32_t length);
+
+/*
+ * Largest payload proto_recv_packet() will allocate memory for.
+ * A packet announcing a bigger payload fails with EMSGSIZE and leaves
+ * the stream positioned at the start of the payload, so the connection
+ * cannot be used any further.
+ */
+#define BVD_DEFAULT_MAX_PAYLOAD (16 * 1024 * 1024)
+extern uint32_t proto_max_payload;
+
+/*
+ * The two halves of proto_recv_packet(), for callers that want to
+ * look at the header before deciding what to do with the payload.
+ * proto_recv_header() returns the header in host byte order;
+ * proto_recv_payload() then reads hdr->payload_length bytes of payload
+ * into a malloc'ed buffer (NULL if there is none), subject to
+ * proto_max_payload.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and errno is set.
+ */
+int proto_recv_header(int fd, bvd_packet_header *hdr);
+int proto_recv_payload(int fd, bvd_packet_header *hdr, void **payload);
+
+/*
+ * Send just a packet header, for callers that write the payload
+ * themselves.  The header is converted like in proto_send_packet().
+ */
+int proto_send_header(int fd, bvd_packet_header *hdr);
+
+/*
+ * Convert the multi-byte fields of a header to network byte order,
+ * in place, for callers that put it on the wire themselves.
+ */
+void proto_header_to_wire(bvd_packet_header *hdr);
+
+/*
+ * Read or write exactly size bytes, retrying short transfers.
+ * Reading fails with ECONNRESET if the peer closes the connection first.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and errno is set.
+ */
+int proto_write_fully(int fd, void *buf, size_t size);
+int proto_read_fully(int fd, void *buf, size_t size);
+
+#endif
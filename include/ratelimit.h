@@ -0,0 +1,64 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * Rate limits.
+ *
+ * With -L, every connection may send at most so many packets and bytes a
+ * second; with -H, every handle may, however many times it logs in
+ * again.  A packet over either limit is NACKed without being looked at
+ * (its payload is read and dropped), so a client that floods the server
+ * gets refusals instead of everybody else's share of it.  LOGOUT and
+ * HEARTBEAT packets are never refused.
+ *
+ * A limit is a token bucket, BVD_RATE_BURST_MS worth of packets (or
+ * bytes) deep.  Each bucket is kept as the single time at which it will
+ * be full again, so taking from it is one compare-and-swap, without a
+ * lock, however many threads share it.
+ *
+ * Also, however many packets a client has waiting, its service thread
+ * yields to the others after BVD_RATE_BUDGET of them in a row, so that
+ * busy connections take turns.
+ */
+
+#define BVD_RATE_BURST_MS 100
+#define BVD_RATE_BUDGET 64
+
+typedef struct rate_limit {
+	long packets;	//per second, 0 for none
+	long bytes;
+} RATE_LIMIT;
+
+typedef struct rate_bucket {
+	atomic_long packets_full;	//nsec, when the bucket is full again
+	atomic_long bytes_full;
+} RATE_BUCKET;
+
+/*
+ * The limits per connection (-L) and per handle (-H).
+ */
+extern RATE_LIMIT rate_conn_limit;
+extern RATE_LIMIT rate_handle_limit;
+
+/*
+ * Parse "packets[,bytes]" into a limit.
+ * Returns 0 on success, -1 if the string is malformed.
+ */
+int rate_parse(char *spec, RATE_LIMIT *limit);
+
+/*
+ * Initialize a full bucket.
+ */
+void rate_bucket_init(RATE_BUCKET *b);
+
+/*
+ * Take one packet of length bytes from a connection's bucket and, if
+ * handle is not NULL, from its handle's.  Either both take it, and 0 is
+ * returned, or neither does and -1 is returned.
+ */
+int rate_take(RATE_BUCKET *conn, RATE_BUCKET *handle, size_t length);
+
+#endif
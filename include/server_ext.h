@@ -0,0 +1,64 @@
+#ifndef SERVER_EXT_H
+#define SERVER_EXT_H
+
+#include "mailbox.h"
+#include "batch.h"
+
+/*
+ * With -M, a connection has a single thread: the client service thread
+ * also drains the mailbox, between packets, waiting with poll() on both
+ * the socket and the mailbox's eventfd (see mb_eventfd()).  That is one
+ * thread and stack per connection instead of two, and a delivery no
+ * longer needs a hand-over to another thread.  The price is that a
+ * client sending a packet slowly holds up its own deliveries meanwhile.
+ */
+extern int bvd_merged_service;
+
+/*
+ * Idle connections.
+ *
+ * With -I ms, a connection that has sent nothing for that long is
+ * disconnected, as if it had dropped: its handle is unregistered and
+ * its threads end.  This is what clears out clients whose machine or
+ * network went away without closing the connection.
+ *
+ * With -K ms as well, a client that asked for the "heartbeat" capability
+ * (see capability.h) and has sent nothing for that long is sent a
+ * HEARTBEAT, then another every -K ms while it stays quiet.  It answers
+ * with a HEARTBEAT of its own, or with anything else, which keeps it
+ * from being disconnected; so -K should be well under -I.  A HEARTBEAT
+ * from a client is never answered, and any client may send one.
+ *
+ * Both run on a timer of the connection (see timer.h) that is only
+ * looked at when it expires: a packet merely stamps the time.
+ * 0, the default, turns them off.
+ */
+#define BVD_HEARTBEAT_PKT (BVD_SEND_BATCH_PKT + 6)
+#define HEARTBEAT_NOTICE_TYPE ((NOTICE_TYPE)(RRCPT_NOTICE_TYPE + 1))
+
+/*
+ * The ACK of a LOGIN, which is written in v1 even on a connection that
+ * it turns v2 on for (see wire.h).
+ */
+#define LOGIN_ACK_NOTICE_TYPE ((NOTICE_TYPE)(RRCPT_NOTICE_TYPE + 2))
+
+extern int bvd_idle_timeout_ms;
+extern int bvd_heartbeat_ms;
+
+/*
+ * Registers handle for a connection carried over by a hot restart
+ * (see handoff.h), as a LOGIN with the given capabilities would,
+ * but without answering it.  Returns the new mailbox, or NULL if the
+ * handle could not be registered.
+ */
+MAILBOX* bvd_resume_login(int fd, char* handle, int caps);
+
+/*
+ * Starts the service threads for a connection carried over by a hot
+ * restart.  mb is what bvd_resume_login() returned, or NULL if the
+ * client had not logged in; the reference is handed to the session.
+ * The connection is closed when the client service thread finishes.
+ */
+int bvd_resume_session(int fd, MAILBOX* mb, int caps);
+
+#endif
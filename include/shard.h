@@ -0,0 +1,95 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "mailbox.h"
+#include "mailbox_ext.h"
+
+/*
+ * Sharded runtime: one shard per core.
+ *
+ * With -S n the server runs as n shards (-S 0: one per CPU it may run
+ * on), shard i pinned to the i-th of those CPUs, wrapping around.
+ *
+ *   - A new connection is handed to the next shard, round-robin, and its
+ *     service threads run pinned to that shard's CPU.
+ *   - Every handle has a home shard, its interned ID (see intern.h)
+ *     modulo n.  At LOGIN the connection moves to the home shard of its
+ *     handle, so that the threads and the mailbox of a logged in client
+ *     all stay on one core.
+ *   - A SEND (plain or batched) to a handle homed on another shard is
+ *     not added to the receiver's mailbox by the sender.  It goes on the
+ *     single-producer single-consumer queue from the sender's shard to
+ *     the receiver's, and the router thread of the receiver's shard
+ *     drains its queues in batches, adding every run of messages for the
+ *     same mailbox under a single mailbox lock.
+ *
+ * All the threads of a shard may push onto the same queue, so pushes
+ * are serialized by a lock of the queue, which only ever bounces between
+ * threads of one CPU.  The consumer side takes no lock.  A full queue
+ * makes the pusher yield until the router catches up, which keeps the
+ * order of the messages from one sender to one receiver.
+ *
+ * Streamed SENDs (see stream.h), whose sender waits for the receiver
+ * anyway, and notices are still added directly; a streamed SEND first
+ * waits for the queue to its receiver's shard to be delivered, so that
+ * it cannot overtake earlier messages.
+ */
+
+/*
+ * Number of slots of each queue (a power of 2), and the most messages a
+ * router takes off one queue before looking at the next.  There are
+ * n * n queues, each BVD_SHARD_RING * 32 bytes.
+ */
+#define BVD_SHARD_RING 512
+#define BVD_SHARD_BATCH 256
+
+/*
+ * Number of shards, 0 if the server is not sharded.
+ */
+extern int shard_count;
+
+/*
+ * Starts n shards (n = 0: one per usable CPU) and their router threads.
+ * Returns 0 on success, -1 on error.
+ */
+int shard_init(int n);
+
+/*
+ * The shard a new connection should go to, -1 if the server is not sharded.
+ */
+int shard_next(void);
+
+/*
+ * The home shard of the handle of a mailbox, -1 if the server is not sharded.
+ */
+int shard_home(MAILBOX *mb);
+
+/*
+ * Pins the calling thread to the CPU of a shard, and makes the shard its
+ * own for shard_add_messages().  Does nothing if the server is not sharded.
+ */
+void shard_enter(int shard);
+
+/*
+ * Add messages to a mailbox, as mb_add_messages() would, but through the
+ * queue to the home shard of the mailbox if the calling thread is on
+ * another shard.  Queued messages are taken over at once (0 is returned)
+ * and are bounced to their sender if the mailbox turns out to be defunct
+ * by the time they reach it.
+ */
+int shard_add_messages(MAILBOX *to, MB_BATCH_MESSAGE *msgs, int count);
+
+/*
+ * Waits until the messages the calling thread's shard has queued for the
+ * home shard of a mailbox are all in their mailboxes.
+ */
+void shard_flush(MAILBOX *to);
+
+/*
+ * Waits until every queue is empty, i.e. until every queued message is
+ * in its mailbox.  Used by a hot restart once no client thread can push
+ * anymore.
+ */
+void shard_quiesce(void);
+
+#endif
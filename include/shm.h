@@ -0,0 +1,188 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+#include "batch.h"
+
+/*
+ * Shared-memory transport for clients on the same machine.
+ *
+ * A client that connects to the server's Unix-domain socket (-u on the
+ * command line) may, as the very first thing it sends, offer a region of
+ * shared memory: a SHM packet with no payload, which carries a sealed
+ * memfd and four eventfds as SCM_RIGHTS.  The server maps the region and
+ * ACKs the offer through it; from then on every packet, both ways and
+ * in the same format as on a socket (LOGIN included), goes through the
+ * two rings in the region, and the socket carries nothing more.  It is
+ * kept open only so that either side learns when the other goes away,
+ * and the server shuts it down to end the session, as for any client.
+ * An offer the server cannot use is NACKed on the socket, which can go
+ * on as an ordinary connection.
+ *
+ * The region is a header page, then the data of the client-to-server
+ * ring, then that of the server-to-client ring, ring_size bytes each.
+ * Each ring is a single-producer single-consumer byte queue: head and
+ * tail count the bytes ever taken out and put in, so tail - head bytes
+ * are in it, at data[head % ring_size] on.  Copying in and out of a ring
+ * takes no system call.  A side that finds nothing to read (or no room
+ * to write) sets data_wanted (room_wanted) before it sleeps on its
+ * eventfd, and the other side writes the eventfd only if it finds the
+ * flag set once it has moved tail (head): so the eventfds are written
+ * only when a ring goes from empty to not empty under a sleeping
+ * reader, or has room again for a sleeping writer.  A busy connection
+ * makes no system calls at all.
+ *
+ * The server trusts nothing in the region: what it reads of the other
+ * side's counters is checked against its own, which it keeps to itself,
+ * and the memfd must be sealed against shrinking so that it cannot be
+ * pulled out from under the mapping.
+ *
+ * Sessions over rings are not streamed (see stream.h): their SENDs are
+ * buffered, up to the largest payload, and a streamed body to them is
+ * copied into the ring.  They are not carried over by a hot restart
+ * (see handoff.h) either; they are disconnected, and clients connect
+ * again.
+ */
+
+#define BVD_SHM_PKT (BVD_SEND_BATCH_PKT + 7)
+#define BVD_SHM_MAGIC 0x4256444d
+#define BVD_SHM_VERSION 1
+
+/*
+ * Bytes of each ring: the default of clients, and what the server takes.
+ */
+#define BVD_SHM_RING_SIZE (1024 * 1024)
+#define BVD_SHM_MIN_RING (64 * 1024)
+#define BVD_SHM_MAX_RING (64 * 1024 * 1024)
+
+/*
+ * Where the data of the rings starts in the region.
+ */
+#define BVD_SHM_DATA_OFFSET 4096
+
+/*
+ * The memfd, then the eventfds: data and room of the client-to-server
+ * ring, then of the server-to-client ring.
+ */
+#define BVD_SHM_FDS 5
+
+typedef struct shm_ring {
+	//written by the reader
+	_Alignas(64) _Atomic uint64_t head;
+	_Atomic uint32_t data_wanted;
+	//written by the writer
+	_Alignas(64) _Atomic uint64_t tail;
+	_Atomic uint32_t room_wanted;
+} SHM_RING;
+
+typedef struct shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ring_size;            // a power of 2
+	uint32_t reserved;
+	SHM_RING rings[2];             // client to server, server to client
+} SHM_HEADER;
+
+/*
+ * One side's view of the rings.
+ */
+typedef struct shm_conn {
+	int fd;                        // the socket, not closed by shm_close()
+	int memfd;                     // the client's, until it is offered
+	void *base;
+	size_t size;
+	uint32_t ring_size;
+	SHM_RING *in, *out;
+	char *in_data, *out_data;
+	uint64_t in_head;              // our own counters, see above
+	uint64_t out_tail;
+	int in_ready;                  // eventfds: written by the other side
+	int out_room;
+	int in_room;                   // and by this one
+	int out_ready;
+	int stop_fd;                   // if not -1, ends blocking waits once readable
+	int read_timeout_ms;           // how long a blocking read or write waits
+	int write_timeout_ms;          // at a time, -1 for ever
+} SHM_CONN;
+
+/*
+ * Client: creates a region with rings of ring_size bytes (a power of 2)
+ * and its eventfds, for the connected Unix-domain socket fd.
+ * Returns NULL with errno set on error.
+ */
+SHM_CONN *shm_create(int fd, uint32_t ring_size);
+
+/*
+ * Client: sends the offer of the region, as a SHM packet of the given
+ * msgid.  Its reply is read from the ring, unless it is a NACK, which
+ * comes on the socket.
+ * Returns 0 on success, -1 on error.
+ */
+int shm_offer(SHM_CONN *conn, uint32_t msgid);
+
+/*
+ * Server: on a Unix-domain socket whose client has sent nothing else
+ * yet, takes an offer of a region if that is what comes first.
+ * Returns 0 with *conn NULL if the client sent something else, which is
+ * left unread; 0 with *conn set and the header of the offer in *hdr if
+ * it was taken; -1 with the header in *hdr (zeroed if it could not be
+ * read) if it could not be used.
+ */
+int shm_accept(int fd, bvd_packet_header *hdr, SHM_CONN **conn);
+
+/*
+ * Unmaps the region and closes the eventfds.
+ */
+void shm_close(SHM_CONN *conn);
+
+/*
+ * Copies as much of iov as there is room for into the outgoing ring,
+ * without waiting.
+ * Returns the bytes copied, or -1 with errno EAGAIN if there was no room
+ * or EPROTO if the other side corrupted the ring.
+ */
+ssize_t shm_writev(SHM_CONN *conn, struct iovec *iov, int count);
+
+/*
+ * Writes length bytes to the outgoing ring, waiting for room for up to
+ * write_timeout_ms at a time.
+ * Returns 0 on success, -1 on error or if the other side went away.
+ */
+int shm_write_fully(SHM_CONN *conn, void *buf, size_t length);
+
+/*
+ * Waits for room in the outgoing ring, for up to write_timeout_ms.
+ * Returns 0 once there is some, -1 on timeout or if the other side went
+ * away.
+ */
+int shm_wait_room(SHM_CONN *conn);
+
+/*
+ * Copies up to length bytes out of the incoming ring, without waiting.
+ * Returns the bytes copied, or -1 with errno EAGAIN if there were none or
+ * EPROTO if the other side corrupted the ring.
+ */
+ssize_t shm_read(SHM_CONN *conn, void *buf, size_t length);
+
+/*
+ * Reads length bytes from the incoming ring, waiting for up to
+ * read_timeout_ms at a time.  buf may be NULL to throw them away.
+ * Returns 0 on success, -1 on error or if the other side went away.
+ */
+int shm_read_fully(SHM_CONN *conn, void *buf, size_t length);
+
+/*
+ * For a side that waits on more than its rings.  Returns 1 if there is
+ * something to read (room to write), or 0 after asking to be woken up
+ * through in_ready (out_room) when there is.
+ */
+int shm_want_data(SHM_CONN *conn);
+int shm_want_room(SHM_CONN *conn);
+
+#endif
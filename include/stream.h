@@ -0,0 +1,82 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include <semaphore.h>
+
+#include "mailbox.h"
+#include "shm.h"
+
+/*
+ * Streaming relay of large message bodies.
+ *
+ * A SEND whose payload is at least bvd_stream_min bytes is not read into
+ * memory.  The client service thread reads just the receiver's handle,
+ * then enqueues a stream entry in the receiver's mailbox and waits.
+ * When the receiver's mailbox service thread gets to the entry, it
+ * writes the DLVR header and moves the body straight from the sender's
+ * socket to the receiver's, through a pipe with splice(), so at most a
+ * pipe's worth of the body is ever in the server.  The sender's TCP
+ * window only reopens as fast as the receiver reads, which is the
+ * flow control.
+ *
+ * A stream entry is a message entry whose length is BVD_STREAM_LENGTH
+ * and whose body points to the BVD_STREAM below, which lives on the
+ * waiting client service thread's stack.  Whoever finishes with the
+ * entry -- the mailbox service thread, or the discard hook if the
+ * mailbox goes away first -- must set the body to NULL and post done.
+ */
+
+#define BVD_STREAM_LENGTH (-1)
+#define BVD_IS_STREAM(entry) ((entry)->type == MESSAGE_ENTRY_TYPE && (entry)->length == BVD_STREAM_LENGTH)
+
+/*
+ * Default size from which a SEND is streamed instead of buffered.
+ */
+#define BVD_DEFAULT_STREAM_MIN (256 * 1024)
+extern uint32_t bvd_stream_min;
+
+/*
+ * Longest receiver handle accepted on a streamed SEND, \r\n included.
+ */
+#define BVD_STREAM_HANDLE_MAX 256
+
+typedef struct bvd_stream {
+	int fd;                        // sender's socket, at the start of the body
+	uint32_t length;               // bytes of body still to be read from fd
+	int status;                    // 0 if the body reached the receiver
+	int drained;                   // set once the body has been read from fd
+	sem_t done;
+} BVD_STREAM;
+
+/*
+ * Move length bytes from the stream's socket to to_fd, through the pipe
+ * in pipefd, which is created on first use.  If writing to to_fd fails,
+ * the rest of the body is still read and thrown away, so the sender's
+ * connection stays in step.
+ *
+ * Returns 0 if every byte was written to to_fd, -1 otherwise.
+ */
+int stream_relay(BVD_STREAM *st, int to_fd, int *pipefd);
+
+/*
+ * The same, to the ring of a receiver on shared memory (see shm.h),
+ * through a buffer: a ring cannot be spliced to.
+ */
+int stream_relay_shm(BVD_STREAM *st, SHM_CONN *to);
+
+/*
+ * Read and throw away length bytes from fd.
+ * Returns 0 on success, -1 on error.
+ */
+int stream_drain(int fd, uint32_t length);
+
+/*
+ * Read a \r\n terminated line of at most max - 1 bytes from fd, one byte
+ * at a time so that nothing past it is consumed, and NUL-terminate it in
+ * place of the \r.  *consumed is increased by the bytes read.
+ * Returns 0 on success, -1 on error or if the line is too long.
+ */
+int stream_read_line(int fd, char *buf, int max, uint32_t *consumed);
+
+#endif
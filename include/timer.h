@@ -0,0 +1,90 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * Timers: a hierarchical timing wheel.
+ *
+ * Every timer of the server (idle connections, heartbeats, write
+ * deadlines, message TTLs) lives in one wheel of BVD_TIMER_LEVELS levels
+ * of 64 slots.  A slot of level 0 holds the timers due in one tick (a
+ * millisecond); a slot of level n covers 64^n ticks, and its timers move
+ * down a level when their slot comes up.  Starting, moving and stopping
+ * a timer are O(1), and a timer is moved at most BVD_TIMER_LEVELS - 1
+ * times whatever it is set for.
+ *
+ * There is no thread of its own, nor one per timer.  The wheel keeps a
+ * timerfd set to the next time it has something to do, and whichever
+ * loop polls timer_fd() calls timer_run() when it becomes readable: the
+ * writer thread of outq.c does.  With no timer due the timerfd is not
+ * set at all, so an idle server does not wake up.
+ *
+ * The callbacks run on that thread, one at a time and without any lock
+ * of the wheel held, so they may start and stop timers, their own too.
+ * At most BVD_TIMER_BATCH of them run per timer_run(); if more are due
+ * the timerfd is left readable, so that a million timers expiring at
+ * once are spread over many rounds of the loop instead of stalling it.
+ */
+
+#define BVD_TIMER_LEVELS 5
+#define BVD_TIMER_BATCH 256
+
+typedef struct bvd_timer BVD_TIMER;
+
+/*
+ * What a timer calls when it expires, with the arg it was set up with.
+ */
+typedef void (BVD_TIMER_FN)(void *arg);
+
+/*
+ * A timer is embedded in whatever it is for; its fields are private.
+ */
+struct bvd_timer {
+	BVD_TIMER *next;
+	BVD_TIMER **pprev;	//what points to it, NULL if not pending
+	uint64_t expires;	//tick
+	int slot;		//level * 64 + index of the slot it is or was last in
+	BVD_TIMER_FN *fn;
+	void *arg;
+};
+
+/*
+ * Sets up the wheel.  Returns 0 on success, -1 on error.
+ */
+int timer_init(void);
+
+/*
+ * A descriptor that becomes readable when timer_run() has work to do.
+ */
+int timer_fd(void);
+
+/*
+ * Runs the callbacks of expired timers, up to BVD_TIMER_BATCH of them.
+ */
+void timer_run(void);
+
+/*
+ * Milliseconds from the monotonic clock the wheel runs on.
+ */
+long timer_now_ms(void);
+
+/*
+ * Initializes a timer, not pending.
+ */
+void timer_setup(BVD_TIMER *t, BVD_TIMER_FN *fn, void *arg);
+
+/*
+ * (Re)starts a timer to expire ms milliseconds from now.
+ */
+void timer_schedule(BVD_TIMER *t, long ms);
+
+/*
+ * Stops a timer.  If its callback is running on another thread, waits
+ * for it to finish, so that afterwards the timer may be freed; called
+ * from the callback itself, it returns at once.  A caller must not hold
+ * anything the callback waits for.
+ */
+void timer_cancel(BVD_TIMER *t);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+/*
+ * Packet traces.
+ *
+ * With -X (file), every packet the server reads from a client is also
+ * written to a trace file, with the connection it came on and when, so
+ * that bvd_replay can send the same traffic to a server again: as it
+ * came, or as fast as the server takes it.  With -x (file) instead, only
+ * LOGINs and the first line of every other payload (the handle of a
+ * SEND) are kept, and the rest is replaced by its length and a hash, so
+ * that a trace of real users carries none of what they said.  Replayed,
+ * the rest is filler of the same length.
+ *
+ * The client service threads only copy the records into a buffer; a
+ * thread of its own writes the buffer out, BVD_TRACE_BUFFER bytes at a
+ * time or every BVD_TRACE_FLUSH_MS.  If the disk cannot keep up, records
+ * are dropped (and counted in trace_dropped) rather than the clients
+ * held up.
+ *
+ * The file starts with BVD_TRACE_MAGIC, followed by the records, each a
+ * BVD_TRACE_RECORD and then its stored payload bytes.  Numbers are in
+ * the byte order of the machine that wrote it.
+ */
+
+#define BVD_TRACE_MAGIC "BVDTRC1\n"
+#define BVD_TRACE_BUFFER (4 * 1024 * 1024)
+#define BVD_TRACE_FLUSH_MS 100
+
+#define BVD_TRACE_PACKET 1
+#define BVD_TRACE_CLOSE 2	//the connection ended, no header nor payload
+
+typedef struct bvd_trace_record {
+	uint32_t conn;		//numbered from 1, in the order they first sent something
+	uint32_t kind;
+	uint64_t usec;		//since the trace started
+	bvd_packet_header hdr;	//host byte order
+	uint32_t stored;	//payload bytes that follow: all of it, or its first line
+	uint32_t rest_hash;	//intern_hash() of the bytes past those, if read
+} BVD_TRACE_RECORD;
+
+/*
+ * Whether a trace is being written.
+ */
+extern int trace_enabled;
+
+/*
+ * Starts writing a trace to path, whole payloads or only the first
+ * lines of those of other packets than LOGINs.  Returns 0 on success, -1 on error.
+ */
+int trace_open(char *path, int first_lines);
+
+/*
+ * A number for a new connection.
+ */
+uint32_t trace_new_conn(void);
+
+/*
+ * Records a packet of connection conn.  The first length bytes of its
+ * payload are at payload; any more are not known, e.g. for a streamed
+ * SEND, or a packet whose payload was dropped unread.
+ */
+void trace_packet(uint32_t conn, bvd_packet_header *hdr, void *payload, uint32_t length);
+
+/*
+ * Records the end of connection conn.
+ */
+void trace_close(uint32_t conn);
+
+/*
+ * Writes out whatever is buffered and stops, for a server shutting down.
+ */
+void trace_finish(void);
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * Wire formats.
+ *
+ * v1 is the framing of protocol.h: bvd_packet_header as the compiler
+ * lays it out, padding after the type included, so 20 bytes in front of
+ * every packet, even a bare ACK.  A client that negotiated the "v2"
+ * capability (see capability.h) switches to a compact framing right
+ * after its LOGIN: it sends everything after the LOGIN in v2, and gets
+ * everything after the ACK of the LOGIN in v2.  The LOGIN and its ACK
+ * are v1 either way, so the client must wait for that ACK, to see
+ * whether v2 was turned on, before it sends anything else.
+ *
+ * A v2 header is
+ *
+ *   flags (3 bits) | header length (5 bits), type (1 byte),
+ *   msgid, payload length, [seconds, nanoseconds], [ID]
+ *
+ * where the header length counts the whole header, the first byte
+ * included, and msgid and the fields after it are varints: 7 bits at a
+ * time, least significant first, the top bit set on every byte but the
+ * last.  The timestamp is there only with BVD_WIRE_TIME, and the ID only
+ * with BVD_WIRE_ID.  A bare ACK takes 4 bytes; a small chat message
+ * from a client that named its receiver before takes 5 + its body.
+ *
+ * The ID stands for a handle, so that it need not be repeated in front
+ * of every message:
+ *   - a SEND with BVD_WIRE_ID and BVD_WIRE_NAMED has the usual payload,
+ *     (handle of receiver)\r\n(message body), and binds the ID to the
+ *     handle for the rest of the connection;
+ *   - a SEND with BVD_WIRE_ID alone has just the message body, and goes
+ *     to the handle bound to the ID.
+ * The client picks the IDs, below BVD_WIRE_MAX_ALIAS.  A SEND with an ID
+ * the server does not know, which also happens after a hot restart
+ * (see handoff.h), is NACKed with the payload BVD_WIRE_UNBOUND, and
+ * should be sent again with the handle.  DLVRs work the same way the
+ * other way round: the first one from a sender has BVD_WIRE_ID and
+ * BVD_WIRE_NAMED and the sender's handle line, the next ones only the
+ * ID and the body.  Those IDs are the server's, and a DLVR without
+ * BVD_WIRE_ID (from a sender on another node of a cluster) has the
+ * handle line as in v1.
+ *
+ * Payloads are otherwise the same as in v1.  Nothing the server sends
+ * in v2 carries a timestamp, which is most of a v1 header; a client may
+ * stamp what it sends, but the server does not look at it.
+ */
+
+#define BVD_WIRE_V1 1
+#define BVD_WIRE_V2 2
+
+#define BVD_WIRE_TIME 0x80
+#define BVD_WIRE_ID 0x40
+#define BVD_WIRE_NAMED 0x20
+
+/*
+ * Room for the header of either format.
+ */
+#define BVD_WIRE_MAX_HEADER 32
+
+#define BVD_WIRE_MAX_ALIAS 65536
+#define BVD_WIRE_UNBOUND "unbound"
+
+/*
+ * Encode a header, in host byte order, in the given format into buf,
+ * which has room for BVD_WIRE_MAX_HEADER bytes.  flags and id are only
+ * used by v2.  Returns the length of the encoded header.
+ */
+int wire_encode_header(int wire, bvd_packet_header *hdr, int flags, uint32_t id, void *buf);
+
+/*
+ * Decode the v2 header at the start of buf, length bytes of which are
+ * there.  Fields it does not have are 0.
+ * Returns the length of the header, or -1 if it is malformed or longer
+ * than length.
+ */
+int wire_decode_header(void *buf, size_t length, bvd_packet_header *hdr, int *flags, uint32_t *id);
+
+/*
+ * The length of the packet, header and payload, whose encoded header
+ * starts at buf.
+ */
+size_t wire_packet_length(int wire, void *buf);
+
+/*
+ * The length of the header of either format that starts at buf.  A v2
+ * header tells from its first byte, so that byte is all there has to be
+ * of it, for a caller reading from a buffer of its own.
+ */
+size_t wire_header_length(int wire, void *buf);
+
+/*
+ * Decode the v2 header at the front of what fd has to read, but leave
+ * it there: reading it along with the payload, with wire_read_rest(),
+ * saves a read per packet, as a v2 header cannot be read in one go
+ * without knowing its length.  A header that has not all arrived yet is
+ * read after all, since the peer may be waiting for room to send the
+ * rest, which only reading makes.
+ * Returns how many bytes of the header are left to read, or -1 on error
+ * with errno set.
+ */
+int wire_peek_header(int fd, bvd_packet_header *hdr, int *flags, uint32_t *id);
+
+/*
+ * Read and throw away skip bytes (a peeked header), then read length
+ * bytes into buf, in as few reads as they arrive in.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and errno is set.
+ */
+int wire_read_rest(int fd, size_t skip, void *buf, size_t length);
+
+/*
+ * Like proto_recv_packet() and proto_send_packet(), in either format.
+ * hdr is in host byte order and is not modified when sending.
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and errno is set.
+ */
+int wire_recv_packet(int fd, int wire, bvd_packet_header *hdr, int *flags, uint32_t *id, void **payload);
+int wire_send_packet(int fd, int wire, bvd_packet_header *hdr, int flags, uint32_t id, void *payload);
+
+/*
+ * Send just a header, for callers that write the payload themselves.
+ */
+int wire_send_header(int fd, int wire, bvd_packet_header *hdr, int flags, uint32_t id);
+
+#endif
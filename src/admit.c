@@ -0,0 +1,143 @@
+#include "admit.h"
+#include "mailbox.h"
+#include "mailbox_ext.h"
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "metrics.h"
+#include "timer.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+
+//HELPER FUNCTION DECLARATIONS
+void admit_sample(void*);
+int admit_read_stat(long*, long*);
+int admit_over(long value, long limit, int percent);
+
+
+//GLOBAL VARIABLES
+ADMIT_LIMITS admit_limits = {0, 0, 0};
+atomic_int admit_state = 0;	//overloaded
+BVD_TIMER admit_timer;
+
+
+
+/*
+ * Parse "threads,queued,rss_mb" into admit_limits.
+ */
+int admit_parse(char *spec){
+	ADMIT_LIMITS limits = {0, 0, 0};
+	if(sscanf(spec, "%ld,%ld,%ld", &limits.threads, &limits.queued, &limits.rss_mb) < 1)
+		return -1;
+	if(limits.threads < 0 || limits.queued < 0 || limits.rss_mb < 0)
+		return -1;
+	admit_limits = limits;
+	return 0;
+}
+
+/*
+ * Starts watching the load, if there is any limit.
+ */
+void admit_init(void){
+	if(admit_limits.threads == 0 && admit_limits.queued == 0 && admit_limits.rss_mb == 0)
+		return;
+	timer_setup(&admit_timer, admit_sample, NULL);
+	timer_schedule(&admit_timer, 0);
+}
+
+/*
+ * Whether the server is overloaded.
+ */
+int admit_overloaded(void){
+	return atomic_load_explicit(&admit_state, memory_order_relaxed);
+}
+
+/*
+ * The payload of a NACK that refuses a client.
+ */
+char *admit_retry_hint(int *length){
+	//the low bits of the clock are as good as random here
+	long retry = BVD_ADMIT_RETRY_MS + metrics_now_nsec() / 1000 % BVD_ADMIT_RETRY_MS;
+	char* hint = malloc(32);
+	*length = snprintf(hint, 32, "retry-after %ld", retry);
+	return hint;
+}
+
+/*
+ * Refuses a connection that was just accepted and closes it.
+ */
+void admit_refuse(int fd){
+	int length;
+	char* hint = admit_retry_hint(&length);
+	bvd_packet_header hdr;
+	proto_init_header(&hdr, BVD_NACK_PKT, 0, length);
+	proto_header_to_wire(&hdr);
+	struct iovec iov[2] = {{&hdr, sizeof(hdr)}, {hint, length}};
+	struct msghdr msg = {0};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	//a fresh socket has room for it; if not, the client just sees it closed
+	sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(fd);
+	free(hint);
+	metrics_add(METRIC_ADMIT_REFUSED, 1);
+}
+
+/*
+	Timer callback: samples the load and decides whether the server is
+	overloaded, with the hysteresis described in admit.h.
+*/
+void admit_sample(void* arg){
+	long threads = 0, rss_kb = 0;
+	admit_read_stat(&threads, &rss_kb);
+	long queued = mb_queued_total();
+
+	int overloaded = admit_overloaded();
+	//going in takes one limit passed, coming out all of them well under
+	int percent = overloaded ? BVD_ADMIT_LOW_PCT : 100;
+	int over = admit_over(threads, admit_limits.threads, percent)
+		|| admit_over(queued, admit_limits.queued, percent)
+		|| admit_over(rss_kb / 1024, admit_limits.rss_mb, percent);
+	if(over != overloaded){
+		debug("%s: threads %ld, queued %ld, rss %ldkB", over ? "overloaded" : "no longer overloaded",
+			threads, queued, rss_kb);
+		atomic_store_explicit(&admit_state, over, memory_order_relaxed);
+		if(over)
+			metrics_add(METRIC_ADMIT_OVERLOADS, 1);
+	}
+	timer_schedule(&admit_timer, BVD_ADMIT_SAMPLE_MS);
+}
+
+/*
+	Reads the thread count and resident memory of the process from
+	/proc/self/stat, in one go.
+*/
+int admit_read_stat(long* threads, long* rss_kb){
+	FILE* f = fopen("/proc/self/stat", "r");
+	if(f == NULL)
+		return -1;
+	//the command name, in parentheses, may have spaces: skip past it
+	int c;
+	while((c = fgetc(f)) != EOF && c != ')')
+		;
+	long rss_pages;
+	int n = fscanf(f, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %ld %*d %*u %*u %ld",
+		threads, &rss_pages);
+	fclose(f);
+	if(n != 2)
+		return -1;
+	*rss_kb = rss_pages * (sysconf(_SC_PAGESIZE) / 1024);
+	return 0;
+}
+
+/*
+	Whether a value is at or over percent of its limit, if it has one.
+*/
+int admit_over(long value, long limit, int percent){
+	return limit > 0 && value * 100 >= limit * percent;
+}
@@ -0,0 +1,121 @@
+#include "batch.h"
+#include "intern.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+/*
+ * Split the payload of a SEND_BATCH packet into its records.
+ *   payload - the payload, which is modified in place
+ *   length - the payload length
+ *   records - variable into which to store a malloc'ed array of records
+ *
+ * On success, the number of records is returned, and the caller is
+ * responsible for freeing the array (but not the data it points to).
+ * On a malformed payload, -1 is returned and nothing is allocated.
+ */
+int bvd_batch_parse(char *payload, size_t length, BVD_BATCH_RECORD **records){
+	//first pass only counts, so the array is allocated once
+	int count = 0;
+	size_t offset = 0;
+	while(offset < length){
+		bvd_batch_record_header rh;
+		if(length - offset < sizeof(rh))
+			return -1;
+		memcpy(&rh, payload + offset, sizeof(rh));
+		offset += sizeof(rh);
+		if(ntohl(rh.length) > length - offset)
+			return -1;
+		offset += ntohl(rh.length);
+		if(++count > BVD_BATCH_MAX_RECORDS)
+			return -1;
+	}
+	if(count == 0)
+		return -1;
+
+	BVD_BATCH_RECORD* recs = malloc(sizeof(BVD_BATCH_RECORD) * count);
+	offset = 0;
+	for(int i = 0; i < count; i++){
+		bvd_batch_record_header rh;
+		memcpy(&rh, payload + offset, sizeof(rh));
+		offset += sizeof(rh);
+
+		char* data = payload + offset;
+		size_t size = ntohl(rh.length);
+		offset += size;
+
+		//the first line is the handle of the receiver
+		char* eol = NULL;
+		for(size_t j = 0; j + 1 < size; j++){
+			if(data[j] == '\r' && data[j+1] == '\n'){
+				eol = data + j;
+				break;
+			}
+		}
+		if(eol == NULL || eol == data){
+			debug("record %d has no receiver", i);
+			free(recs);
+			return -1;
+		}
+		*eol = '\0';
+
+		recs[i].index = i;
+		recs[i].msgid = ntohl(rh.msgid);
+		recs[i].handle = data;
+		recs[i].id = BVD_NO_ID; //interning is up to the caller
+		recs[i].body = eol + 2;
+		recs[i].length = size - (eol + 2 - data);
+	}
+
+	*records = recs;
+	return count;
+}
+
+/*
+ * Append a record to a batch payload under construction.
+ *   buf, len, cap - the payload buffer, its used length and its capacity;
+ *                   the buffer is grown with realloc() as required
+ *   msgid - the ID of the message
+ *   handle - the handle of the receiver
+ *   body, length - the message body
+ *
+ * On success, 0 is returned.
+ * On error, -1 is returned and errno is set.
+ */
+int bvd_batch_append(char **buf, size_t *len, size_t *cap, uint32_t msgid,
+		     char *handle, void *body, size_t length){
+	size_t hlen = strlen(handle);
+	size_t data = hlen + 2 + length;
+	size_t need = *len + sizeof(bvd_batch_record_header) + data;
+
+	if(need > *cap){
+		size_t new_cap = *cap ? *cap : 256;
+		while(new_cap < need)
+			new_cap *= 2;
+		char* grown = realloc(*buf, new_cap);
+		if(grown == NULL)
+			return -1;
+		*buf = grown;
+		*cap = new_cap;
+	}
+
+	bvd_batch_record_header rh;
+	rh.msgid = htonl(msgid);
+	rh.length = htonl(data);
+
+	char* ptr = *buf + *len;
+	memcpy(ptr, &rh, sizeof(rh));
+	ptr += sizeof(rh);
+	memcpy(ptr, handle, hlen);
+	ptr += hlen;
+	memcpy(ptr, "\r\n", 2);
+	ptr += 2;
+	if(length > 0)
+		memcpy(ptr, body, length);
+
+	*len = need;
+	return 0;
+}
@@ -0,0 +1,68 @@
+#include "capability.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+//GLOBAL VARIABLES
+static const struct {
+	char* name;
+	int flag;
+} cap_names[] = {
+	{"coalesce", BVD_CAP_COALESCE},
+	{"lz4", BVD_CAP_LZ4},
+	{"heartbeat", BVD_CAP_HEARTBEAT},
+	{"dedup", BVD_CAP_DEDUP},
+	{"v2", BVD_CAP_V2},
+};
+
+#define NUM_CAPS ((int)(sizeof(cap_names) / sizeof(cap_names[0])))
+
+
+/*
+ * Parse a line of space-separated capability names into a set of flags.
+ * Unknown names are ignored.
+ */
+int bvd_caps_parse(char *line){
+	int caps = 0;
+	char* save = NULL;
+	for(char* tok = strtok_r(line, " \r\n", &save); tok != NULL; tok = strtok_r(NULL, " \r\n", &save)){
+		int known = 0;
+		for(int i = 0; i < NUM_CAPS; i++){
+			if(!strcmp(tok, cap_names[i].name)){
+				caps |= cap_names[i].flag;
+				known = 1;
+			}
+		}
+		if(!known)
+			debug("ignoring unknown capability %s", tok);
+	}
+	return caps;
+}
+
+/*
+ * Format a set of flags as space-separated capability names.
+ * Returns a malloc'ed string, which is not NUL-terminated, and stores
+ * its length in *length.  If caps is 0, NULL is returned and *length is 0.
+ */
+char *bvd_caps_format(int caps, int *length){
+	int len = 0;
+	for(int i = 0; i < NUM_CAPS; i++){
+		if(caps & cap_names[i].flag)
+			len += strlen(cap_names[i].name) + 1;
+	}
+	*length = 0;
+	if(len == 0)
+		return NULL;
+
+	//one byte more for sprintf's NUL, which is not part of the payload
+	char* line = malloc(len + 1);
+	char* ptr = line;
+	for(int i = 0; i < NUM_CAPS; i++){
+		if(caps & cap_names[i].flag)
+			ptr += sprintf(ptr, ptr == line ? "%s" : " %s", cap_names[i].name);
+	}
+	*length = ptr - line;
+	return line;
+}
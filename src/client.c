@@ -0,0 +1,1159 @@
+#define _GNU_SOURCE
+#include "client.h"
+#include "protocol_ext.h"
+#include "batch.h"
+#include "coalesce.h"
+#include "capability.h"
+#include "server_ext.h"
+#include "wire.h"
+#include "shm.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+
+
+#define CLIENT_BUCKETS 1024	//of the name tables
+#define CLIENT_OUT_HIGH (64 * 1024)	//nothing more is packed while this much is unwritten
+#define CLIENT_READ_SIZE (64 * 1024)
+#define CLIENT_BATCH_BYTES (64 * 1024)	//a bigger message goes in a SEND of its own
+
+
+//STRUCTS
+typedef struct client_msg {
+	struct client_msg* next;	//in its bucket of pending
+	struct client_msg* queued;	//next in the queue
+	uint32_t msgid;
+	int in_queue;
+	int acked;
+	int took_room;	//holds a slot of the window
+	int batch;	//records of a SEND_BATCH, 0 for a message
+	uint32_t* records;	//of a SEND_BATCH: their msgids, in order
+	CLIENT_RESULT_FN* fn;
+	void* arg;
+	char* to;	//NUL-terminated, at the start of data
+	char* payload;	//(to)\r\n(body), after it
+	size_t line;	//bytes of payload before the body
+	size_t length;	//of payload
+	char data[];
+} CLIENT_MSG;
+
+//A handle and the v2 ID it goes by, see wire.h
+typedef struct client_name {
+	struct client_name* next;
+	uint32_t id;
+	char handle[];
+} CLIENT_NAME;
+
+struct bvd_client {
+	BVD_CLIENT_CONFIG config;	//with its strings copied
+	int window;
+	int max_batch;
+	int evfd;	//wakes the I/O thread
+	pthread_t io;
+	sem_t lock;	//guards the queue, pending, next_msgid and closing
+	sem_t room;	//free slots of the window
+	uint32_t next_msgid;
+	CLIENT_MSG* head;	//the queue: messages to write, oldest first
+	CLIENT_MSG* tail;
+	CLIENT_MSG** pending;	//messages and batches without an outcome, by msgid
+	uint32_t mask;
+	int closing;
+	//the rest belongs to the I/O thread
+	int fd;	//-1 while disconnected
+	SHM_CONN* shm;	//with config.shm: the rings of the connection, see shm.h
+	int wire;
+	long retry_ms;	//when to connect again
+	long backoff_ms;
+	char* out;	//what is to be written is out[out_sent..out_len)
+	size_t out_len, out_sent, out_cap;
+	char* in;	//what has been read but not handled
+	size_t in_len, in_cap;
+	char* scratch;	//a SEND_BATCH payload under construction
+	size_t scratch_cap;
+	CLIENT_MSG** taken;	//the messages of it
+	CLIENT_NAME* aliases[CLIENT_BUCKETS];	//receivers, by handle
+	uint32_t num_aliases;
+	CLIENT_NAME* senders[CLIENT_BUCKETS];	//senders, by the server's ID
+};
+
+
+//HELPER FUNCTION DECLARATIONS
+void* client_io(void*);
+int client_pump(BVD_CLIENT*);
+int client_pump_shm(BVD_CLIENT*);
+int client_dial(BVD_CLIENT*);
+int client_dial_unix(BVD_CLIENT*);
+int client_offer(BVD_CLIENT*, int);
+int client_login(BVD_CLIENT*, int);
+int client_send_v1(BVD_CLIENT*, int, bvd_packet_header*, void*);
+int client_recv_v1(BVD_CLIENT*, int, bvd_packet_header*, void**);
+void client_hangup(BVD_CLIENT*, int);
+int client_reconnect(BVD_CLIENT*);
+void client_disconnect(BVD_CLIENT*);
+void client_shutdown(BVD_CLIENT*);
+int client_fill(BVD_CLIENT*);
+void client_encode_send(BVD_CLIENT*, CLIENT_MSG*);
+void client_encode_batch(BVD_CLIENT*, CLIENT_MSG*);
+void client_append(BVD_CLIENT*, uint8_t, uint32_t, int, uint32_t, void*, size_t);
+int client_write(BVD_CLIENT*);
+int client_read(BVD_CLIENT*);
+int client_parse(BVD_CLIENT*);
+void client_dispatch(BVD_CLIENT*, bvd_packet_header*, int, uint32_t, char*);
+void client_deliver(BVD_CLIENT*, bvd_packet_header*, int, uint32_t, char*);
+void client_notice(BVD_CLIENT*, uint32_t, int, char*, uint32_t);
+void client_ranges(BVD_CLIENT*, int, char*, uint32_t);
+void client_outcome(BVD_CLIENT*, CLIENT_MSG*, int);
+void client_requeue(BVD_CLIENT*, CLIENT_MSG*);
+CLIENT_MSG* client_pending_find(BVD_CLIENT*, uint32_t);
+void client_pending_remove(BVD_CLIENT*, CLIENT_MSG*);
+void client_free_msg(CLIENT_MSG*);
+CLIENT_NAME* client_alias_find(BVD_CLIENT*, char*);
+CLIENT_NAME* client_sender_find(BVD_CLIENT*, uint32_t);
+void client_name_add(CLIENT_NAME**, uint32_t, uint32_t, char*, size_t);
+void client_names_clear(CLIENT_NAME**);
+uint32_t client_hash(char*);
+void client_wake(BVD_CLIENT*);
+long client_now_ms(void);
+void client_free(BVD_CLIENT*);
+
+
+
+/*
+ * Connects and logs in, then starts the I/O thread.
+ */
+BVD_CLIENT *client_open(BVD_CLIENT_CONFIG *config){
+	BVD_CLIENT* c = calloc(1, sizeof(BVD_CLIENT));
+	c->config = *config;
+	c->config.host = config->host != NULL ? strdup(config->host) : NULL;
+	c->config.path = config->path != NULL ? strdup(config->path) : NULL;
+	c->config.handle = strdup(config->handle);
+	c->config.caps = strdup(config->caps != NULL ? config->caps : BVD_CLIENT_CAPS);
+	c->window = config->window > 0 ? config->window : BVD_CLIENT_WINDOW;
+	c->max_batch = config->max_batch > 0 ? config->max_batch : BVD_CLIENT_MAX_BATCH;
+	if(c->max_batch > BVD_BATCH_MAX_RECORDS)
+		c->max_batch = BVD_BATCH_MAX_RECORDS;
+	//msgids are handed out in order, so a table as big as the window
+	//spreads them evenly
+	uint32_t size = 64;
+	while(size < (uint32_t)c->window)
+		size *= 2;
+	c->pending = calloc(size, sizeof(CLIENT_MSG*));
+	c->mask = size - 1;
+	c->taken = malloc(c->max_batch * sizeof(CLIENT_MSG*));
+	c->next_msgid = 1;
+	c->backoff_ms = BVD_CLIENT_BACKOFF_MS;
+	sem_init(&c->lock, 0, 1);
+	sem_init(&c->room, 0, c->window);
+	c->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	c->fd = client_dial(c);
+	if(c->evfd < 0 || c->fd < 0 || client_login(c, c->fd) < 0){
+		int err = errno;
+		client_free(c);
+		errno = err;
+		return NULL;
+	}
+	if(pthread_create(&c->io, NULL, client_io, c) != 0){
+		client_free(c);
+		errno = EAGAIN;
+		return NULL;
+	}
+	return c;
+}
+
+/*
+ * Queues a message.
+ */
+long client_send(BVD_CLIENT *c, char *to, void *body, size_t length, CLIENT_RESULT_FN *fn, void *arg){
+	size_t to_len = strlen(to);
+	if(to_len + 2 + length > proto_max_payload){
+		errno = EMSGSIZE;
+		return -1;
+	}
+	CLIENT_MSG* msg = malloc(sizeof(CLIENT_MSG) + 2 * to_len + 3 + length);
+	memset(msg, 0, sizeof(CLIENT_MSG));
+	msg->fn = fn;
+	msg->arg = arg;
+	msg->to = msg->data;
+	memcpy(msg->to, to, to_len + 1);
+	msg->payload = msg->to + to_len + 1;
+	memcpy(msg->payload, to, to_len);
+	memcpy(msg->payload + to_len, "\r\n", 2);
+	memcpy(msg->payload + to_len + 2, body, length);
+	msg->line = to_len + 2;
+	msg->length = to_len + 2 + length;
+
+	//the I/O thread cannot wait for room, as it is what makes room
+	if(pthread_equal(pthread_self(), c->io))
+		msg->took_room = sem_trywait(&c->room) == 0;
+	else{
+		while(sem_wait(&c->room) < 0 && errno == EINTR)
+			;
+		msg->took_room = 1;
+	}
+
+	sem_wait(&c->lock);
+	if(c->closing){
+		sem_post(&c->lock);
+		if(msg->took_room)
+			sem_post(&c->room);
+		free(msg);
+		errno = ESHUTDOWN;
+		return -1;
+	}
+	msg->msgid = c->next_msgid++;
+	if(c->next_msgid == 0)
+		c->next_msgid = 1;
+	CLIENT_MSG** bucket = &c->pending[msg->msgid & c->mask];
+	msg->next = *bucket;
+	*bucket = msg;
+	msg->in_queue = 1;
+	int wake = c->head == NULL;
+	if(c->tail != NULL)
+		c->tail->queued = msg;
+	else
+		c->head = msg;
+	c->tail = msg;
+	long msgid = msg->msgid;
+	sem_post(&c->lock);
+
+	//the I/O thread drains the queue whole, so only the first message
+	//into an empty one needs to wake it
+	if(wake)
+		client_wake(c);
+	return msgid;
+}
+
+/*
+ * Waits until every message sent so far has its outcome.
+ */
+void client_flush(BVD_CLIENT *c){
+	//all of the window free means nothing is in flight
+	for(int i = 0; i < c->window; i++){
+		while(sem_wait(&c->room) < 0 && errno == EINTR)
+			;
+	}
+	for(int i = 0; i < c->window; i++)
+		sem_post(&c->room);
+}
+
+/*
+ * Logs out, stops the I/O thread and frees the client.
+ */
+void client_close(BVD_CLIENT *c){
+	sem_wait(&c->lock);
+	c->closing = 1;
+	sem_post(&c->lock);
+	client_wake(c);
+	pthread_join(c->io, NULL);
+	client_free(c);
+}
+
+/*
+	Thread function of the I/O thread.
+*/
+void* client_io(void* arg){
+	BVD_CLIENT* c = arg;
+	while(1){
+		sem_wait(&c->lock);
+		int closing = c->closing;
+		sem_post(&c->lock);
+		if(closing)
+			break;
+		if(c->fd < 0){
+			client_reconnect(c);
+			continue;
+		}
+		if(client_pump(c) < 0){
+			debug("connection of %s lost: %s", c->config.handle, strerror(errno));
+			client_disconnect(c);
+		}
+	}
+	client_shutdown(c);
+	return NULL;
+}
+
+/*
+	One round of the I/O thread on a live connection: packs what is
+	queued, writes what the socket takes, then waits for the socket or
+	a wake-up and reads what came in.
+	Returns -1 if the connection is lost.
+*/
+int client_pump(BVD_CLIENT* c){
+	int more = client_fill(c);
+	if(client_write(c) < 0)
+		return -1;
+	if(more && c->out_sent == c->out_len)
+		return 0; //everything went out at once, so pack some more
+	if(c->shm != NULL)
+		return client_pump_shm(c);
+	struct pollfd fds[2] = {
+		{c->fd, POLLIN | (c->out_sent < c->out_len ? POLLOUT : 0), 0},
+		{c->evfd, POLLIN, 0}
+	};
+	if(poll(fds, 2, -1) < 0)
+		return errno == EINTR ? 0 : -1;
+	if(fds[1].revents & POLLIN){
+		uint64_t n;
+		if(read(c->evfd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+			return -1;
+	}
+	if(fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+		return client_read(c);
+	return 0;
+}
+
+/*
+	The same with rings: their eventfds wake the thread up, and the
+	socket only ever says that the server is gone.  It does not sleep
+	at all while there is something to read, or room for what is left
+	to write.
+*/
+int client_pump_shm(BVD_CLIENT* c){
+	int writing = c->out_sent < c->out_len;
+	if(!shm_want_data(c->shm) && !(writing && shm_want_room(c->shm))){
+		struct pollfd fds[4] = {
+			{c->fd, POLLIN, 0},
+			{c->evfd, POLLIN, 0},
+			{c->shm->in_ready, POLLIN, 0},
+			{c->shm->out_room, POLLIN, 0}
+		};
+		if(poll(fds, writing ? 4 : 3, -1) < 0)
+			return errno == EINTR ? 0 : -1;
+		if(fds[1].revents & POLLIN){
+			uint64_t n;
+			if(read(c->evfd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+				return -1;
+		}
+		if(fds[0].revents){
+			errno = ECONNRESET;
+			return -1;
+		}
+	}
+	return client_read(c);
+}
+
+/*
+	Opens a connection to the server, with a timeout on everything done
+	on it until it is logged in, and offers it rings if it is to have
+	them.
+*/
+int client_dial(BVD_CLIENT* c){
+	if(c->config.path != NULL){
+		int fd = client_dial_unix(c);
+		if(fd >= 0 && c->config.shm > 0 && client_offer(c, fd) < 0){
+			int err = errno;
+			close(fd);
+			errno = err;
+			return -1;
+		}
+		return fd;
+	}
+	struct addrinfo hints, *list, *p;
+	char service[16];
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", c->config.port);
+	if(getaddrinfo(c->config.host, service, &hints, &list) != 0){
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	struct timeval tv = {BVD_CLIENT_TIMEOUT_MS / 1000, (BVD_CLIENT_TIMEOUT_MS % 1000) * 1000};
+	for(p = list; p != NULL; p = p->ai_next){
+		if((fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) < 0)
+			continue;
+		//SO_SNDTIMEO bounds connect() too
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		if(connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(list);
+
+	int one = 1;
+	if(fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+/*
+	The same on the server's Unix-domain socket.
+*/
+int client_dial_unix(BVD_CLIENT* c){
+	struct sockaddr_un addr;
+	if(strlen(c->config.path) >= sizeof(addr.sun_path)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, c->config.path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+		return -1;
+	struct timeval tv = {BVD_CLIENT_TIMEOUT_MS / 1000, (BVD_CLIENT_TIMEOUT_MS % 1000) * 1000};
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+/*
+	Offers the server rings on a new connection, and waits for its ACK
+	on them.  A NACK comes on the socket, which is then taken for the
+	server having gone away.
+*/
+int client_offer(BVD_CLIENT* c, int fd){
+	c->shm = shm_create(fd, c->config.shm);
+	if(c->shm == NULL)
+		return -1;
+	c->shm->read_timeout_ms = c->shm->write_timeout_ms = BVD_CLIENT_TIMEOUT_MS;
+	bvd_packet_header hdr;
+	void* payload = NULL;
+	if(shm_offer(c->shm, 0) < 0 || client_recv_v1(c, fd, &hdr, &payload) < 0 || hdr.type != BVD_ACK_PKT){
+		free(payload);
+		shm_close(c->shm);
+		c->shm = NULL;
+		if(errno == ECONNRESET)
+			errno = ECONNREFUSED;
+		return -1;
+	}
+	free(payload);
+	return 0;
+}
+
+/*
+	Logs in on a new connection, which is v1 until the ACK says
+	otherwise, and leaves it non-blocking.
+*/
+int client_login(BVD_CLIENT* c, int fd){
+	size_t length = strlen(c->config.handle) + 2 + strlen(c->config.caps);
+	char* line = malloc(length + 1);
+	if(c->config.caps[0] != '\0')
+		sprintf(line, "%s\r\n%s", c->config.handle, c->config.caps);
+	else
+		length = sprintf(line, "%s", c->config.handle);
+	bvd_packet_header hdr;
+	proto_init_header(&hdr, BVD_LOGIN_PKT, 0, length);
+	int ret = client_send_v1(c, fd, &hdr, line);
+	free(line);
+	if(ret < 0)
+		return -1;
+
+	void* payload = NULL;
+	if(client_recv_v1(c, fd, &hdr, &payload) < 0)
+		return -1;
+	int caps = hdr.type == BVD_ACK_PKT && payload != NULL ? bvd_caps_parse(payload) : 0;
+	free(payload);
+	if(hdr.type != BVD_ACK_PKT){
+		errno = ECONNREFUSED;
+		return -1;
+	}
+	c->wire = caps & BVD_CAP_V2 ? BVD_WIRE_V2 : BVD_WIRE_V1;
+
+	struct timeval tv = {0, 0};
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return 0;
+}
+
+/*
+	Sends a v1 packet, as proto_send_packet() would, on the socket or
+	the ring.
+*/
+int client_send_v1(BVD_CLIENT* c, int fd, bvd_packet_header* hdr, void* payload){
+	if(c->shm == NULL)
+		return proto_send_packet(fd, hdr, payload);
+	uint8_t head[BVD_WIRE_MAX_HEADER];
+	int head_length = wire_encode_header(BVD_WIRE_V1, hdr, 0, 0, head);
+	if(shm_write_fully(c->shm, head, head_length) < 0)
+		return -1;
+	return hdr->payload_length > 0 ? shm_write_fully(c->shm, payload, hdr->payload_length) : 0;
+}
+
+/*
+	Receives a v1 packet, as proto_recv_packet() would, from the socket
+	or the ring.
+*/
+int client_recv_v1(BVD_CLIENT* c, int fd, bvd_packet_header* hdr, void** payload){
+	if(c->shm == NULL)
+		return proto_recv_packet(fd, hdr, payload);
+	*payload = NULL;
+	if(shm_read_fully(c->shm, hdr, sizeof(bvd_packet_header)) < 0)
+		return -1;
+	hdr->payload_length = ntohl(hdr->payload_length);
+	hdr->msgid = ntohl(hdr->msgid);
+	if(hdr->payload_length > proto_max_payload){
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if(hdr->payload_length == 0)
+		return 0;
+	char* buf = malloc(hdr->payload_length + 1);
+	if(shm_read_fully(c->shm, buf, hdr->payload_length) < 0){
+		free(buf);
+		return -1;
+	}
+	buf[hdr->payload_length] = '\0';
+	*payload = buf;
+	return 0;
+}
+
+/*
+	Closes a connection, and its rings if it has them.
+*/
+void client_hangup(BVD_CLIENT* c, int fd){
+	close(fd);
+	if(c->shm != NULL){
+		shm_close(c->shm);
+		c->shm = NULL;
+	}
+}
+
+/*
+	Connects and logs in again once it is time to, waiting for that
+	time (or to be woken up) if it is not.
+*/
+int client_reconnect(BVD_CLIENT* c){
+	long wait = c->retry_ms - client_now_ms();
+	if(wait > 0){
+		struct pollfd pfd = {c->evfd, POLLIN, 0};
+		if(poll(&pfd, 1, wait) > 0){
+			uint64_t n;
+			if(read(c->evfd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+				return -1;
+		}
+		return -1;
+	}
+	int fd = client_dial(c);
+	if(fd < 0 || client_login(c, fd) < 0){
+		if(fd >= 0)
+			client_hangup(c, fd);
+		c->retry_ms = client_now_ms() + c->backoff_ms;
+		c->backoff_ms *= 2;
+		if(c->backoff_ms > BVD_CLIENT_BACKOFF_MAX_MS)
+			c->backoff_ms = BVD_CLIENT_BACKOFF_MAX_MS;
+		return -1;
+	}
+	c->fd = fd;
+	c->backoff_ms = BVD_CLIENT_BACKOFF_MS;
+	debug("%s logged in again", c->config.handle);
+	if(c->config.on_state != NULL)
+		c->config.on_state(c, 1, c->config.arg);
+	return 0;
+}
+
+/*
+	Drops the connection.  Messages that were written but not ACKed go
+	back to the front of the queue, in order, and those that were ACKed
+	are lost.
+*/
+void client_disconnect(BVD_CLIENT* c){
+	client_hangup(c, c->fd);
+	c->fd = -1;
+	c->out_len = c->out_sent = 0;
+	c->in_len = 0;
+	client_names_clear(c->aliases);
+	client_names_clear(c->senders);
+	c->num_aliases = 0;
+
+	CLIENT_MSG* lost = NULL;
+	CLIENT_MSG* again = NULL;	//to go back in the queue, newest first
+	sem_wait(&c->lock);
+	for(uint32_t i = 0; i <= c->mask; i++){
+		CLIENT_MSG** link = &c->pending[i];
+		while(*link != NULL){
+			CLIENT_MSG* msg = *link;
+			if(msg->batch > 0 || msg->acked){
+				*link = msg->next;
+				msg->queued = lost;
+				lost = msg;
+				continue;
+			}
+			if(!msg->in_queue){
+				//insertion sort, as there are at most a window of them
+				CLIENT_MSG** pos = &again;
+				while(*pos != NULL && (*pos)->msgid > msg->msgid)
+					pos = &(*pos)->queued;
+				msg->queued = *pos;
+				*pos = msg;
+			}
+			link = &msg->next;
+		}
+	}
+	while(again != NULL){
+		CLIENT_MSG* msg = again;
+		again = msg->queued;
+		msg->in_queue = 1;
+		msg->queued = c->head;
+		c->head = msg;
+		if(c->tail == NULL)
+			c->tail = msg;
+	}
+	sem_post(&c->lock);
+
+	while(lost != NULL){
+		CLIENT_MSG* msg = lost;
+		lost = msg->queued;
+		if(msg->batch == 0 && msg->fn != NULL)
+			msg->fn(c, msg->msgid, CLIENT_LOST, msg->arg);
+		if(msg->took_room)
+			sem_post(&c->room);
+		client_free_msg(msg);
+	}
+	c->retry_ms = client_now_ms() + c->backoff_ms;
+	if(c->config.on_state != NULL)
+		c->config.on_state(c, 0, c->config.arg);
+}
+
+/*
+	Finishes off a client that is being closed: writes out what was
+	written in part, then a LOGOUT, and reports every message without
+	an outcome as lost.
+*/
+void client_shutdown(BVD_CLIENT* c){
+	if(c->fd >= 0){
+		client_append(c, BVD_LOGOUT_PKT, 0, 0, 0, NULL, 0);
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+		struct timeval tv = {BVD_CLIENT_TIMEOUT_MS / 1000, (BVD_CLIENT_TIMEOUT_MS % 1000) * 1000};
+		setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if(c->shm != NULL){
+			c->shm->write_timeout_ms = BVD_CLIENT_TIMEOUT_MS;
+			shm_write_fully(c->shm, c->out + c->out_sent, c->out_len - c->out_sent);
+		}
+		else{
+			proto_write_fully(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+		}
+		client_hangup(c, c->fd);
+		c->fd = -1;
+	}
+
+	CLIENT_MSG* lost = NULL;
+	sem_wait(&c->lock);
+	for(uint32_t i = 0; i <= c->mask; i++){
+		while(c->pending[i] != NULL){
+			CLIENT_MSG* msg = c->pending[i];
+			c->pending[i] = msg->next;
+			msg->queued = lost;
+			lost = msg;
+		}
+	}
+	c->head = c->tail = NULL;
+	sem_post(&c->lock);
+
+	while(lost != NULL){
+		CLIENT_MSG* msg = lost;
+		lost = msg->queued;
+		if(msg->batch == 0 && msg->fn != NULL)
+			msg->fn(c, msg->msgid, CLIENT_LOST, msg->arg);
+		if(msg->took_room)
+			sem_post(&c->room);
+		client_free_msg(msg);
+	}
+}
+
+/*
+	Packs queued messages into the output buffer, as SEND_BATCHes of up
+	to max_batch messages and CLIENT_BATCH_BYTES, or a SEND for one that
+	is on its own, until the queue is empty or the buffer is full enough.
+	Returns 1 if messages were left in the queue, 0 if not.
+*/
+int client_fill(BVD_CLIENT* c){
+	while(c->out_len - c->out_sent < CLIENT_OUT_HIGH){
+		CLIENT_MSG* batch = NULL;
+		int n = 0;
+		size_t bytes = 0;
+		sem_wait(&c->lock);
+		while(n < c->max_batch && c->head != NULL){
+			CLIENT_MSG* msg = c->head;
+			if(n > 0 && bytes + msg->length > CLIENT_BATCH_BYTES)
+				break;
+			bytes += msg->length;
+			c->head = msg->queued;
+			msg->in_queue = 0;
+			c->taken[n++] = msg;
+		}
+		if(c->head == NULL)
+			c->tail = NULL;
+		if(n > 1){
+			batch = calloc(1, sizeof(CLIENT_MSG));
+			batch->msgid = c->next_msgid++;
+			if(c->next_msgid == 0)
+				c->next_msgid = 1;
+			batch->batch = n;
+			CLIENT_MSG** bucket = &c->pending[batch->msgid & c->mask];
+			batch->next = *bucket;
+			*bucket = batch;
+		}
+		int more = c->head != NULL;
+		sem_post(&c->lock);
+
+		if(n == 1)
+			client_encode_send(c, c->taken[0]);
+		else if(n > 1)
+			client_encode_batch(c, batch);
+		if(!more)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+	Writes a SEND, naming its receiver by ID with v2.
+*/
+void client_encode_send(BVD_CLIENT* c, CLIENT_MSG* msg){
+	char* payload = msg->payload;
+	size_t length = msg->length;
+	int flags = 0;
+	uint32_t id = 0;
+	if(c->wire == BVD_WIRE_V2){
+		CLIENT_NAME* alias = client_alias_find(c, msg->to);
+		if(alias != NULL){
+			flags = BVD_WIRE_ID;
+			id = alias->id;
+			payload += msg->line;
+			length -= msg->line;
+		}
+		else if(c->num_aliases + 1 < BVD_WIRE_MAX_ALIAS){
+			flags = BVD_WIRE_ID | BVD_WIRE_NAMED;
+			id = ++c->num_aliases;
+			client_name_add(c->aliases, client_hash(msg->to), id, msg->to, msg->line - 2);
+		}
+	}
+	client_append(c, BVD_SEND_PKT, msg->msgid, flags, id, payload, length);
+}
+
+/*
+	Writes the messages taken from the queue as a SEND_BATCH.
+*/
+void client_encode_batch(BVD_CLIENT* c, CLIENT_MSG* batch){
+	size_t length = 0;
+	batch->records = malloc(batch->batch * sizeof(uint32_t));
+	for(int i = 0; i < batch->batch; i++){
+		CLIENT_MSG* msg = c->taken[i];
+		batch->records[i] = msg->msgid;
+		bvd_batch_append(&c->scratch, &length, &c->scratch_cap, msg->msgid, msg->to,
+			msg->payload + msg->line, msg->length - msg->line);
+	}
+	client_append(c, BVD_SEND_BATCH_PKT, batch->msgid, 0, 0, c->scratch, length);
+}
+
+/*
+	Appends a packet to the output buffer, in the connection's format.
+*/
+void client_append(BVD_CLIENT* c, uint8_t type, uint32_t msgid, int flags, uint32_t id, void* payload, size_t length){
+	if(c->out_len + BVD_WIRE_MAX_HEADER + length > c->out_cap){
+		if(c->out_sent > 0){
+			memmove(c->out, c->out + c->out_sent, c->out_len - c->out_sent);
+			c->out_len -= c->out_sent;
+			c->out_sent = 0;
+		}
+		while(c->out_len + BVD_WIRE_MAX_HEADER + length > c->out_cap)
+			c->out_cap = c->out_cap == 0 ? 2 * CLIENT_OUT_HIGH : 2 * c->out_cap;
+		c->out = realloc(c->out, c->out_cap);
+	}
+	//no timestamps: the server does not look at them
+	bvd_packet_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = type;
+	hdr.msgid = msgid;
+	hdr.payload_length = length;
+	c->out_len += wire_encode_header(c->wire, &hdr, flags, id, c->out + c->out_len);
+	if(length > 0)
+		memcpy(c->out + c->out_len, payload, length);
+	c->out_len += length;
+}
+
+/*
+	Writes as much of the output buffer as the socket takes.
+	Returns -1 if the connection is lost.
+*/
+int client_write(BVD_CLIENT* c){
+	while(c->out_sent < c->out_len){
+		ssize_t n;
+		if(c->shm != NULL){
+			struct iovec iov = {c->out + c->out_sent, c->out_len - c->out_sent};
+			n = shm_writev(c->shm, &iov, 1);
+		}
+		else{
+			n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+		}
+		if(n < 0){
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		c->out_sent += n;
+	}
+	if(c->out_sent == c->out_len)
+		c->out_len = c->out_sent = 0;
+	return 0;
+}
+
+/*
+	Reads what the socket has and handles the packets that are whole.
+	Returns -1 if the connection is lost.
+*/
+int client_read(BVD_CLIENT* c){
+	if(c->in_cap - c->in_len < CLIENT_READ_SIZE){
+		c->in_cap = c->in_len + 2 * CLIENT_READ_SIZE;
+		c->in = realloc(c->in, c->in_cap);
+	}
+	ssize_t n;
+	if(c->shm != NULL)
+		n = shm_read(c->shm, c->in + c->in_len, c->in_cap - c->in_len);
+	else
+		n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+	if(n < 0)
+		return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	if(n == 0){
+		errno = ECONNRESET;
+		return -1;
+	}
+	c->in_len += n;
+	return client_parse(c);
+}
+
+/*
+	Handles the whole packets at the front of the input buffer.
+*/
+int client_parse(BVD_CLIENT* c){
+	size_t pos = 0;
+	size_t need = 0;
+	while(pos < c->in_len){
+		char* buf = c->in + pos;
+		size_t avail = c->in_len - pos;
+		size_t hlen = wire_header_length(c->wire, buf);
+		if(avail < hlen)
+			break;
+		bvd_packet_header hdr;
+		int flags = 0;
+		uint32_t id = 0;
+		if(c->wire == BVD_WIRE_V1){
+			memcpy(&hdr, buf, sizeof(hdr));
+			hdr.payload_length = ntohl(hdr.payload_length);
+			hdr.msgid = ntohl(hdr.msgid);
+		}
+		else if(wire_decode_header(buf, hlen, &hdr, &flags, &id) < 0){
+			debug("malformed v2 header from the server");
+			errno = EPROTO;
+			return -1;
+		}
+		if(hdr.payload_length > proto_max_payload){
+			errno = EMSGSIZE;
+			return -1;
+		}
+		if(avail - hlen < hdr.payload_length){
+			need = hlen + hdr.payload_length;
+			break;
+		}
+		client_dispatch(c, &hdr, flags, id, buf + hlen);
+		pos += hlen + hdr.payload_length;
+	}
+	if(pos > 0){
+		memmove(c->in, c->in + pos, c->in_len - pos);
+		c->in_len -= pos;
+	}
+	//room for a big packet to come in whole
+	if(need + CLIENT_READ_SIZE > c->in_cap){
+		c->in_cap = need + CLIENT_READ_SIZE;
+		c->in = realloc(c->in, c->in_cap);
+	}
+	return 0;
+}
+
+/*
+	Handles a packet from the server.
+*/
+void client_dispatch(BVD_CLIENT* c, bvd_packet_header* hdr, int flags, uint32_t id, char* payload){
+	uint32_t length = hdr->payload_length;
+	switch(hdr->type){
+		case BVD_DLVR_PKT:
+			client_deliver(c, hdr, flags, id, payload);
+			break;
+		case BVD_ACK_PKT:
+			client_notice(c, hdr->msgid, CLIENT_ACKED, payload, length);
+			break;
+		case BVD_NACK_PKT:
+			client_notice(c, hdr->msgid, CLIENT_NACKED, payload, length);
+			break;
+		case BVD_RRCPT_PKT:
+			client_notice(c, hdr->msgid, CLIENT_DELIVERED, NULL, 0);
+			break;
+		case BVD_BOUNCE_PKT:
+			client_notice(c, hdr->msgid, CLIENT_BOUNCED, NULL, 0);
+			break;
+		case BVD_ACK_RANGE_PKT:
+			client_ranges(c, CLIENT_ACKED, payload, length);
+			break;
+		case BVD_RRCPT_RANGE_PKT:
+			client_ranges(c, CLIENT_DELIVERED, payload, length);
+			break;
+		case BVD_HEARTBEAT_PKT:
+			client_append(c, BVD_HEARTBEAT_PKT, 0, 0, 0, NULL, 0);
+			break;
+		default:
+			debug("packet of type %d ignored", hdr->type);
+	}
+}
+
+/*
+	A DLVR: works out who it is from and hands it over.
+*/
+void client_deliver(BVD_CLIENT* c, bvd_packet_header* hdr, int flags, uint32_t id, char* payload){
+	char* from = "";
+	char* body = payload;
+	size_t length = hdr->payload_length;
+	if(!(flags & BVD_WIRE_ID) || (flags & BVD_WIRE_NAMED)){
+		char* eol = memmem(payload, length, "\r\n", 2);
+		if(eol == NULL){
+			debug("DLVR without a sender ignored");
+			return;
+		}
+		*eol = '\0';
+		from = payload;
+		body = eol + 2;
+		length -= body - payload;
+		if(flags & BVD_WIRE_ID)
+			client_name_add(c->senders, id, id, from, eol - from);
+	}
+	else{
+		CLIENT_NAME* sender = client_sender_find(c, id);
+		if(sender != NULL)
+			from = sender->handle;
+	}
+	if(c->config.on_dlvr != NULL)
+		c->config.on_dlvr(c, from, body, length, c->config.arg);
+}
+
+/*
+	A notice about msgid, which is a message or a SEND_BATCH.
+*/
+void client_notice(BVD_CLIENT* c, uint32_t msgid, int outcome, char* payload, uint32_t length){
+	sem_wait(&c->lock);
+	CLIENT_MSG* msg = client_pending_find(c, msgid);
+	if(msg == NULL || msg->in_queue){
+		sem_post(&c->lock);
+		return; //done with already, or not ours
+	}
+	if(msg->batch > 0 && outcome != CLIENT_DELIVERED && outcome != CLIENT_BOUNCED){
+		client_pending_remove(c, msg);
+		sem_post(&c->lock);
+		//the ACK of a batch has a bitmap of the records that were NACKed
+		for(int i = 0; i < msg->batch; i++){
+			int refused = outcome == CLIENT_NACKED || ((uint32_t)i / 8 < length && (payload[i / 8] & (1 << (i % 8))));
+			sem_wait(&c->lock);
+			CLIENT_MSG* rec = client_pending_find(c, msg->records[i]);
+			sem_post(&c->lock);
+			if(rec != NULL)
+				client_outcome(c, rec, refused ? CLIENT_NACKED : CLIENT_ACKED);
+		}
+		client_free_msg(msg);
+		return;
+	}
+	if(outcome == CLIENT_NACKED && length == strlen(BVD_WIRE_UNBOUND) && memcmp(payload, BVD_WIRE_UNBOUND, length) == 0){
+		//the server forgot its IDs (see wire.h), so every receiver is
+		//named again, and so is this one
+		client_requeue(c, msg);
+		sem_post(&c->lock);
+		client_names_clear(c->aliases);
+		c->num_aliases = 0;
+		return;
+	}
+	sem_post(&c->lock);
+	client_outcome(c, msg, outcome);
+}
+
+/*
+	A ranged notice, see coalesce.h.
+*/
+void client_ranges(BVD_CLIENT* c, int outcome, char* payload, uint32_t length){
+	for(uint32_t i = 0; i + sizeof(bvd_msgid_range) <= length; i += sizeof(bvd_msgid_range)){
+		bvd_msgid_range range;
+		memcpy(&range, payload + i, sizeof(range));
+		uint32_t first = ntohl(range.first);
+		uint32_t count = ntohl(range.count);
+		for(uint32_t j = 0; j < count; j++)
+			client_notice(c, first + j, outcome, NULL, 0);
+	}
+}
+
+/*
+	Reports what became of a message, and is done with it unless that
+	was only its ACK.
+*/
+void client_outcome(BVD_CLIENT* c, CLIENT_MSG* msg, int outcome){
+	if(outcome == CLIENT_ACKED){
+		if(msg->acked)
+			return;
+		msg->acked = 1;
+		if(msg->fn != NULL)
+			msg->fn(c, msg->msgid, CLIENT_ACKED, msg->arg);
+		return;
+	}
+	sem_wait(&c->lock);
+	client_pending_remove(c, msg);
+	sem_post(&c->lock);
+	if(msg->fn != NULL){
+		//an RRCPT may overtake the ACK
+		if(!msg->acked && outcome != CLIENT_NACKED)
+			msg->fn(c, msg->msgid, CLIENT_ACKED, msg->arg);
+		msg->fn(c, msg->msgid, outcome, msg->arg);
+	}
+	if(msg->took_room)
+		sem_post(&c->room);
+	client_free_msg(msg);
+}
+
+/*
+	Puts a message that was written back in the queue, among the others
+	in msgid order.  The lock must be held.
+*/
+void client_requeue(BVD_CLIENT* c, CLIENT_MSG* msg){
+	CLIENT_MSG* prev = NULL;
+	CLIENT_MSG* next = c->head;
+	while(next != NULL && next->msgid < msg->msgid){
+		prev = next;
+		next = next->queued;
+	}
+	msg->queued = next;
+	if(prev != NULL)
+		prev->queued = msg;
+	else
+		c->head = msg;
+	if(next == NULL)
+		c->tail = msg;
+	msg->in_queue = 1;
+}
+
+/*
+	The message or batch msgid, or NULL.  The lock must be held.
+*/
+CLIENT_MSG* client_pending_find(BVD_CLIENT* c, uint32_t msgid){
+	CLIENT_MSG* msg = c->pending[msgid & c->mask];
+	while(msg != NULL && msg->msgid != msgid)
+		msg = msg->next;
+	return msg;
+}
+
+/*
+	Takes a message or batch out of the table.  The lock must be held.
+*/
+void client_pending_remove(BVD_CLIENT* c, CLIENT_MSG* msg){
+	CLIENT_MSG** link = &c->pending[msg->msgid & c->mask];
+	while(*link != NULL && *link != msg)
+		link = &(*link)->next;
+	if(*link != NULL)
+		*link = msg->next;
+}
+
+void client_free_msg(CLIENT_MSG* msg){
+	free(msg->records);
+	free(msg);
+}
+
+CLIENT_NAME* client_alias_find(BVD_CLIENT* c, char* handle){
+	CLIENT_NAME* name = c->aliases[client_hash(handle) % CLIENT_BUCKETS];
+	while(name != NULL && strcmp(name->handle, handle) != 0)
+		name = name->next;
+	return name;
+}
+
+CLIENT_NAME* client_sender_find(BVD_CLIENT* c, uint32_t id){
+	CLIENT_NAME* name = c->senders[id % CLIENT_BUCKETS];
+	while(name != NULL && name->id != id)
+		name = name->next;
+	return name;
+}
+
+/*
+	Adds the first length bytes of handle to a name table, under key.
+*/
+void client_name_add(CLIENT_NAME** table, uint32_t key, uint32_t id, char* handle, size_t length){
+	CLIENT_NAME* name = malloc(sizeof(CLIENT_NAME) + length + 1);
+	name->id = id;
+	memcpy(name->handle, handle, length);
+	name->handle[length] = '\0';
+	name->next = table[key % CLIENT_BUCKETS];
+	table[key % CLIENT_BUCKETS] = name;
+}
+
+void client_names_clear(CLIENT_NAME** table){
+	for(int i = 0; i < CLIENT_BUCKETS; i++){
+		while(table[i] != NULL){
+			CLIENT_NAME* name = table[i];
+			table[i] = name->next;
+			free(name);
+		}
+	}
+}
+
+/*
+	FNV-1a.
+*/
+uint32_t client_hash(char* s){
+	uint32_t h = 2166136261u;
+	while(*s != '\0'){
+		h ^= (uint8_t)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+void client_wake(BVD_CLIENT* c){
+	uint64_t one = 1;
+	if(write(c->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		debug("cannot wake the I/O thread: %s", strerror(errno));
+}
+
+long client_now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void client_free(BVD_CLIENT* c){
+	if(c->fd >= 0)
+		client_hangup(c, c->fd);
+	if(c->evfd >= 0)
+		close(c->evfd);
+	client_names_clear(c->aliases);
+	client_names_clear(c->senders);
+	sem_destroy(&c->lock);
+	sem_destroy(&c->room);
+	free(c->config.host);
+	free(c->config.path);
+	free(c->config.handle);
+	free(c->config.caps);
+	free(c->pending);
+	free(c->taken);
+	free(c->out);
+	free(c->in);
+	free(c->scratch);
+	free(c);
+}
@@ -0,0 +1,692 @@
+#include "cluster.h"
+#include "directory.h"
+#include "mailbox.h"
+#include "mailbox_ext.h"
+#include "intern.h"
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "compress.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+#define CLUSTER_TABLE_BUCKETS 1024
+#define CLUSTER_BACKOFF_MIN_USEC 10000
+#define CLUSTER_BACKOFF_MAX_USEC 1000000
+
+
+//STRUCTS
+typedef struct cluster_node {
+	char* host;
+	int port;
+	MAILBOX* mb; //peer mailbox: everything waiting to go to this node
+} cluster_node;
+
+typedef struct ring_point {
+	uint32_t hash;
+	int node;
+} ring_point;
+
+typedef struct cluster_entry {
+	char* handle;
+	int node;
+	uint64_t subscribers; //nodes that were told where the handle is
+	struct cluster_entry* next;
+} cluster_entry;
+
+typedef struct cluster_table {
+	cluster_entry** buckets;
+	int num_buckets;
+	int count;
+	sem_t mutex;
+} cluster_table;
+
+
+//HELPER FUNCTION DECLARATIONS
+int ring_point_cmp(const void*, const void*);
+int cluster_route(char*, int, int);
+void cluster_enqueue(int, MAILBOX*, int, char*, int, int, char*, int);
+void cluster_invalidate(char*, uint64_t);
+void* cluster_link_service(void*);
+int cluster_connect(int);
+int cluster_reclaim(int, int);
+void cluster_append_entry(char**, size_t*, size_t*, MAILBOX_ENTRY*);
+void cluster_finish_entry(MAILBOX_ENTRY*, int);
+void cluster_dispatch(int, BVD_BATCH_RECORD*);
+void cluster_receive_message(int, int, char*, int, char*, int);
+void cluster_receive_notice(int, int, int, char*, int);
+
+void table_init(cluster_table*);
+cluster_entry** table_find(cluster_table*, char*);
+cluster_entry* table_insert(cluster_table*, char*);
+void table_remove(cluster_table*, cluster_entry**);
+void owner_claim(char*, int);
+void owner_release(char*, int);
+int owner_locate(char*, int);
+int cache_get(char*);
+void cache_set(char*, int);
+void cache_forget(char*);
+
+
+//GLOBAL VARIABLES
+cluster_node cluster_nodes[BVD_CLUSTER_MAX_NODES];
+int num_cluster_nodes = 0;
+int self_node = -1;
+ring_point* cluster_ring = NULL;
+int cluster_ring_size = 0;
+cluster_table cluster_owned; //where the handles this node owns are logged in
+cluster_table cluster_located; //where other handles were last seen
+
+
+
+/*
+ * Enable cluster mode.
+ */
+int cluster_init(char *node_list, int self){
+	char* list = strdup(node_list);
+	char* save = NULL;
+	for(char* tok = strtok_r(list, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)){
+		char* colon = strrchr(tok, ':');
+		if(colon == NULL || num_cluster_nodes == BVD_CLUSTER_MAX_NODES){
+			free(list);
+			return -1;
+		}
+		*colon = '\0';
+		cluster_nodes[num_cluster_nodes].host = strdup(tok);
+		cluster_nodes[num_cluster_nodes].port = atoi(colon + 1);
+		cluster_nodes[num_cluster_nodes].mb = NULL;
+		num_cluster_nodes++;
+	}
+	free(list);
+	if(self < 0 || self >= num_cluster_nodes)
+		return -1;
+	self_node = self;
+
+	cluster_ring_size = num_cluster_nodes * BVD_CLUSTER_VNODES;
+	cluster_ring = malloc(sizeof(ring_point) * cluster_ring_size);
+	for(int n = 0; n < num_cluster_nodes; n++){
+		for(int v = 0; v < BVD_CLUSTER_VNODES; v++){
+			char point[300];
+			int len = snprintf(point, sizeof(point), "%s:%d#%d", cluster_nodes[n].host, cluster_nodes[n].port, v);
+			cluster_ring[n * BVD_CLUSTER_VNODES + v].hash = intern_hash(point, len);
+			cluster_ring[n * BVD_CLUSTER_VNODES + v].node = n;
+		}
+	}
+	qsort(cluster_ring, cluster_ring_size, sizeof(ring_point), ring_point_cmp);
+
+	table_init(&cluster_owned);
+	table_init(&cluster_located);
+
+	for(int n = 0; n < num_cluster_nodes; n++){
+		if(n == self_node)
+			continue;
+		char name[32];
+		snprintf(name, sizeof(name), "@node%d", n);
+		cluster_nodes[n].mb = mb_init(name);
+		mb_set_caps(cluster_nodes[n].mb, BVD_PEER_CAPS);
+		pthread_t tid;
+		pthread_create(&tid, NULL, cluster_link_service, (void*)(intptr_t)n);
+		pthread_detach(tid);
+	}
+	return 0;
+}
+
+/*
+ * Nonzero if cluster mode is enabled.
+ */
+int cluster_enabled(void){
+	return self_node >= 0;
+}
+
+/*
+ * The node that keeps track of handle.
+ */
+int cluster_owner(char *handle){
+	uint32_t h = intern_hash(handle, strlen(handle));
+	//first point at or after h, wrapping around
+	int lo = 0, hi = cluster_ring_size;
+	while(lo < hi){
+		int mid = (lo + hi) / 2;
+		if(cluster_ring[mid].hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return cluster_ring[lo == cluster_ring_size ? 0 : lo].node;
+}
+
+int ring_point_cmp(const void* a, const void* b){
+	uint32_t ha = ((const ring_point*)a)->hash;
+	uint32_t hb = ((const ring_point*)b)->hash;
+	return ha < hb ? -1 : ha > hb;
+}
+
+/*
+ * Tell the owner that handle logged in at this node.
+ */
+void cluster_claim(char *handle){
+	if(!cluster_enabled())
+		return;
+	cache_forget(handle);
+	int owner = cluster_owner(handle);
+	if(owner == self_node)
+		owner_claim(handle, self_node);
+	else
+		cluster_enqueue(owner, NULL, 0, handle, PEER_OP_CLAIM, -1, NULL, 0);
+}
+
+/*
+ * Tell the owner that handle logged out at this node.
+ */
+void cluster_release(char *handle){
+	if(!cluster_enabled())
+		return;
+	int owner = cluster_owner(handle);
+	if(owner == self_node)
+		owner_release(handle, self_node);
+	else
+		cluster_enqueue(owner, NULL, 0, handle, PEER_OP_RELEASE, -1, NULL, 0);
+}
+
+/*
+ * Forward a message for a handle not logged in at this node.
+ */
+int cluster_forward(MAILBOX *from, int msgid, char *handle, char *dlvr, int length){
+	int node = cluster_route(handle, 0, -1);
+	if(node < 0)
+		return -1;
+	cluster_enqueue(node, from, msgid, handle, PEER_OP_MESSAGE, 0, dlvr, length);
+	free(dlvr);
+	return 0;
+}
+
+/*
+ * Give the sender of a message its RRCPT or BOUNCE.
+ */
+void cluster_notify(MAILBOX *from, NOTICE_TYPE type, int msgid, char *dlvr, int length){
+	if(from == NULL)
+		return;
+	if(!(mb_get_caps(from) & BVD_PEER_CAPS)){
+		mb_add_notice(from, type, msgid, NULL, 0);
+		return;
+	}
+	//the link thread needs to know who it is for: the handle in front of the body
+	char* eol = memchr(dlvr, '\r', length);
+	int hlen = eol == NULL ? 0 : eol - dlvr;
+	mb_add_notice(from, type, msgid, strndup(dlvr, hlen), hlen);
+}
+
+/*
+	Where to send a record about handle, which is not logged in here,
+	that has been passed on hop times and came from node origin (-1 if
+	it started here).  The owner tells origin where the handle is, so
+	that it can send there directly next time.
+	Returns -1 if there is nowhere left to send it.
+*/
+int cluster_route(char* handle, int hop, int origin){
+	if(hop >= BVD_CLUSTER_MAX_HOPS)
+		return -1;
+	int node = cache_get(handle);
+	if(node >= 0 && node != self_node && node != origin)
+		return node;
+
+	int owner = cluster_owner(handle);
+	if(owner != self_node)
+		return owner == origin ? -1 : owner; //the owner thought it was here
+
+	node = owner_locate(handle, origin);
+	if(node < 0 || node == self_node || node == origin)
+		return -1;
+	if(origin >= 0)
+		cluster_enqueue(origin, NULL, 0, handle, PEER_OP_LOCATE, node, NULL, 0);
+	return node;
+}
+
+/*
+	Queues a record for a node: (handle)\r\n(op)[(arg)](data), which is
+	how the link thread finds it.  arg is left out if negative.
+	from is the reference to give a BOUNCE to if the record cannot be
+	sent; it is transferred.
+*/
+void cluster_enqueue(int node, MAILBOX* from, int msgid, char* handle, int op, int arg, char* data, int length){
+	int hlen = strlen(handle);
+	int blen = hlen + 3 + (arg >= 0) + length;
+	char* body = malloc(blen);
+	char* ptr = body;
+	memcpy(ptr, handle, hlen);
+	ptr += hlen;
+	memcpy(ptr, "\r\n", 2);
+	ptr += 2;
+	*ptr++ = op;
+	if(arg >= 0)
+		*ptr++ = arg;
+	if(length > 0)
+		memcpy(ptr, data, length);
+	mb_add_message(cluster_nodes[node].mb, msgid, from, body, blen);
+}
+
+/*
+	Tells every node in the set to forget where handle is.
+*/
+void cluster_invalidate(char* handle, uint64_t subscribers){
+	for(int n = 0; n < num_cluster_nodes; n++){
+		if(subscribers & (1ULL << n))
+			cluster_enqueue(n, NULL, 0, handle, PEER_OP_INVALIDATE, -1, NULL, 0);
+	}
+}
+
+/*
+	Thread function for the link to another node: writes out whatever
+	is in the node's peer mailbox, as much of it per packet as there is.
+	The connection is made on first use and remade after an error.
+*/
+void* cluster_link_service(void* arg){
+	int node = (intptr_t)arg;
+	MAILBOX* mb = cluster_nodes[node].mb;
+	MAILBOX_ENTRY* entries[BVD_CLUSTER_LINK_BATCH];
+	char* buf = NULL;
+	size_t cap = 0;
+	int fd = -1;
+	int backoff = CLUSTER_BACKOFF_MIN_USEC;
+
+	while((entries[0] = mb_next_entry(mb)) != NULL){
+		int n = 1 + mb_take_entries(mb, entries + 1, BVD_CLUSTER_LINK_BATCH - 1);
+
+		if(fd < 0 && (fd = cluster_connect(node)) >= 0){
+			backoff = CLUSTER_BACKOFF_MIN_USEC;
+			if(cluster_reclaim(fd, node) < 0){
+				close(fd);
+				fd = -1;
+			}
+		}
+
+		int ret = -1;
+		if(fd >= 0){
+			size_t len = 0;
+			for(int i = 0; i < n; i++)
+				cluster_append_entry(&buf, &len, &cap, entries[i]);
+			bvd_packet_header hdr;
+			proto_init_header(&hdr, BVD_PEER_BATCH_PKT, 0, len);
+			ret = proto_send_packet(fd, &hdr, buf);
+		}
+		for(int i = 0; i < n; i++)
+			cluster_finish_entry(entries[i], ret);
+
+		if(ret < 0){
+			debug("link to node %d is down", node);
+			if(fd >= 0)
+				close(fd);
+			fd = -1;
+			usleep(backoff);
+			backoff = backoff * 2 > CLUSTER_BACKOFF_MAX_USEC ? CLUSTER_BACKOFF_MAX_USEC : backoff * 2;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/*
+	Opens a link to node, introducing ourselves with a PEER packet.
+*/
+int cluster_connect(int node){
+	struct addrinfo hints, *list, *p;
+	char service[16];
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", cluster_nodes[node].port);
+	if(getaddrinfo(cluster_nodes[node].host, service, &hints, &list) != 0)
+		return -1;
+	for(p = list; p != NULL; p = p->ai_next){
+		if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+			continue;
+		if(connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(list);
+	if(fd < 0)
+		return -1;
+
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	char hello[16];
+	int len = snprintf(hello, sizeof(hello), "%d", self_node);
+	bvd_packet_header hdr;
+	proto_init_header(&hdr, BVD_PEER_PKT, 0, len);
+	if(proto_send_packet(fd, &hdr, hello) < 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+	Claims again, over a new link, the local handles that node owns,
+	in case it has forgotten them.
+*/
+int cluster_reclaim(int fd, int node){
+	char** handles = dir_all_handles();
+	char* buf = NULL;
+	size_t len = 0, cap = 0;
+	char op = PEER_OP_CLAIM;
+	int count = 0, ret = 0;
+	bvd_packet_header hdr;
+
+	for(int i = 0; handles[i] != NULL; i++){
+		if(cluster_owner(handles[i]) == node){
+			bvd_batch_append(&buf, &len, &cap, 0, handles[i], &op, 1);
+			count++;
+		}
+		free(handles[i]);
+		if(ret == 0 && count > 0 && (count == BVD_CLUSTER_LINK_BATCH || handles[i + 1] == NULL)){
+			proto_init_header(&hdr, BVD_PEER_BATCH_PKT, 0, len);
+			ret = proto_send_packet(fd, &hdr, buf);
+			len = 0;
+			count = 0;
+		}
+	}
+	free(handles);
+	free(buf);
+	return ret;
+}
+
+/*
+	Adds the record for a peer mailbox entry to a PEER_BATCH payload.
+	Notices are the RRCPTs and BOUNCEs that cluster_notify() addressed
+	to the node; everything else went through cluster_enqueue().
+*/
+void cluster_append_entry(char** buf, size_t* len, size_t* cap, MAILBOX_ENTRY* entry){
+	if(entry->type == NOTICE_ENTRY_TYPE){
+		char op[2] = {entry->content.notice.type == RRCPT_NOTICE_TYPE ? PEER_OP_RRCPT : PEER_OP_BOUNCE, 0};
+		//the body is the sender's handle, from strndup()
+		bvd_batch_append(buf, len, cap, entry->content.notice.msgid, entry->body, op, sizeof(op));
+		return;
+	}
+	char* body = entry->body;
+	char* eol = memchr(body, '\r', entry->length);
+	*eol = '\0';
+	bvd_batch_append(buf, len, cap, entry->content.message.msgid, body, eol + 2, entry->length - (eol + 2 - body));
+	*eol = '\r';
+}
+
+/*
+	Done with a peer mailbox entry, which was sent if ret is 0.
+	A message that could not be sent is bounced to its sender.
+*/
+void cluster_finish_entry(MAILBOX_ENTRY* entry, int ret){
+	if(entry->type == MESSAGE_ENTRY_TYPE && entry->content.message.from != NULL){
+		MESSAGE* msg = &entry->content.message;
+		if(ret < 0){
+			char* eol = memchr(entry->body, '\n', entry->length);
+			char* dlvr = eol + 3; //past the op and hop count
+			cluster_notify(msg->from, BOUNCE_NOTICE_TYPE, msg->msgid, dlvr, entry->length - (dlvr - (char*)entry->body));
+		}
+		mb_unref(msg->from);
+	}
+	free(entry->body);
+	free(entry);
+}
+
+/*
+ * Serve an incoming link until the connection drops.
+ */
+void cluster_peer_service(int fd, char *hello){
+	int origin = hello == NULL ? -1 : atoi(hello);
+	if(!cluster_enabled() || origin < 0 || origin >= num_cluster_nodes || origin == self_node)
+		return;
+	debug("fd %d: link from node %d", fd, origin);
+
+	bvd_packet_header hdr;
+	void* payload = NULL;
+	while(proto_recv_packet(fd, &hdr, &payload) == 0){
+		BVD_BATCH_RECORD* records = NULL;
+		int count = -1;
+		if(hdr.type == BVD_PEER_BATCH_PKT && payload != NULL)
+			count = bvd_batch_parse(payload, hdr.payload_length, &records);
+		for(int i = 0; i < count; i++)
+			cluster_dispatch(origin, &records[i]);
+		free(records);
+		free(payload);
+		if(count < 0)
+			break;
+	}
+}
+
+/*
+	Acts on one record that came over the link from origin.
+*/
+void cluster_dispatch(int origin, BVD_BATCH_RECORD* rec){
+	if(rec->length < 1)
+		return;
+	int op = rec->body[0];
+	int arg = rec->length > 1 ? (uint8_t)rec->body[1] : -1;
+	switch(op){
+		case PEER_OP_MESSAGE:
+			if(arg >= 0)
+				cluster_receive_message(origin, rec->msgid, rec->handle, arg, rec->body + 2, rec->length - 2);
+			break;
+		case PEER_OP_RRCPT:
+		case PEER_OP_BOUNCE:
+			if(arg >= 0)
+				cluster_receive_notice(origin, op, rec->msgid, rec->handle, arg);
+			break;
+		case PEER_OP_CLAIM:
+			if(cluster_owner(rec->handle) == self_node)
+				owner_claim(rec->handle, origin);
+			break;
+		case PEER_OP_RELEASE:
+			owner_release(rec->handle, origin);
+			break;
+		case PEER_OP_LOCATE:
+			if(arg >= 0 && arg < num_cluster_nodes)
+				cache_set(rec->handle, arg);
+			break;
+		case PEER_OP_INVALIDATE:
+			cache_forget(rec->handle);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+	A message from a sender on another node: delivered if the receiver
+	is here, passed on if we know better, bounced otherwise.  Its "from"
+	is the peer mailbox of the node it came from, which is where the
+	RRCPT or BOUNCE goes.
+*/
+void cluster_receive_message(int origin, int msgid, char* handle, int hop, char* body, int length){
+	//the mailbox service thread trusts the DLVR payload, so check it here
+	char* eol = memchr(body, '\n', length);
+	int raw_length;
+	if(eol == NULL || bvd_frame_check(eol + 1, length - (eol + 1 - body), &raw_length) < 0)
+		return;
+
+	char* dlvr = malloc(length);
+	memcpy(dlvr, body, length);
+	MAILBOX* peer = cluster_nodes[origin].mb;
+	mb_ref(peer); //for the "from" field of the message
+
+	MAILBOX* to = dir_lookup(handle);
+	if(to != NULL){
+		mb_add_message(to, msgid, peer, dlvr, length);
+		mb_unref(to);
+		return;
+	}
+	int node = cluster_route(handle, hop + 1, origin);
+	if(node >= 0){
+		cluster_enqueue(node, peer, msgid, handle, PEER_OP_MESSAGE, hop + 1, dlvr, length);
+	}
+	else{
+		cluster_notify(peer, BOUNCE_NOTICE_TYPE, msgid, dlvr, length);
+		mb_unref(peer);
+	}
+	free(dlvr);
+}
+
+/*
+	An RRCPT or BOUNCE for a sender that is, or was, somewhere in the cluster.
+*/
+void cluster_receive_notice(int origin, int op, int msgid, char* handle, int hop){
+	MAILBOX* mb = dir_lookup(handle);
+	if(mb != NULL){
+		mb_add_notice(mb, op == PEER_OP_RRCPT ? RRCPT_NOTICE_TYPE : BOUNCE_NOTICE_TYPE, msgid, NULL, 0);
+		mb_unref(mb);
+		return;
+	}
+	int node = cluster_route(handle, hop + 1, origin);
+	if(node >= 0)
+		cluster_enqueue(node, NULL, msgid, handle, op, hop + 1, NULL, 0);
+}
+
+/*
+	handle logged in at node: the nodes that were told otherwise must forget.
+*/
+void owner_claim(char* handle, int node){
+	uint64_t stale = 0;
+	sem_wait(&cluster_owned.mutex);
+	cluster_entry* entry = table_insert(&cluster_owned, handle);
+	if(entry->node != node){
+		stale = entry->subscribers;
+		entry->subscribers = 0;
+	}
+	entry->node = node;
+	sem_post(&cluster_owned.mutex);
+	cluster_invalidate(handle, stale);
+}
+
+/*
+	handle logged out at node; a release from a node it has since moved
+	away from is ignored.
+*/
+void owner_release(char* handle, int node){
+	uint64_t stale = 0;
+	sem_wait(&cluster_owned.mutex);
+	cluster_entry** link = table_find(&cluster_owned, handle);
+	if(*link != NULL && (*link)->node == node){
+		stale = (*link)->subscribers;
+		table_remove(&cluster_owned, link);
+	}
+	sem_post(&cluster_owned.mutex);
+	cluster_invalidate(handle, stale);
+}
+
+/*
+	Where an owned handle is logged in, or -1.  origin is about to be
+	told, so it is remembered for invalidation.
+*/
+int owner_locate(char* handle, int origin){
+	int node = -1;
+	sem_wait(&cluster_owned.mutex);
+	cluster_entry* entry = *table_find(&cluster_owned, handle);
+	if(entry != NULL){
+		node = entry->node;
+		if(origin >= 0 && origin != node)
+			entry->subscribers |= 1ULL << origin;
+	}
+	sem_post(&cluster_owned.mutex);
+	return node;
+}
+
+int cache_get(char* handle){
+	int node = -1;
+	sem_wait(&cluster_located.mutex);
+	cluster_entry* entry = *table_find(&cluster_located, handle);
+	if(entry != NULL)
+		node = entry->node;
+	sem_post(&cluster_located.mutex);
+	return node;
+}
+
+void cache_set(char* handle, int node){
+	sem_wait(&cluster_located.mutex);
+	table_insert(&cluster_located, handle)->node = node;
+	sem_post(&cluster_located.mutex);
+}
+
+void cache_forget(char* handle){
+	sem_wait(&cluster_located.mutex);
+	cluster_entry** link = table_find(&cluster_located, handle);
+	if(*link != NULL)
+		table_remove(&cluster_located, link);
+	sem_post(&cluster_located.mutex);
+}
+
+void table_init(cluster_table* table){
+	table->num_buckets = CLUSTER_TABLE_BUCKETS;
+	table->buckets = calloc(table->num_buckets, sizeof(cluster_entry*));
+	table->count = 0;
+	sem_init(&table->mutex, 0, 1);
+}
+
+/*
+	The link that points to handle's entry, or to NULL at the end of its
+	chain if there is none.  Called with the table's mutex held.
+*/
+cluster_entry** table_find(cluster_table* table, char* handle){
+	cluster_entry** link = &table->buckets[intern_hash(handle, strlen(handle)) % table->num_buckets];
+	while(*link != NULL && strcmp((*link)->handle, handle))
+		link = &(*link)->next;
+	return link;
+}
+
+/*
+	handle's entry, made if there is none yet (with node -1).
+	The table doubles once it has as many entries as buckets.
+*/
+cluster_entry* table_insert(cluster_table* table, char* handle){
+	cluster_entry** link = table_find(table, handle);
+	if(*link != NULL)
+		return *link;
+
+	if(table->count >= table->num_buckets){
+		int num_buckets = table->num_buckets * 2;
+		cluster_entry** buckets = calloc(num_buckets, sizeof(cluster_entry*));
+		for(int i = 0; i < table->num_buckets; i++){
+			cluster_entry* entry = table->buckets[i];
+			while(entry != NULL){
+				cluster_entry* next = entry->next;
+				int b = intern_hash(entry->handle, strlen(entry->handle)) % num_buckets;
+				entry->next = buckets[b];
+				buckets[b] = entry;
+				entry = next;
+			}
+		}
+		free(table->buckets);
+		table->buckets = buckets;
+		table->num_buckets = num_buckets;
+		link = table_find(table, handle);
+	}
+
+	cluster_entry* entry = malloc(sizeof(cluster_entry));
+	entry->handle = strdup(handle);
+	entry->node = -1;
+	entry->subscribers = 0;
+	entry->next = NULL;
+	*link = entry;
+	table->count++;
+	return entry;
+}
+
+void table_remove(cluster_table* table, cluster_entry** link){
+	cluster_entry* entry = *link;
+	*link = entry->next;
+	free(entry->handle);
+	free(entry);
+	table->count--;
+}
@@ -0,0 +1,103 @@
+#include "coalesce.h"
+#include "protocol_ext.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+//HELPER FUNCTION DECLARATIONS
+int coalesce_write(OUTQ* out, uint8_t type, uint32_t* msgids, int count);
+
+
+/*
+ * Initialize an empty coalescer.
+ */
+void coalesce_init(COALESCER *co){
+	co->num_acks = 0;
+	co->num_rrcpts = 0;
+}
+
+/*
+ * Hold back an ACK or RRCPT notice for msgid, writing a ranged notice
+ * to out if that fills up the pending set.
+ */
+int coalesce_add(COALESCER *co, OUTQ *out, NOTICE_TYPE type, uint32_t msgid){
+	if(co->num_acks == 0 && co->num_rrcpts == 0){
+		//first pending notice starts the clock
+		clock_gettime(CLOCK_REALTIME, &co->deadline);
+		co->deadline.tv_nsec += BVD_COALESCE_USEC * 1000L;
+		if(co->deadline.tv_nsec >= 1000000000L){
+			co->deadline.tv_sec += 1;
+			co->deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	if(type == ACK_NOTICE_TYPE){
+		co->acks[co->num_acks++] = msgid;
+		if(co->num_acks == BVD_COALESCE_MAX)
+			return coalesce_flush(co, out);
+	}
+	else{
+		co->rrcpts[co->num_rrcpts++] = msgid;
+		if(co->num_rrcpts == BVD_COALESCE_MAX)
+			return coalesce_flush(co, out);
+	}
+	return 0;
+}
+
+/*
+ * Write out everything pending, if anything.
+ */
+int coalesce_flush(COALESCER *co, OUTQ *out){
+	int ret = 0;
+	//ACKs first, since a request is acknowledged before it is delivered
+	if(co->num_acks > 0 && coalesce_write(out, BVD_ACK_RANGE_PKT, co->acks, co->num_acks) < 0)
+		ret = -1;
+	if(co->num_rrcpts > 0 && coalesce_write(out, BVD_RRCPT_RANGE_PKT, co->rrcpts, co->num_rrcpts) < 0)
+		ret = -1;
+	co->num_acks = 0;
+	co->num_rrcpts = 0;
+	return ret;
+}
+
+/*
+ * Returns the time by which the pending notices must be flushed,
+ * or NULL if nothing is pending.
+ */
+struct timespec *coalesce_deadline(COALESCER *co){
+	if(co->num_acks == 0 && co->num_rrcpts == 0)
+		return NULL;
+	return &co->deadline;
+}
+
+/*
+	Turns the pending msgids, in the order they were added,
+	into ranges of consecutive ids and writes them as one packet.
+*/
+int coalesce_write(OUTQ* out, uint8_t type, uint32_t* msgids, int count){
+	bvd_msgid_range ranges[BVD_COALESCE_MAX];
+	int num_ranges = 0;
+	uint32_t first = msgids[0];
+	uint32_t run = 1;
+
+	for(int i = 1; i <= count; i++){
+		if(i < count && msgids[i] == first + run){
+			run++;
+			continue;
+		}
+		ranges[num_ranges].first = htonl(first);
+		ranges[num_ranges].count = htonl(run);
+		num_ranges++;
+		if(i < count){
+			first = msgids[i];
+			run = 1;
+		}
+	}
+
+	debug("%d notice(s) coalesced into %d range(s)", count, num_ranges);
+
+	bvd_packet_header hdr;
+	proto_init_header(&hdr, type, msgids[0], num_ranges * sizeof(bvd_msgid_range));
+	return outq_send_packet(out, &hdr, ranges);
+}
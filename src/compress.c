@@ -0,0 +1,82 @@
+#include "compress.h"
+#include "lz.h"
+#include "protocol_ext.h"
+#include "debug.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+
+/*
+ * Frame length bytes of body into dst, compressing it if compress is
+ * non-zero and that makes it smaller.
+ * Returns the framed length.
+ */
+int bvd_frame_body(void *body, int length, int compress, void *dst){
+	uint8_t* out = dst;
+	uint32_t raw_length = htonl(length);
+	memcpy(out + 1, &raw_length, sizeof(raw_length));
+
+	if(compress && length >= BVD_COMPRESS_MIN){
+		//anything that does not come out smaller is kept raw
+		int n = lz_compress(body, length, out + BVD_FRAME_HEADER_SIZE, length - 1);
+		if(n > 0){
+			out[0] = BVD_CODEC_LZ4;
+			return BVD_FRAME_HEADER_SIZE + n;
+		}
+	}
+
+	out[0] = BVD_CODEC_RAW;
+	memcpy(out + BVD_FRAME_HEADER_SIZE, body, length);
+	return BVD_FRAME_HEADER_SIZE + length;
+}
+
+/*
+ * Check a framed body of length bytes.
+ * Returns the codec and stores the raw length in *raw_length,
+ * or returns -1 if the frame is malformed or too large.
+ */
+int bvd_frame_check(void *frame, int length, int *raw_length){
+	uint8_t* in = frame;
+	uint32_t raw;
+	if(length < BVD_FRAME_HEADER_SIZE)
+		return -1;
+	memcpy(&raw, in + 1, sizeof(raw));
+	raw = ntohl(raw);
+
+	int data = length - BVD_FRAME_HEADER_SIZE;
+	if(in[0] == BVD_CODEC_RAW && raw != data)
+		return -1;
+	//the block format cannot expand data by more than 255:1
+	if(in[0] == BVD_CODEC_LZ4 && raw > (uint32_t)data * 255 + 15)
+		return -1;
+	//nor may it unpack to more than would have been taken raw
+	if(in[0] == BVD_CODEC_LZ4 && raw > proto_max_payload)
+		return -1;
+	if(in[0] != BVD_CODEC_RAW && in[0] != BVD_CODEC_LZ4)
+		return -1;
+
+	*raw_length = raw;
+	return in[0];
+}
+
+/*
+ * Recover the body from a frame of length bytes into dst, which has
+ * room for the raw length reported by bvd_frame_check().
+ * Returns the raw length, or -1 if the frame is malformed.
+ */
+int bvd_unframe_body(void *frame, int length, void *dst){
+	int raw_length;
+	int codec = bvd_frame_check(frame, length, &raw_length);
+	uint8_t* data = (uint8_t*)frame + BVD_FRAME_HEADER_SIZE;
+
+	if(codec == BVD_CODEC_RAW){
+		memcpy(dst, data, raw_length);
+		return raw_length;
+	}
+	if(codec == BVD_CODEC_LZ4){
+		return lz_decompress(data, length - BVD_FRAME_HEADER_SIZE, dst, raw_length);
+	}
+	debug("malformed body frame");
+	return -1;
+}
@@ -0,0 +1,99 @@
+#include "dedup.h"
+#include "debug.h"
+
+#include <string.h>
+
+
+#define DEDUP_SLOTS (2 * BVD_DEDUP_WINDOW)
+
+
+//HELPER FUNCTION DECLARATIONS
+int dedup_home(uint32_t msgid);
+int dedup_find(DEDUP* d, uint32_t msgid);
+void dedup_forget(DEDUP* d, int slot);
+
+
+/*
+ * Initialize an empty window.
+ */
+void dedup_init(DEDUP *d){
+	memset(d->table, 0, sizeof(d->table));
+	d->next = 0;
+	d->count = 0;
+}
+
+/*
+ * Returns 1 if msgid is in the window, 0 if not.
+ */
+int dedup_seen(DEDUP *d, uint32_t msgid){
+	return d->table[dedup_find(d, msgid)] != 0;
+}
+
+/*
+ * Adds msgid to the window, pushing the oldest out if it is full.
+ */
+void dedup_record(DEDUP *d, uint32_t msgid){
+	if(dedup_seen(d, msgid))
+		return;
+	if(d->count == BVD_DEDUP_WINDOW)
+		dedup_forget(d, dedup_find(d, d->ring[d->next]));
+	else
+		d->count++;
+	d->ring[d->next] = msgid;
+	//the table is never more than half full, so there is a free slot
+	d->table[dedup_find(d, msgid)] = d->next + 1;
+	d->next = (d->next + 1) % BVD_DEDUP_WINDOW;
+}
+
+/*
+ * Takes msgid back out of the window if it is the one added last.
+ */
+void dedup_unrecord(DEDUP *d, uint32_t msgid){
+	int last = (d->next + BVD_DEDUP_WINDOW - 1) % BVD_DEDUP_WINDOW;
+	if(d->count == 0 || d->ring[last] != msgid)
+		return;
+	dedup_forget(d, dedup_find(d, msgid));
+	d->next = last;
+	d->count--;
+}
+
+/*
+	The slot where the search for msgid starts.  Client msgids are
+	mostly consecutive, and an odd multiplier gives consecutive ones
+	different slots.
+*/
+int dedup_home(uint32_t msgid){
+	return (msgid * 2654435761u) % DEDUP_SLOTS;
+}
+
+/*
+	The slot of msgid, or the free slot where it would go.
+*/
+int dedup_find(DEDUP* d, uint32_t msgid){
+	int slot = dedup_home(msgid);
+	while(d->table[slot] != 0 && d->ring[d->table[slot] - 1] != msgid)
+		slot = (slot + 1) % DEDUP_SLOTS;
+	return slot;
+}
+
+/*
+	Frees a slot of the table.  The entries after it that could not go
+	in their home slot are moved back, so that no search stops short of
+	them at the free slot.
+*/
+void dedup_forget(DEDUP* d, int slot){
+	int next = slot;
+	while(1){
+		next = (next + 1) % DEDUP_SLOTS;
+		if(d->table[next] == 0)
+			break;
+		int home = dedup_home(d->ring[d->table[next] - 1]);
+		//it may stay if its home is cyclically in (slot, next]
+		int stays = slot <= next ? (home > slot && home <= next) : (home > slot || home <= next);
+		if(!stays){
+			d->table[slot] = d->table[next];
+			slot = next;
+		}
+	}
+	d->table[slot] = 0;
+}
@@ -1,31 +1,51 @@
 #include "directory.h"
 #include "mailbox.h"
 #include "debug.h"
+#include "intern.h"
+#include "directory_ext.h"
+#include "ratelimit.h"
+#include "lockprof.h"
 #include <semaphore.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <sys/socket.h>
 
 
 
+//Entries live in chunks that never move, so a lookup needs only the
+//lock of its stripe and never the global one
+#define DIR_CHUNK_BITS 12
+#define DIR_CHUNK_SIZE (1 << DIR_CHUNK_BITS)
+#define DIR_MAX_CHUNKS (1 << 16)
+#define DIR_STRIPES 64
+
+
 //STRUCTS
-//The head will always be empty
-typedef struct directory_node {
-	char* handle;
+//The directory is an array indexed by handle ID (see intern.h)
+typedef struct directory_entry {
+	MAILBOX* mailbox; //NULL if the handle is not registered
 	int sockfd;
-	MAILBOX* mailbox;
-	int isDefunct;
-	struct directory_node* next;
-} directory_node;
+	RATE_BUCKET rate; //of the handle, kept across logins, see ratelimit.h
+} directory_entry;
+
+//A lock on its own cache line, so that stripes do not contend by accident
+typedef struct directory_stripe {
+	_Alignas(64) sem_t lock;
+} directory_stripe;
 
 
 //HELPER FUNCTION DECLARATIONS
-void dir_free(directory_node*);
+void dir_free(void);
+directory_entry* dir_entry(uint32_t, int);
 
 
 //GLOBAL VARIABLES
-sem_t mutex;
-struct directory_node * directory_head;
+sem_t mutex; //guards registering, unregistering and the defunct flag
+directory_stripe dir_stripes[DIR_STRIPES]; //entry id is guarded by stripe id % DIR_STRIPES
+_Atomic(directory_entry*) directory[DIR_MAX_CHUNKS];
+uint32_t dir_num_ids; //IDs up to the end of the highest chunk made
 int num_nodes;
+int directory_defunct;
 
 extern sem_t mutex2;
 extern sem_t mutex3;
@@ -35,18 +55,16 @@ extern sem_t mutex3;
  * Initialize the directory.
  */
 void dir_init(void){
-	directory_head = malloc(sizeof(directory_node));
+	intern_init();
 	sem_init(&mutex , 0, 1);
 	sem_init(&mutex2 , 0, 1);
 	sem_init(&mutex3 , 0, 1);
-	sem_wait(&mutex);
+	for(int i = 0; i < DIR_STRIPES; i++)
+		sem_init(&dir_stripes[i].lock, 0, 1);
+	BVD_LOCK(LOCK_DIRECTORY, &mutex);
 	num_nodes = 0;
-	directory_head->mailbox = NULL;
-	directory_head->sockfd = -1;
-	directory_head->handle = NULL;
-	directory_head->next = NULL;
-	directory_head->isDefunct = 0;
-	sem_post(&mutex);
+	directory_defunct = 0;
+	BVD_UNLOCK(LOCK_DIRECTORY, &mutex);
 }
 
 
@@ -57,15 +75,14 @@ void dir_init(void){
  * which triggers the eventual termination of all the server threads.
  */
 void dir_shutdown(void){
-	sem_wait(&mutex);
-	directory_node* ptr = directory_head;
-	while(ptr != NULL){
-		shutdown(ptr->sockfd, SHUT_RDWR); //as per the spec;
-		ptr->isDefunct = 1;
-		ptr = ptr->next;
+	BVD_LOCK(LOCK_DIRECTORY, &mutex);
+	for(uint32_t id = 0; id < dir_num_ids; id++){
+		directory_entry* entry = dir_entry(id, 0);
+		if(entry != NULL && entry->mailbox != NULL)
+			shutdown(entry->sockfd, SHUT_RDWR); //as per the spec;
 	}
-
-	sem_post(&mutex);
+	directory_defunct = 1;
+	BVD_UNLOCK(LOCK_DIRECTORY, &mutex);
 
 }
 
@@ -76,32 +93,32 @@ void dir_shutdown(void){
  * by a call to dir_shutdown().
  */
 void dir_fini(void){
-	dir_free(directory_head);
+	dir_free();
 	sem_destroy(&mutex);
 	sem_destroy(&mutex2);
 	sem_destroy(&mutex3);
+	for(int i = 0; i < DIR_STRIPES; i++)
+		sem_destroy(&dir_stripes[i].lock);
 }
 
 /*
-	
-	recursively shuts down all the directories
-		Have to do it this way because in order to
-		most efficiently (one-pass) free a singly linked list 
-		is to do it recursively
-	dont need to make this thread safe as this 
-	will only be called within a semaphore 
-	-> I made it so I know it is not being called from your library ;)
+	Shuts down and lets go of every mailbox still registered.
+	Only called from dir_fini(), once no one else is using the directory.
 */
-void dir_free(directory_node* ptr){
-	if(ptr->next != NULL){
-		dir_free(ptr->next);
+void dir_free(void){
+	for(uint32_t id = 0; id < dir_num_ids; id++){
+		directory_entry* entry = dir_entry(id, 0);
+		if(entry != NULL && entry->mailbox != NULL){
+			num_nodes -= 1;
+			mb_shutdown(entry->mailbox);
+			mb_unref(entry->mailbox);
+		}
 	}
-
-	num_nodes -= 1;
-	mb_shutdown(ptr->mailbox);
-	ptr->next = NULL;
-	free(ptr);
-	return;
+	for(uint32_t i = 0; i < dir_num_ids >> DIR_CHUNK_BITS; i++){
+		free(directory[i]);
+		directory[i] = NULL;
+	}
+	dir_num_ids = 0;
 }
 
 /*
@@ -113,30 +130,24 @@ void dir_free(directory_node* ptr){
  * Returns NULL if handle was already registered or if the directory is defunct.
  */
 MAILBOX *dir_register(char *handle, int sockfd){
-	MAILBOX* returnThis = dir_lookup(handle);//this doesnt need mutex dir_lookup has it.
-	sem_wait(&mutex);
-	if(returnThis != NULL){
-		mb_unref(returnThis);
+	MAILBOX* returnThis = NULL;
+	uint32_t id = intern_handle(handle);
+	BVD_LOCK(LOCK_DIRECTORY, &mutex);
+	directory_entry* entry = dir_entry(id, 1);
+	sem_t* stripe = &dir_stripes[id % DIR_STRIPES].lock;
+	BVD_LOCK(LOCK_DIR_STRIPE, stripe);
+	if(directory_defunct || entry->mailbox != NULL){
 		returnThis = NULL;
 	}
 	else{
-		directory_node* ptr = directory_head;
-		ptr->mailbox = mb_init(handle);
-		mb_ref(ptr->mailbox);
-		ptr->handle = malloc(sizeof(char) * strlen(handle));
-		strcpy(ptr->handle, handle);
-		ptr->sockfd = sockfd;
-		returnThis = ptr->mailbox;
-		//Create new Node and make the new head
-		directory_node* new_node = malloc(sizeof(directory_node));
-		new_node->mailbox = NULL;
-		new_node->sockfd = -1;
-		new_node->handle = NULL;
-		new_node->next = ptr;
-		new_node->isDefunct = 0;
+		entry->mailbox = mb_init(handle);
+		mb_ref(entry->mailbox);
+		entry->sockfd = sockfd;
+		returnThis = entry->mailbox;
 		num_nodes += 1;
 	}
-	sem_post(&mutex);
+	BVD_UNLOCK(LOCK_DIR_STRIPE, stripe);
+	BVD_UNLOCK(LOCK_DIRECTORY, &mutex);
 	return returnThis;	
 }
 
@@ -146,23 +157,22 @@ MAILBOX *dir_register(char *handle, int sockfd){
  * -- This only unregisters it if it is even there
  */
 void dir_unregister(char *handle){
-	sem_wait(&mutex);
-	directory_node* ptr = directory_head;
-	int node_found = 0;
-	while(ptr->next != NULL && !node_found){
-		if(!strcmp(handle, ptr->next->handle)){ //strcmp returns 0 if the strings are equal
-			mb_unref(ptr->next->mailbox);//as per the spec
-			mb_shutdown(ptr->next->mailbox);
-			free(ptr->next);
-			ptr->next = ptr->next->next;
-			node_found = 1;
-			num_nodes -= 1;
-		}
-		else{
-			ptr = ptr->next;
-		}
+	uint32_t id = intern_find(handle);
+	if(id == BVD_NO_ID)
+		return; //never registered
+	BVD_LOCK(LOCK_DIRECTORY, &mutex);
+	directory_entry* entry = dir_entry(id, 0);
+	sem_t* stripe = &dir_stripes[id % DIR_STRIPES].lock;
+	BVD_LOCK(LOCK_DIR_STRIPE, stripe);
+	if(entry != NULL && entry->mailbox != NULL){
+		mb_shutdown(entry->mailbox);//as per the spec
+		mb_unref(entry->mailbox);
+		entry->mailbox = NULL;
+		entry->sockfd = -1;
+		num_nodes -= 1;
 	}
-	sem_post(&mutex);
+	BVD_UNLOCK(LOCK_DIR_STRIPE, stripe);
+	BVD_UNLOCK(LOCK_DIRECTORY, &mutex);
 }
 
 /*
@@ -174,18 +184,59 @@ void dir_unregister(char *handle){
  * to decrease the reference count when the pointer is ultimately discarded.
  */
 MAILBOX *dir_lookup(char *handle){
-	sem_wait(&mutex);
-	directory_node* ptr = directory_head->next;
+	uint32_t id = intern_find(handle);
+	if(id == BVD_NO_ID)
+		return NULL; //never registered, no need to lock
+	return dir_lookup_id(id);
+}
+
+/*
+ * Query the directory for the handle with a given ID (see intern.h).
+ * Same as dir_lookup(), minus the hashing of the handle.
+ */
+MAILBOX *dir_lookup_id(uint32_t id){
+	directory_entry* entry = dir_entry(id, 0);
+	if(entry == NULL)
+		return NULL;
+	sem_t* stripe = &dir_stripes[id % DIR_STRIPES].lock;
+	BVD_LOCK(LOCK_DIR_STRIPE, stripe);
+	MAILBOX* returnThis = entry->mailbox;
+	if(returnThis != NULL){
+		mb_ref(returnThis); //calls it as per the spec
+	}
+	BVD_UNLOCK(LOCK_DIR_STRIPE, stripe);
+	return returnThis;
+}
+
+/*
+ * The rate limit bucket of the handle with a given ID (see ratelimit.h).
+ */
+RATE_BUCKET *dir_rate_bucket(uint32_t id){
+	directory_entry* entry = dir_entry(id, 0);
+	return entry == NULL ? NULL : &entry->rate;
+}
 
-	while(ptr != NULL){
-		if(!strcmp(handle, ptr->handle)){ //strcmp returns 0 if the strings are equal
-			mb_ref(ptr->mailbox); //calls it as per the spec
-			return ptr->mailbox;
+/*
+	The entry of an ID, or NULL if its chunk does not exist yet.
+	With create set, a missing chunk is made, which needs mutex held.
+*/
+directory_entry* dir_entry(uint32_t id, int create){
+	_Atomic(directory_entry*)* slot = &directory[id >> DIR_CHUNK_BITS];
+	directory_entry* chunk = atomic_load_explicit(slot, memory_order_acquire);
+	if(chunk == NULL){
+		if(!create)
+			return NULL;
+		chunk = malloc(sizeof(directory_entry) * DIR_CHUNK_SIZE);
+		for(int i = 0; i < DIR_CHUNK_SIZE; i++){
+			chunk[i].mailbox = NULL;
+			chunk[i].sockfd = -1;
+			rate_bucket_init(&chunk[i].rate);
 		}
-		ptr = ptr->next;
+		atomic_store_explicit(slot, chunk, memory_order_release);
+		if(dir_num_ids <= id)
+			dir_num_ids = (id | (DIR_CHUNK_SIZE - 1)) + 1;
 	}
-	sem_post(&mutex);
-	return NULL;
+	return &chunk[id & (DIR_CHUNK_SIZE - 1)];
 }
 
 /*
@@ -195,16 +246,15 @@ MAILBOX *dir_lookup(char *handle){
  * that it contains.
  */
 char **dir_all_handles(void){
-	sem_wait(&mutex);
-	directory_node* ptr = directory_head->next;
-	char** handles = malloc(sizeof(char*) * num_nodes);
-	for(int i = 0; i < num_nodes; i++){
-		handles[i] = ptr->handle;
-		ptr = ptr->next;
+	BVD_LOCK(LOCK_DIRECTORY, &mutex);
+	char** handles = malloc(sizeof(char*) * (num_nodes + 1));
+	int i = 0;
+	for(uint32_t id = 0; id < dir_num_ids; id++){
+		directory_entry* entry = dir_entry(id, 0);
+		if(entry != NULL && entry->mailbox != NULL)
+			handles[i++] = strdup(intern_name(id));
 	}
-	sem_post(&mutex);
+	handles[i] = NULL;
+	BVD_UNLOCK(LOCK_DIRECTORY, &mutex);
 	return handles;
 }
-
-
-
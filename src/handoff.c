@@ -0,0 +1,670 @@
+#define _GNU_SOURCE
+#include "handoff.h"
+#include "directory.h"
+#include "mailbox.h"
+#include "mailbox_ext.h"
+#include "protocol_ext.h"
+#include "server_ext.h"
+#include "stream.h"
+#include "metrics.h"
+#include "shard.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+
+/*
+ * What goes over the socketpair, all integers in network byte order:
+ *
+ *   header:   magic (4), version (4), number of sessions (4),
+ *             length of the state (4)             + SCM_RIGHTS: listenfd
+ *   state:    for each session:
+ *               caps (4), handle length (2, 0 if not logged in), handle,
+ *               entries, each starting with a kind byte:
+ *                 1 = message: msgid (4), sender length (2), sender,
+ *                              body length (4), body
+ *                 2 = notice:  notice type (1), msgid (4),
+ *                              body length (4), body
+ *                 0 = end of the session's entries
+ *   fds:      one byte each, carrying up to HANDOFF_FDS_PER_MSG client
+ *             sockets as SCM_RIGHTS, in session order
+ *
+ * The new process writes one byte once it has started and one once it
+ * is serving.
+ */
+#define HANDOFF_FDS_PER_MSG 250
+#define HANDOFF_ENTRY_END 0
+#define HANDOFF_ENTRY_MESSAGE 1
+#define HANDOFF_ENTRY_NOTICE 2
+#define HANDOFF_TAKE_CHUNK 64
+
+
+//STRUCTS
+//A connection whose client service thread has stopped
+typedef struct handoff_session {
+	int fd;
+	MAILBOX* mb;
+	int caps;
+	int mb_parked;
+} handoff_session;
+
+typedef struct handoff_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_sessions;
+	uint32_t state_length;
+} handoff_header;
+
+//Reads the state back, failing once anything runs past the end
+typedef struct handoff_cursor {
+	char* ptr;
+	char* end;
+	int bad;
+} handoff_cursor;
+
+
+//HELPER FUNCTION DECLARATIONS
+void handoff_signal(int);
+void handoff_park(void);
+void handoff_add_session(int, MAILBOX*, int, int);
+int handoff_wait(int(*)(void), long);
+int handoff_clients_parked(void);
+int handoff_mailboxes_parked(void);
+int handoff_start_child(void);
+char* handoff_write_state(size_t*);
+void handoff_write_entry(FILE*, MAILBOX_ENTRY*);
+int handoff_send_fds(int, void*, int, int*, int);
+int handoff_recv_fds(int, void*, int, int*, int);
+int handoff_read_state(char*, size_t, int*, int);
+uint32_t handoff_get(handoff_cursor*, int);
+char* handoff_get_bytes(handoff_cursor*, size_t);
+
+
+//GLOBAL VARIABLES
+int handoff_trigger_fd = -1;
+int trigger_pipe[2] = {-1, -1}; //written by the SIGUSR2 handler
+int stop_pipe[2] = {-1, -1}; //written once to stop the client service threads, never read
+char** handoff_argv = NULL;
+char handoff_exe[PATH_MAX];
+atomic_int live_clients = 0;
+
+sem_t handoff_mutex; //guards everything below
+handoff_session* sessions = NULL;
+int num_sessions = 0;
+int max_sessions = 0;
+int sessions_frozen = 0;
+
+
+
+/*
+ * Enables hot restart.
+ */
+int handoff_init(char** argv){
+	//the path as it is now, so that a binary replaced on disk is picked up
+	ssize_t n = readlink("/proc/self/exe", handoff_exe, sizeof(handoff_exe) - 1);
+	if(n < 0)
+		return -1;
+	handoff_exe[n] = '\0';
+
+	//the new process must not be told to resume from our own -R
+	int argc = 0;
+	while(argv[argc] != NULL)
+		argc++;
+	handoff_argv = malloc(sizeof(char*) * (argc + 3));
+	int j = 0;
+	for(int i = 0; i < argc; i++){
+		if(!strncmp(argv[i], "-R", 2)){
+			if(argv[i][2] == '\0')
+				i++;
+			continue;
+		}
+		handoff_argv[j++] = argv[i];
+	}
+	handoff_argv[j++] = "-R";
+	handoff_argv[j++] = "3";
+	handoff_argv[j] = NULL;
+
+	if(pipe2(trigger_pipe, O_CLOEXEC | O_NONBLOCK) < 0 || pipe2(stop_pipe, O_CLOEXEC) < 0)
+		return -1;
+	handoff_trigger_fd = trigger_pipe[0];
+	sem_init(&handoff_mutex, 0, 1);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handoff_signal;
+	sa.sa_flags = SA_RESTART;
+	sigfillset(&sa.sa_mask);
+	return sigaction(SIGUSR2, &sa, NULL);
+}
+
+/*
+	SIGUSR2: only wakes up the accept loop, which does the work.
+*/
+void handoff_signal(int sig){
+	int saved = errno;
+	char c = 0;
+	if(write(trigger_pipe[1], &c, 1) < 0){
+		//a byte is already waiting, which is just as good
+	}
+	errno = saved;
+}
+
+/*
+ * For the client service thread, between packets.
+ */
+int handoff_requested(int fd){
+	if(stop_pipe[0] < 0)
+		return 0;
+	struct pollfd pfd[2] = {{fd, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+	while(poll(pfd, 2, -1) < 0 && errno == EINTR)
+		;
+	return pfd[1].revents != 0;
+}
+
+void handoff_client_started(void){
+	atomic_fetch_add(&live_clients, 1);
+}
+
+void handoff_client_finished(void){
+	atomic_fetch_sub(&live_clients, 1);
+}
+
+/*
+ * For a client service thread that waits on more than its socket.
+ */
+int handoff_stop_fd(void){
+	return stop_pipe[0];
+}
+
+/*
+ * Stop the calling client service thread for the hot restart.
+ */
+void handoff_park_client(int fd, MAILBOX* mb, int caps){
+	handoff_add_session(fd, mb, caps, 0);
+	handoff_park();
+}
+
+/*
+ * Stop a client service thread that serves its mailbox as well.
+ */
+void handoff_park_session(int fd, MAILBOX* mb, int caps){
+	handoff_add_session(fd, mb, caps, 1);
+	handoff_park();
+}
+
+/*
+	Records a stopped connection, unless the state is already written.
+*/
+void handoff_add_session(int fd, MAILBOX* mb, int caps, int mb_parked){
+	sem_wait(&handoff_mutex);
+	if(!sessions_frozen){
+		if(num_sessions == max_sessions){
+			max_sessions = max_sessions == 0 ? 64 : max_sessions * 2;
+			sessions = realloc(sessions, sizeof(handoff_session) * max_sessions);
+		}
+		sessions[num_sessions].fd = fd;
+		sessions[num_sessions].mb = mb;
+		sessions[num_sessions].caps = caps;
+		sessions[num_sessions].mb_parked = mb_parked;
+		num_sessions++;
+	}
+	sem_post(&handoff_mutex);
+}
+
+/*
+ * Stop the calling mailbox service thread for the hot restart.
+ */
+void handoff_park_mailbox(MAILBOX* mb){
+	sem_wait(&handoff_mutex);
+	for(int i = 0; i < num_sessions; i++){
+		if(sessions[i].mb == mb)
+			sessions[i].mb_parked = 1;
+	}
+	sem_post(&handoff_mutex);
+	handoff_park();
+}
+
+/*
+	A stopped thread waits for the process to exit.
+*/
+void handoff_park(void){
+	while(1)
+		pause();
+}
+
+/*
+	Polls done() until it holds or timeout_ms have gone by.
+	Returns what done() last said.
+*/
+int handoff_wait(int(*done)(void), long timeout_ms){
+	long deadline = metrics_now_nsec() + timeout_ms * 1000000L;
+	int ret;
+	while(!(ret = done()) && metrics_now_nsec() < deadline)
+		usleep(1000);
+	return ret;
+}
+
+int handoff_clients_parked(void){
+	sem_wait(&handoff_mutex);
+	int ret = num_sessions >= atomic_load(&live_clients);
+	sem_post(&handoff_mutex);
+	return ret;
+}
+
+int handoff_mailboxes_parked(void){
+	int ret = 1;
+	sem_wait(&handoff_mutex);
+	for(int i = 0; i < num_sessions; i++){
+		if(sessions[i].mb != NULL && !sessions[i].mb_parked)
+			ret = 0;
+	}
+	sem_post(&handoff_mutex);
+	return ret;
+}
+
+/*
+ * Stops the old process and hands everything to a new one.
+ */
+int handoff_begin(int listenfd){
+	char c;
+	while(read(trigger_pipe[0], &c, 1) == 1)
+		;
+	long start = metrics_now_nsec();
+
+	int sock = handoff_start_child();
+	if(sock < 0){
+		fprintf(stderr, "handoff: cannot start %s, carrying on\n", handoff_exe);
+		return -1;
+	}
+
+	//1. the client service threads
+	if(write(stop_pipe[1], &c, 1) != 1)
+		return -1;
+	handoff_wait(handoff_clients_parked, BVD_HANDOFF_TIMEOUT_MS);
+	sem_wait(&handoff_mutex);
+	sessions_frozen = 1;
+	sem_post(&handoff_mutex);
+	//what they queued for other shards must reach the mailboxes first
+	shard_quiesce();
+
+	//2. the mailbox service threads
+	for(int i = 0; i < num_sessions; i++){
+		if(sessions[i].mb != NULL)
+			mb_interrupt(sessions[i].mb);
+	}
+	handoff_wait(handoff_mailboxes_parked, BVD_HANDOFF_TIMEOUT_MS);
+	long stopped = metrics_now_nsec();
+
+	//3. what is left in the mailboxes, and the sockets
+	int* fds = malloc(sizeof(int) * (num_sessions + 1));
+	int nfds = 0;
+	size_t state_length;
+	char* state = handoff_write_state(&state_length);
+	for(int i = 0; i < num_sessions; i++){
+		if(sessions[i].mb == NULL || sessions[i].mb_parked)
+			fds[nfds++] = sessions[i].fd;
+	}
+
+	handoff_header hdr;
+	hdr.magic = htonl(BVD_HANDOFF_MAGIC);
+	hdr.version = htonl(BVD_HANDOFF_VERSION);
+	hdr.num_sessions = htonl(nfds);
+	hdr.state_length = htonl(state_length);
+	int ret = handoff_send_fds(sock, &hdr, sizeof(hdr), &listenfd, 1);
+	if(ret == 0)
+		ret = proto_write_fully(sock, state, state_length);
+	for(int i = 0; ret == 0 && i < nfds; i += HANDOFF_FDS_PER_MSG){
+		int n = nfds - i < HANDOFF_FDS_PER_MSG ? nfds - i : HANDOFF_FDS_PER_MSG;
+		ret = handoff_send_fds(sock, &c, 1, fds + i, n);
+	}
+	long sent = metrics_now_nsec();
+
+	//4. wait for the new process to be serving before going away
+	if(ret == 0)
+		ret = proto_read_fully(sock, &c, 1);
+	if(ret < 0){
+		fprintf(stderr, "handoff: new process failed, %d connections lost\n", nfds);
+		_exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "handoff: %d connections (%d left behind), %zu bytes of state; "
+		"stopped in %.1f ms, sent in %.1f ms, serving again after %.1f ms\n",
+		nfds, atomic_load(&live_clients) - nfds, state_length,
+		(stopped - start) / 1e6, (sent - stopped) / 1e6, (metrics_now_nsec() - start) / 1e6);
+	//the sockets belong to the new process now, so no shutdown(), no cleanup
+	_exit(EXIT_SUCCESS);
+}
+
+/*
+	Forks and execs the new binary with one end of a socketpair as fd 3,
+	and waits until it says it is running.
+	Returns our end of the socketpair, or -1.
+*/
+int handoff_start_child(void){
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+		return -1;
+	pid_t pid = fork();
+	if(pid == 0){
+		//nothing but fd 3 may survive the exec, or a client socket
+		//would stay open in the new process after being closed in it
+		if(sv[1] == 3)
+			fcntl(3, F_SETFD, 0);
+		else if(dup2(sv[1], 3) < 0)
+			_exit(127);
+		close_range(4, ~0U, 0);
+		execv(handoff_exe, handoff_argv);
+		_exit(127);
+	}
+	close(sv[1]);
+	char c;
+	if(pid < 0 || proto_read_fully(sv[0], &c, 1) < 0){
+		close(sv[0]);
+		return -1;
+	}
+	return sv[0];
+}
+
+/*
+	Serializes the sessions that stopped completely, taking their
+	mailboxes' entries out as it goes.
+*/
+char* handoff_write_state(size_t* length){
+	char* state = NULL;
+	FILE* out = open_memstream(&state, length);
+	MAILBOX_ENTRY* entries[HANDOFF_TAKE_CHUNK];
+
+	for(int i = 0; i < num_sessions; i++){
+		handoff_session* s = &sessions[i];
+		if(s->mb != NULL && !s->mb_parked)
+			continue;
+		char* handle = s->mb == NULL ? "" : mb_get_handle(s->mb);
+		uint32_t caps = htonl(s->caps);
+		uint16_t hlen = htons(strlen(handle));
+		fwrite(&caps, sizeof(caps), 1, out);
+		fwrite(&hlen, sizeof(hlen), 1, out);
+		fwrite(handle, 1, strlen(handle), out);
+
+		int n;
+		while(s->mb != NULL && (n = mb_take_entries(s->mb, entries, HANDOFF_TAKE_CHUNK)) > 0){
+			for(int j = 0; j < n; j++)
+				handoff_write_entry(out, entries[j]);
+		}
+		fputc(HANDOFF_ENTRY_END, out);
+	}
+
+	fclose(out);
+	return state;
+}
+
+/*
+	Entries are not freed: the process is about to go away.
+	A stream entry can only be left if its sender did not stop, so it
+	could not be finished anyway and is left out.
+*/
+void handoff_write_entry(FILE* out, MAILBOX_ENTRY* entry){
+	uint32_t msgid, length = htonl(entry->length);
+	if(entry->type == MESSAGE_ENTRY_TYPE){
+		if(BVD_IS_STREAM(entry))
+			return;
+		MESSAGE* msg = &entry->content.message;
+		char* from = msg->from == NULL ? "" : mb_get_handle(msg->from);
+		uint16_t flen = htons(strlen(from));
+		msgid = htonl(msg->msgid);
+		fputc(HANDOFF_ENTRY_MESSAGE, out);
+		fwrite(&msgid, sizeof(msgid), 1, out);
+		fwrite(&flen, sizeof(flen), 1, out);
+		fwrite(from, 1, strlen(from), out);
+	}
+	else{
+		msgid = htonl(entry->content.notice.msgid);
+		fputc(HANDOFF_ENTRY_NOTICE, out);
+		fputc(entry->content.notice.type, out);
+		fwrite(&msgid, sizeof(msgid), 1, out);
+	}
+	fwrite(&length, sizeof(length), 1, out);
+	if(entry->length > 0)
+		fwrite(entry->body, 1, entry->length, out);
+}
+
+/*
+	Sends len bytes of data with nfds file descriptors attached.
+*/
+int handoff_send_fds(int sock, void* data, int len, int* fds, int nfds){
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MSG)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {data, len};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+	ssize_t n;
+	while((n = sendmsg(sock, &msg, 0)) < 0 && errno == EINTR)
+		;
+	return n == len ? 0 : -1;
+}
+
+/*
+	Receives exactly len bytes of data and the file descriptors attached
+	to them, at most max.  Returns the number of descriptors, or -1.
+*/
+int handoff_recv_fds(int sock, void* data, int len, int* fds, int max){
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MSG)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {data, len};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	ssize_t n;
+	while((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL)) < 0 && errno == EINTR)
+		;
+	if(n != len || (msg.msg_flags & MSG_CTRUNC))
+		return -1;
+
+	int nfds = 0;
+	for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if(nfds + count > max)
+			return -1;
+		memcpy(fds + nfds, CMSG_DATA(cmsg), sizeof(int) * count);
+		nfds += count;
+	}
+	return nfds;
+}
+
+/*
+ * Called by the new process with the socket given by -R.
+ */
+int handoff_resume(int sock){
+	long start = metrics_now_nsec();
+	char c = 0;
+	if(proto_write_fully(sock, &c, 1) < 0)
+		return -1;
+
+	handoff_header hdr;
+	int listenfd;
+	if(handoff_recv_fds(sock, &hdr, sizeof(hdr), &listenfd, 1) != 1)
+		return -1;
+	if(ntohl(hdr.magic) != BVD_HANDOFF_MAGIC || ntohl(hdr.version) != BVD_HANDOFF_VERSION){
+		fprintf(stderr, "handoff: unknown state format\n");
+		close(listenfd);
+		return -1;
+	}
+	int count = ntohl(hdr.num_sessions);
+	size_t length = ntohl(hdr.state_length);
+
+	char* state = malloc(length + 1);
+	int* fds = malloc(sizeof(int) * (count + 1));
+	int nfds = 0;
+	int ret = proto_read_fully(sock, state, length);
+	while(ret == 0 && nfds < count){
+		int n = handoff_recv_fds(sock, &c, 1, fds + nfds, count - nfds);
+		if(n <= 0)
+			ret = -1;
+		else
+			nfds += n;
+	}
+	if(ret == 0)
+		ret = handoff_read_state(state, length, fds, count);
+	free(state);
+	free(fds);
+	if(ret < 0){
+		fprintf(stderr, "handoff: cannot take over from the old process\n");
+		close(listenfd);
+		return -1;
+	}
+
+	//the old process exits once it reads this
+	if(proto_write_fully(sock, &c, 1) < 0)
+		debug("handoff: old process went away early");
+	close(sock);
+	fprintf(stderr, "handoff: resumed %d connections in %.1f ms\n", count, (metrics_now_nsec() - start) / 1e6);
+	return listenfd;
+}
+
+/*
+	Brings back the sessions in three passes: every handle first, so that
+	a message from any of them finds its sender, then the mailbox entries,
+	and only then the service threads.
+*/
+int handoff_read_state(char* state, size_t length, int* fds, int count){
+	MAILBOX** mbs = calloc(count, sizeof(MAILBOX*));
+	int* caps = malloc(sizeof(int) * count);
+	char** entries = malloc(sizeof(char*) * count);
+	handoff_cursor cur = {state, state + length, 0};
+
+	for(int i = 0; i < count && !cur.bad; i++){
+		caps[i] = handoff_get(&cur, 4);
+		int hlen = handoff_get(&cur, 2);
+		char* handle = handoff_get_bytes(&cur, hlen);
+		if(cur.bad)
+			break;
+		if(hlen > 0){
+			handle = strndup(handle, hlen);
+			mbs[i] = bvd_resume_login(fds[i], handle, caps[i]);
+			if(mbs[i] == NULL)
+				fprintf(stderr, "handoff: cannot register %s again\n", handle);
+			free(handle);
+		}
+
+		//skip the entries for now
+		entries[i] = cur.ptr;
+		int kind;
+		while(!cur.bad && (kind = handoff_get(&cur, 1)) != HANDOFF_ENTRY_END){
+			if(kind == HANDOFF_ENTRY_MESSAGE){
+				handoff_get(&cur, 4);
+				handoff_get_bytes(&cur, handoff_get(&cur, 2));
+			}
+			else{
+				handoff_get_bytes(&cur, 5);
+			}
+			handoff_get_bytes(&cur, handoff_get(&cur, 4));
+		}
+	}
+
+	for(int i = 0; i < count && !cur.bad; i++){
+		handoff_cursor ec = {entries[i], state + length, 0};
+		int kind;
+		while((kind = handoff_get(&ec, 1)) != HANDOFF_ENTRY_END){
+			int type = 0;
+			char* from = NULL;
+			int flen = 0;
+			if(kind == HANDOFF_ENTRY_NOTICE)
+				type = handoff_get(&ec, 1);
+			int msgid = handoff_get(&ec, 4);
+			if(kind == HANDOFF_ENTRY_MESSAGE){
+				flen = handoff_get(&ec, 2);
+				from = handoff_get_bytes(&ec, flen);
+			}
+			int blen = handoff_get(&ec, 4);
+			char* body = handoff_get_bytes(&ec, blen);
+			if(mbs[i] == NULL)
+				continue;
+
+			char* copy = NULL;
+			if(blen > 0){
+				copy = malloc(blen);
+				memcpy(copy, body, blen);
+			}
+			if(kind == HANDOFF_ENTRY_MESSAGE){
+				//a sender that is gone gets no receipt
+				MAILBOX* sender = NULL;
+				if(flen > 0){
+					char* handle = strndup(from, flen);
+					sender = dir_lookup(handle);
+					free(handle);
+				}
+				mb_add_message(mbs[i], msgid, sender, copy, blen);
+			}
+			else{
+				mb_add_notice(mbs[i], type, msgid, copy, blen);
+			}
+		}
+	}
+
+	int ret = cur.bad ? -1 : 0;
+	for(int i = 0; i < count; i++){
+		if(ret == 0)
+			bvd_resume_session(fds[i], mbs[i], caps[i]);
+		else{
+			if(mbs[i] != NULL)
+				mb_unref(mbs[i]);
+			close(fds[i]);
+		}
+	}
+	free(mbs);
+	free(caps);
+	free(entries);
+	return ret;
+}
+
+/*
+	Big-endian integer of size bytes; 0 once the cursor has gone bad.
+*/
+uint32_t handoff_get(handoff_cursor* cur, int size){
+	uint8_t* p = (uint8_t*)handoff_get_bytes(cur, size);
+	uint32_t v = 0;
+	for(int i = 0; p != NULL && i < size; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+char* handoff_get_bytes(handoff_cursor* cur, size_t size){
+	if(cur->bad || (size_t)(cur->end - cur->ptr) < size){
+		cur->bad = 1;
+		return NULL;
+	}
+	char* p = cur->ptr;
+	cur->ptr += size;
+	return p;
+}
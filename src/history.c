@@ -0,0 +1,599 @@
+#define _GNU_SOURCE
+#include "history.h"
+#include "intern.h"
+#include "metrics.h"
+#include "lockprof.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#define HISTORY_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define HISTORY_LOC(number, offset) ((uint64_t)(number) << 32 | (offset))
+
+
+//STRUCTS
+//A segment file, mapped
+typedef struct history_segment {
+	char* base;
+	size_t size;
+	uint32_t number;
+	atomic_int refs;	//one for the store while it keeps it, and one for each range it is in
+} HISTORY_SEGMENT;
+
+//Where the records of a handle are every BVD_HISTORY_SPARSE of them
+typedef struct history_mark {
+	uint64_t time_ms;
+	uint64_t loc;
+} HISTORY_MARK;
+
+//The records of a handle
+typedef struct history_index {
+	uint64_t last;	//0 if none
+	uint32_t count;
+	HISTORY_MARK* marks;	//oldest first
+	int num_marks, marks_size;
+} HISTORY_INDEX;
+
+//A record in the buffer, with the handle IDs the appender indexes it under
+typedef struct history_pending {
+	uint32_t from, to;
+	_Atomic int state;	//HISTORY_HELD until history_settle()
+	HISTORY_RECORD rec;
+} HISTORY_PENDING;
+
+#define HISTORY_HELD 0
+#define HISTORY_TAKEN 1
+#define HISTORY_REFUSED 2
+
+
+//HELPER FUNCTION DECLARATIONS
+void* history_appender(void*);
+void history_append(HISTORY_PENDING*);
+void history_swap(void);
+int history_roll(void);
+HISTORY_SEGMENT* history_map(uint32_t, int);
+void history_unref(HISTORY_SEGMENT*);
+HISTORY_SEGMENT* history_segment(uint64_t);
+void history_scan(HISTORY_SEGMENT*, int);
+void history_note(uint32_t, uint64_t, uint64_t);
+uint64_t history_start(HISTORY_INDEX*, uint64_t);
+int history_number_cmp(const void*, const void*);
+uint64_t history_now_ms(void);
+
+
+//GLOBAL VARIABLES
+int history_enabled = 0;
+int history_max_segments = BVD_HISTORY_SEGMENTS;
+char* history_dir;
+
+sem_t history_buf_lock;	//guards the buffers and history_last_ms
+sem_t history_kick;	//a full buffer is waiting
+char* history_buf;	//being filled
+size_t history_used;
+char* history_out = NULL;	//handed to the appender
+size_t history_out_used;
+char* history_spare = NULL;	//free, NULL while the appender has it
+uint64_t history_last_ms = 0;	//so that times never go back
+
+sem_t history_lock;	//guards the segments and the index
+HISTORY_SEGMENT** history_segs = NULL;	//history_segs[i] is segment number history_first + i
+int history_num_segs = 0, history_segs_size = 0;
+uint32_t history_first = 1;
+size_t history_tail = 0;	//where the next record goes in the last segment, which only the appender writes
+HISTORY_INDEX* history_index = NULL;	//by handle ID
+uint32_t history_index_size = 0;
+
+
+
+/*
+ * Starts keeping history in dir.
+ */
+int history_init(char *dir){
+	DIR* d = opendir(dir);
+	if(d == NULL)
+		return -1;
+	history_dir = dir;
+	if(history_max_segments < 1)
+		history_max_segments = 1;
+	sem_init(&history_buf_lock, 0, 1);
+	sem_init(&history_kick, 0, 0);
+	sem_init(&history_lock, 0, 1);
+
+	uint32_t* numbers = NULL;
+	int count = 0, size = 0;
+	struct dirent* de;
+	while((de = readdir(d)) != NULL){
+		uint32_t number;
+		char end;
+		if(sscanf(de->d_name, "history-%u.se%c", &number, &end) != 2 || end != 'g' || number == 0)
+			continue;
+		if(count == size){
+			size = size == 0 ? 16 : size * 2;
+			numbers = realloc(numbers, size * sizeof(uint32_t));
+		}
+		numbers[count++] = number;
+	}
+	closedir(d);
+	qsort(numbers, count, sizeof(uint32_t), history_number_cmp);
+
+	//only the newest run of consecutive segments, and no more of them than are kept
+	int from = 0;
+	for(int i = 1; i < count; i++){
+		if(numbers[i] != numbers[i - 1] + 1)
+			from = i;
+	}
+	if(count - from > history_max_segments)
+		from = count - history_max_segments;
+	for(int i = 0; i < from; i++){
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/history-%08u.seg", dir, numbers[i]);
+		unlink(path);
+	}
+	for(int i = from; i < count; i++){
+		HISTORY_SEGMENT* seg = history_map(numbers[i], 0);
+		if(seg == NULL){
+			free(numbers);
+			return -1;
+		}
+		if(history_num_segs == 0)
+			history_first = seg->number;
+		if(history_num_segs == history_segs_size){
+			history_segs_size = history_segs_size == 0 ? 16 : history_segs_size * 2;
+			history_segs = realloc(history_segs, history_segs_size * sizeof(HISTORY_SEGMENT*));
+		}
+		history_segs[history_num_segs++] = seg;
+		history_scan(seg, i == count - 1);
+	}
+	free(numbers);
+	if(history_num_segs == 0 && history_roll() < 0)
+		return -1;
+
+	history_buf = malloc(BVD_HISTORY_BUFFER);
+	history_spare = malloc(BVD_HISTORY_BUFFER);
+	history_used = 0;
+	pthread_t tid;
+	if(pthread_create(&tid, NULL, history_appender, NULL) != 0)
+		return -1;
+	pthread_detach(tid);
+	history_enabled = 1;
+	return 0;
+}
+
+/*
+ * Records a message before it is handed to its receiver.
+ */
+void *history_record(uint32_t from, uint32_t to, char *to_handle, uint32_t msgid, char *dlvr, int length){
+	char* eol = memchr(dlvr, '\n', length);
+	size_t line = eol + 1 - dlvr;
+	size_t from_length = line - 2;
+	size_t to_length = strlen(to_handle);
+	size_t frame_length = length - line;
+	size_t size = HISTORY_ALIGN(sizeof(HISTORY_RECORD) + BVD_HISTORY_TIME_SIZE + line + to_length + 2 + frame_length);
+	if(from_length > UINT16_MAX || to_length > UINT16_MAX || size > BVD_HISTORY_SEGMENT_SIZE / 4){
+		metrics_add(METRIC_HISTORY_DROPPED, 1);
+		return NULL;
+	}
+
+	size_t total = offsetof(HISTORY_PENDING, rec) + size;
+	BVD_LOCK(LOCK_HISTORY_BUFFER, &history_buf_lock);
+	if(history_used + total > BVD_HISTORY_BUFFER)
+		history_swap();
+	if(history_used + total > BVD_HISTORY_BUFFER){
+		BVD_UNLOCK(LOCK_HISTORY_BUFFER, &history_buf_lock);
+		metrics_add(METRIC_HISTORY_DROPPED, 1);
+		return NULL;
+	}
+	uint64_t now = history_now_ms();
+	if(now < history_last_ms)
+		now = history_last_ms;
+	history_last_ms = now;
+
+	HISTORY_PENDING* p = (HISTORY_PENDING*)(history_buf + history_used);
+	p->from = from;
+	p->to = to;
+	atomic_init(&p->state, HISTORY_HELD);
+	p->rec = (HISTORY_RECORD){size, msgid, now, {0, 0}, from_length, to_length, frame_length};
+	char* at = (char*)(&p->rec + 1);
+	uint64_t time_be = htobe64(now);
+	memcpy(at, &time_be, BVD_HISTORY_TIME_SIZE);
+	at += BVD_HISTORY_TIME_SIZE;
+	memcpy(at, dlvr, line);
+	at += line;
+	memcpy(at, to_handle, to_length);
+	memcpy(at + to_length, "\r\n", 2);
+	memcpy(at + to_length + 2, eol + 1, frame_length);
+	history_used += total;
+	BVD_UNLOCK(LOCK_HISTORY_BUFFER, &history_buf_lock);
+	return p;
+}
+
+/*
+ * Lets the appender write a record held by history_record(), or drop it.
+ */
+void history_settle(void *held, int taken){
+	HISTORY_PENDING* p = held;
+	atomic_store_explicit(&p->state, taken ? HISTORY_TAKEN : HISTORY_REFUSED, memory_order_release);
+}
+
+/*
+ * Parses the payload of a HISTORY request.
+ */
+int history_parse(void *payload, uint32_t length, HISTORY_QUERY *q){
+	if(payload == NULL || length < BVD_HISTORY_REQUEST_SIZE)
+		return -1;
+	char* p = payload;
+	uint64_t since, until;
+	uint32_t max;
+	memcpy(&since, p, 8);
+	memcpy(&until, p + 8, 8);
+	memcpy(&max, p + 16, 4);
+	q->since_ms = be64toh(since);
+	q->until_ms = be64toh(until);
+	q->max = ntohl(max);
+	if(q->max == 0 || q->max > BVD_HISTORY_MAX_RANGE)
+		q->max = BVD_HISTORY_MAX_RANGE;
+	q->peer = length > BVD_HISTORY_REQUEST_SIZE ? p + BVD_HISTORY_REQUEST_SIZE : NULL;
+	q->peer_length = length - BVD_HISTORY_REQUEST_SIZE;
+	return 0;
+}
+
+/*
+ * Finds the messages of a query, pinning the segments they are in.
+ */
+int history_range(uint32_t id, HISTORY_QUERY *q, HISTORY_RANGE *range){
+	range->items = malloc(q->max * sizeof(HISTORY_ITEM));
+	range->count = 0;
+	range->segs = NULL;
+	range->num_segs = 0;
+	char* name = intern_name(id);
+	size_t name_length = strlen(name);
+
+	BVD_LOCK(LOCK_HISTORY, &history_lock);
+	uint64_t loc = id < history_index_size ? history_start(&history_index[id], q->until_ms) : 0;
+	range->segs = malloc(history_num_segs * sizeof(void*));
+	HISTORY_SEGMENT* pinned = NULL;
+	for(int scanned = 0; loc != 0 && range->count < (int)q->max && scanned < BVD_HISTORY_SCAN_MAX; scanned++){
+		HISTORY_SEGMENT* seg = history_segment(loc);
+		if(seg == NULL)
+			break; //the rest of the chain is gone
+		HISTORY_RECORD* rec = (HISTORY_RECORD*)(seg->base + (uint32_t)loc);
+		char* head = (char*)(rec + 1);
+		char* from = head + BVD_HISTORY_TIME_SIZE;
+		char* to = from + rec->from_length + 2;
+		int sent = rec->from_length == name_length && memcmp(from, name, name_length) == 0;
+		loc = rec->prev[sent ? 0 : 1];
+		if(q->until_ms != 0 && rec->time_ms >= q->until_ms)
+			continue;
+		if(rec->time_ms < q->since_ms)
+			break;
+		if(q->peer != NULL){
+			char* other = sent ? to : from;
+			uint32_t other_length = sent ? rec->to_length : rec->from_length;
+			if(other_length != q->peer_length || memcmp(other, q->peer, other_length) != 0)
+				continue;
+		}
+		//the chain only ever goes back to older segments
+		if(seg != pinned){
+			atomic_fetch_add(&seg->refs, 1);
+			range->segs[range->num_segs++] = pinned = seg;
+		}
+		uint32_t head_length = BVD_HISTORY_TIME_SIZE + rec->from_length + 2 + rec->to_length + 2;
+		range->items[range->count++] = (HISTORY_ITEM){rec->msgid, head, head_length, head + head_length, rec->frame_length};
+	}
+	BVD_UNLOCK(LOCK_HISTORY, &history_lock);
+
+	//found newest first, and sent oldest first
+	for(int i = 0, j = range->count - 1; i < j; i++, j--){
+		HISTORY_ITEM item = range->items[i];
+		range->items[i] = range->items[j];
+		range->items[j] = item;
+	}
+	return range->count;
+}
+
+/*
+ * Lets go of the segments of a range, and frees it.
+ */
+void history_release(HISTORY_RANGE *range){
+	for(int i = 0; i < range->num_segs; i++)
+		history_unref(range->segs[i]);
+	free(range->segs);
+	free(range->items);
+}
+
+/*
+	Thread function of the appender: writes the records the client
+	service threads buffer to the segments, every BVD_HISTORY_FLUSH_MS or
+	as soon as a buffer is full.
+*/
+void* history_appender(void* arg){
+	while(1){
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += BVD_HISTORY_FLUSH_MS * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L){
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while(sem_timedwait(&history_kick, &deadline) < 0 && errno == EINTR)
+			;
+
+		BVD_LOCK(LOCK_HISTORY_BUFFER, &history_buf_lock);
+		if(history_out == NULL && history_used > 0)
+			history_swap();
+		char* out = history_out;
+		size_t used = history_out_used;
+		BVD_UNLOCK(LOCK_HISTORY_BUFFER, &history_buf_lock);
+		if(out == NULL)
+			continue;
+
+		for(size_t at = 0; at < used; ){
+			HISTORY_PENDING* p = (HISTORY_PENDING*)(out + at);
+			//its sender settles it as soon as the receiver's mailbox answers
+			int state;
+			while((state = atomic_load_explicit(&p->state, memory_order_acquire)) == HISTORY_HELD)
+				sched_yield();
+			if(state == HISTORY_TAKEN)
+				history_append(p);
+			at += offsetof(HISTORY_PENDING, rec) + p->rec.size;
+		}
+		BVD_LOCK(LOCK_HISTORY_BUFFER, &history_buf_lock);
+		history_out = NULL;
+		history_spare = out;
+		BVD_UNLOCK(LOCK_HISTORY_BUFFER, &history_buf_lock);
+	}
+	return NULL;
+}
+
+/*
+	Writes a record at the end of the last segment, starting a new one
+	if it does not fit, and indexes it.  The size goes in last, so that a
+	record cut short is not taken for one when the segment is read again.
+*/
+void history_append(HISTORY_PENDING* p){
+	HISTORY_RECORD* rec = &p->rec;
+	if(history_tail + rec->size > history_segs[history_num_segs - 1]->size && history_roll() < 0){
+		metrics_add(METRIC_HISTORY_DROPPED, 1);
+		return;
+	}
+	HISTORY_SEGMENT* seg = history_segs[history_num_segs - 1];
+	uint64_t loc = HISTORY_LOC(seg->number, history_tail);
+	//only this thread changes the index, so it may read it without the lock
+	rec->prev[0] = p->from < history_index_size ? history_index[p->from].last : 0;
+	rec->prev[1] = p->to < history_index_size ? history_index[p->to].last : 0;
+	uint32_t size = rec->size;
+	char* at = seg->base + history_tail;
+	memcpy(at + sizeof(size), (char*)rec + sizeof(size), size - sizeof(size));
+	atomic_store_explicit((_Atomic uint32_t*)at, size, memory_order_release);
+	history_tail += size;
+
+	BVD_LOCK(LOCK_HISTORY, &history_lock);
+	history_note(p->from, loc, rec->time_ms);
+	if(p->to != p->from)
+		history_note(p->to, loc, rec->time_ms);
+	BVD_UNLOCK(LOCK_HISTORY, &history_lock);
+	metrics_add(METRIC_HISTORY_RECORDED, 1);
+	metrics_add(METRIC_HISTORY_BYTES, size);
+}
+
+/*
+	Hands the buffer being filled to the appender and starts on the
+	spare, unless the appender still has it.  Caller must hold
+	history_buf_lock.
+*/
+void history_swap(void){
+	if(history_spare == NULL || history_out != NULL)
+		return;
+	history_out = history_buf;
+	history_out_used = history_used;
+	history_buf = history_spare;
+	history_spare = NULL;
+	history_used = 0;
+	sem_post(&history_kick);
+}
+
+/*
+	Starts a new segment after the last one, deleting the oldest if
+	there are too many.  A segment that is in a range being sent stays
+	mapped until the range is released.
+	Returns 0 on success, -1 on error.
+*/
+int history_roll(void){
+	uint32_t number = history_num_segs == 0 ? history_first : history_segs[history_num_segs - 1]->number + 1;
+	HISTORY_SEGMENT* seg = history_map(number, 1);
+	if(seg == NULL)
+		return -1;
+	HISTORY_SEGMENT* gone[history_num_segs + 1];
+	int num_gone = 0;
+
+	BVD_LOCK(LOCK_HISTORY, &history_lock);
+	if(history_num_segs == history_segs_size){
+		history_segs_size = history_segs_size == 0 ? 16 : history_segs_size * 2;
+		history_segs = realloc(history_segs, history_segs_size * sizeof(HISTORY_SEGMENT*));
+	}
+	history_segs[history_num_segs++] = seg;
+	while(history_num_segs > history_max_segments){
+		gone[num_gone++] = history_segs[0];
+		memmove(history_segs, history_segs + 1, --history_num_segs * sizeof(HISTORY_SEGMENT*));
+		history_first++;
+	}
+	BVD_UNLOCK(LOCK_HISTORY, &history_lock);
+	history_tail = 0;
+
+	for(int i = 0; i < num_gone; i++){
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/history-%08u.seg", history_dir, gone[i]->number);
+		unlink(path);
+		history_unref(gone[i]);
+	}
+	return 0;
+}
+
+/*
+	Maps segment number, creating it (BVD_HISTORY_SEGMENT_SIZE bytes of
+	zeroes) if create is set.
+	Returns NULL on error.
+*/
+HISTORY_SEGMENT* history_map(uint32_t number, int create){
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/history-%08u.seg", history_dir, number);
+	int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0), 0600);
+	if(fd < 0){
+		debug("history: cannot open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	if((create && ftruncate(fd, BVD_HISTORY_SEGMENT_SIZE) < 0) || fstat(fd, &st) < 0){
+		debug("history: cannot size %s: %s", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	char* base = st.st_size < (off_t)sizeof(HISTORY_RECORD) ? MAP_FAILED
+		: mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED){
+		debug("history: cannot map %s", path);
+		return NULL;
+	}
+	HISTORY_SEGMENT* seg = malloc(sizeof(HISTORY_SEGMENT));
+	seg->base = base;
+	seg->size = st.st_size;
+	seg->number = number;
+	atomic_init(&seg->refs, 1);
+	return seg;
+}
+
+/*
+	Drops a reference to a segment, unmapping it with the last one.
+*/
+void history_unref(HISTORY_SEGMENT* seg){
+	if(atomic_fetch_sub(&seg->refs, 1) == 1){
+		munmap(seg->base, seg->size);
+		free(seg);
+	}
+}
+
+/*
+	The segment a location is in, or NULL if it is gone.  Caller must
+	hold history_lock.
+*/
+HISTORY_SEGMENT* history_segment(uint64_t loc){
+	uint32_t number = loc >> 32;
+	if(number < history_first || number - history_first >= (uint32_t)history_num_segs)
+		return NULL;
+	return history_segs[number - history_first];
+}
+
+/*
+	Indexes the records of a segment read at startup, up to the first
+	one that is not whole.  New records go after them if it is the last
+	segment.
+*/
+void history_scan(HISTORY_SEGMENT* seg, int last){
+	size_t at = 0;
+	while(at + sizeof(HISTORY_RECORD) <= seg->size){
+		HISTORY_RECORD* rec = (HISTORY_RECORD*)(seg->base + at);
+		size_t need = sizeof(HISTORY_RECORD) + BVD_HISTORY_TIME_SIZE + rec->from_length + 2 + rec->to_length + 2 + rec->frame_length;
+		if(rec->size == 0 || rec->size % 8 != 0 || rec->size < need || rec->size > seg->size - at)
+			break;
+		char* from = (char*)(rec + 1) + BVD_HISTORY_TIME_SIZE;
+		char* to = from + rec->from_length + 2;
+		char handle[UINT16_MAX + 1];
+		memcpy(handle, from, rec->from_length);
+		handle[rec->from_length] = '\0';
+		uint32_t from_id = intern_handle(handle);
+		memcpy(handle, to, rec->to_length);
+		handle[rec->to_length] = '\0';
+		uint32_t to_id = intern_handle(handle);
+
+		uint64_t loc = HISTORY_LOC(seg->number, at);
+		history_note(from_id, loc, rec->time_ms);
+		if(to_id != from_id)
+			history_note(to_id, loc, rec->time_ms);
+		if(rec->time_ms > history_last_ms)
+			history_last_ms = rec->time_ms;
+		at += rec->size;
+	}
+	if(last)
+		history_tail = at;
+	else if(at + sizeof(HISTORY_RECORD) <= seg->size && ((HISTORY_RECORD*)(seg->base + at))->size != 0)
+		debug("history: segment %u is cut short at %zu", seg->number, at);
+}
+
+/*
+	Adds the record at loc to the index of a handle, dropping marks in
+	segments that are gone.  Caller must hold history_lock, or be alone.
+*/
+void history_note(uint32_t id, uint64_t loc, uint64_t time_ms){
+	if(id >= history_index_size){
+		uint32_t size = history_index_size == 0 ? 1024 : history_index_size;
+		while(id >= size)
+			size *= 2;
+		history_index = realloc(history_index, size * sizeof(HISTORY_INDEX));
+		memset(history_index + history_index_size, 0, (size - history_index_size) * sizeof(HISTORY_INDEX));
+		history_index_size = size;
+	}
+	HISTORY_INDEX* ix = &history_index[id];
+	ix->last = loc;
+	if(ix->count++ % BVD_HISTORY_SPARSE != 0)
+		return;
+	int gone = 0;
+	while(gone < ix->num_marks && (ix->marks[gone].loc >> 32) < history_first)
+		gone++;
+	if(gone > 0){
+		ix->num_marks -= gone;
+		memmove(ix->marks, ix->marks + gone, ix->num_marks * sizeof(HISTORY_MARK));
+	}
+	if(ix->num_marks == ix->marks_size){
+		ix->marks_size = ix->marks_size == 0 ? 4 : ix->marks_size * 2;
+		ix->marks = realloc(ix->marks, ix->marks_size * sizeof(HISTORY_MARK));
+	}
+	ix->marks[ix->num_marks++] = (HISTORY_MARK){time_ms, loc};
+}
+
+/*
+	Where to start walking a handle's chain back from for a range that
+	ends at until_ms (0 for now): the first mark at or past it, or the
+	last record.  Caller must hold history_lock.
+*/
+uint64_t history_start(HISTORY_INDEX* ix, uint64_t until_ms){
+	if(until_ms == 0)
+		return ix->last;
+	int lo = 0, hi = ix->num_marks;
+	while(lo < hi){
+		int mid = (lo + hi) / 2;
+		if(ix->marks[mid].time_ms < until_ms)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < ix->num_marks ? ix->marks[lo].loc : ix->last;
+}
+
+int history_number_cmp(const void* a, const void* b){
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+uint64_t history_now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,341 @@
+#include "hot.h"
+#include "intern.h"
+#include "lockprof.h"
+#include "timer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#define HOT_INDEX_BITS 8	//of the index of a table, 4 slots per handle tracked
+#define HOT_INDEX_SIZE (1 << HOT_INDEX_BITS)
+#define HOT_INDEX_MASK (HOT_INDEX_SIZE - 1)
+
+
+//STRUCTS
+typedef struct hot_entry {
+	uint32_t id;
+	uint16_t at;		//its slot in the index
+	uint64_t count;
+	uint64_t error;		//of the count, at most
+} HOT_ENTRY;
+
+typedef struct hot_table {
+	HOT_ENTRY heap[BVD_HOT_TRACKED];	//lowest count first
+	int used;
+	uint16_t index[HOT_INDEX_SIZE];		//1 + where a handle is in heap, by hash of its ID; 0 for none
+	uint64_t sketch[BVD_HOT_SKETCH_ROWS][BVD_HOT_SKETCH_WIDTH];
+} HOT_TABLE;
+
+typedef enum {
+	HOT_SENDERS,
+	HOT_SENT_BYTES,
+	HOT_RECEIVERS,
+	HOT_RECEIVED_BYTES,
+	NUM_HOT_TABLES
+} HOT_TABLE_KIND;
+
+
+//HELPER FUNCTION DECLARATIONS
+void hot_merge_aside(HOT_LOCAL*);
+void hot_merge(HOT_SLOT*);
+void hot_add(HOT_TABLE*, uint32_t id, uint64_t weight);
+uint64_t hot_estimate(HOT_TABLE*, uint32_t id, uint64_t weight);
+int hot_lookup(HOT_TABLE*, uint32_t id);
+void hot_unindex(HOT_TABLE*, int slot);
+void hot_sift_up(HOT_TABLE*, int at);
+void hot_sift_down(HOT_TABLE*, int at);
+void hot_swap(HOT_TABLE*, int a, int b);
+void hot_decay(HOT_TABLE*);
+void hot_tick(void*);
+int hot_entry_cmp(const void*, const void*);
+
+
+//GLOBAL VARIABLES
+HOT_TABLE hot_tables[NUM_HOT_TABLES];
+sem_t hot_mutex;
+atomic_uint hot_epoch = 0;	//merge periods gone by
+BVD_TIMER hot_timer;
+
+//a multiplier per row of the sketches
+static const uint64_t hot_seeds[] = {0x9e3779b97f4a7c15, 0xc2b2ae3d27d4eb4f, 0x165667b19e3779f9, 0xd6e8feb86659fd93};
+_Static_assert(BVD_HOT_SKETCH_ROWS <= sizeof(hot_seeds) / sizeof(hot_seeds[0]), "a seed per row");
+
+static const char* hot_names[NUM_HOT_TABLES] = {
+	[HOT_SENDERS] = "hot_senders",
+	[HOT_SENT_BYTES] = "hot_sent_bytes",
+	[HOT_RECEIVERS] = "hot_receivers",
+	[HOT_RECEIVED_BYTES] = "hot_received_bytes",
+};
+
+
+
+/*
+ * Sets up the tables and starts decaying them.
+ */
+void hot_init(void){
+	sem_init(&hot_mutex, 0, 1);
+	timer_setup(&hot_timer, hot_tick, NULL);
+	timer_schedule(&hot_timer, BVD_HOT_MERGE_MS);
+}
+
+/*
+ * Initializes the counters of a connection.
+ */
+void hot_local_init(HOT_LOCAL *local){
+	memset(local, 0, sizeof(*local));
+	local->from = BVD_NO_ID;
+	local->epoch = atomic_load_explicit(&hot_epoch, memory_order_relaxed);
+}
+
+/*
+ * Counts a message.
+ */
+void hot_count(HOT_LOCAL *local, uint32_t from, uint32_t to, uint64_t bytes){
+	unsigned epoch = atomic_load_explicit(&hot_epoch, memory_order_relaxed);
+	if(from != local->from || epoch != local->epoch){
+		hot_flush(local);
+		local->from = from;
+		local->epoch = epoch;
+	}
+	if(to != BVD_NO_ID){
+		//IDs are dense, so the low bits spread them well enough
+		HOT_SLOT* slot = &local->slots[to % BVD_HOT_LOCAL_SLOTS];
+		if(slot->count != 0 && slot->id != to){
+			if(local->num_aside == BVD_HOT_LOCAL_SLOTS)
+				hot_merge_aside(local);
+			local->aside[local->num_aside++] = *slot;
+			slot->count = 0;
+			slot->bytes = 0;
+		}
+		slot->id = to;
+		slot->count++;
+		slot->bytes += bytes;
+	}
+	local->from_count++;
+	local->from_bytes += bytes;
+}
+
+/*
+ * Merges what a connection counted into the server-wide tables.
+ */
+void hot_flush(HOT_LOCAL *local){
+	if(local->from_count == 0)
+		return;
+	BVD_LOCK(LOCK_HOT, &hot_mutex);
+	hot_add(&hot_tables[HOT_SENDERS], local->from, local->from_count);
+	hot_add(&hot_tables[HOT_SENT_BYTES], local->from, local->from_bytes);
+	for(int i = 0; i < BVD_HOT_LOCAL_SLOTS; i++){
+		if(local->slots[i].count != 0)
+			hot_merge(&local->slots[i]);
+	}
+	for(int i = 0; i < local->num_aside; i++)
+		hot_merge(&local->aside[i]);
+	BVD_UNLOCK(LOCK_HOT, &hot_mutex);
+	local->from_count = 0;
+	local->from_bytes = 0;
+	local->num_aside = 0;
+	memset(local->slots, 0, sizeof(local->slots));
+}
+
+/*
+	Merges what a connection put aside, and what its sender sent so
+	far, leaving its slots be.
+*/
+void hot_merge_aside(HOT_LOCAL* local){
+	BVD_LOCK(LOCK_HOT, &hot_mutex);
+	hot_add(&hot_tables[HOT_SENDERS], local->from, local->from_count);
+	hot_add(&hot_tables[HOT_SENT_BYTES], local->from, local->from_bytes);
+	for(int i = 0; i < local->num_aside; i++)
+		hot_merge(&local->aside[i]);
+	BVD_UNLOCK(LOCK_HOT, &hot_mutex);
+	local->from_count = 0;
+	local->from_bytes = 0;
+	local->num_aside = 0;
+}
+
+/*
+ * Write the highest of each table to out.
+ */
+void hot_report(FILE *out){
+	HOT_ENTRY entries[BVD_HOT_TRACKED];
+	for(int i = 0; i < NUM_HOT_TABLES; i++){
+		BVD_LOCK(LOCK_HOT, &hot_mutex);
+		int used = hot_tables[i].used;
+		memcpy(entries, hot_tables[i].heap, sizeof(HOT_ENTRY) * used);
+		BVD_UNLOCK(LOCK_HOT, &hot_mutex);
+
+		qsort(entries, used, sizeof(HOT_ENTRY), hot_entry_cmp);
+		fprintf(out, "%s", hot_names[i]);
+		for(int j = 0; j < used && j < BVD_HOT_TOP; j++){
+			fprintf(out, " %s:%lu:%lu", intern_name(entries[j].id),
+				(unsigned long)entries[j].count, (unsigned long)entries[j].error);
+		}
+		fprintf(out, "%s\r\n", used == 0 ? " -" : "");
+	}
+}
+
+/*
+	Adds what was counted for a receiver to the receiver tables.
+	Called with hot_mutex held.
+*/
+void hot_merge(HOT_SLOT* slot){
+	hot_add(&hot_tables[HOT_RECEIVERS], slot->id, slot->count);
+	hot_add(&hot_tables[HOT_RECEIVED_BYTES], slot->id, slot->bytes);
+}
+
+/*
+	Adds weight to the count of a handle in a table: to its count if it
+	is in the heap, or else to its estimate, which takes the place of
+	the lowest count if it is above it.  Called with hot_mutex held.
+*/
+void hot_add(HOT_TABLE* t, uint32_t id, uint64_t weight){
+	uint64_t estimate = hot_estimate(t, id, weight);
+	int slot = hot_lookup(t, id);
+	if(t->index[slot] != 0){
+		int at = t->index[slot] - 1;
+		t->heap[at].count += weight;
+		hot_sift_down(t, at);
+		return;
+	}
+	if(t->used < BVD_HOT_TRACKED){
+		int at = t->used++;
+		t->heap[at] = (HOT_ENTRY){id, slot, estimate, estimate - weight};
+		t->index[slot] = at + 1;
+		hot_sift_up(t, at);
+		return;
+	}
+	if(estimate <= t->heap[0].count)
+		return;
+	hot_unindex(t, t->heap[0].at);
+	slot = hot_lookup(t, id); //the index may have moved under it
+	t->heap[0] = (HOT_ENTRY){id, slot, estimate, estimate - weight};
+	t->index[slot] = 1;
+	hot_sift_down(t, 0);
+}
+
+/*
+	Adds weight to the counters of a handle in the sketch of a table,
+	and returns the lowest of them.
+*/
+uint64_t hot_estimate(HOT_TABLE* t, uint32_t id, uint64_t weight){
+	uint64_t estimate = UINT64_MAX;
+	for(int r = 0; r < BVD_HOT_SKETCH_ROWS; r++){
+		uint64_t* c = &t->sketch[r][((id * hot_seeds[r]) >> 32) % BVD_HOT_SKETCH_WIDTH];
+		*c += weight;
+		if(*c < estimate)
+			estimate = *c;
+	}
+	return estimate;
+}
+
+/*
+	The slot of the index a handle is in, or the free one it would go
+	to: open addressing with linear probing, from a multiplicative hash.
+*/
+int hot_lookup(HOT_TABLE* t, uint32_t id){
+	int slot = (id * 2654435761u) >> (32 - HOT_INDEX_BITS);
+	while(t->index[slot] != 0 && t->heap[t->index[slot] - 1].id != id)
+		slot = (slot + 1) & HOT_INDEX_MASK;
+	return slot;
+}
+
+/*
+	Empties a slot of the index, moving back the ones after it that
+	would no longer be found past the gap.
+*/
+void hot_unindex(HOT_TABLE* t, int slot){
+	t->index[slot] = 0;
+	for(int j = (slot + 1) & HOT_INDEX_MASK; t->index[j] != 0; j = (j + 1) & HOT_INDEX_MASK){
+		HOT_ENTRY* e = &t->heap[t->index[j] - 1];
+		int home = (e->id * 2654435761u) >> (32 - HOT_INDEX_BITS);
+		if(((j - home) & HOT_INDEX_MASK) < ((j - slot) & HOT_INDEX_MASK))
+			continue; //its home is between the gap and it
+		t->index[slot] = t->index[j];
+		t->index[j] = 0;
+		e->at = slot;
+		slot = j;
+	}
+}
+
+void hot_sift_up(HOT_TABLE* t, int at){
+	while(at > 0 && t->heap[(at - 1) / 2].count > t->heap[at].count){
+		hot_swap(t, at, (at - 1) / 2);
+		at = (at - 1) / 2;
+	}
+}
+
+void hot_sift_down(HOT_TABLE* t, int at){
+	while(1){
+		int low = at;
+		int left = 2 * at + 1;
+		if(left < t->used && t->heap[left].count < t->heap[low].count)
+			low = left;
+		if(left + 1 < t->used && t->heap[left + 1].count < t->heap[low].count)
+			low = left + 1;
+		if(low == at)
+			return;
+		hot_swap(t, at, low);
+		at = low;
+	}
+}
+
+void hot_swap(HOT_TABLE* t, int a, int b){
+	HOT_ENTRY e = t->heap[a];
+	t->heap[a] = t->heap[b];
+	t->heap[b] = e;
+	t->index[t->heap[a].at] = a + 1;
+	t->index[t->heap[b].at] = b + 1;
+}
+
+/*
+	Takes a 1/BVD_HOT_DECAY off every count, error and counter of the
+	sketch of a table, rounded up so that they all get to 0, drops the
+	handles that did, and builds the heap and its index again from
+	those left.  Called with hot_mutex held.
+*/
+void hot_decay(HOT_TABLE* t){
+	for(int r = 0; r < BVD_HOT_SKETCH_ROWS; r++){
+		for(int i = 0; i < BVD_HOT_SKETCH_WIDTH; i++)
+			t->sketch[r][i] -= (t->sketch[r][i] + BVD_HOT_DECAY - 1) / BVD_HOT_DECAY;
+	}
+	int used = 0;
+	for(int i = 0; i < t->used; i++){
+		HOT_ENTRY e = t->heap[i];
+		e.count -= (e.count + BVD_HOT_DECAY - 1) / BVD_HOT_DECAY;
+		e.error -= (e.error + BVD_HOT_DECAY - 1) / BVD_HOT_DECAY;
+		if(e.count > 0)
+			t->heap[used++] = e;
+	}
+	t->used = used;
+	memset(t->index, 0, sizeof(t->index));
+	for(int i = 0; i < used; i++){
+		int slot = hot_lookup(t, t->heap[i].id);
+		t->heap[i].at = slot;
+		t->index[slot] = i + 1;
+	}
+	for(int i = used / 2 - 1; i >= 0; i--)
+		hot_sift_down(t, i);
+}
+
+/*
+	Timer callback: starts a new merge period and decays the tables.
+*/
+void hot_tick(void* arg){
+	atomic_fetch_add_explicit(&hot_epoch, 1, memory_order_relaxed);
+	BVD_LOCK(LOCK_HOT, &hot_mutex);
+	for(int i = 0; i < NUM_HOT_TABLES; i++)
+		hot_decay(&hot_tables[i]);
+	BVD_UNLOCK(LOCK_HOT, &hot_mutex);
+	timer_schedule(&hot_timer, BVD_HOT_MERGE_MS);
+}
+
+/*
+	Highest count first.
+*/
+int hot_entry_cmp(const void* a, const void* b){
+	const HOT_ENTRY* x = a;
+	const HOT_ENTRY* y = b;
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
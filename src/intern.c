@@ -0,0 +1,149 @@
+#include "intern.h"
+#include "debug.h"
+#include "lockprof.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <semaphore.h>
+
+
+//The names are kept in chunks that never move, so intern_name() needs no lock
+#define INTERN_CHUNK_BITS 12
+#define INTERN_CHUNK_SIZE (1 << INTERN_CHUNK_BITS)
+#define INTERN_MAX_CHUNKS (1 << 16)
+#define INTERN_MIN_SLOTS 1024
+
+
+//STRUCTS
+//A slot of the open-addressed table; the hash saves most string compares
+typedef struct intern_slot {
+	uint32_t hash;
+	uint32_t id;	//BVD_NO_ID if the slot is free
+} intern_slot;
+
+
+//HELPER FUNCTION DECLARATIONS
+intern_slot* intern_probe(char*, uint32_t);
+void intern_grow(void);
+
+
+//GLOBAL VARIABLES
+sem_t intern_mutex;
+intern_slot* intern_slots = NULL;
+uint32_t intern_mask = 0; //number of slots - 1
+uint32_t intern_count = 0;
+char** intern_chunks[INTERN_MAX_CHUNKS];
+
+
+/*
+ * Initialize the intern table.
+ */
+void intern_init(void){
+	sem_init(&intern_mutex, 0, 1);
+	intern_slots = malloc(sizeof(intern_slot) * INTERN_MIN_SLOTS);
+	for(int i = 0; i < INTERN_MIN_SLOTS; i++)
+		intern_slots[i].id = BVD_NO_ID;
+	intern_mask = INTERN_MIN_SLOTS - 1;
+}
+
+/*
+ * Get the ID of a handle, giving it one if it does not have one yet.
+ */
+uint32_t intern_handle(char *handle){
+	uint32_t hash = intern_hash(handle, strlen(handle));
+	BVD_LOCK(LOCK_INTERN, &intern_mutex);
+	intern_slot* slot = intern_probe(handle, hash);
+	if(slot->id == BVD_NO_ID){
+		uint32_t id = intern_count;
+		char*** chunk = &intern_chunks[id >> INTERN_CHUNK_BITS];
+		if(*chunk == NULL)
+			*chunk = malloc(sizeof(char*) * INTERN_CHUNK_SIZE);
+		(*chunk)[id & (INTERN_CHUNK_SIZE - 1)] = strdup(handle);
+		slot->hash = hash;
+		slot->id = id;
+		intern_count++;
+		//keep the table at most half full
+		if(intern_count * 2 > intern_mask)
+			intern_grow();
+		BVD_UNLOCK(LOCK_INTERN, &intern_mutex);
+		return id;
+	}
+	uint32_t id = slot->id;
+	BVD_UNLOCK(LOCK_INTERN, &intern_mutex);
+	return id;
+}
+
+/*
+ * Get the ID of a handle, or BVD_NO_ID if it has never been given one.
+ */
+uint32_t intern_find(char *handle){
+	uint32_t hash = intern_hash(handle, strlen(handle));
+	BVD_LOCK(LOCK_INTERN, &intern_mutex);
+	uint32_t id = intern_probe(handle, hash)->id;
+	BVD_UNLOCK(LOCK_INTERN, &intern_mutex);
+	return id;
+}
+
+/*
+ * Get the handle with a given ID.
+ */
+char *intern_name(uint32_t id){
+	return intern_chunks[id >> INTERN_CHUNK_BITS][id & (INTERN_CHUNK_SIZE - 1)];
+}
+
+/*
+ * Hash of a string: FNV-1a, with murmur3's finalizer to spread out
+ * handles that differ only in their last characters.
+ */
+uint32_t intern_hash(const char *s, size_t len){
+	uint32_t h = 2166136261u;
+	for(size_t i = 0; i < len; i++){
+		h ^= (uint8_t)s[i];
+		h *= 16777619u;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/*
+	The slot holding handle, or the free slot where it would go.
+	Caller must hold intern_mutex.
+*/
+intern_slot* intern_probe(char* handle, uint32_t hash){
+	uint32_t i = hash & intern_mask;
+	while(1){
+		intern_slot* slot = &intern_slots[i];
+		if(slot->id == BVD_NO_ID)
+			return slot;
+		if(slot->hash == hash && !strcmp(intern_name(slot->id), handle))
+			return slot;
+		i = (i + 1) & intern_mask;
+	}
+}
+
+/*
+	Doubles the table and rehashes every ID.
+	Caller must hold intern_mutex.
+*/
+void intern_grow(void){
+	uint32_t size = (intern_mask + 1) * 2;
+	intern_slot* slots = malloc(sizeof(intern_slot) * size);
+	for(uint32_t i = 0; i < size; i++)
+		slots[i].id = BVD_NO_ID;
+	for(uint32_t i = 0; i <= intern_mask; i++){
+		intern_slot* old = &intern_slots[i];
+		if(old->id == BVD_NO_ID)
+			continue;
+		uint32_t j = old->hash & (size - 1);
+		while(slots[j].id != BVD_NO_ID)
+			j = (j + 1) & (size - 1);
+		slots[j] = *old;
+	}
+	free(intern_slots);
+	intern_slots = slots;
+	intern_mask = size - 1;
+}
@@ -0,0 +1,151 @@
+#include "lockprof.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+
+//STRUCTS
+typedef struct lock_stats {
+	atomic_long acquired;
+	atomic_long contended;
+	atomic_long wait_nsec;
+	atomic_long wait_hist[BVD_LOCKPROF_BUCKETS];
+	atomic_long hold_max_nsec;
+	_Atomic(const char*) hold_max_at;
+} LOCK_STATS;
+
+//A lock the thread holds
+typedef struct lock_held {
+	sem_t* sem;
+	long since_nsec;
+	const char* where;
+} LOCK_HELD;
+
+
+//HELPER FUNCTION DECLARATIONS
+int lockprof_bucket(long nsec);
+long lockprof_percentile(LOCK_STATS* st, double fraction);
+
+
+//GLOBAL VARIABLES
+LOCK_STATS lock_stats[NUM_LOCK_SITES];
+static __thread LOCK_HELD lock_held[BVD_LOCKPROF_DEPTH];
+static __thread int lock_num_held;
+
+static const char* lock_names[NUM_LOCK_SITES] = {
+	[LOCK_DIRECTORY] = "directory",
+	[LOCK_DIR_STRIPE] = "dir_stripe",
+	[LOCK_INTERN] = "intern",
+	[LOCK_MB_REGISTRY] = "mb_registry",
+	[LOCK_MAILBOX] = "mailbox",
+	[LOCK_THREAD_COUNTER] = "thread_counter",
+	[LOCK_HISTORY_BUFFER] = "history_buffer",
+	[LOCK_HISTORY] = "history",
+	[LOCK_HOT] = "hot",
+};
+
+
+
+/*
+ * Take a lock at a site, keeping count.
+ */
+void lockprof_wait(LOCK_SITE site, sem_t *sem, const char *where){
+	LOCK_STATS* st = &lock_stats[site];
+	if(sem_trywait(sem) < 0){
+		long start = metrics_now_nsec();
+		while(sem_wait(sem) < 0 && errno == EINTR)
+			;
+		long waited = metrics_now_nsec() - start;
+		atomic_fetch_add_explicit(&st->contended, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&st->wait_nsec, waited, memory_order_relaxed);
+		atomic_fetch_add_explicit(&st->wait_hist[lockprof_bucket(waited)], 1, memory_order_relaxed);
+	}
+	atomic_fetch_add_explicit(&st->acquired, 1, memory_order_relaxed);
+	if(lock_num_held < BVD_LOCKPROF_DEPTH)
+		lock_held[lock_num_held++] = (LOCK_HELD){sem, metrics_now_nsec(), where};
+}
+
+/*
+ * Release a lock taken with lockprof_wait().
+ */
+void lockprof_post(LOCK_SITE site, sem_t *sem){
+	//usually the last one taken, but not always
+	for(int i = lock_num_held - 1; i >= 0; i--){
+		if(lock_held[i].sem != sem)
+			continue;
+		long held = metrics_now_nsec() - lock_held[i].since_nsec;
+		LOCK_STATS* st = &lock_stats[site];
+		long max = atomic_load_explicit(&st->hold_max_nsec, memory_order_relaxed);
+		while(held > max){
+			if(atomic_compare_exchange_weak(&st->hold_max_nsec, &max, held)){
+				//another thread may store its own place in between, which is close enough
+				atomic_store_explicit(&st->hold_max_at, lock_held[i].where, memory_order_relaxed);
+				break;
+			}
+		}
+		lock_held[i] = lock_held[--lock_num_held];
+		break;
+	}
+	sem_post(sem);
+}
+
+/*
+ * Write the figures of every site to out.
+ */
+void lockprof_report(FILE *out){
+#ifndef BVD_LOCKPROF
+	return;
+#endif
+	for(int i = 0; i < NUM_LOCK_SITES; i++){
+		LOCK_STATS* st = &lock_stats[i];
+		const char* name = lock_names[i];
+		long contended = atomic_load(&st->contended);
+		fprintf(out, "lock_%s_acquired %ld\r\n", name, atomic_load(&st->acquired));
+		fprintf(out, "lock_%s_contended %ld\r\n", name, contended);
+		fprintf(out, "lock_%s_wait_nsec %ld\r\n", name, atomic_load(&st->wait_nsec));
+		fprintf(out, "lock_%s_wait_hist", name);
+		for(int b = 0; b < BVD_LOCKPROF_BUCKETS; b++)
+			fprintf(out, " %ld", atomic_load(&st->wait_hist[b]));
+		fprintf(out, "\r\n");
+		fprintf(out, "lock_%s_wait_p50_nsec %ld\r\n", name, lockprof_percentile(st, 0.5));
+		fprintf(out, "lock_%s_wait_p99_nsec %ld\r\n", name, lockprof_percentile(st, 0.99));
+		const char* at = atomic_load(&st->hold_max_at);
+		fprintf(out, "lock_%s_hold_max_nsec %ld\r\n", name, atomic_load(&st->hold_max_nsec));
+		fprintf(out, "lock_%s_hold_max_at %s\r\n", name, at != NULL ? at : "-");
+	}
+}
+
+/*
+	The histogram bucket of a wait: under 1us, under 4us, ... by
+	factors of 4, and the last one for anything longer.
+*/
+int lockprof_bucket(long nsec){
+	int b = 0;
+	for(long bound = 1000; b < BVD_LOCKPROF_BUCKETS - 1 && nsec >= bound; bound *= 4)
+		b++;
+	return b;
+}
+
+/*
+	The upper bound of the bucket the given fraction of the contended
+	waits fall into, or 0 if none did.  The last bucket has no bound, so
+	its lower one stands in.
+*/
+long lockprof_percentile(LOCK_STATS* st, double fraction){
+	long total = 0;
+	long counts[BVD_LOCKPROF_BUCKETS];
+	for(int b = 0; b < BVD_LOCKPROF_BUCKETS; b++)
+		total += counts[b] = atomic_load(&st->wait_hist[b]);
+	if(total == 0)
+		return 0;
+	long seen = 0;
+	long bound = 1000;
+	for(int b = 0; b < BVD_LOCKPROF_BUCKETS - 1; b++, bound *= 4){
+		seen += counts[b];
+		if(seen >= total * fraction)
+			return bound;
+	}
+	return bound / 4;
+}
@@ -0,0 +1,190 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5	// the block format wants the last 5 bytes as literals
+#define LZ_MFLIMIT 12		// and no match starting in the last 12
+#define LZ_MAX_OFFSET 65535
+
+
+//HELPER FUNCTION DECLARATIONS
+static uint32_t lz_read32(const uint8_t*);
+static int lz_hash(uint32_t);
+static uint8_t* lz_write_length(uint8_t*, int);
+
+
+/*
+ * Compress length bytes from src into dst, which has room for cap bytes.
+ * Returns the compressed size, or 0 if it did not fit in cap bytes.
+ */
+int lz_compress(const void *src, int length, void *dst, int cap){
+	const uint8_t* in = src;
+	const uint8_t* ip = in;
+	const uint8_t* anchor = in;
+	const uint8_t* iend = in + length;
+	uint8_t* out = dst;
+	uint8_t* oend = out + cap;
+
+	//positions of recently seen 4-byte sequences, -1 if none
+	int32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0xff, sizeof(table));
+
+	if(length >= LZ_MFLIMIT){
+		const uint8_t* mflimit = iend - LZ_MFLIMIT;
+		const uint8_t* matchlimit = iend - LZ_LAST_LITERALS;
+		while(ip < mflimit){
+			uint32_t seq = lz_read32(ip);
+			int h = lz_hash(seq);
+			int32_t ref = table[h];
+			table[h] = ip - in;
+			if(ref < 0 || ip - (in + ref) > LZ_MAX_OFFSET || lz_read32(in + ref) != seq){
+				ip++;
+				continue;
+			}
+
+			const uint8_t* match = in + ref;
+			while(ip > anchor && match > in && ip[-1] == match[-1]){
+				ip--;
+				match--;
+			}
+			int mlen = LZ_MIN_MATCH;
+			while(ip + mlen < matchlimit && ip[mlen] == match[mlen])
+				mlen++;
+
+			int litlen = ip - anchor;
+			//token, literal length bytes, literals, offset, match length bytes
+			if(out + 1 + litlen / 255 + 1 + litlen + 2 + mlen / 255 + 1 > oend)
+				return 0;
+
+			uint8_t* token = out++;
+			*token = (litlen >= 15 ? 15 : litlen) << 4;
+			if(litlen >= 15)
+				out = lz_write_length(out, litlen - 15);
+			memcpy(out, anchor, litlen);
+			out += litlen;
+
+			int offset = ip - match;
+			*out++ = offset & 0xff;
+			*out++ = offset >> 8;
+
+			int ml = mlen - LZ_MIN_MATCH;
+			*token |= ml >= 15 ? 15 : ml;
+			if(ml >= 15)
+				out = lz_write_length(out, ml - 15);
+
+			ip += mlen;
+			anchor = ip;
+		}
+	}
+
+	//whatever is left goes out as literals
+	int litlen = iend - anchor;
+	if(out + 1 + litlen / 255 + 1 + litlen > oend)
+		return 0;
+	uint8_t* token = out++;
+	*token = (litlen >= 15 ? 15 : litlen) << 4;
+	if(litlen >= 15)
+		out = lz_write_length(out, litlen - 15);
+	memcpy(out, anchor, litlen);
+	out += litlen;
+
+	return out - (uint8_t*)dst;
+}
+
+/*
+ * Decompress length bytes from src into dst, which must have room for
+ * exactly raw_length bytes.
+ * Returns raw_length on success, -1 if the input is malformed.
+ */
+int lz_decompress(const void *src, int length, void *dst, int raw_length){
+	const uint8_t* ip = src;
+	const uint8_t* iend = ip + length;
+	uint8_t* op = dst;
+	uint8_t* oend = op + raw_length;
+
+	while(ip < iend){
+		uint8_t token = *ip++;
+
+		int litlen = token >> 4;
+		if(litlen == 15){
+			uint8_t b;
+			do{
+				if(ip >= iend)
+					return -1;
+				b = *ip++;
+				litlen += b;
+				//stop before a long run of 255s can overflow
+				if(litlen > oend - op)
+					return -1;
+			} while(b == 255);
+		}
+		if(litlen > iend - ip || litlen > oend - op)
+			return -1;
+		memcpy(op, ip, litlen);
+		op += litlen;
+		ip += litlen;
+
+		//the last sequence has literals only
+		if(ip == iend)
+			break;
+
+		if(iend - ip < 2)
+			return -1;
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > op - (uint8_t*)dst)
+			return -1;
+
+		int mlen = token & 15;
+		if(mlen == 15){
+			uint8_t b;
+			do{
+				if(ip >= iend)
+					return -1;
+				b = *ip++;
+				mlen += b;
+				if(mlen > oend - op)
+					return -1;
+			} while(b == 255);
+		}
+		mlen += LZ_MIN_MATCH;
+		if(mlen > oend - op)
+			return -1;
+
+		//byte by byte, since the match may overlap what it produces
+		const uint8_t* match = op - offset;
+		for(int i = 0; i < mlen; i++)
+			op[i] = match[i];
+		op += mlen;
+	}
+
+	if(op != oend)
+		return -1;
+	return raw_length;
+}
+
+static uint32_t lz_read32(const uint8_t* p){
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static int lz_hash(uint32_t v){
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+	Lengths of 15 and more continue in bytes of 255 plus a final remainder.
+*/
+static uint8_t* lz_write_length(uint8_t* out, int length){
+	while(length >= 255){
+		*out++ = 255;
+		length -= 255;
+	}
+	*out++ = length;
+	return out;
+}
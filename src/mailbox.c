@@ -1,36 +1,127 @@
-
+#define _GNU_SOURCE
 #include "mailbox.h"
+#include "mailbox_ext.h"
 #include "debug.h"
+#include "intern.h"
+#include "timer.h"
+#include "metrics.h"
+#include "dedup.h"
+#include "lockprof.h"
+#include "stream.h"
 
 
 
 #include <semaphore.h>
+#include <stdatomic.h>
+#include <sched.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 
 
 //STRUCTS
 typedef struct mailbox_node {
 	MAILBOX_ENTRY* mb_entry;
 	int msgid;
+	long enqueued_ms; //with a TTL only
 	struct mailbox_node* next;
 } MB_NODE;
 
-
-typedef struct mailbox {
+//A queue of entries, in the order they came in
+typedef struct mailbox_lane {
 	MB_NODE* head;
 	MB_NODE* tail;
-	sem_t mutex;
+} MB_LANE;
+
+#define MB_CONTROL 0 //notices
+#define MB_DATA 1 //messages
+
+//What a spilled message looks like in its spill file, followed by its body
+typedef struct mailbox_spill_record {
+	int msgid;
+	int length;
+	int has_body;
+	long enqueued_ms;
+	struct mailbox* from; //the reference stays with the record
+} MB_SPILL_RECORD;
+
+#define MB_SPILL_IOV 128 //records written with one pwritev()
 
-	sem_t ref_mutex;
-	char* handle;
+//What a spinning waiter does between two looks at the mailbox
+#if defined(__x86_64__) || defined(__i386__)
+#define MB_PAUSE() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define MB_PAUSE() __asm__ __volatile__("yield")
+#else
+#define MB_PAUSE() do{}while(0)
+#endif
+
+
+typedef struct mailbox {
+	MB_LANE lanes[2]; //control first, see mailbox_ext.h
+	int control_streak; //control entries taken in a row while messages waited
+	sem_t mutex; //counts the entries waiting in both lanes
+	sem_t lock; //guards the rest, so that mailboxes never contend with each other
+
+	MAILBOX_DISCARD_HOOK* discard_hook;
+	uint32_t id; //interned handle, see intern.h
+	int caps;
+	DEDUP* dedup; //msgids of the messages the client sent, with the capability
 	int ref_cnt;
 	int is_defunct;
+	int is_interrupted;
+	int efd; //eventfd poked on every new entry, -1 until asked for
+	BVD_TIMER ttl; //expires the oldest message, with a TTL only
+	int ttl_armed;
+
+	//the data lane goes on in the spill file, once it has spilled
+	int spill_fd; //-1 while nothing is spilled
+	off_t spill_read; //where the next record to read back starts
+	off_t spill_write; //where the next one is appended
+	_Atomic long spill_count; //messages in the file
+	MB_LANE spill_queue; //messages on their way to the file, behind those in it
+	_Atomic long spill_queued; //messages in spill_queue or being written
+	int spill_writing; //a thread is writing spill_queue out, see mb_spill_flush()
+	int spill_stalled; //the disk is full: spill_queue waits for the file to be read back
+	_Atomic long data_resident; //messages in the data lane in memory
+	_Atomic long last_taken_ms; //when an entry was last taken out, with a budget only
+	long wait_avg_nsec; //how long the owner has lately waited for an entry, see mb_wait()
+	struct mailbox* prev_mb; //every mailbox, for finding the cold ones
+	struct mailbox* next_mb;
 } MAILBOX;
 
 
 //FUNCTION DECLARATIONS
 MB_NODE* make_new_node(int msgid, void* body, int length);
+void mb_append_node(MAILBOX* mb, MB_NODE* node);
+MB_NODE* mb_pop_node(MAILBOX* mb);
+int mb_wait(MAILBOX* mb, const struct timespec* abstime);
+METRIC mb_spin(MAILBOX* mb, long start, long budget);
+void mb_fini(MAILBOX* mb);
+MAILBOX_ENTRY* mb_dequeue(MAILBOX* mb);
+void mb_poke(int efd);
+void mb_expire(void* arg);
+long mb_node_cost(MB_NODE* node);
+MB_NODE* mb_unlink_head(MAILBOX* mb, MB_LANE* lane);
+MB_NODE* mb_data_head(MAILBOX* mb);
+int mb_has_entries(MAILBOX* mb);
+void mb_queue_node(MAILBOX* mb, MB_NODE* node);
+void mb_unqueue(MAILBOX* mb);
+int mb_spill_open(void);
+ssize_t mb_spill_write(int fd, off_t at, MB_NODE* chain);
+long mb_spill_flush(MAILBOX* mb);
+void mb_spill_read(MAILBOX* mb);
+void mb_spill_close(MAILBOX* mb);
+int mb_over_budget(void);
+void mb_spill_cold(void);
+void mb_spill_retry(void* arg);
+int mb_find_cold(MAILBOX** victims, int max);
+long mb_spill_tail(MAILBOX* mb);
 
 
 
@@ -38,6 +129,18 @@ MB_NODE* make_new_node(int msgid, void* body, int length);
 //GLOBAL VARIABLES
 sem_t mutex2;
 sem_t mutex3;
+int mb_ttl_ms = 0;
+atomic_long mb_queued = 0; //entries in all mailboxes
+long mb_budget_mb = 0;
+char* mb_spill_dir = NULL;
+atomic_long mb_resident = 0; //bytes of the entries in memory in all mailboxes
+atomic_int mb_spilling = 0; //whether a thread is spilling mailboxes already
+atomic_long mb_spill_retry_ms = 0; //after finding nothing to spill, when to look again
+BVD_TIMER mb_spill_timer; //looks again then, set up by the first thread to spill
+int mb_spill_timer_ready = 0;
+long mb_spin_nsec = BVD_MB_SPIN_NSEC;
+int mb_num_cpus = 0; //spinning is no use with a single one
+MAILBOX* mb_all = NULL; //guarded by mutex2
 
 
 
@@ -46,22 +149,47 @@ sem_t mutex3;
  * The mailbox is returned with a reference count of 1.
  */
 MAILBOX *mb_init(char *handle){
-	sem_wait(&mutex2);
+	BVD_LOCK(LOCK_MB_REGISTRY, &mutex2);
 	MAILBOX* mb = malloc(sizeof(MAILBOX));
-	mb->head = NULL;
-	mb->tail = NULL;
-	mb->handle = handle;
-
-	sem_init(&mb->mutex , 0, 1);
-	sem_wait(&mb->mutex);	
-
-	sem_init(&mb->ref_mutex , 0, 1);
-	sem_wait(&mb->ref_mutex);
+	for(int i = 0; i < 2; i++){
+		mb->lanes[i].head = NULL;
+		mb->lanes[i].tail = NULL;
+	}
+	mb->control_streak = 0;
+	mb->id = intern_handle(handle);
+	mb->discard_hook = NULL;
+	mb->caps = 0;
+	mb->dedup = NULL;
 
+	sem_init(&mb->mutex , 0, 0);
+	sem_init(&mb->lock , 0, 1);
 
 	mb->ref_cnt = 1;
 	mb->is_defunct = 0;
-	sem_post(&mutex2);
+	mb->is_interrupted = 0;
+	mb->efd = -1;
+	timer_setup(&mb->ttl, mb_expire, mb);
+	mb->ttl_armed = 0;
+	mb->spill_fd = -1;
+	mb->spill_read = 0;
+	mb->spill_write = 0;
+	mb->spill_count = 0;
+	mb->spill_queue.head = NULL;
+	mb->spill_queue.tail = NULL;
+	mb->spill_queued = 0;
+	mb->spill_writing = 0;
+	mb->spill_stalled = 0;
+	mb->data_resident = 0;
+	mb->last_taken_ms = timer_now_ms();
+	mb->wait_avg_nsec = 0;
+	if(mb_num_cpus == 0)
+		mb_num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	mb->prev_mb = NULL;
+	mb->next_mb = mb_all;
+	if(mb_all != NULL)
+		mb_all->prev_mb = mb;
+	mb_all = mb;
+	BVD_UNLOCK(LOCK_MB_REGISTRY, &mutex2);
 	return mb;
 }
 
@@ -69,7 +197,67 @@ MAILBOX *mb_init(char *handle){
  * Set the discard hook for a mailbox.
  */
 void mb_set_discard_hook(MAILBOX *mb, MAILBOX_DISCARD_HOOK * mb_dh){
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	mb->discard_hook = mb_dh;
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+}
+
+/*
+ * Set and get the capabilities negotiated by the client that owns the mailbox.
+ */
+void mb_set_caps(MAILBOX *mb, int caps){
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	mb->caps = caps;
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+}
+
+int mb_get_caps(MAILBOX *mb){
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	int caps = mb->caps;
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+	return caps;
+}
+
+/*
+ * Tell whether a msgid is in the window of messages the owner of the
+ * mailbox sent, and add one to it.
+ */
+int mb_msgid_seen(MAILBOX *mb, uint32_t msgid){
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	int seen = mb->dedup != NULL && dedup_seen(mb->dedup, msgid);
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+	return seen;
+}
+
+void mb_msgid_record(MAILBOX *mb, uint32_t msgid){
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	if(mb->dedup == NULL){
+		mb->dedup = malloc(sizeof(DEDUP));
+		dedup_init(mb->dedup);
+	}
+	dedup_record(mb->dedup, msgid);
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+}
+
+void mb_msgid_unrecord(MAILBOX *mb, uint32_t msgid){
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	if(mb->dedup != NULL)
+		dedup_unrecord(mb->dedup, msgid);
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+}
 
+/*
+ * The number of entries waiting in all mailboxes together.
+ */
+long mb_queued_total(void){
+	return atomic_load_explicit(&mb_queued, memory_order_relaxed);
+}
+
+/*
+ * The bytes of the entries held in memory by all mailboxes together.
+ */
+long mb_resident_bytes(void){
+	return atomic_load_explicit(&mb_resident, memory_order_relaxed);
 }
 
 /*
@@ -79,13 +267,19 @@ void mb_set_discard_hook(MAILBOX *mb, MAILBOX_DISCARD_HOOK * mb_dh){
  * that exist to the mailbox.
  */
 void mb_ref(MAILBOX *mb){
-	sem_wait(&mutex2);
-
-	if(mb->ref_cnt == 0){
-		sem_wait(&mb->ref_mutex);
-	}
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
 	mb->ref_cnt += 1;
-	sem_post(&mutex2);
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+}
+
+/*
+ * Increase the reference count on a mailbox by n, for a caller that is
+ * about to make n copies of the pointer.
+ */
+void mb_refn(MAILBOX *mb, int n){
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	mb->ref_cnt += n;
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
 }
 
 /*
@@ -96,12 +290,15 @@ void mb_ref(MAILBOX *mb){
  * the mailbox will be finalized.
  */
 void mb_unref(MAILBOX *mb){
-	sem_wait(&mutex2);
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
 	mb->ref_cnt -= 1;
-	if(mb->ref_cnt == 0){
-		sem_post(&mb->ref_mutex);
+	int finalize = (mb->ref_cnt == 0);
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+
+	//nobody else can reach the mailbox anymore, so no lock is needed
+	if(finalize){
+		mb_fini(mb);
 	}
-	sem_post(&mutex2);
 }
 
 /*
@@ -113,35 +310,84 @@ void mb_unref(MAILBOX *mb){
  * entries that remain in it will be discarded.
  */
 void mb_shutdown(MAILBOX *mb){
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
 	mb->is_defunct = 1;
-	sem_wait(&mb->ref_mutex);
-	sem_post(&mb->ref_mutex);
-	//discard all the entries
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+	//wake up the service thread so it sees the mailbox is defunct
+	sem_post(&mb->mutex);
+}
 
-	MB_NODE* ptr = mb->head;
+/*
+ * Wake up the thread servicing the mailbox without giving it anything.
+ */
+void mb_interrupt(MAILBOX *mb){
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	mb->is_interrupted = 1;
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+	sem_post(&mb->mutex);
+}
 
-	while(ptr!=NULL){
-		free(ptr->mb_entry->body);
-		ptr = ptr->next;
-		mb->head = mb->head->next;
+/*
+	Discards whatever is left in the queue, calling the
+	discard hook first so undelivered messages can be bounced.
+	Only called from mb_unref once the last reference is gone.
+*/
+void mb_fini(MAILBOX* mb){
+	//first, so that discarding, which may finalize other mailboxes, is done without mutex2
+	BVD_LOCK(LOCK_MB_REGISTRY, &mutex2);
+	if(mb->prev_mb != NULL)
+		mb->prev_mb->next_mb = mb->next_mb;
+	else
+		mb_all = mb->next_mb;
+	if(mb->next_mb != NULL)
+		mb->next_mb->prev_mb = mb->prev_mb;
+	BVD_UNLOCK(LOCK_MB_REGISTRY, &mutex2);
+
+	if(mb_ttl_ms > 0)
+		timer_cancel(&mb->ttl);
+	MB_NODE* ptr;
+	while((ptr = mb_pop_node(mb)) != NULL){
+		atomic_fetch_sub_explicit(&mb_queued, 1, memory_order_relaxed);
+		MAILBOX_ENTRY* entry = ptr->mb_entry;
+		if(entry->type == MESSAGE_ENTRY_TYPE && entry->content.message.from == mb){
+			entry->content.message.from = NULL; //as per the spec
+		}
+		if(mb->discard_hook != NULL){
+			mb->discard_hook(entry);
+		}
+		if(entry->type == MESSAGE_ENTRY_TYPE && entry->content.message.from != NULL){
+			mb_unref(entry->content.message.from);
+		}
+		free(entry->body);
+		free(entry);
+		free(ptr);
 	}
 
-	free(mb->handle);
-	sem_destroy(&mb->ref_mutex);
+	free(mb->dedup);
+	if(mb->spill_fd >= 0)
+		close(mb->spill_fd);
 	sem_destroy(&mb->mutex);
+	sem_destroy(&mb->lock);
+	if(mb->efd >= 0)
+		close(mb->efd);
+	free(mb);
 }
 
 /*
  * Get the handle associated with a mailbox.
  */
 char *mb_get_handle(MAILBOX *mb){
-	sem_wait(&mutex2);
-	char* return_this = NULL;
-	if(mb != NULL){
-		return_this = mb -> handle;
-	}
-	sem_post(&mutex2);
-	return return_this;
+	//the ID never changes, so there is nothing to lock
+	if(mb == NULL)
+		return NULL;
+	return intern_name(mb->id);
+}
+
+/*
+ * Get the interned ID (see intern.h) of the handle of a mailbox.
+ */
+uint32_t mb_get_id(MAILBOX *mb){
+	return mb->id;
 }
 
 /*
@@ -162,60 +408,74 @@ char *mb_get_handle(MAILBOX *mb){
  * caller must discard this pointer which it no longer "owns".
  */
 void mb_add_message(MAILBOX *mb, int msgid, MAILBOX *from, void *body, int length){
-	sem_wait(&mutex2);
-	if(!mb->is_defunct){
-		//adding the info to an appropraitely existing node.
-		MB_NODE* ptr = mb->head;
-		int id_match = 0;
-		while(ptr != NULL && !id_match){
-			if(ptr->mb_entry->content.notice.msgid == msgid){
-				ptr->mb_entry->body = body;
-				ptr->mb_entry->length = length;
-				MESSAGE msg = {msgid, from};
-				memcpy(&(ptr->mb_entry->content.message), &msg, sizeof(MESSAGE));
-				id_match = 1;
-			}
-			ptr = ptr->next;
-		}
-
-		debug("id_match: %d \n", id_match);
-
-		if(!id_match){
-			//append the message node to the head
-
-			//allocate the new node
-			MB_NODE* new_node = make_new_node(msgid, body, length);
-
-			//copy the message into the entry
-			MESSAGE msg ;
-			msg.msgid = msgid;
-			msg.from = from;
-			new_node->mb_entry->content.message = msg;
-
+	MB_BATCH_MESSAGE msg = {msgid, from, body, length};
+	if(mb_add_messages(mb, &msg, 1) < 0){
+		//the caller no longer owns these, so they are dropped here
+		free(body);
+		if(from != NULL)
+			mb_unref(from);
+	}
+}
 
-		
-		debug("id_match: %d \n", id_match);
-		
-			
-			//Append node to tail
-			if(mb->head == NULL){
-				new_node->next = mb->head;
+/*
+ * Add several messages to the end of the mailbox queue at once.
+ */
+int mb_add_messages(MAILBOX *mb, MB_BATCH_MESSAGE *msgs, int count){
+	//allocate outside the lock, the queue only needs it for the linking
+	MB_NODE* nodes[count > 0 ? count : 1];
+	for(int i = 0; i < count; i++){
+		nodes[i] = make_new_node(msgs[i].msgid, msgs[i].body, msgs[i].length);
+		nodes[i]->mb_entry->type = MESSAGE_ENTRY_TYPE;
+		//copy the message into the entry
+		MESSAGE msg;
+		msg.msgid = msgs[i].msgid;
+		msg.from = msgs[i].from;
+		nodes[i]->mb_entry->content.message = msg;
+	}
 
-				mb->head = new_node;
-				mb->tail = new_node;
-			}
-			else{
-				mb->tail->next = mb->head;
-				mb->tail = new_node;
-			}
-			sem_post(&mb->mutex);
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	int accepted = !mb->is_defunct;
+	int flush = 0;
+	if(accepted){
+		//once the data lane has spilled, what comes after must follow it into the file
+		if(mb->spill_count > 0 || mb->spill_queued > 0){
+			for(int i = 0; i < count; i++)
+				mb_queue_node(mb, nodes[i]);
+			flush = !mb->spill_writing && !mb->spill_stalled;
+			mb->spill_writing |= flush;
+		}
+		else{
+			for(int i = 0; i < count; i++)
+				mb_append_node(mb, nodes[i]);
+		}
+		if(mb_ttl_ms > 0 && !mb->ttl_armed){
+			mb->ttl_armed = 1;
+			timer_schedule(&mb->ttl, mb_ttl_ms);
 		}
+	}
+	int efd = mb->efd;
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
 
+	debug("enqueued %d message(s), accepted: %d", count, accepted);
 
-		debug("id_match: %d \n", id_match);
+	if(!accepted){
+		//nobody will dequeue these, so ownership goes back to the caller
+		for(int i = 0; i < count; i++){
+			free(nodes[i]->mb_entry);
+			free(nodes[i]);
+		}
+		return -1;
+	}
+	atomic_fetch_add_explicit(&mb_queued, count, memory_order_relaxed);
+	for(int i = 0; i < count; i++){
+		sem_post(&mb->mutex);
 	}
-	
-	sem_post(&mutex2);
+	mb_poke(efd);
+	if(flush)
+		mb_spill_flush(mb);
+	if(mb_over_budget())
+		mb_spill_cold();
+	return 0;
 }
 
 /*
@@ -231,73 +491,148 @@ void mb_add_message(MAILBOX *mb, int msgid, MAILBOX *from, void *body, int lengt
  * this notice from the mailbox.
  */
 void mb_add_notice(MAILBOX *mb, NOTICE_TYPE ntype, int msgid, void *body, int length){
-	sem_wait(&mutex2);
-	if(!mb->is_defunct){
-		//adding the info to an appropraitely existing node.
-		MB_NODE* ptr = mb->head;
-		int id_match = 0;
-
-		while(ptr != NULL && !id_match){
-			if(ptr->mb_entry->content.message.msgid == msgid){
-				ptr->mb_entry->body = body;
-				ptr->mb_entry->length = length;
-				NOTICE notice = {ntype, msgid};
-				memcpy(&(ptr->mb_entry->content.notice), &notice, sizeof(NOTICE));
-				id_match = 1;
-			}
-			ptr = ptr->next;
-		}
-
-
-		
-		debug("id_match: %d \n", id_match);
-
-		if(!id_match){
-			MB_NODE* new_node = make_new_node(msgid, body, length);
-
-
-			
-			NOTICE notice;
-			notice.type = ntype;
-			notice.msgid = msgid;
-
-			new_node->mb_entry->content.notice = notice;
-
-			//Append Node to tail
-			if(mb->head == NULL){
-				new_node->next = mb->head;
-				mb->head = new_node;
-				mb->tail = new_node;
-			}
-			else{
-				mb->tail->next = mb->head;
-				mb->tail = new_node;
-			}
-
-
-
-			//sem_post(&mb->mutex);
-		}
+	MB_NODE* new_node = make_new_node(msgid, body, length);
+	new_node->mb_entry->type = NOTICE_ENTRY_TYPE;
+
+	NOTICE notice;
+	notice.type = ntype;
+	notice.msgid = msgid;
+	new_node->mb_entry->content.notice = notice;
+
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	int accepted = !mb->is_defunct;
+	if(accepted){
+		mb_append_node(mb, new_node);
 	}
+	int efd = mb->efd;
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
 
-	
-
-	sem_post(&mutex2);
+	if(accepted){
+		atomic_fetch_add_explicit(&mb_queued, 1, memory_order_relaxed);
+		sem_post(&mb->mutex);
+		mb_poke(efd);
+	}
+	else{
+		free(body);
+		free(new_node->mb_entry);
+		free(new_node);
+	}
 }
 
 MB_NODE* make_new_node(int msgid, void* body, int length){
-	sem_wait(&mutex3);
+	//malloc is thread safe, so this needs no lock
 	MB_NODE* new_node = malloc(sizeof(MB_NODE));
 	new_node->msgid = msgid;
+	new_node->enqueued_ms = mb_ttl_ms > 0 ? timer_now_ms() : 0;
+	new_node->next = NULL;
 
 	//allocate and assign the entry's info
 	new_node->mb_entry = malloc(sizeof(MAILBOX_ENTRY));
 	new_node->mb_entry->body = body;
 	new_node->mb_entry->length = length;
-	sem_post(&mutex3);
 	return new_node;
 }
 
+/*
+	Links a node onto the tail of its lane: notices go in the control
+	lane, messages in the data lane.  Caller must hold mb->lock.
+*/
+void mb_append_node(MAILBOX* mb, MB_NODE* node){
+	MB_LANE* lane = &mb->lanes[node->mb_entry->type == NOTICE_ENTRY_TYPE ? MB_CONTROL : MB_DATA];
+	atomic_fetch_add_explicit(&mb_resident, mb_node_cost(node), memory_order_relaxed);
+	if(lane == &mb->lanes[MB_DATA])
+		atomic_fetch_add_explicit(&mb->data_resident, 1, memory_order_relaxed);
+	node->next = NULL;
+	if(lane->head == NULL){
+		lane->head = node;
+		lane->tail = node;
+	}
+	else{
+		lane->tail->next = node;
+		lane->tail = node;
+	}
+}
+
+/*
+	Unlinks the head of a lane, if any, and takes it off the books.
+	Caller must hold mb->lock.
+*/
+MB_NODE* mb_unlink_head(MAILBOX* mb, MB_LANE* lane){
+	MB_NODE* node = lane->head;
+	if(node != NULL){
+		lane->head = node->next;
+		if(lane->head == NULL)
+			lane->tail = NULL;
+		node->next = NULL;
+		atomic_fetch_sub_explicit(&mb_resident, mb_node_cost(node), memory_order_relaxed);
+		if(lane == &mb->lanes[MB_DATA])
+			atomic_fetch_sub_explicit(&mb->data_resident, 1, memory_order_relaxed);
+	}
+	return node;
+}
+
+/*
+	The bytes an entry holds in memory.
+*/
+long mb_node_cost(MB_NODE* node){
+	return sizeof(MB_NODE) + sizeof(MAILBOX_ENTRY) + node->mb_entry->length;
+}
+
+/*
+	The first message of the data lane, read back from the spill file if
+	the part in memory has run out, or taken from the spill queue once
+	the file is empty.  If the next messages are being written to the
+	file, waits for them to get there, letting go of mb->lock meanwhile.
+	Caller must hold mb->lock.
+*/
+MB_NODE* mb_data_head(MAILBOX* mb){
+	MB_LANE* data = &mb->lanes[MB_DATA];
+	while(data->head == NULL && mb->spill_count == 0 && mb->spill_writing){
+		BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+		sched_yield();
+		BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	}
+	if(data->head == NULL && mb->spill_count > 0)
+		mb_spill_read(mb);
+	else if(data->head == NULL && mb->spill_queue.head != NULL)
+		mb_unqueue(mb);
+	return data->head;
+}
+
+/*
+	Whether there is anything in the mailbox, spilled or not.
+	Caller must hold mb->lock.
+*/
+int mb_has_entries(MAILBOX* mb){
+	return mb->lanes[MB_CONTROL].head != NULL || mb->lanes[MB_DATA].head != NULL
+		|| mb->spill_count > 0 || mb->spill_queued > 0;
+}
+
+/*
+	Unlinks the node that goes out next: the head of the control lane,
+	unless BVD_MB_CONTROL_BURST control entries in a row have gone out
+	while messages waited, in which case one message goes first.
+	Returns NULL if both lanes are empty.  Caller must hold mb->lock.
+*/
+MB_NODE* mb_pop_node(MAILBOX* mb){
+	MB_LANE* control = &mb->lanes[MB_CONTROL];
+	MB_LANE* data = &mb->lanes[MB_DATA];
+	MB_LANE* lane;
+	mb_data_head(mb);
+	if(control->head != NULL && (data->head == NULL || mb->control_streak < BVD_MB_CONTROL_BURST)){
+		lane = control;
+		mb->control_streak = data->head == NULL ? 0 : mb->control_streak + 1;
+	}
+	else{
+		lane = data;
+		mb->control_streak = 0;
+	}
+	MB_NODE* node = mb_unlink_head(mb, lane);
+	if(node != NULL && mb_budget_mb > 0)
+		atomic_store_explicit(&mb->last_taken_ms, timer_now_ms(), memory_order_relaxed);
+	return node;
+}
+
 /*
  * Remove the first entry from the mailbox, blocking until there is
  * one.  The caller assumes the responsibility of freeing the entry
@@ -310,25 +645,584 @@ MB_NODE* make_new_node(int msgid, void* body, int length){
  * that service should be terminated.
  */
 MAILBOX_ENTRY *mb_next_entry(MAILBOX *mb){
-	sem_wait(&mb->mutex);
+	mb_wait(mb, NULL);
+	return mb_dequeue(mb);
+}
+
+/*
+ * Remove the first entry from the mailbox, like mb_next_entry(), but
+ * give up waiting at the absolute (CLOCK_REALTIME) time abstime.
+ */
+MAILBOX_ENTRY *mb_next_entry_timed(MAILBOX *mb, const struct timespec *abstime){
+	if(mb_wait(mb, abstime) < 0)
+		return NULL; //errno is ETIMEDOUT
+	return mb_dequeue(mb);
+}
+
+/*
+ * Remove the first entries from the mailbox at once.
+ */
+int mb_next_entries(MAILBOX *mb, MAILBOX_ENTRY **entries, int max, long max_bytes, const struct timespec *abstime){
+	if(mb_wait(mb, abstime) < 0)
+		return -1; //errno is ETIMEDOUT
+	//the token taken is for the first entry; the others each bring their own
+	int count = 0;
+	long bytes = 0;
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	if(mb->is_defunct || mb->is_interrupted){
+		errno = mb->is_defunct ? ESHUTDOWN : EINTR;
+		//leave a token behind so that any later call also returns
+		sem_post(&mb->mutex);
+		BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+		return -1;
+	}
+	do{
+		MB_NODE* node = mb_pop_node(mb);
+		entries[count++] = node->mb_entry;
+		bytes += node->mb_entry->length;
+		free(node);
+	}while(count < max && bytes < max_bytes && mb_has_entries(mb) && sem_trywait(&mb->mutex) == 0);
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+	atomic_fetch_sub_explicit(&mb_queued, count, memory_order_relaxed);
+	metrics_add(METRIC_MB_BATCHES, 1);
+	metrics_add(METRIC_MB_BATCHED, count);
+	return count;
+}
+
+/*
+	Takes a token from mb->mutex, waiting for one if there is none: by
+	spinning, then yielding, if entries have lately come that soon, and
+	then asleep, until abstime unless it is NULL.  The wait is folded
+	into the mailbox's running average, which sets how long the next one
+	spins.  Only the thread servicing the mailbox waits on it.
+	Returns 0, or -1 with errno set to ETIMEDOUT.
+*/
+int mb_wait(MAILBOX* mb, const struct timespec* abstime){
+	if(sem_trywait(&mb->mutex) == 0)
+		return 0;
+	long start = mb_spin_nsec > 0 ? metrics_now_nsec() : 0;
+	METRIC how = METRIC_MB_WAIT_PARKED;
+	if(mb_spin_nsec > 0 && mb->wait_avg_nsec * 2 <= mb_spin_nsec){
+		long budget = mb->wait_avg_nsec * 2 > BVD_MB_SPIN_MIN_NSEC ? mb->wait_avg_nsec * 2 : BVD_MB_SPIN_MIN_NSEC;
+		how = mb_spin(mb, start, budget);
+	}
+	if(how == METRIC_MB_WAIT_PARKED){
+		while((abstime == NULL ? sem_wait(&mb->mutex) : sem_timedwait(&mb->mutex, abstime)) < 0){
+			if(errno != EINTR)
+				return -1;
+		}
+	}
+	if(mb_spin_nsec > 0){
+		long waited = metrics_now_nsec() - start;
+		//a long wait only has to say that waits are long
+		if(waited > mb_spin_nsec * 4)
+			waited = mb_spin_nsec * 4;
+		mb->wait_avg_nsec += (waited - mb->wait_avg_nsec) / 8;
+	}
+	metrics_add(how, 1);
+	return 0;
+}
+
+/*
+	Looks for a token with sem_trywait(), which the poster only makes a
+	system call for when somebody sleeps on the semaphore: every
+	BVD_MB_SPIN_PAUSES pauses for budget nanoseconds from start (on more
+	than one CPU), then after each of BVD_MB_SPIN_YIELDS sched_yield()s.
+	Returns how it got one, or METRIC_MB_WAIT_PARKED if it did not.
+*/
+METRIC mb_spin(MAILBOX* mb, long start, long budget){
+	if(mb_num_cpus > 1){
+		while(metrics_now_nsec() - start < budget){
+			for(int i = 0; i < BVD_MB_SPIN_PAUSES; i++)
+				MB_PAUSE();
+			if(sem_trywait(&mb->mutex) == 0)
+				return METRIC_MB_WAIT_SPUN;
+		}
+	}
+	for(int i = 0; i < BVD_MB_SPIN_YIELDS; i++){
+		sched_yield();
+		if(sem_trywait(&mb->mutex) == 0)
+			return METRIC_MB_WAIT_YIELDED;
+	}
+	return METRIC_MB_WAIT_PARKED;
+}
+
+/*
+	Takes the head off the queue once the caller has
+	consumed a token from mb->mutex.
+*/
+MAILBOX_ENTRY* mb_dequeue(MAILBOX* mb){
 	//dequeue
-	MAILBOX_ENTRY* return_this;
-	if(mb->is_defunct){
-		return_this = NULL;
+	MAILBOX_ENTRY* return_this = NULL;
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	if(mb->is_defunct || mb->is_interrupted){
+		errno = mb->is_defunct ? ESHUTDOWN : EINTR;
+		//leave a token behind so that any later call also returns NULL
+		sem_post(&mb->mutex);
 	}
 	else{
-		return_this = mb->head->mb_entry;
-		mb->head = mb->head->next;
+		MB_NODE* node = mb_pop_node(mb);
+		if(node != NULL){
+			return_this = node->mb_entry;
+			free(node);
+			atomic_fetch_sub_explicit(&mb_queued, 1, memory_order_relaxed);
+		}
 	}
-	sem_post(&mb->mutex);
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
 	return return_this;
 }
 
+/*
+ * Remove up to max entries from the front of the mailbox without waiting.
+ */
+int mb_take_entries(MAILBOX *mb, MAILBOX_ENTRY **entries, int max){
+	int count = 0;
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	//every entry in the queue has a token, which goes with it
+	while(count < max && mb_has_entries(mb) && sem_trywait(&mb->mutex) == 0){
+		MB_NODE* node = mb_pop_node(mb);
+		entries[count++] = node->mb_entry;
+		free(node);
+	}
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+	atomic_fetch_sub_explicit(&mb_queued, count, memory_order_relaxed);
+	return count;
+}
 
+/*
+ * Get an eventfd that becomes readable whenever an entry is added.
+ */
+int mb_eventfd(MAILBOX *mb){
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	if(mb->efd < 0)
+		mb->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int efd = mb->efd;
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+	return efd;
+}
 
+/*
+	Tells whoever polls the mailbox's eventfd, if anyone, that there is
+	something new.
+*/
+void mb_poke(int efd){
+	uint64_t one = 1;
+	if(efd >= 0 && write(efd, &one, sizeof(one)) < 0){
+		//the counter is saturated, which wakes the poller just as well
+	}
+}
 
+/*
+	Timer callback, with a TTL: bounces the messages that have been in
+	the data lane for mb_ttl_ms, through the discard hook as if the mailbox
+	had gone away, and sets the timer for the next one to.  Only entries
+	whose token can be taken are removed, like in mb_take_entries(), so
+	a service thread that is about to dequeue still finds an entry.
+	The timer is stopped in mb_fini() before the mailbox is freed.
+*/
+void mb_expire(void* arg){
+	MAILBOX* mb = arg;
+	long now = timer_now_ms();
+	MB_NODE* expired = NULL;
+	MB_NODE** last = &expired;
+
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	MB_LANE* data = &mb->lanes[MB_DATA];
+	//the lane is in the order the messages came in, so the old ones are in front
+	while(mb_data_head(mb) != NULL && now - data->head->enqueued_ms >= mb_ttl_ms){
+		if(mb->is_defunct || mb->is_interrupted)
+			break; //the extra token is not for an entry
+		if(sem_trywait(&mb->mutex) < 0)
+			break;
+		MB_NODE* node = mb_unlink_head(mb, data);
+		*last = node;
+		last = &node->next;
+		atomic_fetch_sub_explicit(&mb_queued, 1, memory_order_relaxed);
+	}
+	mb->ttl_armed = data->head != NULL && !mb->is_defunct && !mb->is_interrupted;
+	if(mb->ttl_armed)
+		timer_schedule(&mb->ttl, data->head->enqueued_ms + mb_ttl_ms - now);
+	MAILBOX_DISCARD_HOOK* hook = mb->discard_hook;
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+
+	while(expired != NULL){
+		MB_NODE* next = expired->next;
+		MAILBOX_ENTRY* entry = expired->mb_entry;
+		if(hook != NULL)
+			hook(entry);
+		if(entry->content.message.from != NULL)
+			mb_unref(entry->content.message.from);
+		free(entry->body);
+		free(entry);
+		free(expired);
+		metrics_add(METRIC_MB_EXPIRED, 1);
+		expired = next;
+	}
+}
 
+/*
+	Queues a message for the spill file, behind what is in it already.
+	Caller must hold mb->lock.
+*/
+void mb_queue_node(MAILBOX* mb, MB_NODE* node){
+	MB_LANE* queue = &mb->spill_queue;
+	atomic_fetch_add_explicit(&mb_resident, mb_node_cost(node), memory_order_relaxed);
+	atomic_fetch_add_explicit(&mb->spill_queued, 1, memory_order_relaxed);
+	node->next = NULL;
+	if(queue->head == NULL)
+		queue->head = node;
+	else
+		queue->tail->next = node;
+	queue->tail = node;
+}
 
+/*
+	Moves the spill queue onto the data lane, which must be empty, once
+	the file is read back and nothing is being written to it: what is
+	left in the queue could not be written (a stream, or a full disk),
+	and carries on in memory.  Caller must hold mb->lock.
+*/
+void mb_unqueue(MAILBOX* mb){
+	MB_LANE* data = &mb->lanes[MB_DATA];
+	data->head = mb->spill_queue.head;
+	data->tail = mb->spill_queue.tail;
+	mb->spill_queue.head = NULL;
+	mb->spill_queue.tail = NULL;
+	atomic_fetch_add_explicit(&mb->data_resident, mb->spill_queued, memory_order_relaxed);
+	mb->spill_queued = 0;
+	mb->spill_stalled = 0;
+}
 
+/*
+	Creates a spill file in mb_spill_dir, unlinked already.
+	Returns its descriptor, or -1 on error.
+*/
+int mb_spill_open(void){
+	char* dir = mb_spill_dir != NULL ? mb_spill_dir : P_tmpdir;
+	int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if(fd < 0){
+		//a file system without O_TMPFILE
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/bvd_spill_XXXXXX", dir);
+		fd = mkostemp(path, O_CLOEXEC);
+		if(fd < 0){
+			debug("cannot create a spill file in %s: %s", dir, strerror(errno));
+			return -1;
+		}
+		unlink(path);
+	}
+	return fd;
+}
+
+/*
+	Writes a chain of at most MB_SPILL_IOV messages, linked through next,
+	to a spill file at offset at, with one pwritev().  If the file cannot
+	take them all, it is cut back to at.  Needs no lock: the caller is
+	the only thread writing to the file, and nobody reads past at.
+	Returns the bytes written, or -1 on error.
+*/
+ssize_t mb_spill_write(int fd, off_t at, MB_NODE* chain){
+	MB_SPILL_RECORD records[MB_SPILL_IOV];
+	struct iovec iov[2 * MB_SPILL_IOV];
+	int n = 0, nrec = 0;
+	for(MB_NODE* node = chain; node != NULL; node = node->next){
+		MAILBOX_ENTRY* entry = node->mb_entry;
+		MB_SPILL_RECORD* rec = &records[nrec++];
+		memset(rec, 0, sizeof(*rec));
+		rec->msgid = entry->content.message.msgid;
+		rec->length = entry->body != NULL ? entry->length : 0;
+		rec->has_body = entry->body != NULL;
+		rec->enqueued_ms = node->enqueued_ms;
+		rec->from = entry->content.message.from;
+		iov[n].iov_base = rec;
+		iov[n++].iov_len = sizeof(*rec);
+		if(rec->length > 0){
+			iov[n].iov_base = entry->body;
+			iov[n++].iov_len = rec->length;
+		}
+	}
+	//a regular file takes it all unless it cannot, so a short write is an error too
+	size_t want = 0;
+	for(int i = 0; i < n; i++)
+		want += iov[i].iov_len;
+	ssize_t wrote = pwritev(fd, iov, n, at);
+	if(wrote < 0 || (size_t)wrote != want){
+		debug("cannot spill: %s", wrote < 0 ? strerror(errno) : "short write");
+		if(ftruncate(fd, at) < 0){
+			//the records past spill_write are never read anyway
+		}
+		return -1;
+	}
+	return wrote;
+}
+
+/*
+	Writes the spill queue of a mailbox to its spill file, which is
+	created the first time, MB_SPILL_IOV messages at a time and without
+	mb->lock while writing, so that neither the senders nor whoever
+	takes entries out wait for the disk; and frees the messages written.
+	The "from" references go with the records.  Stops at a stream, whose
+	body lives on its sender's stack, or if the disk is full, leaving the
+	rest in memory.  Only one thread writes at a time: the caller set
+	mb->spill_writing under the lock, and it is cleared here.
+	Returns the number of messages written.
+*/
+long mb_spill_flush(MAILBOX* mb){
+	long total = 0;
+	long total_bytes = 0;
+	MB_NODE* written = NULL;
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	MB_LANE* queue = &mb->spill_queue;
+	while(!mb->spill_stalled && queue->head != NULL && !BVD_IS_STREAM(queue->head->mb_entry)){
+		MB_NODE* chain = queue->head;
+		MB_NODE* last = chain;
+		long count = 1;
+		long bytes = mb_node_cost(chain);
+		while(count < MB_SPILL_IOV && last->next != NULL && !BVD_IS_STREAM(last->next->mb_entry)){
+			last = last->next;
+			bytes += mb_node_cost(last);
+			count++;
+		}
+		queue->head = last->next;
+		if(queue->head == NULL)
+			queue->tail = NULL;
+		last->next = NULL;
+		int fd = mb->spill_fd;
+		off_t at = mb->spill_write;
+		BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+
+		if(fd < 0)
+			fd = mb_spill_open();
+		ssize_t wrote = fd >= 0 ? mb_spill_write(fd, at, chain) : -1;
+
+		BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+		mb->spill_fd = fd;
+		if(wrote < 0){
+			last->next = queue->head;
+			queue->head = chain;
+			if(queue->tail == NULL)
+				queue->tail = last;
+			mb->spill_stalled = 1;
+			metrics_add(METRIC_MB_SPILL_FAILED, 1);
+			break;
+		}
+		mb->spill_write = at + wrote;
+		atomic_fetch_add_explicit(&mb->spill_count, count, memory_order_relaxed);
+		atomic_fetch_sub_explicit(&mb->spill_queued, count, memory_order_relaxed);
+		atomic_fetch_sub_explicit(&mb_resident, bytes, memory_order_relaxed);
+		last->next = written;
+		written = chain;
+		total += count;
+		total_bytes += wrote;
+	}
+	mb->spill_writing = 0;
+	mb_spill_close(mb);
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+
+	metrics_add(METRIC_MB_SPILLED, total);
+	metrics_add(METRIC_MB_SPILLED_BYTES, total_bytes);
+	while(written != NULL){
+		MB_NODE* next = written->next;
+		free(written->mb_entry->body);
+		free(written->mb_entry);
+		free(written);
+		written = next;
+	}
+	return total;
+}
+
+/*
+	Reads the next BVD_MB_SPILL_CHUNK bytes of records (at least one
+	record) back from the spill file onto the data lane, which must be
+	empty, and closes the file once it is all read and nothing is being
+	written to it.  The file is ours
+	alone, so failing to read it back means the disk failed under it,
+	and the messages in it cannot be given up quietly: the server exits.
+	Caller must hold mb->lock.
+*/
+void mb_spill_read(MAILBOX* mb){
+	size_t want = mb->spill_write - mb->spill_read;
+	if(want > BVD_MB_SPILL_CHUNK)
+		want = BVD_MB_SPILL_CHUNK;
+	char* chunk = malloc(want);
+	ssize_t got = pread(mb->spill_fd, chunk, want, mb->spill_read);
+	if(got < (ssize_t)sizeof(MB_SPILL_RECORD)){
+		perror("Error: cannot read a mailbox spill file back");
+		exit(EXIT_FAILURE);
+	}
 
+	size_t at = 0;
+	long count = 0;
+	//a body read on its own takes at past got, which ends the chunk
+	while(mb->spill_count > 0 && at + sizeof(MB_SPILL_RECORD) <= (size_t)got){
+		MB_SPILL_RECORD rec;
+		memcpy(&rec, chunk + at, sizeof(rec));
+		void* body = NULL;
+		if(rec.has_body){
+			body = malloc(rec.length > 0 ? rec.length : 1);
+			if(got - at - sizeof(rec) >= (size_t)rec.length){
+				memcpy(body, chunk + at + sizeof(rec), rec.length);
+			}
+			else if(count > 0){
+				free(body); //the next batch starts with it
+				break;
+			}
+			else if(pread(mb->spill_fd, body, rec.length, mb->spill_read + sizeof(rec)) != rec.length){
+				//a body bigger than the chunk, read on its own
+				perror("Error: cannot read a mailbox spill file back");
+				exit(EXIT_FAILURE);
+			}
+		}
+		MB_NODE* node = make_new_node(rec.msgid, body, rec.length);
+		node->enqueued_ms = rec.enqueued_ms;
+		node->mb_entry->type = MESSAGE_ENTRY_TYPE;
+		node->mb_entry->content.message.msgid = rec.msgid;
+		node->mb_entry->content.message.from = rec.from;
+		mb_append_node(mb, node);
+
+		at += sizeof(rec) + rec.length;
+		mb->spill_read += sizeof(rec) + rec.length;
+		atomic_fetch_sub_explicit(&mb->spill_count, 1, memory_order_relaxed);
+		count++;
+	}
+	free(chunk);
+	metrics_add(METRIC_MB_UNSPILLED, count);
+	mb_spill_close(mb);
+}
 
+/*
+	Closes the spill file once there is nothing in it and nobody writing
+	to it.  Caller must hold mb->lock.
+*/
+void mb_spill_close(MAILBOX* mb){
+	if(mb->spill_fd >= 0 && mb->spill_count == 0 && !mb->spill_writing){
+		close(mb->spill_fd);
+		mb->spill_fd = -1;
+		mb->spill_read = 0;
+		mb->spill_write = 0;
+	}
+}
+
+/*
+	Whether the entries in memory are over the budget, if there is one.
+*/
+int mb_over_budget(void){
+	return mb_budget_mb > 0 && atomic_load_explicit(&mb_resident, memory_order_relaxed) > mb_budget_mb * 1048576L;
+}
+
+/*
+	Once the entries in memory go over the budget, spills the tails of
+	the data lanes of the mailboxes whose owners took anything out
+	longest ago until they are down to BVD_MB_SPILL_LOW percent of it.
+	One thread does it at a time; the others carry on meanwhile.
+*/
+void mb_spill_cold(void){
+	int idle = 0;
+	if(timer_now_ms() < atomic_load_explicit(&mb_spill_retry_ms, memory_order_relaxed)
+		|| !atomic_compare_exchange_strong(&mb_spilling, &idle, 1))
+		return;
+	long low = mb_budget_mb * 1048576L / 100 * BVD_MB_SPILL_LOW;
+	while(atomic_load_explicit(&mb_resident, memory_order_relaxed) > low){
+		MAILBOX* victims[BVD_MB_SPILL_VICTIMS];
+		int n = mb_find_cold(victims, BVD_MB_SPILL_VICTIMS);
+		long spilled = 0;
+		for(int i = 0; i < n; i++){
+			if(atomic_load_explicit(&mb_resident, memory_order_relaxed) > low)
+				spilled += mb_spill_tail(victims[i]);
+			mb_unref(victims[i]);
+		}
+		if(spilled == 0){
+			//nothing left to spill, or the disk is full: do not scan on every message
+			atomic_store_explicit(&mb_spill_retry_ms, timer_now_ms() + BVD_MB_SPILL_RETRY_MS, memory_order_relaxed);
+			//but look again then even if no message comes
+			if(!mb_spill_timer_ready){
+				timer_setup(&mb_spill_timer, mb_spill_retry, NULL);
+				mb_spill_timer_ready = 1;
+			}
+			timer_schedule(&mb_spill_timer, BVD_MB_SPILL_RETRY_MS);
+			break;
+		}
+	}
+	atomic_store(&mb_spilling, 0);
+}
+
+/*
+	Timer callback, BVD_MB_SPILL_RETRY_MS after a scan found nothing to
+	spill: scans again if the entries in memory are still over the budget.
+*/
+void mb_spill_retry(void* arg){
+	if(mb_over_budget())
+		mb_spill_cold();
+}
+
+/*
+	Finds up to max of the coldest mailboxes with a tail to spill, and
+	takes a reference to each, coldest first.  The counters looked at
+	are read without the mailboxes' locks, which is good enough for
+	picking.  Returns how many were found.
+*/
+int mb_find_cold(MAILBOX** victims, int max){
+	long taken[max];
+	int n = 0;
+	BVD_LOCK(LOCK_MB_REGISTRY, &mutex2);
+	for(MAILBOX* mb = mb_all; mb != NULL; mb = mb->next_mb){
+		if(atomic_load_explicit(&mb->data_resident, memory_order_relaxed) <= BVD_MB_SPILL_KEEP
+			|| atomic_load_explicit(&mb->spill_count, memory_order_relaxed) > 0
+			|| atomic_load_explicit(&mb->spill_queued, memory_order_relaxed) > 0)
+			continue;
+		long t = atomic_load_explicit(&mb->last_taken_ms, memory_order_relaxed);
+		if(n == max && t >= taken[n - 1])
+			continue;
+		int i = n < max ? n++ : n - 1;
+		for(; i > 0 && taken[i - 1] > t; i--){
+			victims[i] = victims[i - 1];
+			taken[i] = taken[i - 1];
+		}
+		victims[i] = mb;
+		taken[i] = t;
+	}
+	//a mailbox is unlinked under mutex2 before it is freed, but it may be on its way there
+	int kept = 0;
+	for(int i = 0; i < n; i++){
+		BVD_LOCK(LOCK_MAILBOX, &victims[i]->lock);
+		if(victims[i]->ref_cnt > 0){
+			victims[i]->ref_cnt += 1;
+			victims[kept++] = victims[i];
+		}
+		BVD_UNLOCK(LOCK_MAILBOX, &victims[i]->lock);
+	}
+	BVD_UNLOCK(LOCK_MB_REGISTRY, &mutex2);
+	return kept;
+}
+
+/*
+	Spills the data lane of a mailbox but for its first BVD_MB_SPILL_KEEP
+	messages and anything up to its last stream, unless it has spilled
+	already.  Returns the number of messages spilled.
+*/
+long mb_spill_tail(MAILBOX* mb){
+	BVD_LOCK(LOCK_MAILBOX, &mb->lock);
+	MB_LANE* data = &mb->lanes[MB_DATA];
+	MB_NODE* keep = NULL; //the last node that stays
+	int i = 0;
+	for(MB_NODE* node = data->head; node != NULL; node = node->next){
+		if(++i <= BVD_MB_SPILL_KEEP || BVD_IS_STREAM(node->mb_entry))
+			keep = node;
+	}
+	int spill = !mb->is_defunct && mb->spill_count == 0 && mb->spill_queued == 0 && keep != NULL && keep->next != NULL;
+	if(spill){
+		//the tail goes behind what stays, through the spill queue
+		mb->spill_queue.head = keep->next;
+		mb->spill_queue.tail = data->tail;
+		keep->next = NULL;
+		data->tail = keep;
+		long count = 0;
+		for(MB_NODE* node = mb->spill_queue.head; node != NULL; node = node->next)
+			count++;
+		atomic_fetch_sub_explicit(&mb->data_resident, count, memory_order_relaxed);
+		atomic_fetch_add_explicit(&mb->spill_queued, count, memory_order_relaxed);
+		mb->spill_writing = 1;
+	}
+	BVD_UNLOCK(LOCK_MAILBOX, &mb->lock);
+	return spill ? mb_spill_flush(mb) : 0;
+}
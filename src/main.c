@@ -4,19 +4,37 @@
 #include <string.h>
 #include <signal.h> // sigaction(), sigsuspend(), sig*()
 #include <pthread.h>
+#include <poll.h>
+#include <errno.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 
 #include "debug.h"
 #include "server.h"
+#include "server_ext.h"
 #include "directory.h"
 #include "thread_counter.h"
 #include "protocol.h"
+#include "protocol_ext.h"
+#include "stream.h"
+#include "handoff.h"
+#include "cluster.h"
+#include "shard.h"
+#include "outq.h"
+#include "ratelimit.h"
+#include "admit.h"
+#include "trace.h"
+#include "timer.h"
+#include "mailbox_ext.h"
+#include "history.h"
+#include "hot.h"
 
 
 static void terminate(int sig);
 void *thread(void *vargp);
 int open_listenfd(int port);
+int open_unixfd(char* path);
 
 
 
@@ -29,8 +47,15 @@ int main(int argc, char* argv[]) {
 	int c = 0;
 	int port = -1;
 	char* hostname = NULL;
-	int qFlag = 0;
-	while((c = getopt(argc, argv, "p:q:h:")) != -1){
+	int qFlag __attribute__((unused)) = 0; //only shown when debugging
+	int upgradable = 0;
+	int resume_fd = -1;
+	char* cluster_nodes = NULL;
+	int cluster_self = -1;
+	int num_shards = -1;
+	char* unix_path = NULL;
+	char* history_path = NULL;
+	while((c = getopt(argc, argv, "p:q:h:m:l:UR:C:N:S:W:O:MI:K:T:L:H:A:X:x:u:B:D:Y:y:P:")) != -1){
 		if(c == 'p'){
 			sscanf(optarg, "%d", &port);
 		}
@@ -41,10 +66,84 @@ int main(int argc, char* argv[]) {
 		if(c == 'q'){
 			qFlag = 1;
 		}
+		if(c == 'm'){ //largest payload that is buffered in memory
+			sscanf(optarg, "%u", &proto_max_payload);
+		}
+		if(c == 'l'){ //SENDs at least this large are streamed
+			sscanf(optarg, "%u", &bvd_stream_min);
+		}
+		if(c == 'U'){ //hot restart on SIGUSR2, see handoff.h
+			upgradable = 1;
+		}
+		if(c == 'R'){ //take over from the process that started us
+			sscanf(optarg, "%d", &resume_fd);
+		}
+		if(c == 'C'){ //host:port of every node of the cluster, see cluster.h
+			cluster_nodes = optarg;
+		}
+		if(c == 'N'){ //which of them we are
+			sscanf(optarg, "%d", &cluster_self);
+		}
+		if(c == 'W'){ //disconnect a client that reads nothing for this long (ms), see outq.h
+			sscanf(optarg, "%d", &outq_deadline_ms);
+		}
+		if(c == 'O'){ //or that has this many bytes waiting for it
+			sscanf(optarg, "%zu", &outq_limit);
+		}
+		if(c == 'I'){ //disconnect a client that sends nothing for this long (ms), see server_ext.h
+			sscanf(optarg, "%d", &bvd_idle_timeout_ms);
+		}
+		if(c == 'K'){ //heartbeat clients that are quiet for this long (ms)
+			sscanf(optarg, "%d", &bvd_heartbeat_ms);
+		}
+		if(c == 'T'){ //bounce messages that wait in a mailbox this long (ms), see mailbox_ext.h
+			sscanf(optarg, "%d", &mb_ttl_ms);
+		}
+		if(c == 'M'){ //one thread per connection instead of two, see server_ext.h
+			bvd_merged_service = 1;
+		}
+		if(c == 'S'){ //one shard per core, see shard.h; 0 for as many as there are cores
+			sscanf(optarg, "%d", &num_shards);
+		}
+		if(c == 'L' && rate_parse(optarg, &rate_conn_limit) < 0){ //packets[,bytes] a second per connection, see ratelimit.h
+			fprintf(stderr, "Error: bad rate limit %s\n", optarg);
+			exit(EXIT_FAILURE);
+		}
+		if(c == 'H' && rate_parse(optarg, &rate_handle_limit) < 0){ //and per handle
+			fprintf(stderr, "Error: bad rate limit %s\n", optarg);
+			exit(EXIT_FAILURE);
+		}
+		if(c == 'A' && admit_parse(optarg) < 0){ //threads,queued,rss_mb past which newcomers are turned away, see admit.h
+			fprintf(stderr, "Error: bad admission limits %s\n", optarg);
+			exit(EXIT_FAILURE);
+		}
+		if((c == 'X' || c == 'x') && trace_open(optarg, c == 'x') < 0){ //write a trace of what clients send, see trace.h
+			perror("Error: cannot write the trace");
+			exit(EXIT_FAILURE);
+		}
+		if(c == 'u'){ //listen on this Unix-domain socket as well, see shm.h
+			unix_path = optarg;
+		}
+		if(c == 'B'){ //keep mailboxes to this many MB in memory, spilling the rest, see mailbox_ext.h
+			sscanf(optarg, "%ld", &mb_budget_mb);
+		}
+		if(c == 'D'){ //in this directory
+			mb_spill_dir = optarg;
+		}
+		if(c == 'P'){ //spin up to this many ns for a mailbox entry before sleeping, see mailbox_ext.h
+			sscanf(optarg, "%ld", &mb_spin_nsec);
+		}
+		if(c == 'Y'){ //keep the messages sent here in this directory, see history.h
+			history_path = optarg;
+		}
+		if(c == 'y'){ //in at most this many segments
+			sscanf(optarg, "%d", &history_max_segments);
+		}
 	}
 	debug("Port: %d\n", port);
 	debug("hostname: %s\n", hostname);
 	debug("qFlag: %d\n", qFlag);
+	debug("max payload: %u, stream from: %u\n", proto_max_payload, bvd_stream_min);
 
 
 	//Set up SIGHUP Handler
@@ -56,12 +155,40 @@ int main(int argc, char* argv[]) {
 		perror("Error: cannot handle SIGHUP");
 	}
 
+	//a peer that went away must cost a failed write, not the server
+	signal(SIGPIPE, SIG_IGN);
+
 
 
 	// Perform required initializations of the thread counter and directory.
 	thread_counter = tcnt_init();
 	dir_init();
 
+	if(cluster_nodes != NULL && cluster_init(cluster_nodes, cluster_self) < 0){
+		fprintf(stderr, "Error: bad cluster node list or node index\n");
+		exit(EXIT_FAILURE);
+	}
+	if(timer_init() < 0){
+		perror("Error: cannot set up the timers");
+		exit(EXIT_FAILURE);
+	}
+	if(outq_init() < 0){
+		perror("Error: cannot start the writer thread");
+		exit(EXIT_FAILURE);
+	}
+	admit_init();
+	hot_init();
+	if(history_path != NULL && history_init(history_path) < 0){
+		perror("Error: cannot keep the history");
+		exit(EXIT_FAILURE);
+	}
+	if(num_shards >= 0 && shard_init(num_shards) < 0){
+		fprintf(stderr, "Error: cannot start the shards\n");
+		exit(EXIT_FAILURE);
+	}
+	if(upgradable && handoff_init(argv) < 0){
+		perror("Error: cannot enable hot restart");
+	}
 
 	socklen_t clientlen = sizeof(struct sockaddr);
 	struct sockaddr_in clientaddr;
@@ -69,10 +196,49 @@ int main(int argc, char* argv[]) {
 
 	int *connfdp;
 
-	int listenfd = open_listenfd(port);
+	int listenfd;
+	if(resume_fd >= 0)
+		listenfd = handoff_resume(resume_fd);
+	else
+		listenfd = open_listenfd(port);
+	if(listenfd < 0){
+		perror("Error: cannot listen");
+		exit(EXIT_FAILURE);
+	}
+	//not handed over by a hot restart: the new process binds the path again
+	int unixfd = -1;
+	if(unix_path != NULL && (unixfd = open_unixfd(unix_path)) < 0){
+		perror("Error: cannot listen on the Unix-domain socket");
+		exit(EXIT_FAILURE);
+	}
 	while(1){
+		int fd = listenfd;
+		if(handoff_trigger_fd >= 0 || unixfd >= 0){
+			struct pollfd pfd[3] = {{listenfd, POLLIN, 0}, {unixfd, POLLIN, 0}, {handoff_trigger_fd, POLLIN, 0}};
+			if(poll(pfd, 3, -1) < 0)
+				continue;
+			if(pfd[2].revents){
+				handoff_begin(listenfd); //returns only if we carry on
+				continue;
+			}
+			if(!pfd[0].revents)
+				fd = unixfd;
+		}
 		connfdp = (int*)malloc(sizeof(int));
-		*connfdp = accept(listenfd, ((struct sockaddr*) (&clientaddr)), &clientlen);
+		if(fd == unixfd)
+			*connfdp = accept(unixfd, NULL, NULL);
+		else
+			*connfdp = accept(listenfd, ((struct sockaddr*) (&clientaddr)), &clientlen);
+		if(*connfdp < 0){
+			free(connfdp);
+			continue;
+		}
+		if(admit_overloaded()){
+			admit_refuse(*connfdp);
+			free(connfdp);
+			continue;
+		}
+		handoff_client_started();
 		pthread_create(&tid, NULL, thread, connfdp);
 	}
 
@@ -110,6 +276,33 @@ int open_listenfd(int port){
 }
 
 
+int open_unixfd(char* path){
+
+	int unixfd;
+	struct sockaddr_un addr;
+
+	if(strlen(path) >= sizeof(addr.sun_path)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if((unixfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	//whatever an earlier run left behind
+	unlink(path);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if(bind(unixfd, ((struct sockaddr*) (&addr)), sizeof(addr)) < 0)
+		return -1;
+
+	if(listen(unixfd, 1023) < 0)
+		return -1;
+	return unixfd;
+}
+
+
 
 void *thread(void *vargp){
 	int connfd = *((int*)vargp);
@@ -129,6 +322,7 @@ void terminate(int sig) {
 	// Shut down the directory.
 	// This will trigger the eventual termination of service threads.
 	dir_shutdown();
+	trace_finish();
 	
 	debug("Waiting for service threads to terminate...");
 	tcnt_wait_for_zero(thread_counter);
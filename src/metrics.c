@@ -0,0 +1,127 @@
+#include "metrics.h"
+#include "debug.h"
+#include "mailbox_ext.h"
+#include "lockprof.h"
+#include "hot.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+
+//GLOBAL VARIABLES
+atomic_long metrics[NUM_METRICS];
+
+static const char* metric_names[NUM_METRICS] = {
+	[METRIC_LZ_RAW_BYTES] = "lz_raw_bytes",
+	[METRIC_LZ_STORED_BYTES] = "lz_stored_bytes",
+	[METRIC_LZ_COMPRESS_BYTES] = "lz_compress_bytes",
+	[METRIC_LZ_COMPRESS_NSEC] = "lz_compress_nsec",
+	[METRIC_LZ_DECOMPRESS_BYTES] = "lz_decompress_bytes",
+	[METRIC_LZ_DECOMPRESS_NSEC] = "lz_decompress_nsec",
+	[METRIC_LZ_PASSTHROUGH] = "lz_passthrough",
+	[METRIC_SHARD_FORWARDED] = "shard_forwarded",
+	[METRIC_SHARD_BATCHES] = "shard_batches",
+	[METRIC_OUTQ_DEFERRED_BYTES] = "outq_deferred_bytes",
+	[METRIC_OUTQ_DISCONNECTS] = "outq_disconnects",
+	[METRIC_TIMERS_FIRED] = "timers_fired",
+	[METRIC_IDLE_DISCONNECTS] = "idle_disconnects",
+	[METRIC_HEARTBEATS] = "heartbeats",
+	[METRIC_MB_EXPIRED] = "mb_expired",
+	[METRIC_DEDUP_CHECKED] = "dedup_checked",
+	[METRIC_DEDUP_SUPPRESSED] = "dedup_suppressed",
+	[METRIC_RATE_REFUSED] = "rate_refused",
+	[METRIC_ADMIT_OVERLOADS] = "admit_overloads",
+	[METRIC_ADMIT_REFUSED] = "admit_refused",
+	[METRIC_TRACE_DROPPED] = "trace_dropped",
+	[METRIC_MB_SPILLED] = "mb_spilled",
+	[METRIC_MB_SPILLED_BYTES] = "mb_spilled_bytes",
+	[METRIC_MB_UNSPILLED] = "mb_unspilled",
+	[METRIC_MB_SPILL_FAILED] = "mb_spill_failed",
+	[METRIC_MB_BATCHES] = "mb_batches",
+	[METRIC_MB_BATCHED] = "mb_batched",
+	[METRIC_OUTQ_WRITES] = "outq_writes",
+	[METRIC_OUTQ_WRITTEN_PACKETS] = "outq_written_packets",
+	[METRIC_HISTORY_RECORDED] = "history_recorded",
+	[METRIC_HISTORY_BYTES] = "history_bytes",
+	[METRIC_HISTORY_DROPPED] = "history_dropped",
+	[METRIC_HISTORY_READS] = "history_reads",
+	[METRIC_HISTORY_READ_MESSAGES] = "history_read_messages",
+	[METRIC_MB_WAIT_SPUN] = "mb_wait_spun",
+	[METRIC_MB_WAIT_YIELDED] = "mb_wait_yielded",
+	[METRIC_MB_WAIT_PARKED] = "mb_wait_parked",
+};
+
+
+/*
+ * Add v to a counter.
+ */
+void metrics_add(METRIC m, long v){
+	atomic_fetch_add_explicit(&metrics[m], v, memory_order_relaxed);
+}
+
+/*
+ * Read a counter.
+ */
+long metrics_get(METRIC m){
+	return atomic_load_explicit(&metrics[m], memory_order_relaxed);
+}
+
+long metrics_now_nsec(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+	Per-MB cost of some work, 0 if none has been done yet.
+*/
+double metrics_per_mb(METRIC nsec, METRIC bytes){
+	long b = metrics_get(bytes);
+	return b == 0 ? 0 : metrics_get(nsec) / (b / 1048576.0);
+}
+
+/*
+ * Produce the text report of every counter.
+ */
+char *metrics_report(int *length){
+	char* report = NULL;
+	size_t size = 0;
+	FILE* out = open_memstream(&report, &size);
+	for(int i = 0; i < NUM_METRICS; i++){
+		fprintf(out, "%s %ld\r\n", metric_names[i], metrics_get(i));
+	}
+
+	long stored = metrics_get(METRIC_LZ_STORED_BYTES);
+	fprintf(out, "lz_ratio %.3f\r\n",
+		stored == 0 ? 0 : (double)metrics_get(METRIC_LZ_RAW_BYTES) / stored);
+	fprintf(out, "lz_compress_nsec_per_mb %.0f\r\n",
+		metrics_per_mb(METRIC_LZ_COMPRESS_NSEC, METRIC_LZ_COMPRESS_BYTES));
+	fprintf(out, "lz_decompress_nsec_per_mb %.0f\r\n",
+		metrics_per_mb(METRIC_LZ_DECOMPRESS_NSEC, METRIC_LZ_DECOMPRESS_BYTES));
+	long batches = metrics_get(METRIC_SHARD_BATCHES);
+	fprintf(out, "shard_batch_avg %.1f\r\n",
+		batches == 0 ? 0 : (double)metrics_get(METRIC_SHARD_FORWARDED) / batches);
+	long checked = metrics_get(METRIC_DEDUP_CHECKED);
+	fprintf(out, "dedup_suppressed_rate %.4f\r\n",
+		checked == 0 ? 0 : (double)metrics_get(METRIC_DEDUP_SUPPRESSED) / checked);
+	fprintf(out, "mb_resident_bytes %ld\r\n", mb_resident_bytes());
+	long taken = metrics_get(METRIC_MB_BATCHES);
+	fprintf(out, "mb_batch_avg %.1f\r\n",
+		taken == 0 ? 0 : (double)metrics_get(METRIC_MB_BATCHED) / taken);
+	long writes = metrics_get(METRIC_OUTQ_WRITES);
+	fprintf(out, "outq_packets_per_write %.1f\r\n",
+		writes == 0 ? 0 : (double)metrics_get(METRIC_OUTQ_WRITTEN_PACKETS) / writes);
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	fprintf(out, "cpu_usec %ld\r\n",
+		(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+	hot_report(out);
+	lockprof_report(out);
+
+	fclose(out);
+	*length = size;
+	return report;
+}
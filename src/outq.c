@@ -0,0 +1,658 @@
+#include "outq.h"
+#include "protocol_ext.h"
+#include "wire.h"
+#include "shm.h"
+#include "timer.h"
+#include "metrics.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+
+#define OUTQ_EVENTS 64
+#define OUTQ_CONTROL 0	//everything but deliveries
+#define OUTQ_DATA 1	//deliveries
+#define OUTQ_IOV_MAX 1024	//iovecs per write, which is the kernel's limit
+
+
+//STRUCTS
+//A piece of a packet sent while the queue is corked
+typedef struct outq_seg {
+	char* ptr;	//the caller's bytes, or NULL for bytes copied to the stage
+	size_t off;	//where they are in the stage then, which may move as it grows
+	size_t len;
+	int lane;
+	int first;	//starts a packet
+} OUTQ_SEG;
+
+typedef struct outq_lane {
+	char* buf;
+	size_t head, tail, size;	//the pending bytes are buf[head..tail)
+} OUTQ_LANE;
+
+struct outq {
+	int fd;
+	SHM_CONN* shm;	//with a shared-memory transport, what is written to instead of fd
+	int wire;	//what deliveries are written in, see wire.h
+	sem_t lock;
+	OUTQ_LANE lanes[2];
+	size_t data_rest;	//bytes left of a delivery that is partly written
+	long progress_ms;	//when bytes last went out while some were pending
+	BVD_TIMER deadline;	//running while armed, or once was
+	int armed;	//pending, and waiting for EPOLLOUT
+	int registered;	//fd (or the eventfd of the ring) is in the epoll set
+	int flushing;	//the owner is writing the queue out itself
+	int dead;	//disconnected
+	int corked;	//sends are gathered up until outq_uncork()
+	OUTQ_SEG* segs;	//what they sent, in order
+	int num_segs, segs_size;
+	char* stage;	//headers and small payloads of the packets sent while corked
+	size_t stage_len, stage_size;
+	struct outq* next;	//in outq_retired
+};
+
+
+//HELPER FUNCTION DECLARATIONS
+void* outq_writer(void*);
+void outq_write_some(OUTQ*);
+ssize_t outq_write(OUTQ*, struct iovec*, int, int);
+int outq_event_fd(OUTQ*);
+void outq_watch(OUTQ*);
+void outq_deadline_expired(void*);
+void outq_wake(void*);
+void outq_append(OUTQ_LANE*, void*, size_t);
+size_t outq_pending(OUTQ*);
+int outq_iov(OUTQ*, struct iovec*);
+void outq_consume(OUTQ*, size_t);
+void outq_arm(OUTQ*);
+void outq_disarm(OUTQ*);
+void outq_kill(OUTQ*, const char*);
+void outq_stage(OUTQ*, int, void*, size_t, int);
+
+
+//GLOBAL VARIABLES
+int outq_deadline_ms = BVD_OUTQ_DEADLINE_MS;
+size_t outq_limit = BVD_OUTQ_LIMIT;
+int outq_epfd = -1;
+sem_t outq_mutex;	//guards the list below
+OUTQ* outq_retired = NULL;	//closed queues, freed by the writer thread
+BVD_TIMER outq_reaper;	//brings the writer thread round to free them
+
+
+
+/*
+ * Starts the writer thread.
+ */
+int outq_init(void){
+	sem_init(&outq_mutex, 0, 1);
+	timer_setup(&outq_reaper, outq_wake, NULL);
+	outq_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(outq_epfd < 0)
+		return -1;
+	//the timers run here, see timer.h
+	struct epoll_event ev = {EPOLLIN, {.ptr = NULL}};
+	if(epoll_ctl(outq_epfd, EPOLL_CTL_ADD, timer_fd(), &ev) < 0)
+		return -1;
+	pthread_t tid;
+	if(pthread_create(&tid, NULL, outq_writer, NULL) != 0)
+		return -1;
+	pthread_detach(tid);
+	return 0;
+}
+
+/*
+ * Creates the queue of a client socket.
+ */
+OUTQ *outq_open(int fd, int wire){
+	OUTQ* q = calloc(1, sizeof(OUTQ));
+	q->fd = fd;
+	q->wire = wire;
+	sem_init(&q->lock, 0, 1);
+	timer_setup(&q->deadline, outq_deadline_expired, q);
+	struct timeval tv = {outq_deadline_ms / 1000, (outq_deadline_ms % 1000) * 1000};
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	return q;
+}
+
+/*
+ * Creates the queue of a client on a shared-memory transport.
+ */
+OUTQ *outq_open_shm(int fd, SHM_CONN *shm, int wire){
+	OUTQ* q = outq_open(fd, wire);
+	q->shm = shm;
+	shm->write_timeout_ms = outq_deadline_ms;
+	return q;
+}
+
+/*
+ * Send a packet through a queue.
+ */
+int outq_send_packet(OUTQ *q, bvd_packet_header *hdr, void *payload){
+	return outq_send_wire(q, q->wire, hdr, 0, 0, payload);
+}
+
+/*
+ * Send a packet through a queue in the given format.
+ */
+int outq_send_wire(OUTQ *q, int wire, bvd_packet_header *hdr, int flags, uint32_t id, void *payload){
+	struct iovec part = {payload, hdr->payload_length};
+	return outq_send_parts(q, wire, hdr, flags, id, &part, 1);
+}
+
+/*
+ * Send a packet with a payload in parts.
+ */
+int outq_send_parts(OUTQ *q, int wire, bvd_packet_header *hdr, int flags, uint32_t id, struct iovec *parts, int count){
+	size_t length = hdr->payload_length;
+	int lane = hdr->type == BVD_DLVR_PKT ? OUTQ_DATA : OUTQ_CONTROL;
+	char head[BVD_WIRE_MAX_HEADER];
+	size_t head_length = wire_encode_header(wire, hdr, flags, id, head);
+	struct iovec iov[count + 1];
+	iov[0] = (struct iovec){head, head_length};
+	memcpy(iov + 1, parts, count * sizeof(struct iovec));
+
+	sem_wait(&q->lock);
+	if(q->dead){
+		sem_post(&q->lock);
+		errno = EPIPE;
+		return -1;
+	}
+	if(q->corked){
+		for(int i = 0; i <= count; i++)
+			outq_stage(q, lane, iov[i].iov_base, iov[i].iov_len, i == 0);
+		sem_post(&q->lock);
+		return 0;
+	}
+	//nothing ahead of it: try the socket first, which is what usually works
+	size_t sent = 0;
+	if(outq_pending(q) == 0){
+		ssize_t n = outq_write(q, iov, length > 0 ? count + 1 : 1, MSG_DONTWAIT);
+		metrics_add(METRIC_OUTQ_WRITES, 1);
+		metrics_add(METRIC_OUTQ_WRITTEN_PACKETS, 1);
+		if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK){
+			outq_kill(q, "write failed");
+			sem_post(&q->lock);
+			return -1;
+		}
+		sent = n < 0 ? 0 : n;
+	}
+
+	size_t total = head_length + length;
+	if(sent < total){
+		if(outq_pending(q) + total - sent > outq_limit){
+			outq_kill(q, "queue limit");
+			sem_post(&q->lock);
+			return -1;
+		}
+		size_t skip = sent;
+		for(int i = 0; i <= count; i++){
+			if(skip >= iov[i].iov_len){
+				skip -= iov[i].iov_len;
+				continue;
+			}
+			outq_append(&q->lanes[lane], (char*)iov[i].iov_base + skip, iov[i].iov_len - skip);
+			skip = 0;
+		}
+		//a delivery that went out in part has to be finished before anything else
+		if(sent > 0 && lane == OUTQ_DATA)
+			q->data_rest = total - sent;
+		metrics_add(METRIC_OUTQ_DEFERRED_BYTES, total - sent);
+		if(!q->armed && !q->flushing)
+			outq_arm(q);
+	}
+	sem_post(&q->lock);
+	return 0;
+}
+
+/*
+ * Gathers up the packets sent from now on, until outq_uncork().
+ */
+void outq_cork(OUTQ *q){
+	q->corked = 1;
+}
+
+/*
+ * Writes out the packets sent since outq_cork() together.
+ */
+int outq_uncork(OUTQ *q){
+	q->corked = 0;
+	sem_wait(&q->lock);
+	if(q->dead){
+		q->num_segs = 0;
+		q->stage_len = 0;
+		sem_post(&q->lock);
+		errno = EPIPE;
+		return -1;
+	}
+	size_t total = 0;
+	for(int i = 0; i < q->num_segs; i++){
+		if(q->segs[i].ptr == NULL)
+			q->segs[i].ptr = q->stage + q->segs[i].off;
+		total += q->segs[i].len;
+	}
+
+	//nothing ahead of them: as much as the socket takes in one go, which is all of it usually
+	size_t sent = 0;
+	if(outq_pending(q) == 0){
+		struct iovec iov[OUTQ_IOV_MAX];
+		int packets = 0;
+		for(int i = 0; i < q->num_segs; ){
+			int count = 0;
+			size_t want = 0;
+			for(; i < q->num_segs && count < OUTQ_IOV_MAX; i++){
+				iov[count++] = (struct iovec){q->segs[i].ptr, q->segs[i].len};
+				want += q->segs[i].len;
+				packets += q->segs[i].first;
+			}
+			ssize_t n = outq_write(q, iov, count, MSG_DONTWAIT);
+			metrics_add(METRIC_OUTQ_WRITES, 1);
+			if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK){
+				outq_kill(q, "write failed");
+				q->num_segs = 0;
+				q->stage_len = 0;
+				sem_post(&q->lock);
+				return -1;
+			}
+			sent += n < 0 ? 0 : n;
+			if(n < 0 || (size_t)n < want)
+				break;
+		}
+		metrics_add(METRIC_OUTQ_WRITTEN_PACKETS, packets);
+	}
+
+	int ret = 0;
+	if(sent < total){
+		if(outq_pending(q) + total - sent > outq_limit){
+			outq_kill(q, "queue limit");
+			ret = -1;
+		}
+		else{
+			//the rest goes to the lanes, as if it had been sent packet by packet
+			size_t skip = sent;
+			for(int i = 0; i < q->num_segs; ){
+				int j = i + 1;
+				size_t length = q->segs[i].len;
+				while(j < q->num_segs && !q->segs[j].first)
+					length += q->segs[j++].len;
+				if(skip >= length){
+					skip -= length;
+					i = j;
+					continue;
+				}
+				int lane = q->segs[i].lane;
+				//a delivery that went out in part has to be finished before anything else
+				if(skip > 0 && lane == OUTQ_DATA)
+					q->data_rest = length - skip;
+				for(; i < j; i++){
+					if(skip >= q->segs[i].len){
+						skip -= q->segs[i].len;
+						continue;
+					}
+					outq_append(&q->lanes[lane], q->segs[i].ptr + skip, q->segs[i].len - skip);
+					skip = 0;
+				}
+			}
+			metrics_add(METRIC_OUTQ_DEFERRED_BYTES, total - sent);
+			if(!q->armed && !q->flushing)
+				outq_arm(q);
+		}
+	}
+	q->num_segs = 0;
+	q->stage_len = 0;
+	sem_post(&q->lock);
+	return ret;
+}
+
+/*
+ * Writes out everything queued, blocking until it has all gone.
+ */
+int outq_flush(OUTQ *q){
+	sem_wait(&q->lock);
+	if(q->dead){
+		sem_post(&q->lock);
+		return -1;
+	}
+	if(q->armed)
+		outq_disarm(q);
+	q->flushing = 1;
+	sem_post(&q->lock);
+
+	//only the owner adds to the queue, and the writer leaves it alone
+	//while flushing, so the bytes can be written without the lock
+	int ret = 0;
+	while(outq_pending(q) > 0){
+		struct iovec iov[3];
+		ssize_t n = outq_write(q, iov, outq_iov(q, iov), 0);
+		if(n <= 0){
+			ret = -1;
+			break;
+		}
+		outq_consume(q, n);
+	}
+
+	sem_wait(&q->lock);
+	q->flushing = 0;
+	if(ret < 0)
+		outq_kill(q, "flush failed");
+	sem_post(&q->lock);
+	return ret;
+}
+
+/*
+ * Flushes the queue and frees it.
+ */
+void outq_close(OUTQ *q){
+	outq_flush(q);
+	sem_wait(&q->lock);
+	q->dead = 1;
+	if(q->armed)
+		outq_disarm(q);
+	if(q->registered)
+		epoll_ctl(outq_epfd, EPOLL_CTL_DEL, outq_event_fd(q), NULL);
+	sem_post(&q->lock);
+
+	//the writer may have an event for it in hand, so it frees it
+	sem_wait(&outq_mutex);
+	q->next = outq_retired;
+	outq_retired = q;
+	sem_post(&outq_mutex);
+	timer_schedule(&outq_reaper, 0);
+}
+
+/*
+	Thread function of the writer thread: writes out queues whose
+	sockets have room, runs the timers (which disconnect the queues past
+	their deadline, among other things) and frees closed queues between
+	rounds, when no event can refer to them.
+*/
+void* outq_writer(void* arg){
+	struct epoll_event events[OUTQ_EVENTS];
+	while(1){
+		int n = epoll_wait(outq_epfd, events, OUTQ_EVENTS, -1);
+		int timers = 0;
+		for(int i = 0; i < n; i++){
+			if(events[i].data.ptr == NULL)
+				timers = 1;
+			else
+				outq_write_some(events[i].data.ptr);
+		}
+		if(timers)
+			timer_run();
+
+		sem_wait(&outq_mutex);
+		OUTQ* retired = outq_retired;
+		outq_retired = NULL;
+		sem_post(&outq_mutex);
+		while(retired != NULL){
+			OUTQ* next = retired->next;
+			//timers run on this thread, so this one's cannot be running
+			timer_cancel(&retired->deadline);
+			sem_destroy(&retired->lock);
+			free(retired->lanes[OUTQ_CONTROL].buf);
+			free(retired->lanes[OUTQ_DATA].buf);
+			free(retired->segs);
+			free(retired->stage);
+			free(retired);
+			retired = next;
+		}
+	}
+	return NULL;
+}
+
+/*
+	The socket has room: write as much of the queue as it takes.
+*/
+void outq_write_some(OUTQ* q){
+	sem_wait(&q->lock);
+	if(!q->armed || q->dead || q->flushing){
+		sem_post(&q->lock);
+		return;
+	}
+	struct iovec iov[3];
+	ssize_t n = outq_write(q, iov, outq_iov(q, iov), MSG_DONTWAIT);
+	if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK){
+		outq_kill(q, "write failed");
+	}
+	else{
+		if(n > 0){
+			outq_consume(q, n);
+			q->progress_ms = timer_now_ms();
+		}
+		if(outq_pending(q) == 0){
+			outq_disarm(q);
+		}
+		else{
+			//EPOLLONESHOT disabled it, so this asks for the next EPOLLOUT
+			outq_watch(q);
+		}
+	}
+	sem_post(&q->lock);
+}
+
+/*
+	Timer callback: disconnects the client if its queue has made no
+	progress for too long, or looks again when it would have.  The timer
+	is not stopped when the queue empties, so it may find it disarmed.
+	Only the writer thread frees queues, and it runs the timers too, so
+	the queue is still there.
+*/
+void outq_deadline_expired(void* arg){
+	OUTQ* q = arg;
+	sem_wait(&q->lock);
+	if(q->armed && !q->dead){
+		long idle = timer_now_ms() - q->progress_ms;
+		if(idle >= outq_deadline_ms)
+			outq_kill(q, "write deadline");
+		else
+			timer_schedule(&q->deadline, outq_deadline_ms - idle);
+	}
+	sem_post(&q->lock);
+}
+
+/*
+	Timer callback: nothing to do, the writer thread frees the closed
+	queues once the round that ran it is over.
+*/
+void outq_wake(void* arg){
+}
+
+/*
+	Copies bytes to the end of a lane, making room as needed.
+	Caller must hold q->lock.
+*/
+void outq_append(OUTQ_LANE* lane, void* data, size_t length){
+	if(lane->tail + length > lane->size){
+		//slide what is pending to the front before growing
+		memmove(lane->buf, lane->buf + lane->head, lane->tail - lane->head);
+		lane->tail -= lane->head;
+		lane->head = 0;
+		if(lane->tail + length > lane->size){
+			size_t size = lane->size == 0 ? 4096 : lane->size;
+			while(size < lane->tail + length)
+				size *= 2;
+			lane->buf = realloc(lane->buf, size);
+			lane->size = size;
+		}
+	}
+	memcpy(lane->buf + lane->tail, data, length);
+	lane->tail += length;
+}
+
+/*
+	Adds bytes to the packets gathered up while corked: copied to the
+	stage if there are fewer than BVD_OUTQ_COPY_MAX, else only pointed
+	at.  Caller must hold q->lock.
+*/
+void outq_stage(OUTQ* q, int lane, void* data, size_t length, int first){
+	if(length == 0 && !first)
+		return;
+	if(q->num_segs == q->segs_size){
+		q->segs_size = q->segs_size == 0 ? 64 : q->segs_size * 2;
+		q->segs = realloc(q->segs, q->segs_size * sizeof(OUTQ_SEG));
+	}
+	OUTQ_SEG* seg = &q->segs[q->num_segs++];
+	*seg = (OUTQ_SEG){data, 0, length, lane, first};
+	if(length < BVD_OUTQ_COPY_MAX){
+		if(q->stage_len + length > q->stage_size){
+			size_t size = q->stage_size == 0 ? 4096 : q->stage_size;
+			while(size < q->stage_len + length)
+				size *= 2;
+			q->stage = realloc(q->stage, size);
+			q->stage_size = size;
+		}
+		memcpy(q->stage + q->stage_len, data, length);
+		seg->ptr = NULL;
+		seg->off = q->stage_len;
+		q->stage_len += length;
+	}
+}
+
+/*
+	The bytes queued in both lanes.
+*/
+size_t outq_pending(OUTQ* q){
+	return q->lanes[OUTQ_CONTROL].tail - q->lanes[OUTQ_CONTROL].head
+		+ q->lanes[OUTQ_DATA].tail - q->lanes[OUTQ_DATA].head;
+}
+
+/*
+	Fills in the order the queued bytes go out in, and returns how many
+	of the 3 iovecs it used: the rest of a delivery that is partly
+	written, then the control lane, then the other deliveries.  Control
+	packets only ever overtake whole deliveries, so the stream stays a
+	sequence of whole packets.
+*/
+int outq_iov(OUTQ* q, struct iovec* iov){
+	OUTQ_LANE* control = &q->lanes[OUTQ_CONTROL];
+	OUTQ_LANE* data = &q->lanes[OUTQ_DATA];
+	int count = 0;
+	if(q->data_rest > 0)
+		iov[count++] = (struct iovec){data->buf + data->head, q->data_rest};
+	if(control->tail > control->head)
+		iov[count++] = (struct iovec){control->buf + control->head, control->tail - control->head};
+	if(data->tail - data->head > q->data_rest)
+		iov[count++] = (struct iovec){data->buf + data->head + q->data_rest, data->tail - data->head - q->data_rest};
+	return count;
+}
+
+/*
+	Drops n bytes that went out in the order of outq_iov().  If they end
+	in the middle of a delivery, walks the headers of the deliveries
+	that went out to find how much of that one is left.
+*/
+void outq_consume(OUTQ* q, size_t n){
+	OUTQ_LANE* control = &q->lanes[OUTQ_CONTROL];
+	OUTQ_LANE* data = &q->lanes[OUTQ_DATA];
+	size_t k = n < q->data_rest ? n : q->data_rest;
+	data->head += k;
+	q->data_rest -= k;
+	n -= k;
+	k = control->tail - control->head;
+	k = n < k ? n : k;
+	control->head += k;
+	n -= k;
+	if(n > 0){
+		//the deliveries are whole from here on, and start with a header
+		size_t end = data->head + n;
+		size_t pos = data->head;
+		while(pos < end)
+			pos += wire_packet_length(q->wire, data->buf + pos);
+		q->data_rest = pos - end;
+		data->head = end;
+	}
+	if(control->head == control->tail)
+		control->head = control->tail = 0;
+	if(data->head == data->tail)
+		data->head = data->tail = 0;
+}
+
+/*
+	Asks the writer thread to write the queue out when the socket has
+	room, and starts the deadline.  Caller must hold q->lock.
+*/
+void outq_arm(OUTQ* q){
+	q->armed = 1;
+	q->progress_ms = timer_now_ms();
+	timer_schedule(&q->deadline, outq_deadline_ms);
+	outq_watch(q);
+}
+
+/*
+	Asks the writer thread for the next time the socket has room: an
+	EPOLLOUT, or with a ring, the client writing the eventfd it is told
+	to when it makes room (see shm.h).  Caller must hold q->lock.
+*/
+void outq_watch(OUTQ* q){
+	struct epoll_event ev = {(q->shm != NULL ? EPOLLIN : EPOLLOUT) | EPOLLONESHOT, {.ptr = q}};
+	epoll_ctl(outq_epfd, q->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, outq_event_fd(q), &ev);
+	q->registered = 1;
+	//the client made room before it could be told to say so
+	if(q->shm != NULL && shm_want_room(q->shm)){
+		uint64_t one = 1;
+		if(write(q->shm->out_room, &one, sizeof(one)) < 0){
+			//already written, which wakes the writer thread up just as well
+		}
+	}
+}
+
+/*
+	Writes what iov holds, to the socket or the ring.  flags is
+	MSG_DONTWAIT, or 0 to wait until some of it is written.
+*/
+ssize_t outq_write(OUTQ* q, struct iovec* iov, int count, int flags){
+	ssize_t n;
+	if(q->shm != NULL){
+		while((n = shm_writev(q->shm, iov, count)) < 0 && errno == EAGAIN && !(flags & MSG_DONTWAIT)){
+			if(shm_wait_room(q->shm) < 0)
+				return -1;
+		}
+		return n;
+	}
+	struct msghdr msg = {0};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	while((n = sendmsg(q->fd, &msg, flags | MSG_NOSIGNAL)) < 0 && errno == EINTR)
+		;
+	return n;
+}
+
+/*
+	What the writer thread waits on for the queue.
+*/
+int outq_event_fd(OUTQ* q){
+	return q->shm != NULL ? q->shm->out_room : q->fd;
+}
+
+/*
+	Nothing is pending anymore.  A pending EPOLLOUT, if any, finds the
+	queue not armed and is ignored, and so does the deadline timer: it
+	is left running, as stopping it could wait for its callback, which
+	waits for q->lock.  Caller must hold q->lock.
+*/
+void outq_disarm(OUTQ* q){
+	q->armed = 0;
+}
+
+/*
+	Disconnects the client: the socket is shut down, which ends its
+	session, and whatever is queued is dropped.  Caller must hold q->lock.
+*/
+void outq_kill(OUTQ* q, const char* why){
+	debug("fd %d: disconnected, %s (%zu bytes queued)", q->fd, why, outq_pending(q));
+	q->dead = 1;
+	if(q->armed)
+		outq_disarm(q);
+	for(int i = 0; i < 2; i++)
+		q->lanes[i].head = q->lanes[i].tail = 0;
+	q->data_rest = 0;
+	shutdown(q->fd, SHUT_RDWR);
+	metrics_add(METRIC_OUTQ_DISCONNECTS, 1);
+}
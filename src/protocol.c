@@ -1,5 +1,6 @@
 #include "debug.h"
 #include "protocol.h"
+#include "protocol_ext.h"
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -7,6 +8,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+
+
+//GLOBAL VARIABLES
+uint32_t proto_max_payload = BVD_DEFAULT_MAX_PAYLOAD;
+
 
 /*
  * Send a packet with a specified header and payload.
@@ -25,35 +32,47 @@ int proto_send_packet(int fd, bvd_packet_header *hdr, void *payload){
 	//write payload to fd
 	//get length of payload from header
 	if(hdr == NULL){
-
-	debug("HI");
+		errno = EINVAL;
 		return -1;
 	}
 
 	//get size;
 	uint32_t size = hdr-> payload_length;
 
-	hdr->payload_length = htonl(hdr->payload_length);
-	hdr->timestamp_sec 	= htonl(hdr->timestamp_sec);
-	hdr->timestamp_nsec = htonl(hdr->timestamp_nsec);
-
-	if(hdr->msgid == 0)
-		hdr->msgid 			= (hdr->timestamp_nsec); //Unique ID
-
 	//Write header
-	if(write(fd, (void*)hdr, sizeof(bvd_packet_header)) != sizeof(bvd_packet_header)){
+	if(proto_send_header(fd, hdr) < 0){
 		return -1;
 	}
 
 	//write payload if the size is non 0
 	if(size > 0){
-		if(write(fd, payload, size) != size){
+		if(proto_write_fully(fd, payload, size) < 0){
 			return -1;
 		}
 	}
 	return 0;
 }
 
+/*
+ * Send just a packet header, for callers that write the payload
+ * themselves.  The header is converted like in proto_send_packet().
+ */
+int proto_send_header(int fd, bvd_packet_header *hdr){
+	proto_header_to_wire(hdr);
+	return proto_write_fully(fd, (void*)hdr, sizeof(bvd_packet_header));
+}
+
+/*
+ * Convert the multi-byte fields of a header to network byte order,
+ * in place, as they are sent.
+ */
+void proto_header_to_wire(bvd_packet_header *hdr){
+	hdr->payload_length = htonl(hdr->payload_length);
+	hdr->msgid 			= htonl(hdr->msgid);
+	hdr->timestamp_sec 	= htonl(hdr->timestamp_sec);
+	hdr->timestamp_nsec = htonl(hdr->timestamp_nsec);
+}
+
 /*
  * Receive a packet, blocking until one is available.
  *  fd - file descriptor from which packet is to be received
@@ -70,65 +89,119 @@ int proto_send_packet(int fd, bvd_packet_header *hdr, void *payload){
  * and errno is set.
  */
 int proto_recv_packet(int fd, bvd_packet_header *hdr, void **payload){	
+	if(proto_recv_header(fd, hdr) < 0){
+		return -1;
+	}
+	return proto_recv_payload(fd, hdr, payload);
+}
 
+/*
+ * Receive just a packet header, returned in host byte order.
+ */
+int proto_recv_header(int fd, bvd_packet_header *hdr){
 	//recv Header
-	
-	int t = -1;
-	if((t = read(fd, (void*)hdr, sizeof(bvd_packet_header))) < 0){
+	if(proto_read_fully(fd, (void*)hdr, sizeof(bvd_packet_header)) < 0){
 		return -1;
 	}
-	
-
 
 	hdr->payload_length = ntohl(hdr->payload_length);
+	hdr->msgid			= ntohl(hdr->msgid);
 	hdr->timestamp_nsec = ntohl(hdr->timestamp_nsec);
 	hdr->timestamp_sec 	= ntohl(hdr->timestamp_sec);
-	hdr->msgid			= (hdr->timestamp_nsec);
+	return 0;
+}
+
+/*
+ * Receive the payload announced by a header read with proto_recv_header().
+ */
+int proto_recv_payload(int fd, bvd_packet_header *hdr, void **payload){
 	//Add Payload if needed
+	//The payload is handed back whole; splitting off the first line is
+	//left to the caller, since not every packet type has one.
 	uint32_t size = hdr->payload_length;
+	char* input = NULL;
 
-	if(size > 0){
-
-		
-		char* input = malloc(size*sizeof(char));
-
-		*payload = malloc(size*sizeof(char));
-		*(((char**)payload)+1) = malloc(size*sizeof(char));
-
+	//the length comes from the peer, so it is not trusted with the heap
+	if(size > proto_max_payload){
+		debug("payload of %u bytes is over the limit of %u", size, proto_max_payload);
+		errno = EMSGSIZE;
+		return -1;
+	}
 
-		if((t = read(fd, input, size)) != size){
+	if(size > 0){
+		//one extra byte so that text payloads can be used as strings
+		if((input = malloc(size + 1)) == NULL){
 			return -1;
 		}
-		int rFound = 0;
-		int new_line = 0;
-		char* ptr = input;
-		int i = 0;
-		for(; i < size && !new_line; i++){
-			if(rFound && *ptr == '\n'){
-				new_line = 1;
-			}
-			else{
-				rFound = 0;
-			}
-			if(*ptr == '\r'){
-				rFound = 1;
-			}
-			ptr++;
-		}
-
-		memcpy( *payload , input , i*sizeof(char));
-		if(i+1 < size){
-			memcpy( *(((char**)payload)+1), input+i+1, (size-i-1) * sizeof(char));
+		if(proto_read_fully(fd, input, size) < 0){
+			free(input);
+			return -1;
 		}
-		
+		input[size] = '\0';
+	}
 
+	if(payload != NULL){
+		*payload = input;
+	}
+	else{
 		free(input);
 	}
-
-	debug("Payload: %s", (char*)*payload);
 	return 0;
 }
 
+/*
+ * Fill in a packet header, in host byte order, stamped with the
+ * current time.
+ */
+void proto_init_header(bvd_packet_header *hdr, uint8_t type, uint32_t msgid, uint32_t length){
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	memset(hdr, 0, sizeof(bvd_packet_header));
+	hdr->type = type;
+	hdr->payload_length = length;
+	hdr->msgid = msgid;
+	hdr->timestamp_sec = now.tv_sec;
+	hdr->timestamp_nsec = now.tv_nsec;
+}
 
+/*
+	Keeps calling write until all of buf has gone out,
+	since a socket can accept less than we asked for.
+*/
+int proto_write_fully(int fd, void* buf, size_t size){
+	char* ptr = buf;
+	while(size > 0){
+		ssize_t n = write(fd, ptr, size);
+		if(n < 0){
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		ptr += n;
+		size -= n;
+	}
+	return 0;
+}
 
-
+/*
+	Keeps calling read until size bytes have arrived.
+	A peer that closes the connection part way through is an error (EOF).
+*/
+int proto_read_fully(int fd, void* buf, size_t size){
+	char* ptr = buf;
+	while(size > 0){
+		ssize_t n = read(fd, ptr, size);
+		if(n < 0){
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		if(n == 0){
+			errno = ECONNRESET;
+			return -1;
+		}
+		ptr += n;
+		size -= n;
+	}
+	return 0;
+}
@@ -0,0 +1,109 @@
+#include "ratelimit.h"
+#include "metrics.h"
+#include "debug.h"
+
+#include <stdio.h>
+
+
+//STRUCTS
+//What one packet costs one bucket
+typedef struct rate_charge {
+	atomic_long* full;
+	long cost;
+} RATE_CHARGE;
+
+//HELPER FUNCTION DECLARATIONS
+long rate_cost(long rate, long amount);
+int rate_bucket_take(atomic_long* full, long cost, long now);
+
+
+//GLOBAL VARIABLES
+RATE_LIMIT rate_conn_limit = {0, 0};
+RATE_LIMIT rate_handle_limit = {0, 0};
+
+
+
+/*
+ * Parse "packets[,bytes]" into a limit.
+ */
+int rate_parse(char *spec, RATE_LIMIT *limit){
+	limit->packets = 0;
+	limit->bytes = 0;
+	int used = 0, more = 0;
+	if(sscanf(spec, "%ld%n", &limit->packets, &used) < 1)
+		return -1;
+	if(spec[used] == ','){
+		if(sscanf(spec + used + 1, "%ld%n", &limit->bytes, &more) < 1)
+			return -1;
+		used += 1 + more;
+	}
+	//nothing may follow, so that a typo is not taken for a limit
+	if(spec[used] != '\0' || limit->packets < 0 || limit->bytes < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Initialize a full bucket.
+ */
+void rate_bucket_init(RATE_BUCKET *b){
+	atomic_init(&b->packets_full, 0);
+	atomic_init(&b->bytes_full, 0);
+}
+
+/*
+ * Take one packet of length bytes from a connection's bucket and from
+ * its handle's, or from neither.
+ */
+int rate_take(RATE_BUCKET *conn, RATE_BUCKET *handle, size_t length){
+	RATE_CHARGE takes[4];
+	int count = 0;
+	if(rate_conn_limit.packets > 0)
+		takes[count++] = (RATE_CHARGE){&conn->packets_full, rate_cost(rate_conn_limit.packets, 1)};
+	if(rate_conn_limit.bytes > 0)
+		takes[count++] = (RATE_CHARGE){&conn->bytes_full, rate_cost(rate_conn_limit.bytes, length)};
+	if(handle != NULL && rate_handle_limit.packets > 0)
+		takes[count++] = (RATE_CHARGE){&handle->packets_full, rate_cost(rate_handle_limit.packets, 1)};
+	if(handle != NULL && rate_handle_limit.bytes > 0)
+		takes[count++] = (RATE_CHARGE){&handle->bytes_full, rate_cost(rate_handle_limit.bytes, length)};
+	if(count == 0)
+		return 0;
+
+	long now = metrics_now_nsec();
+	for(int i = 0; i < count; i++){
+		if(rate_bucket_take(takes[i].full, takes[i].cost, now) < 0){
+			//give back what the others took
+			while(--i >= 0)
+				atomic_fetch_sub_explicit(takes[i].full, takes[i].cost, memory_order_relaxed);
+			metrics_add(METRIC_RATE_REFUSED, 1);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+	How long, in nsec, a bucket that refills at rate a second takes to
+	get amount back.
+*/
+long rate_cost(long rate, long amount){
+	return amount * 1000000000L / rate;
+}
+
+/*
+	Takes cost from a bucket, unless that would leave it more than
+	BVD_RATE_BURST_MS from full.  A bucket is full at *full or at any
+	time after, and taking from it moves that time on by the cost.  A
+	full bucket always gives, so that a packet larger than the burst
+	still goes through, and the bucket is just empty for longer.
+*/
+int rate_bucket_take(atomic_long* full, long cost, long now){
+	long old = atomic_load_explicit(full, memory_order_relaxed);
+	long next;
+	do{
+		next = (old > now ? old : now) + cost;
+		if(old > now && next - now > BVD_RATE_BURST_MS * 1000000L)
+			return -1;
+	}while(!atomic_compare_exchange_weak_explicit(full, &old, next, memory_order_relaxed, memory_order_relaxed));
+	return 0;
+}
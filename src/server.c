@@ -0,0 +1,1646 @@
+#include "server.h"
+#include "server_ext.h"
+#include "directory.h"
+#include "directory_ext.h"
+#include "intern.h"
+#include "mailbox.h"
+#include "mailbox_ext.h"
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "batch.h"
+#include "capability.h"
+#include "coalesce.h"
+#include "compress.h"
+#include "metrics.h"
+#include "stream.h"
+#include "shm.h"
+#include "handoff.h"
+#include "cluster.h"
+#include "shard.h"
+#include "outq.h"
+#include "timer.h"
+#include "ratelimit.h"
+#include "admit.h"
+#include "trace.h"
+#include "wire.h"
+#include "history.h"
+#include "hot.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+
+
+//STRUCTS
+//What the mailbox service thread knows about its connection
+typedef struct mailbox_session {
+	int fd;
+	MAILBOX* mb;
+	int caps;
+	OUTQ* out; //everything written to the client goes through here, see outq.h
+	int pipefd[2]; //for relaying streams, created on first use
+	int efd; //the mailbox's eventfd, with -M only
+	COALESCER co;
+	int wire; //see wire.h
+	uint8_t* named; //with v2: bit i is set once the client knows ID i
+	uint32_t named_size; //bytes of named
+	SHM_CONN* shm; //with a shared-memory transport, see shm.h
+} mailbox_session;
+
+//What became of an entry written in a batch, until the batch is out
+typedef struct mailbox_written {
+	int sent; //for a message: 0 if it went out (or was queued), -1 if not
+	int moved; //bytes of handle slid up against the body, to slide back
+	char* plain; //the decompressed body that went out instead, to free
+} mailbox_written;
+
+//What the client service thread knows about its connection
+typedef struct client_session {
+	int fd;
+	MAILBOX* mb;
+	int caps;
+	pthread_t mb_tid;
+	mailbox_session* ms; //with -M, the mailbox is served by this thread too
+	BVD_TIMER idle; //with -I or -K, see server_ext.h
+	atomic_long last_active; //when the client last sent something
+	long last_heartbeat;
+	RATE_BUCKET rate; //with -L, see ratelimit.h
+	uint32_t trace_conn; //with -X, see trace.h; 0 until it sends something
+	int wire; //see wire.h
+	int wire_flags; //the v2 flags and ID of the packet being served
+	uint32_t wire_id;
+	uint32_t wire_skip; //bytes of its header still to be read, see wire_peek_header()
+	uint32_t* aliases; //with v2: the handle IDs bound to the client's IDs
+	uint32_t num_aliases;
+	SHM_CONN* shm; //with a shared-memory transport, what is read instead of fd, see shm.h
+	HOT_LOCAL hot; //what it sent, see hot.h
+} client_session;
+
+//What the mailbox service thread is started with: a struct fd_and_mb
+//that knows about the transport
+typedef struct mailbox_start {
+	struct fd_and_mb fdmb;
+	SHM_CONN* shm;
+} mailbox_start;
+
+
+//HELPER FUNCTION DECLARATIONS
+void bvd_client_loop(client_session*);
+void bvd_idle_start(client_session*);
+void bvd_idle_stop(client_session*);
+void bvd_idle_touch(client_session*);
+void bvd_idle_expired(void*);
+void* bvd_resumed_service(void*);
+void bvd_start_mailbox_service(client_session*);
+void bvd_login(client_session*, bvd_packet_header*, char*);
+void bvd_logout(client_session*, bvd_packet_header*);
+void bvd_users(client_session*, bvd_packet_header*);
+void bvd_send(client_session*, bvd_packet_header*, char*);
+void bvd_send_batch(client_session*, bvd_packet_header*, char*);
+int bvd_send_stream(client_session*, bvd_packet_header*, char*);
+int bvd_send_buffered(client_session*, bvd_packet_header*, char*, uint32_t, void*, int);
+void bvd_stats(client_session*, bvd_packet_header*);
+void bvd_history(client_session*, bvd_packet_header*, void*);
+void bvd_reply(client_session*, NOTICE_TYPE, int, void*, int);
+void bvd_discard_hook(MAILBOX_ENTRY*);
+void bvd_mailbox_open(mailbox_session*, int, SHM_CONN*, MAILBOX*);
+void bvd_mailbox_entries(mailbox_session*, MAILBOX_ENTRY**, int);
+void bvd_mailbox_entry(mailbox_session*, MAILBOX_ENTRY*, mailbox_written*);
+int bvd_mailbox_alone(MAILBOX_ENTRY*);
+void bvd_mailbox_done(mailbox_session*, MAILBOX_ENTRY*, mailbox_written*, int);
+void bvd_mailbox_quiesce(mailbox_session*);
+void bvd_mailbox_close(mailbox_session*);
+void bvd_mailbox_drain(mailbox_session*);
+void bvd_client_wait(client_session*);
+void bvd_stream_wait(client_session*, BVD_STREAM*);
+void bvd_deliver(mailbox_session*, MAILBOX_ENTRY*, mailbox_written*);
+int bvd_dlvr_flags(mailbox_session*, MAILBOX*, uint32_t*);
+int bvd_send_dlvr(mailbox_session*, bvd_packet_header*, MAILBOX_ENTRY*, int, uint32_t, mailbox_written*);
+int bvd_relay_stream(mailbox_session*, bvd_packet_header*, MAILBOX_ENTRY*, int, uint32_t);
+void bvd_history_range(mailbox_session*, MAILBOX_ENTRY*);
+int bvd_history_item(mailbox_session*, HISTORY_ITEM*, char**);
+char* bvd_make_dlvr(client_session*, char*, int, int*);
+int bvd_record_cmp(const void*, const void*);
+int bvd_dedup_check(client_session*, uint32_t);
+void bvd_dedup_record(client_session*, uint32_t);
+void bvd_dedup_unrecord(client_session*, uint32_t);
+int bvd_rate_exceeded(client_session*, bvd_packet_header*);
+void bvd_trace(client_session*, bvd_packet_header*, void*, uint32_t);
+void bvd_alias_bind(client_session*, char*);
+char* bvd_alias_handle(client_session*);
+int bvd_recv_header(client_session*, bvd_packet_header*);
+int bvd_recv_rest(client_session*, bvd_packet_header*, char*, void**);
+int bvd_skip_header(client_session*);
+int bvd_drain(client_session*, uint32_t);
+int bvd_shm_start(client_session*);
+int bvd_shm_header(client_session*, bvd_packet_header*);
+int bvd_write_fully(mailbox_session*, void*, size_t);
+
+
+//GLOBAL VARIABLES
+int bvd_merged_service = 0;
+int bvd_idle_timeout_ms = 0;
+int bvd_heartbeat_ms = 0;
+
+
+/*
+ * Thread function for the thread that handles client requests.
+ *
+ * The arg pointer point to the file descriptor of client connection.
+ * This pointer must be freed after the file descriptor has been
+ * retrieved.
+ */
+void *bvd_client_service(void *arg){
+	client_session session;
+	session.fd = *((int*)arg);
+	session.mb = NULL;
+	session.caps = 0;
+	session.ms = NULL;
+	session.wire = BVD_WIRE_V1;
+	session.shm = NULL;
+	free(arg);
+	tcnt_incr(thread_counter);
+	shard_enter(shard_next());
+	bvd_client_loop(&session);
+	if(session.shm != NULL)
+		shm_close(session.shm);
+	tcnt_decr(thread_counter);
+	return NULL;
+}
+
+/*
+	Serves requests until the client logs out or goes away.
+*/
+void bvd_client_loop(client_session* session){
+	bvd_packet_header hdr;
+	void* payload = NULL;
+	int logged_out = 0;
+	int budget = BVD_RATE_BUDGET;
+	int first = session->mb == NULL;
+	rate_bucket_init(&session->rate);
+	hot_local_init(&session->hot);
+	session->trace_conn = 0;
+	session->aliases = NULL;
+	session->num_aliases = 0;
+	bvd_idle_start(session);
+	while(!logged_out){
+		//busy connections take turns, see ratelimit.h
+		if(--budget == 0){
+			budget = BVD_RATE_BUDGET;
+			sched_yield();
+		}
+		//between two packets is the only place to stop for a hot restart
+		//(a session on shared memory is not carried over, its reads just fail)
+		if(session->ms != NULL)
+			bvd_client_wait(session);
+		else if(session->shm == NULL && handoff_requested(session->fd)){
+			bvd_idle_stop(session);
+			handoff_park_client(session->fd, session->mb, session->caps);
+		}
+		if(first){
+			first = 0;
+			if(bvd_shm_start(session) < 0)
+				break;
+		}
+		if(bvd_recv_header(session, &hdr) < 0)
+			break;
+		bvd_idle_touch(session);
+		debug("fd %d: packet type %d, msgid %u", session->fd, hdr.type, hdr.msgid);
+		if(bvd_rate_exceeded(session, &hdr)){
+			bvd_trace(session, &hdr, NULL, 0);
+			bvd_reply(session, NACK_NOTICE_TYPE, hdr.msgid, NULL, 0);
+			if(bvd_drain(session, session->wire_skip + hdr.payload_length) < 0)
+				break;
+			continue;
+		}
+		//a SEND to a bound ID is made whole again, see wire.h
+		char* bound = NULL;
+		if(hdr.type == BVD_SEND_PKT && (session->wire_flags & (BVD_WIRE_ID | BVD_WIRE_NAMED)) == BVD_WIRE_ID){
+			if((bound = bvd_alias_handle(session)) == NULL){
+				bvd_reply(session, NACK_NOTICE_TYPE, hdr.msgid, strdup(BVD_WIRE_UNBOUND), strlen(BVD_WIRE_UNBOUND));
+				if(bvd_drain(session, session->wire_skip + hdr.payload_length) < 0)
+					break;
+				continue;
+			}
+			hdr.payload_length += strlen(bound) + 2;
+		}
+		//large bodies go straight from socket to socket, see stream.h
+		if(hdr.type == BVD_SEND_PKT && session->mb != NULL && session->shm == NULL && hdr.payload_length >= bvd_stream_min){
+			if(bvd_skip_header(session) < 0 || bvd_send_stream(session, &hdr, bound) < 0)
+				break;
+			continue;
+		}
+		if(bvd_recv_rest(session, &hdr, bound, &payload) < 0){
+			break;
+		}
+		bvd_trace(session, &hdr, payload, hdr.payload_length);
+		switch(hdr.type){
+			case BVD_LOGIN_PKT:
+				bvd_login(session, &hdr, payload);
+				break;
+			case BVD_LOGOUT_PKT:
+				bvd_logout(session, &hdr);
+				logged_out = 1;
+				break;
+			case BVD_USERS_PKT:
+				bvd_users(session, &hdr);
+				break;
+			case BVD_SEND_PKT:
+				bvd_send(session, &hdr, payload);
+				break;
+			case BVD_SEND_BATCH_PKT:
+				bvd_send_batch(session, &hdr, payload);
+				break;
+			case BVD_STATS_PKT:
+				bvd_stats(session, &hdr);
+				break;
+			case BVD_HISTORY_PKT:
+				bvd_history(session, &hdr, payload);
+				payload = NULL; //handed over
+				break;
+			case BVD_HEARTBEAT_PKT:
+				//being here is all it is for
+				break;
+			case BVD_PEER_PKT:
+				//another node of the cluster: the connection is a link from now on
+				if(session->mb == NULL && session->shm == NULL && cluster_enabled()){
+					bvd_idle_stop(session);
+					cluster_peer_service(session->fd, payload);
+					logged_out = 1;
+				}
+				else{
+					bvd_reply(session, NACK_NOTICE_TYPE, hdr.msgid, NULL, 0);
+				}
+				break;
+			default:
+				bvd_reply(session, NACK_NOTICE_TYPE, hdr.msgid, NULL, 0);
+				break;
+		}
+		free(payload);
+		payload = NULL;
+	}
+
+	//connection dropped without a LOGOUT
+	if(session->mb != NULL){
+		bvd_logout(session, NULL);
+	}
+	bvd_idle_stop(session);
+	hot_flush(&session->hot);
+	if(session->trace_conn != 0)
+		trace_close(session->trace_conn);
+	free(session->aliases);
+	handoff_client_finished();
+}
+
+/*
+	Starts the timer of a connection, if there is anything for it to do.
+*/
+void bvd_idle_start(client_session* session){
+	timer_setup(&session->idle, bvd_idle_expired, session);
+	atomic_init(&session->last_active, timer_now_ms());
+	session->last_heartbeat = 0;
+	if(bvd_idle_timeout_ms > 0)
+		timer_schedule(&session->idle, bvd_idle_timeout_ms);
+	else if(bvd_heartbeat_ms > 0)
+		timer_schedule(&session->idle, bvd_heartbeat_ms);
+}
+
+/*
+	Stops the timer of a connection.  Once this returns, the callback
+	is not running either, so the session may change or go away.
+*/
+void bvd_idle_stop(client_session* session){
+	if(bvd_idle_timeout_ms > 0 || bvd_heartbeat_ms > 0)
+		timer_cancel(&session->idle);
+}
+
+/*
+	The client just said something.
+*/
+void bvd_idle_touch(client_session* session){
+	if(bvd_idle_timeout_ms > 0 || bvd_heartbeat_ms > 0)
+		atomic_store_explicit(&session->last_active, timer_now_ms(), memory_order_relaxed);
+}
+
+/*
+	Timer callback of a connection: disconnects it if it has been quiet
+	for too long, sends a heartbeat if it is due, and sets the timer
+	for whichever of the two comes next.  The client service thread
+	stops the timer before the session's mailbox changes.
+*/
+void bvd_idle_expired(void* arg){
+	client_session* session = arg;
+	long now = timer_now_ms();
+	long quiet = now - atomic_load_explicit(&session->last_active, memory_order_relaxed);
+	if(bvd_idle_timeout_ms > 0 && quiet >= bvd_idle_timeout_ms){
+		debug("fd %d: disconnected, quiet for %ld ms", session->fd, quiet);
+		//the client service thread takes it from here, as if the client had left
+		shutdown(session->fd, SHUT_RDWR);
+		metrics_add(METRIC_IDLE_DISCONNECTS, 1);
+		return;
+	}
+
+	long next = bvd_idle_timeout_ms > 0 ? bvd_idle_timeout_ms - quiet : -1;
+	if(bvd_heartbeat_ms > 0 && session->mb != NULL && (session->caps & BVD_CAP_HEARTBEAT)){
+		//counted from whichever is later, the client's last word or ours
+		long since = now - session->last_heartbeat < quiet ? now - session->last_heartbeat : quiet;
+		if(since >= bvd_heartbeat_ms){
+			mb_add_notice(session->mb, HEARTBEAT_NOTICE_TYPE, 0, NULL, 0);
+			metrics_add(METRIC_HEARTBEATS, 1);
+			session->last_heartbeat = now;
+			since = 0;
+		}
+		if(next < 0 || bvd_heartbeat_ms - since < next)
+			next = bvd_heartbeat_ms - since;
+	}
+	else if(next < 0){
+		next = bvd_heartbeat_ms; //maybe it logs in with the capability
+	}
+	timer_schedule(&session->idle, next);
+}
+
+/*
+ * Registers handle for a connection carried over by a hot restart.
+ */
+MAILBOX* bvd_resume_login(int fd, char* handle, int caps){
+	MAILBOX* mb = dir_register(handle, fd);
+	if(mb != NULL){
+		mb_set_discard_hook(mb, bvd_discard_hook);
+		mb_set_caps(mb, caps);
+		cluster_claim(handle);
+	}
+	return mb;
+}
+
+/*
+ * Starts the service threads for a connection carried over by a hot restart.
+ */
+int bvd_resume_session(int fd, MAILBOX* mb, int caps){
+	client_session* session = malloc(sizeof(client_session));
+	session->fd = fd;
+	session->mb = mb;
+	session->caps = caps;
+	session->ms = NULL;
+	session->shm = NULL;
+	//whatever it bound its IDs to is lost, see wire.h
+	session->wire = caps & BVD_CAP_V2 ? BVD_WIRE_V2 : BVD_WIRE_V1;
+	handoff_client_started();
+
+	pthread_t tid;
+	if(pthread_create(&tid, NULL, bvd_resumed_service, session) != 0){
+		handoff_client_finished();
+		free(session);
+		return -1;
+	}
+	pthread_detach(tid);
+	return 0;
+}
+
+/*
+	Thread function for a client service thread started by
+	bvd_resume_session(): it starts where LOGIN would have left off.
+*/
+void* bvd_resumed_service(void* arg){
+	client_session session = *((client_session*)arg);
+	free(arg);
+	tcnt_incr(thread_counter);
+	shard_enter(session.mb != NULL ? shard_home(session.mb) : shard_next());
+	if(session.mb != NULL)
+		bvd_start_mailbox_service(&session);
+	bvd_client_loop(&session);
+	close(session.fd);
+	tcnt_decr(thread_counter);
+	return NULL;
+}
+
+/*
+ * Thread function for the thread that delivers the contents of a
+ * client's mailbox over the client connection.
+ *
+ * Once the file descriptor and mailbox have been retrieved,
+ * this structure must be freed.
+ */
+void *bvd_mailbox_service(void *arg){
+	mailbox_start* start = arg;
+	mailbox_session ms;
+	bvd_mailbox_open(&ms, start->fdmb.fd, start->shm, start->fdmb.mb);
+	MAILBOX* mb = ms.mb;
+	free(arg);
+	tcnt_incr(thread_counter);
+	shard_enter(shard_home(mb));
+
+	MAILBOX_ENTRY* entries[BVD_MB_BATCH];
+	while(1){
+		int n = mb_next_entries(mb, entries, BVD_MB_BATCH, BVD_MB_BATCH_BYTES, coalesce_deadline(&ms.co));
+		if(n < 0){
+			if(errno == ETIMEDOUT){
+				coalesce_flush(&ms.co, ms.out);
+				continue;
+			}
+			if(errno == EINTR){
+				//stopped for a hot restart, see handoff.h
+				bvd_mailbox_quiesce(&ms);
+				handoff_park_mailbox(mb);
+			}
+			break;
+		}
+		bvd_mailbox_entries(&ms, entries, n);
+	}
+	bvd_mailbox_close(&ms);
+	mb_unref(mb);
+	tcnt_decr(thread_counter);
+	return NULL;
+}
+
+/*
+	Sets up the delivery side of a connection, whichever thread serves it.
+*/
+void bvd_mailbox_open(mailbox_session* ms, int fd, SHM_CONN* shm, MAILBOX* mb){
+	ms->fd = fd;
+	ms->shm = shm;
+	ms->mb = mb;
+	ms->caps = mb_get_caps(mb);
+	ms->pipefd[0] = ms->pipefd[1] = -1;
+	ms->wire = ms->caps & BVD_CAP_V2 ? BVD_WIRE_V2 : BVD_WIRE_V1;
+	ms->named = NULL;
+	ms->named_size = 0;
+	ms->out = shm != NULL ? outq_open_shm(fd, shm, ms->wire) : outq_open(fd, ms->wire);
+	ms->efd = -1;
+	//without the capability nothing is ever held back, so the deadline stays NULL
+	coalesce_init(&ms->co);
+}
+
+/*
+	Writes out, or holds back for coalescing, entries taken from the
+	mailbox, and frees them.  The packets of a run of entries are
+	gathered up and written together (see outq_cork()), with the bodies
+	left where they are until then; a streamed body is written past the
+	queue, and a HISTORY range is gathered up in batches of its own, so
+	those go out on their own.
+*/
+void bvd_mailbox_entries(mailbox_session* ms, MAILBOX_ENTRY** entries, int n){
+	mailbox_written written[n];
+	int i = 0;
+	while(i < n){
+		int j = i;
+		int corked = n - i > 1 && !bvd_mailbox_alone(entries[i]);
+		if(corked)
+			outq_cork(ms->out);
+		do{
+			bvd_mailbox_entry(ms, entries[j], &written[j]);
+			j++;
+		}while(corked && j < n && !bvd_mailbox_alone(entries[j]));
+		int ok = !corked || outq_uncork(ms->out) == 0;
+		for(; i < j; i++)
+			bvd_mailbox_done(ms, entries[i], &written[i], ok);
+	}
+}
+
+/*
+	Writes out, or holds back for coalescing, one entry taken from the
+	mailbox, leaving what is left to do once it is out in *w.
+*/
+void bvd_mailbox_entry(mailbox_session* ms, MAILBOX_ENTRY* entry, mailbox_written* w){
+	NOTICE* notice = &entry->content.notice;
+	w->sent = 0;
+	w->moved = 0;
+	w->plain = NULL;
+	if((ms->caps & BVD_CAP_COALESCE) && entry->type == NOTICE_ENTRY_TYPE && entry->body == NULL
+		&& (notice->type == ACK_NOTICE_TYPE || notice->type == RRCPT_NOTICE_TYPE)){
+		coalesce_add(&ms->co, ms->out, notice->type, notice->msgid);
+	}
+	else if(entry->type == NOTICE_ENTRY_TYPE && notice->type == HISTORY_NOTICE_TYPE){
+		coalesce_flush(&ms->co, ms->out);
+		bvd_history_range(ms, entry);
+	}
+	else{
+		coalesce_flush(&ms->co, ms->out);
+		bvd_deliver(ms, entry, w);
+	}
+}
+
+/*
+	Whether an entry is written out on its own rather than with the
+	entries around it.
+*/
+int bvd_mailbox_alone(MAILBOX_ENTRY* entry){
+	return BVD_IS_STREAM(entry) || (entry->type == NOTICE_ENTRY_TYPE && entry->content.notice.type == HISTORY_NOTICE_TYPE);
+}
+
+/*
+	Once an entry is out (ok is 0 if the batch it went in was not), puts
+	its body back as it was, earns a delivered message's sender a return
+	receipt, and frees the entry.
+*/
+void bvd_mailbox_done(mailbox_session* ms, MAILBOX_ENTRY* entry, mailbox_written* w, int ok){
+	if(w->moved > 0)
+		memmove(entry->body, (char*)entry->body + BVD_FRAME_HEADER_SIZE, w->moved);
+	free(w->plain);
+	if(entry->type == MESSAGE_ENTRY_TYPE && entry->content.message.from != NULL){
+		MESSAGE* msg = &entry->content.message;
+		cluster_notify(msg->from, w->sent == 0 && ok ? RRCPT_NOTICE_TYPE : BOUNCE_NOTICE_TYPE,
+			msg->msgid, entry->body, entry->length);
+		mb_unref(msg->from);
+	}
+	free(entry->body);
+	free(entry);
+}
+
+/*
+	Gets everything held back onto the socket, before a hot restart
+	hands the socket over.
+*/
+void bvd_mailbox_quiesce(mailbox_session* ms){
+	coalesce_flush(&ms->co, ms->out);
+	outq_flush(ms->out);
+}
+
+/*
+	Writes out what is held back and lets go of the delivery side.
+*/
+void bvd_mailbox_close(mailbox_session* ms){
+	coalesce_flush(&ms->co, ms->out);
+	outq_close(ms->out);
+	free(ms->named);
+	if(ms->pipefd[0] >= 0){
+		close(ms->pipefd[0]);
+		close(ms->pipefd[1]);
+	}
+}
+
+/*
+	With -M: writes out whatever is in the mailbox, without waiting.
+*/
+void bvd_mailbox_drain(mailbox_session* ms){
+	uint64_t count;
+	//reset the eventfd first, so that anything added from here on pokes it again
+	if(read(ms->efd, &count, sizeof(count)) < 0){
+		//nothing new, but there may be leftovers from last time
+	}
+	MAILBOX_ENTRY* entries[64];
+	int n;
+	while((n = mb_take_entries(ms->mb, entries, 64)) > 0)
+		bvd_mailbox_entries(ms, entries, n);
+}
+
+/*
+	With -M, between packets: serves the mailbox until the socket has
+	something to read, and stops here for a hot restart.
+*/
+void bvd_client_wait(client_session* session){
+	mailbox_session* ms = session->ms;
+	int stopfd = handoff_stop_fd();
+	while(1){
+		bvd_mailbox_drain(ms);
+
+		int timeout = -1;
+		struct timespec* deadline = coalesce_deadline(&ms->co);
+		if(deadline != NULL){
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			long usec = (deadline->tv_sec - now.tv_sec) * 1000000L + (deadline->tv_nsec - now.tv_nsec) / 1000;
+			timeout = usec <= 0 ? 0 : (usec + 999) / 1000;
+		}
+		//with a ring, its eventfd says there is something to read, and
+		//the socket only that the client is gone
+		struct pollfd pfd[4] = {{session->fd, POLLIN, 0}, {ms->efd, POLLIN, 0}, {stopfd, POLLIN, 0}, {-1, POLLIN, 0}};
+		if(session->shm != NULL){
+			if(shm_want_data(session->shm))
+				return;
+			pfd[3].fd = session->shm->in_ready;
+		}
+		int n = poll(pfd, 4, timeout);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n == 0){
+			coalesce_flush(&ms->co, ms->out);
+			continue;
+		}
+		if(stopfd >= 0 && pfd[2].revents){
+			//a session on shared memory is not carried over, its reads just fail
+			if(session->shm != NULL)
+				return;
+			bvd_idle_stop(session);
+			bvd_mailbox_quiesce(ms);
+			handoff_park_session(session->fd, session->mb, session->caps);
+		}
+		if(n < 0 || pfd[0].revents || pfd[3].revents)
+			return;
+	}
+}
+
+/*
+	Waits for the receiver of a streamed SEND to be done with the body.
+	With -M this thread may be the receiver's, or one the receiver waits
+	for in turn, so it keeps serving the mailbox meanwhile.
+*/
+void bvd_stream_wait(client_session* session, BVD_STREAM* st){
+	if(session->ms == NULL){
+		sem_wait(&st->done);
+		return;
+	}
+	while(sem_trywait(&st->done) < 0){
+		bvd_mailbox_drain(session->ms);
+		struct pollfd pfd = {session->ms->efd, POLLIN, 0};
+		poll(&pfd, 1, 1);
+	}
+}
+
+/*
+	Writes one mailbox entry to the client as the matching packet.
+*/
+void bvd_deliver(mailbox_session* ms, MAILBOX_ENTRY* entry, mailbox_written* w){
+	bvd_packet_header hdr;
+	if(entry->type == MESSAGE_ENTRY_TYPE){
+		MESSAGE* msg = &entry->content.message;
+		proto_init_header(&hdr, BVD_DLVR_PKT, msg->msgid, entry->length);
+		uint32_t id = 0;
+		int flags = bvd_dlvr_flags(ms, msg->from, &id);
+		if(BVD_IS_STREAM(entry))
+			w->sent = bvd_relay_stream(ms, &hdr, entry, flags, id);
+		else
+			w->sent = bvd_send_dlvr(ms, &hdr, entry, flags, id, w);
+		//from now on the client knows who the ID is
+		if(w->sent == 0 && (flags & BVD_WIRE_NAMED))
+			ms->named[id / 8] |= 1 << (id % 8);
+	}
+	else{
+		NOTICE* notice = &entry->content.notice;
+		uint8_t type = BVD_ACK_PKT;
+		if(notice->type == NACK_NOTICE_TYPE)
+			type = BVD_NACK_PKT;
+		else if(notice->type == BOUNCE_NOTICE_TYPE)
+			type = BVD_BOUNCE_PKT;
+		else if(notice->type == RRCPT_NOTICE_TYPE)
+			type = BVD_RRCPT_PKT;
+		else if(notice->type == HEARTBEAT_NOTICE_TYPE)
+			type = BVD_HEARTBEAT_PKT;
+		proto_init_header(&hdr, type, notice->msgid, entry->length);
+		//the client only knows whether it has v2 once it has read this
+		if(notice->type == LOGIN_ACK_NOTICE_TYPE)
+			outq_send_wire(ms->out, BVD_WIRE_V1, &hdr, 0, 0, entry->body);
+		else
+			outq_send_packet(ms->out, &hdr, entry->body);
+	}
+}
+
+/*
+	With v2: the flags a DLVR from a sender goes out with, see wire.h.
+	The sender is named by its handle ID if it is logged in here, with
+	its handle line as well the first time.  A message from another node
+	of a cluster comes from the node's mailbox, and keeps its handle line.
+*/
+int bvd_dlvr_flags(mailbox_session* ms, MAILBOX* from, uint32_t* id){
+	if(ms->wire == BVD_WIRE_V1)
+		return 0;
+	if(from == NULL || (mb_get_caps(from) & BVD_PEER_CAPS) || (*id = mb_get_id(from)) == BVD_NO_ID)
+		return 0;
+	if(*id / 8 >= ms->named_size){
+		uint32_t size = ms->named_size == 0 ? 64 : ms->named_size;
+		while(*id / 8 >= size)
+			size *= 2;
+		ms->named = realloc(ms->named, size);
+		memset(ms->named + ms->named_size, 0, size - ms->named_size);
+		ms->named_size = size;
+	}
+	if(ms->named[*id / 8] & (1 << (*id % 8)))
+		return BVD_WIRE_ID;
+	return BVD_WIRE_ID | BVD_WIRE_NAMED;
+}
+
+/*
+	The stored body is framed (see compress.h).  A client with the
+	capability gets it as is; anybody else gets the plain body back.
+	The handle line is left out if the client knows the sender's ID.
+	What is sent must stay as it is until the batch is out, so what
+	bvd_mailbox_done() must put back or free is left in *w.
+*/
+int bvd_send_dlvr(mailbox_session* ms, bvd_packet_header* hdr, MAILBOX_ENTRY* entry, int flags, uint32_t id, mailbox_written* w){
+	OUTQ* out = ms->out;
+	char* dlvr = entry->body;
+	int prefix = (char*)memchr(dlvr, '\n', entry->length) - dlvr + 1;
+	char* frame = dlvr + prefix;
+	int keep = !(flags & BVD_WIRE_ID) || (flags & BVD_WIRE_NAMED) ? prefix : 0;
+	if(ms->caps & BVD_CAP_LZ4){
+		if(frame[0] == BVD_CODEC_LZ4)
+			metrics_add(METRIC_LZ_PASSTHROUGH, 1);
+		hdr->payload_length = entry->length - prefix + keep;
+		return outq_send_wire(out, ms->wire, hdr, flags, id, frame - keep);
+	}
+
+	int frame_length = entry->length - prefix;
+	int raw_length;
+	int codec = bvd_frame_check(frame, frame_length, &raw_length);
+
+	if(codec == BVD_CODEC_RAW){
+		//slide the handle up against the body instead of copying the body,
+		//and back later, for a receipt that goes to another node (see cluster_notify)
+		if(keep > 0)
+			memmove(dlvr + BVD_FRAME_HEADER_SIZE, dlvr, prefix);
+		w->moved = keep;
+		hdr->payload_length = keep + raw_length;
+		return outq_send_wire(out, ms->wire, hdr, flags, id, frame + BVD_FRAME_HEADER_SIZE - keep);
+	}
+
+	char* plain = malloc((size_t)keep + raw_length);
+	if(plain == NULL)
+		return -1;
+	memcpy(plain, dlvr, keep);
+	long start = metrics_now_nsec();
+	if(bvd_unframe_body(frame, frame_length, plain + keep) < 0){
+		free(plain);
+		return -1;
+	}
+	metrics_add(METRIC_LZ_DECOMPRESS_NSEC, metrics_now_nsec() - start);
+	metrics_add(METRIC_LZ_DECOMPRESS_BYTES, raw_length);
+
+	hdr->payload_length = keep + raw_length;
+	w->plain = plain;
+	return outq_send_wire(out, ms->wire, hdr, flags, id, plain);
+}
+
+/*
+	Writes the DLVR header and the sender's handle (unless the client
+	knows its ID), then lets the body flow from the sender's socket.  A
+	client with the lz4 capability expects a framed body, so it gets a
+	raw frame header in front.
+	Hands the stream back to the waiting sender when done.
+*/
+int bvd_relay_stream(mailbox_session* ms, bvd_packet_header* hdr, MAILBOX_ENTRY* entry, int flags, uint32_t id){
+	BVD_STREAM* st = entry->body;
+	char* handle = mb_get_handle(entry->content.message.from);
+	int hlen = strlen(handle);
+	int framed = ms->caps & BVD_CAP_LZ4;
+
+	char prefix[hlen + 2 + BVD_FRAME_HEADER_SIZE];
+	int prefix_len = 0;
+	if(!(flags & BVD_WIRE_ID) || (flags & BVD_WIRE_NAMED)){
+		memcpy(prefix, handle, hlen);
+		memcpy(prefix + hlen, "\r\n", 2);
+		prefix_len = hlen + 2;
+	}
+	if(framed){
+		uint32_t raw_length = htonl(st->length);
+		prefix[prefix_len] = BVD_CODEC_RAW;
+		memcpy(prefix + prefix_len + 1, &raw_length, sizeof(raw_length));
+		prefix_len += BVD_FRAME_HEADER_SIZE;
+	}
+
+	hdr->payload_length = prefix_len + st->length;
+	uint8_t head[BVD_WIRE_MAX_HEADER];
+	int head_length = wire_encode_header(ms->wire, hdr, flags, id, head);
+	//the body is written straight to the socket, behind what is queued
+	int ret = -1;
+	if(outq_flush(ms->out) == 0 && bvd_write_fully(ms, head, head_length) == 0 && bvd_write_fully(ms, prefix, prefix_len) == 0)
+		ret = ms->shm != NULL ? stream_relay_shm(st, ms->shm) : stream_relay(st, ms->fd, ms->pipefd);
+	if(ret < 0)
+		shutdown(ms->fd, SHUT_RDWR); //a packet cut short leaves the connection unusable
+
+	//st lives on the sender's stack, so it must not be touched after the post
+	st->status = ret;
+	entry->body = NULL;
+	sem_post(&st->done);
+	return ret;
+}
+
+/*
+	Writes out the messages of a HISTORY request (see history.h),
+	BVD_HISTORY_BATCH at a time, then its ACK.  Their bodies go out
+	straight from the segments, unless they have to be decompressed.
+*/
+void bvd_history_range(mailbox_session* ms, MAILBOX_ENTRY* entry){
+	HISTORY_QUERY q;
+	HISTORY_RANGE range;
+	history_parse(entry->body, entry->length, &q);
+	int count = history_range(mb_get_id(ms->mb), &q, &range);
+	uint32_t sent = 0;
+	int ok = 0;
+	for(int i = 0; i < count && ok == 0; i += BVD_HISTORY_BATCH){
+		char* plain[BVD_HISTORY_BATCH];
+		int n = count - i < BVD_HISTORY_BATCH ? count - i : BVD_HISTORY_BATCH;
+		outq_cork(ms->out);
+		for(int j = 0; j < n; j++)
+			sent += bvd_history_item(ms, &range.items[i + j], &plain[j]) == 0;
+		ok = outq_uncork(ms->out);
+		for(int j = 0; j < n; j++)
+			free(plain[j]);
+	}
+	history_release(&range);
+	if(ok < 0)
+		return;
+	metrics_add(METRIC_HISTORY_READS, 1);
+	metrics_add(METRIC_HISTORY_READ_MESSAGES, sent);
+
+	bvd_packet_header hdr;
+	uint32_t sent_be = htonl(sent);
+	proto_init_header(&hdr, BVD_ACK_PKT, entry->content.notice.msgid, sizeof(sent_be));
+	outq_send_packet(ms->out, &hdr, &sent_be);
+}
+
+/*
+	Sends one message of a HISTORY range.  As with a DLVR, a client
+	with the lz4 capability gets the body framed as it is stored, and
+	anybody else the plain body, which is decompressed to *plain (to be
+	freed once the batch is out) if need be.
+	Returns 0 on success, -1 if the message was not sent.
+*/
+int bvd_history_item(mailbox_session* ms, HISTORY_ITEM* item, char** plain){
+	*plain = NULL;
+	struct iovec parts[2] = {{item->head, item->head_length}, {item->frame, item->frame_length}};
+	if(!(ms->caps & BVD_CAP_LZ4)){
+		int raw_length;
+		int codec = bvd_frame_check(item->frame, item->frame_length, &raw_length);
+		if(codec < 0)
+			return -1;
+		parts[1].iov_len = raw_length;
+		if(codec == BVD_CODEC_RAW){
+			parts[1].iov_base = item->frame + BVD_FRAME_HEADER_SIZE;
+		}
+		else{
+			if((*plain = malloc((size_t)raw_length)) == NULL)
+				return -1;
+			if(bvd_unframe_body(item->frame, item->frame_length, *plain) < 0)
+				return -1;
+			parts[1].iov_base = *plain;
+		}
+	}
+	bvd_packet_header hdr;
+	proto_init_header(&hdr, BVD_HISTORY_PKT, item->msgid, parts[0].iov_len + parts[1].iov_len);
+	return outq_send_parts(ms->out, ms->wire, &hdr, 0, 0, parts, 2);
+}
+
+/*
+	Writes to the client past its queue, on the socket or the ring.
+*/
+int bvd_write_fully(mailbox_session* ms, void* buf, size_t length){
+	if(ms->shm != NULL)
+		return shm_write_fully(ms->shm, buf, length);
+	return proto_write_fully(ms->fd, buf, length);
+}
+
+/*
+	LOGIN: registers the handle and starts the mailbox service thread.
+	The payload is the handle, optionally followed by \r\n and the
+	capabilities the client asks for (see capability.h).
+*/
+void bvd_login(client_session* session, bvd_packet_header* hdr, char* payload){
+	if(session->mb != NULL || payload == NULL){
+		bvd_reply(session, NACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+		return;
+	}
+	int caps = 0;
+	char* eol = strstr(payload, "\r\n");
+	if(eol != NULL){
+		*eol = '\0';
+		caps = bvd_caps_parse(eol + 2) & BVD_CAPS_SUPPORTED;
+	}
+	//no new mailboxes while overloaded, see admit.h
+	if(admit_overloaded()){
+		int hint_length;
+		char* hint = admit_retry_hint(&hint_length);
+		metrics_add(METRIC_ADMIT_REFUSED, 1);
+		bvd_reply(session, NACK_NOTICE_TYPE, hdr->msgid, hint, hint_length);
+		return;
+	}
+
+	MAILBOX* mb = dir_register(payload, session->fd);
+	if(mb == NULL){
+		bvd_reply(session, NACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+		return;
+	}
+	mb_set_discard_hook(mb, bvd_discard_hook);
+	mb_set_caps(mb, caps);
+	cluster_claim(payload);
+	bvd_idle_stop(session); //it looks at the mailbox
+	session->mb = mb;
+	session->caps = caps;
+	//the client sends v2 from the next packet on, see wire.h
+	session->wire = caps & BVD_CAP_V2 ? BVD_WIRE_V2 : BVD_WIRE_V1;
+	//from now on the connection lives where its mailbox does
+	shard_enter(shard_home(mb));
+
+	//the ACK goes through the mailbox so it is ordered with everything else
+	int caps_length;
+	char* caps_line = bvd_caps_format(caps, &caps_length);
+	bvd_reply(session, LOGIN_ACK_NOTICE_TYPE, hdr->msgid, caps_line, caps_length);
+	//only now, so that a HEARTBEAT cannot go out ahead of the ACK
+	if(bvd_idle_timeout_ms > 0 || bvd_heartbeat_ms > 0)
+		timer_schedule(&session->idle, 0);
+	bvd_start_mailbox_service(session);
+}
+
+/*
+	Starts the mailbox service thread of a logged in session.
+*/
+void bvd_start_mailbox_service(client_session* session){
+	if(bvd_merged_service){
+		//no thread: bvd_client_wait() serves the mailbox between packets
+		session->ms = malloc(sizeof(mailbox_session));
+		bvd_mailbox_open(session->ms, session->fd, session->shm, session->mb);
+		session->ms->efd = mb_eventfd(session->mb);
+		mb_ref(session->mb); //for the mailbox session
+		return;
+	}
+	mailbox_start* start = malloc(sizeof(mailbox_start));
+	start->fdmb.fd = session->fd;
+	start->fdmb.mb = session->mb;
+	start->shm = session->shm;
+	mb_ref(session->mb); //for the mailbox service thread
+	pthread_create(&session->mb_tid, NULL, bvd_mailbox_service, start);
+}
+
+/*
+	LOGOUT: unregisters the handle, which shuts down the mailbox and
+	therefore the mailbox service thread.  The ACK is written only once
+	that thread is gone, so that the two never write at the same time.
+	hdr is NULL if the client went away without logging out.
+*/
+void bvd_logout(client_session* session, bvd_packet_header* hdr){
+	if(session->mb == NULL){
+		if(hdr != NULL)
+			bvd_reply(session, NACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+		return;
+	}
+
+	bvd_idle_stop(session); //it looks at the mailbox
+	char* handle = strdup(mb_get_handle(session->mb));
+	cluster_release(handle);
+	dir_unregister(handle);
+	free(handle);
+	if(session->ms != NULL){
+		bvd_mailbox_close(session->ms);
+		free(session->ms);
+		session->ms = NULL;
+		mb_unref(session->mb); //the mailbox session's
+	}
+	else{
+		pthread_join(session->mb_tid, NULL);
+	}
+	mb_unref(session->mb);
+	session->mb = NULL;
+
+	if(hdr != NULL)
+		bvd_reply(session, ACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+}
+
+/*
+	USERS: the ACK carries every registered handle, one per line.
+*/
+void bvd_users(client_session* session, bvd_packet_header* hdr){
+	if(session->mb == NULL){
+		bvd_reply(session, NACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+		return;
+	}
+
+	char** handles = dir_all_handles();
+	int length = 0;
+	for(int i = 0; handles[i] != NULL; i++){
+		length += strlen(handles[i]) + 2;
+	}
+
+	char* body = malloc(length + 1);
+	char* ptr = body;
+	for(int i = 0; handles[i] != NULL; i++){
+		ptr += sprintf(ptr, "%s\r\n", handles[i]);
+		free(handles[i]);
+	}
+	free(handles);
+
+	bvd_reply(session, ACK_NOTICE_TYPE, hdr->msgid, body, length);
+}
+
+/*
+	SEND: the payload is (handle of receiver)\r\n(message body).
+*/
+void bvd_send(client_session* session, bvd_packet_header* hdr, char* payload){
+	char* eol = payload == NULL ? NULL : strstr(payload, "\r\n");
+	if(session->mb == NULL || eol == NULL){
+		bvd_reply(session, NACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+		return;
+	}
+	*eol = '\0';
+	bvd_alias_bind(session, payload);
+	if(bvd_dedup_check(session, hdr->msgid)){
+		bvd_reply(session, ACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+		return;
+	}
+
+	int length;
+	char* body = eol + 2;
+	int body_length = hdr->payload_length - (body - payload);
+	char* dlvr = bvd_make_dlvr(session, body, body_length, &length);
+	MAILBOX* to = dlvr == NULL ? NULL : dir_lookup(payload);
+	if(to == NULL){
+		//not logged in here, but maybe somewhere else in the cluster
+		mb_ref(session->mb); //for the "from" field of the message
+		if(dlvr != NULL && cluster_enabled() && cluster_forward(session->mb, hdr->msgid, payload, dlvr, length) == 0){
+			hot_count(&session->hot, mb_get_id(session->mb), BVD_NO_ID, body_length);
+			bvd_dedup_record(session, hdr->msgid);
+			bvd_reply(session, ACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+			return;
+		}
+		mb_unref(session->mb);
+		free(dlvr);
+		bvd_reply(session, NACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+		return;
+	}
+
+	MB_BATCH_MESSAGE msg = {hdr->msgid, session->mb, dlvr, length};
+	void* held = NULL;
+	if(history_enabled)
+		held = history_record(mb_get_id(session->mb), mb_get_id(to), payload, hdr->msgid, dlvr, length);
+	hot_count(&session->hot, mb_get_id(session->mb), mb_get_id(to), body_length);
+	mb_ref(session->mb); //for the "from" field of the message
+	int taken = shard_add_messages(to, &msg, 1) == 0;
+	if(!taken){
+		//the receiver is going away, as mb_add_message() would
+		free(dlvr);
+		mb_unref(session->mb);
+	}
+	if(held != NULL)
+		history_settle(held, taken);
+	mb_unref(to);
+
+	bvd_dedup_record(session, hdr->msgid);
+	bvd_reply(session, ACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+}
+
+/*
+	SEND of a body too large to buffer: see stream.h.
+	The payload is still on the socket, just past the header, or past
+	where the handle line would be if the SEND is to a bound ID.
+	Returns -1 if the connection can no longer be used.
+*/
+int bvd_send_stream(client_session* session, bvd_packet_header* hdr, char* bound){
+	char handle[BVD_STREAM_HANDLE_MAX];
+	uint32_t consumed = 0;
+	if(bound != NULL){
+		//counted in the length, though the client did not send it
+		consumed = strlen(bound) + 2;
+		if(consumed > sizeof(handle))
+			return -1;
+		strcpy(handle, bound);
+	}
+	else{
+		if(stream_read_line(session->fd, handle, sizeof(handle), &consumed) < 0)
+			return -1;
+		bvd_alias_bind(session, handle);
+	}
+	uint32_t length = hdr->payload_length - consumed;
+	if(trace_enabled){
+		//the body is not read here, so only the handle line is known
+		char line[BVD_STREAM_HANDLE_MAX + 2];
+		int line_length = snprintf(line, sizeof(line), "%s\r\n", handle);
+		bvd_trace(session, hdr, line, line_length);
+	}
+	if(bvd_dedup_check(session, hdr->msgid)){
+		bvd_reply(session, ACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+		return stream_drain(session->fd, length);
+	}
+
+	uint8_t frame[BVD_FRAME_HEADER_SIZE];
+	int framed = session->caps & BVD_CAP_LZ4;
+	if(framed){
+		if(length < BVD_FRAME_HEADER_SIZE || proto_read_fully(session->fd, frame, sizeof(frame)) < 0)
+			return -1;
+		length -= BVD_FRAME_HEADER_SIZE;
+
+		//a compressed body cannot be unframed on the fly for a legacy
+		//receiver, so it is buffered like any other SEND instead
+		if(frame[0] != BVD_CODEC_RAW)
+			return bvd_send_buffered(session, hdr, handle, consumed, frame, sizeof(frame));
+	}
+
+	MAILBOX* to = dir_lookup(handle);
+	if(to == NULL){
+		//another node of the cluster can only take it buffered
+		if(cluster_enabled() && hdr->payload_length <= proto_max_payload)
+			return bvd_send_buffered(session, hdr, handle, consumed, frame, framed ? sizeof(frame) : 0);
+		bvd_reply(session, NACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+		return stream_drain(session->fd, length);
+	}
+
+	BVD_STREAM st;
+	st.fd = session->fd;
+	st.length = length;
+	st.status = -1;
+	st.drained = 0;
+	sem_init(&st.done, 0, 0);
+
+	MB_BATCH_MESSAGE msg = {hdr->msgid, session->mb, &st, BVD_STREAM_LENGTH};
+	mb_ref(session->mb); //for the "from" field of the message
+	shard_flush(to); //not ahead of messages still on their way to the receiver
+	int accepted = mb_add_messages(to, &msg, 1) == 0;
+	uint32_t to_id = mb_get_id(to);
+	mb_unref(to);
+	if(!accepted){
+		mb_unref(session->mb);
+		sem_destroy(&st.done);
+		bvd_reply(session, NACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+		return stream_drain(session->fd, length);
+	}
+	hot_count(&session->hot, mb_get_id(session->mb), to_id, length);
+	bvd_dedup_record(session, hdr->msgid);
+	bvd_reply(session, ACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+
+	//the receiver's mailbox service thread reads the body from here on
+	bvd_stream_wait(session, &st);
+	sem_destroy(&st.done);
+	bvd_idle_touch(session); //a long stream is not a quiet client
+	debug("stream %u to %s: status %d", hdr->msgid, handle, st.status);
+	if(!st.drained)
+		return stream_drain(session->fd, st.length);
+	return 0;
+}
+
+/*
+	Falls back from streaming to an ordinary SEND: reads the rest of the
+	payload, past the handle line (consumed bytes) and the prefix_len
+	bytes already read into prefix, and hands all of it to bvd_send().
+*/
+int bvd_send_buffered(client_session* session, bvd_packet_header* hdr, char* handle, uint32_t consumed, void* prefix, int prefix_len){
+	if(hdr->payload_length > proto_max_payload)
+		return -1;
+	char* payload = malloc(hdr->payload_length + 1);
+	int hlen = strlen(handle);
+	memcpy(payload, handle, hlen);
+	memcpy(payload + hlen, "\r\n", 2);
+	memcpy(payload + consumed, prefix, prefix_len);
+	if(proto_read_fully(session->fd, payload + consumed + prefix_len, hdr->payload_length - consumed - prefix_len) < 0){
+		free(payload);
+		return -1;
+	}
+	payload[hdr->payload_length] = '\0';
+	bvd_send(session, hdr, payload);
+	free(payload);
+	return 0;
+}
+
+/*
+	SEND_BATCH: see batch.h for the format.
+	The records are sorted by receiver ID so that each receiver is looked
+	up once and gets all of its records under one mailbox lock.  Handles
+	that were never interned all get BVD_NO_ID and so end up in one
+	group with no local mailbox, which is fine as every record of that
+	group is either forwarded on its own or NACKed.
+*/
+void bvd_send_batch(client_session* session, bvd_packet_header* hdr, char* payload){
+	BVD_BATCH_RECORD* records = NULL;
+	int count = -1;
+	if(session->mb != NULL && payload != NULL)
+		count = bvd_batch_parse(payload, hdr->payload_length, &records);
+	if(count < 0){
+		bvd_reply(session, NACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+		return;
+	}
+
+	int bitmap_len = (count + 7) / 8;
+	uint8_t* nack_bitmap = calloc(bitmap_len, 1);
+	MB_BATCH_MESSAGE* msgs = malloc(sizeof(MB_BATCH_MESSAGE) * count);
+	int* msg_index = malloc(sizeof(int) * count); //record each message came from
+	void** held = history_enabled ? malloc(sizeof(void*) * count) : NULL; //records to settle
+
+	for(int i = 0; i < count; i++)
+		records[i].id = intern_find(records[i].handle);
+	qsort(records, count, sizeof(BVD_BATCH_RECORD), bvd_record_cmp);
+
+	int start = 0;
+	while(start < count){
+		int end = start + 1;
+		while(end < count && records[start].id == records[end].id)
+			end++;
+
+		MAILBOX* to = records[start].id == BVD_NO_ID ? NULL : dir_lookup_id(records[start].id);
+		int remote = to == NULL && cluster_enabled();
+		int n = 0;
+		for(int i = start; i < end; i++){
+			BVD_BATCH_RECORD* rec = &records[i];
+			if(bvd_dedup_check(session, rec->msgid))
+				continue; //ACKed, as it is not NACKed
+			char* dlvr = to == NULL && !remote ? NULL : bvd_make_dlvr(session, rec->body, rec->length, &msgs[n].length);
+			if(dlvr != NULL && remote){
+				mb_ref(session->mb); //for the "from" field of the message
+				if(cluster_forward(session->mb, rec->msgid, rec->handle, dlvr, msgs[n].length) == 0){
+					hot_count(&session->hot, mb_get_id(session->mb), BVD_NO_ID, rec->length);
+					bvd_dedup_record(session, rec->msgid);
+					continue;
+				}
+				mb_unref(session->mb);
+				free(dlvr);
+				dlvr = NULL;
+			}
+			if(dlvr == NULL){
+				nack_bitmap[rec->index / 8] |= 1 << (rec->index % 8);
+				continue;
+			}
+			msgs[n].msgid = rec->msgid;
+			msgs[n].from = session->mb;
+			msgs[n].body = dlvr;
+			msg_index[n] = rec->index;
+			//now, so that a record sent twice in the batch is taken once
+			bvd_dedup_record(session, rec->msgid);
+			if(held != NULL)
+				held[n] = history_record(mb_get_id(session->mb), rec->id, rec->handle, rec->msgid, dlvr, msgs[n].length);
+			hot_count(&session->hot, mb_get_id(session->mb), rec->id, rec->length);
+			n++;
+		}
+		if(n > 0){
+			mb_refn(session->mb, n); //one for the "from" field of each message
+			int taken = shard_add_messages(to, msgs, n) == 0;
+			if(!taken){
+				//newest first, as only the last one recorded can be taken back
+				for(int i = n - 1; i >= 0; i--){
+					bvd_dedup_unrecord(session, msgs[i].msgid);
+					free(msgs[i].body);
+					mb_unref(session->mb);
+					nack_bitmap[msg_index[i] / 8] |= 1 << (msg_index[i] % 8);
+				}
+				//and the copies of them later in the group, which were skipped
+				for(int i = start; i < end; i++){
+					for(int j = 0; j < n; j++){
+						if(records[i].msgid == msgs[j].msgid)
+							nack_bitmap[records[i].index / 8] |= 1 << (records[i].index % 8);
+					}
+				}
+			}
+			for(int i = 0; held != NULL && i < n; i++){
+				if(held[i] != NULL)
+					history_settle(held[i], taken);
+			}
+		}
+		if(to != NULL)
+			mb_unref(to);
+		start = end;
+	}
+
+	free(msgs);
+	free(msg_index);
+	free(held);
+	free(records);
+	bvd_reply(session, ACK_NOTICE_TYPE, hdr->msgid, nack_bitmap, bitmap_len);
+}
+
+/*
+	With the "dedup" capability: whether the client sent a message with
+	this msgid already, see dedup.h.
+*/
+int bvd_dedup_check(client_session* session, uint32_t msgid){
+	if(!(session->caps & BVD_CAP_DEDUP))
+		return 0;
+	metrics_add(METRIC_DEDUP_CHECKED, 1);
+	if(!mb_msgid_seen(session->mb, msgid))
+		return 0;
+	debug("fd %d: msgid %u sent again", session->fd, msgid);
+	metrics_add(METRIC_DEDUP_SUPPRESSED, 1);
+	return 1;
+}
+
+/*
+	With the "dedup" capability: the message with this msgid was taken.
+*/
+void bvd_dedup_record(client_session* session, uint32_t msgid){
+	if(session->caps & BVD_CAP_DEDUP)
+		mb_msgid_record(session->mb, msgid);
+}
+
+/*
+	With the "dedup" capability: the message with this msgid, the last
+	one recorded, was not taken after all.
+*/
+void bvd_dedup_unrecord(client_session* session, uint32_t msgid){
+	if(session->caps & BVD_CAP_DEDUP)
+		mb_msgid_unrecord(session->mb, msgid);
+}
+
+/*
+	With -L or -H: whether the packet is over the rate of its connection
+	or of its handle, see ratelimit.h.  It is counted against both if not.
+*/
+int bvd_rate_exceeded(client_session* session, bvd_packet_header* hdr){
+	if(hdr->type == BVD_LOGOUT_PKT || hdr->type == BVD_HEARTBEAT_PKT)
+		return 0;
+	if(rate_conn_limit.packets == 0 && rate_conn_limit.bytes == 0
+		&& rate_handle_limit.packets == 0 && rate_handle_limit.bytes == 0)
+		return 0;
+	RATE_BUCKET* handle = session->mb == NULL ? NULL : dir_rate_bucket(mb_get_id(session->mb));
+	if(rate_take(&session->rate, handle, sizeof(*hdr) + hdr->payload_length) == 0)
+		return 0;
+	debug("fd %d: over the rate limit, msgid %u refused", session->fd, hdr->msgid);
+	return 1;
+}
+
+/*
+	With -X or -x: records a packet the client sent, of which length
+	bytes of payload are known, see trace.h.
+*/
+void bvd_trace(client_session* session, bvd_packet_header* hdr, void* payload, uint32_t length){
+	if(!trace_enabled)
+		return;
+	if(session->trace_conn == 0)
+		session->trace_conn = trace_new_conn();
+	trace_packet(session->trace_conn, hdr, payload, length);
+}
+
+/*
+	With v2: a SEND that names its receiver with an ID binds the ID to
+	the receiver's handle, see wire.h.  A handle that was never logged
+	in here is not bound, as there is no ID to bind it to; the client
+	learns that at its next SEND to the ID, and names it again.
+*/
+void bvd_alias_bind(client_session* session, char* handle){
+	if((session->wire_flags & (BVD_WIRE_ID | BVD_WIRE_NAMED)) != (BVD_WIRE_ID | BVD_WIRE_NAMED))
+		return;
+	uint32_t alias = session->wire_id;
+	uint32_t id = intern_find(handle);
+	if(alias >= BVD_WIRE_MAX_ALIAS || id == BVD_NO_ID)
+		return;
+	if(alias >= session->num_aliases){
+		uint32_t num = session->num_aliases == 0 ? 16 : session->num_aliases;
+		while(alias >= num)
+			num *= 2;
+		session->aliases = realloc(session->aliases, sizeof(uint32_t) * num);
+		for(uint32_t i = session->num_aliases; i < num; i++)
+			session->aliases[i] = BVD_NO_ID;
+		session->num_aliases = num;
+	}
+	session->aliases[alias] = id;
+}
+
+/*
+	With v2: the handle bound to the ID of the packet being served,
+	or NULL if there is none.
+*/
+char* bvd_alias_handle(client_session* session){
+	uint32_t alias = session->wire_id;
+	if(alias >= session->num_aliases || session->aliases[alias] == BVD_NO_ID)
+		return NULL;
+	return intern_name(session->aliases[alias]);
+}
+
+/*
+	Reads the header of the next packet, in the client's wire format.
+	A v2 header is only peeked at, see wire_peek_header().
+*/
+int bvd_recv_header(client_session* session, bvd_packet_header* hdr){
+	session->wire_skip = 0;
+	if(session->shm != NULL)
+		return bvd_shm_header(session, hdr);
+	if(session->wire == BVD_WIRE_V1){
+		session->wire_flags = 0;
+		session->wire_id = 0;
+		return proto_recv_header(session->fd, hdr);
+	}
+	int left = wire_peek_header(session->fd, hdr, &session->wire_flags, &session->wire_id);
+	if(left < 0)
+		return -1;
+	session->wire_skip = left;
+	return 0;
+}
+
+/*
+	Reads the rest of the packet, a peeked header included, like
+	proto_recv_payload() would.  The body of a SEND to a bound ID is read
+	into a payload that starts with the handle line, as if the client
+	had sent it, so that nothing after this needs to know; by now
+	hdr->payload_length counts the line.
+*/
+int bvd_recv_rest(client_session* session, bvd_packet_header* hdr, char* bound, void** payload){
+	uint32_t size = hdr->payload_length;
+	uint32_t line = bound == NULL ? 0 : strlen(bound) + 2;
+	if(size > proto_max_payload){
+		debug("payload of %u bytes is over the limit of %u", size, proto_max_payload);
+		errno = EMSGSIZE;
+		return -1;
+	}
+	char* buf = size > 0 ? malloc(size + 1) : NULL;
+	if(line > 0){
+		memcpy(buf, bound, line - 2);
+		memcpy(buf + line - 2, "\r\n", 2);
+	}
+	int ret = session->shm != NULL ? shm_read_fully(session->shm, buf + line, size - line)
+		: wire_read_rest(session->fd, session->wire_skip, buf + line, size - line);
+	if(ret < 0){
+		free(buf);
+		return -1;
+	}
+	session->wire_skip = 0;
+	if(buf != NULL)
+		buf[size] = '\0';
+	*payload = buf;
+	return 0;
+}
+
+/*
+	Reads a peeked header, for the few paths that read the payload
+	from the socket themselves.
+*/
+int bvd_skip_header(client_session* session){
+	if(session->wire_skip > 0 && stream_drain(session->fd, session->wire_skip) < 0)
+		return -1;
+	session->wire_skip = 0;
+	return 0;
+}
+
+/*
+	Reads and throws away length bytes of a payload the client sent.
+*/
+int bvd_drain(client_session* session, uint32_t length){
+	if(session->shm != NULL)
+		return shm_read_fully(session->shm, NULL, length);
+	return stream_drain(session->fd, length);
+}
+
+/*
+	A client on the Unix-domain socket may start with an offer of
+	shared memory, see shm.h.  It is ACKed through the rings, or NACKed
+	on the socket, which then goes on as usual.
+	Returns -1 if the connection can no longer be used.
+*/
+int bvd_shm_start(client_session* session){
+	bvd_packet_header hdr;
+	if(shm_accept(session->fd, &hdr, &session->shm) < 0){
+		if(hdr.type != BVD_SHM_PKT)
+			return -1;
+		bvd_reply(session, NACK_NOTICE_TYPE, hdr.msgid, NULL, 0);
+		return stream_drain(session->fd, hdr.payload_length);
+	}
+	if(session->shm == NULL)
+		return 0;
+	debug("fd %d: on shared memory, rings of %u bytes", session->fd, session->shm->ring_size);
+	session->shm->stop_fd = handoff_stop_fd();
+	session->shm->write_timeout_ms = outq_deadline_ms;
+	bvd_reply(session, ACK_NOTICE_TYPE, hdr.msgid, NULL, 0);
+	return 0;
+}
+
+/*
+	Reads the header of the next packet from the ring, whole, as there
+	is nothing to peek at.
+*/
+int bvd_shm_header(client_session* session, bvd_packet_header* hdr){
+	session->wire_flags = 0;
+	session->wire_id = 0;
+	if(session->wire == BVD_WIRE_V1){
+		if(shm_read_fully(session->shm, hdr, sizeof(bvd_packet_header)) < 0)
+			return -1;
+		hdr->payload_length = ntohl(hdr->payload_length);
+		hdr->msgid = ntohl(hdr->msgid);
+		hdr->timestamp_sec = ntohl(hdr->timestamp_sec);
+		hdr->timestamp_nsec = ntohl(hdr->timestamp_nsec);
+		return 0;
+	}
+	//the first byte says how long the header is
+	uint8_t buf[BVD_WIRE_MAX_HEADER];
+	if(shm_read_fully(session->shm, buf, 1) < 0)
+		return -1;
+	size_t hlen = wire_header_length(BVD_WIRE_V2, buf);
+	if(hlen > 1 && shm_read_fully(session->shm, buf + 1, hlen - 1) < 0)
+		return -1;
+	if(wire_decode_header(buf, hlen, hdr, &session->wire_flags, &session->wire_id) < 0){
+		debug("malformed v2 header");
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	STATS: the ACK carries the metrics report.
+*/
+void bvd_stats(client_session* session, bvd_packet_header* hdr){
+	if(session->mb == NULL){
+		bvd_reply(session, NACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+		return;
+	}
+	int length;
+	char* report = metrics_report(&length);
+	bvd_reply(session, ACK_NOTICE_TYPE, hdr->msgid, report, length);
+}
+
+/*
+	HISTORY: see history.h.  The payload is handed to the mailbox
+	service thread, which looks the range up and writes it out in turn
+	with the rest of the mailbox.
+*/
+void bvd_history(client_session* session, bvd_packet_header* hdr, void* payload){
+	HISTORY_QUERY q;
+	if(session->mb == NULL || !history_enabled || history_parse(payload, hdr->payload_length, &q) < 0){
+		free(payload);
+		bvd_reply(session, NACK_NOTICE_TYPE, hdr->msgid, NULL, 0);
+		return;
+	}
+	mb_add_notice(session->mb, HISTORY_NOTICE_TYPE, hdr->msgid, payload, hdr->payload_length);
+}
+
+/*
+	Sends an ACK or NACK for a request.  Once the client is logged in
+	it goes through the mailbox, before that straight to the socket.
+	Takes ownership of body.
+*/
+void bvd_reply(client_session* session, NOTICE_TYPE type, int msgid, void* body, int length){
+	if(session->mb != NULL){
+		mb_add_notice(session->mb, type, msgid, body, length);
+		return;
+	}
+	//v1, but for the ACK of a LOGOUT on a connection that had v2
+	bvd_packet_header hdr;
+	proto_init_header(&hdr, type == ACK_NOTICE_TYPE ? BVD_ACK_PKT : BVD_NACK_PKT, msgid, length);
+	if(session->shm != NULL){
+		uint8_t head[BVD_WIRE_MAX_HEADER];
+		int head_length = wire_encode_header(session->wire, &hdr, 0, 0, head);
+		if(shm_write_fully(session->shm, head, head_length) == 0 && length > 0)
+			shm_write_fully(session->shm, body, length);
+	}
+	else{
+		wire_send_packet(session->fd, session->wire, &hdr, 0, 0, body);
+	}
+	free(body);
+}
+
+/*
+	Undelivered messages left in a mailbox that goes away are
+	bounced back to their sender.
+*/
+void bvd_discard_hook(MAILBOX_ENTRY* entry){
+	if(entry->type == MESSAGE_ENTRY_TYPE && entry->content.message.from != NULL){
+		cluster_notify(entry->content.message.from, BOUNCE_NOTICE_TYPE,
+			entry->content.message.msgid, entry->body, entry->length);
+	}
+	//the sender is still waiting, and will drain the body itself
+	if(BVD_IS_STREAM(entry)){
+		BVD_STREAM* st = entry->body;
+		entry->body = NULL;
+		sem_post(&st->done);
+	}
+}
+
+/*
+	Builds the payload of the DLVR packet up front,
+	(handle of sender)\r\n(framed message body), so the mailbox
+	service thread can write it out as is.  A body from a client
+	with the lz4 capability is framed already and only checked;
+	any other body is framed here, and compressed if it is big enough.
+	Returns NULL if the sender's frame is malformed.
+*/
+char* bvd_make_dlvr(client_session* session, char* body, int length, int* dlvr_length){
+	char* handle = mb_get_handle(session->mb);
+	int hlen = strlen(handle);
+	char* dlvr;
+	int raw_length;
+
+	if(session->caps & BVD_CAP_LZ4){
+		int codec = bvd_frame_check(body, length, &raw_length);
+		if(codec < 0)
+			return NULL;
+		//every receiver without the capability gets it unpacked
+		if(codec == BVD_CODEC_LZ4 && (uint32_t)raw_length > proto_max_payload)
+			return NULL;
+		if(codec == BVD_CODEC_LZ4){
+			metrics_add(METRIC_LZ_RAW_BYTES, raw_length);
+			metrics_add(METRIC_LZ_STORED_BYTES, length);
+		}
+		*dlvr_length = hlen + 2 + length;
+		dlvr = malloc(*dlvr_length);
+		memcpy(dlvr + hlen + 2, body, length);
+	}
+	else{
+		dlvr = malloc(hlen + 2 + BVD_FRAME_BOUND(length));
+		long start = metrics_now_nsec();
+		int framed = bvd_frame_body(body, length, 1, dlvr + hlen + 2);
+		if(length >= BVD_COMPRESS_MIN){
+			metrics_add(METRIC_LZ_COMPRESS_NSEC, metrics_now_nsec() - start);
+			metrics_add(METRIC_LZ_COMPRESS_BYTES, length);
+		}
+		if(dlvr[hlen + 2] == BVD_CODEC_LZ4){
+			metrics_add(METRIC_LZ_RAW_BYTES, length);
+			metrics_add(METRIC_LZ_STORED_BYTES, framed);
+			//give back what compression saved, it may sit in the mailbox a while
+			dlvr = realloc(dlvr, hlen + 2 + framed);
+		}
+		*dlvr_length = hlen + 2 + framed;
+	}
+
+	memcpy(dlvr, handle, hlen);
+	memcpy(dlvr + hlen, "\r\n", 2);
+	return dlvr;
+}
+
+/*
+	Groups batch records by receiver, keeping batch order within a group.
+*/
+int bvd_record_cmp(const void* a, const void* b){
+	const BVD_BATCH_RECORD* ra = a;
+	const BVD_BATCH_RECORD* rb = b;
+	if(ra->id != rb->id)
+		return ra->id < rb->id ? -1 : 1;
+	return ra->index - rb->index;
+}
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+#include "shard.h"
+#include "mailbox.h"
+#include "mailbox_ext.h"
+#include "cluster.h"
+#include "metrics.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+
+#define SHARD_RING_MASK (BVD_SHARD_RING - 1)
+
+
+//STRUCTS
+//A message on its way to another shard
+typedef struct shard_slot {
+	MAILBOX* to;	//holds a reference for the message
+	MB_BATCH_MESSAGE msg;
+} shard_slot;
+
+//The queue from one shard to another; head and tail on lines of their own
+typedef struct shard_ring {
+	_Alignas(64) atomic_uint head;	//next slot to take, moved by the router
+	_Alignas(64) atomic_uint tail;	//next slot to fill, moved by the pushers
+	sem_t push_lock;	//serializes the threads of the pushing shard
+	shard_slot slots[BVD_SHARD_RING];
+} shard_ring;
+
+typedef struct shard {
+	int cpu;
+	int index;
+	shard_ring* in;	//in[i] is the queue from shard i
+	atomic_int asleep;	//the router is waiting on wake, or about to
+	sem_t wake;
+	pthread_t router;
+} shard;
+
+
+//HELPER FUNCTION DECLARATIONS
+void* shard_router(void*);
+int shard_drain(shard_ring*);
+int shard_pending(shard*);
+void shard_push(shard*, shard_ring*, MAILBOX*, MB_BATCH_MESSAGE*, int);
+void shard_wake(shard*);
+
+
+//GLOBAL VARIABLES
+int shard_count = 0;
+shard* shards = NULL;
+atomic_int shard_rr = 0;
+__thread int shard_self = -1; //shard of the calling thread, -1 if none
+
+
+
+/*
+ * Starts n shards and their router threads.
+ */
+int shard_init(int n){
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		return -1;
+	int cpus[CPU_SETSIZE];
+	int num_cpus = 0;
+	for(int c = 0; c < CPU_SETSIZE; c++){
+		if(CPU_ISSET(c, &allowed))
+			cpus[num_cpus++] = c;
+	}
+	if(n == 0)
+		n = num_cpus;
+	if(n < 1 || num_cpus == 0)
+		return -1;
+
+	shards = calloc(n, sizeof(shard));
+	for(int i = 0; i < n; i++){
+		shard* s = &shards[i];
+		s->cpu = cpus[i % num_cpus];
+		s->index = i;
+		if(posix_memalign((void**)&s->in, 64, sizeof(shard_ring) * n) != 0)
+			return -1;
+		for(int j = 0; j < n; j++){
+			atomic_init(&s->in[j].head, 0);
+			atomic_init(&s->in[j].tail, 0);
+			sem_init(&s->in[j].push_lock, 0, 1);
+		}
+		atomic_init(&s->asleep, 0);
+		sem_init(&s->wake, 0, 0);
+	}
+	shard_count = n;
+	for(int i = 0; i < n; i++){
+		if(pthread_create(&shards[i].router, NULL, shard_router, &shards[i]) != 0)
+			return -1;
+		pthread_detach(shards[i].router);
+	}
+	debug("%d shards on %d CPUs", n, num_cpus);
+	return 0;
+}
+
+/*
+ * The shard a new connection should go to.
+ */
+int shard_next(void){
+	if(shard_count == 0)
+		return -1;
+	return (unsigned)atomic_fetch_add(&shard_rr, 1) % shard_count;
+}
+
+/*
+ * The home shard of the handle of a mailbox.
+ */
+int shard_home(MAILBOX *mb){
+	if(shard_count == 0)
+		return -1;
+	return mb_get_id(mb) % shard_count;
+}
+
+/*
+ * Pins the calling thread to the CPU of a shard.
+ */
+void shard_enter(int shard){
+	if(shard_count == 0 || shard == shard_self)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(shards[shard].cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	shard_self = shard;
+}
+
+/*
+ * Add messages to a mailbox, through the queue to its home shard if need be.
+ */
+int shard_add_messages(MAILBOX *to, MB_BATCH_MESSAGE *msgs, int count){
+	if(shard_count == 0 || shard_self < 0)
+		return mb_add_messages(to, msgs, count);
+	shard* home = &shards[shard_home(to)];
+	if(home->index == shard_self)
+		return mb_add_messages(to, msgs, count);
+
+	mb_refn(to, count); //one for each slot
+	shard_push(home, &home->in[shard_self], to, msgs, count);
+	return 0;
+}
+
+/*
+ * Waits until what the calling thread's shard has queued for the home
+ * shard of a mailbox is in its mailbox.
+ */
+void shard_flush(MAILBOX *to){
+	if(shard_count == 0 || shard_self < 0)
+		return;
+	shard* home = &shards[shard_home(to)];
+	if(home->index == shard_self)
+		return;
+	shard_ring* ring = &home->in[shard_self];
+	unsigned tail = atomic_load(&ring->tail);
+	//head only moves forward, past tail once what was there is delivered
+	while((int)(atomic_load(&ring->head) - tail) < 0){
+		shard_wake(home);
+		sched_yield();
+	}
+}
+
+/*
+ * Waits until every queue is empty.
+ */
+void shard_quiesce(void){
+	for(int i = 0; i < shard_count; i++){
+		while(shard_pending(&shards[i])){
+			shard_wake(&shards[i]);
+			usleep(100);
+		}
+	}
+}
+
+/*
+	Thread function of the router of a shard: moves messages from the
+	queues into the mailboxes, and sleeps when there are none.
+*/
+void* shard_router(void* arg){
+	shard* s = arg;
+	shard_enter(s->index);
+	while(1){
+		int moved = 0;
+		for(int i = 0; i < shard_count; i++)
+			moved += shard_drain(&s->in[i]);
+		if(moved > 0)
+			continue;
+
+		//say we are going to sleep before the last look, so that a push
+		//either shows up in that look or sees asleep and posts wake
+		atomic_store(&s->asleep, 1);
+		if(shard_pending(s) && atomic_exchange(&s->asleep, 0) == 1)
+			continue;
+		while(sem_wait(&s->wake) < 0)
+			;
+	}
+	return NULL;
+}
+
+/*
+	Adds up to BVD_SHARD_BATCH queued messages to their mailboxes, a run
+	of messages for the same mailbox at a time.  The slots are given back
+	only once delivered, so that an empty queue means all is delivered.
+	Returns the number of messages moved.
+*/
+int shard_drain(shard_ring* ring){
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	int n = tail - head;
+	if(n > BVD_SHARD_BATCH)
+		n = BVD_SHARD_BATCH;
+
+	MB_BATCH_MESSAGE msgs[BVD_SHARD_BATCH];
+	int i = 0;
+	while(i < n){
+		MAILBOX* to = ring->slots[(head + i) & SHARD_RING_MASK].to;
+		int count = 0;
+		while(i + count < n && ring->slots[(head + i + count) & SHARD_RING_MASK].to == to){
+			msgs[count] = ring->slots[(head + i + count) & SHARD_RING_MASK].msg;
+			count++;
+		}
+		if(mb_add_messages(to, msgs, count) < 0){
+			//gone since the SEND was ACKed: the messages bounce
+			for(int j = 0; j < count; j++){
+				cluster_notify(msgs[j].from, BOUNCE_NOTICE_TYPE, msgs[j].msgid, msgs[j].body, msgs[j].length);
+				mb_unref(msgs[j].from);
+				free(msgs[j].body);
+			}
+		}
+		for(int j = 0; j < count; j++)
+			mb_unref(to);
+		i += count;
+	}
+
+	if(n > 0){
+		atomic_store_explicit(&ring->head, head + n, memory_order_release);
+		metrics_add(METRIC_SHARD_FORWARDED, n);
+		metrics_add(METRIC_SHARD_BATCHES, 1);
+	}
+	return n;
+}
+
+/*
+	Whether any queue into the shard has messages.
+*/
+int shard_pending(shard* s){
+	for(int i = 0; i < shard_count; i++){
+		if(atomic_load(&s->in[i].head) != atomic_load(&s->in[i].tail))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	Puts messages on a queue, all at once if there is room, and wakes
+	up the router.  The slots inherit the caller's references.
+*/
+void shard_push(shard* s, shard_ring* ring, MAILBOX* to, MB_BATCH_MESSAGE* msgs, int count){
+	sem_wait(&ring->push_lock);
+	int i = 0;
+	while(i < count){
+		unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		int room = BVD_SHARD_RING - (tail - head);
+		if(room == 0){
+			shard_wake(s);
+			sched_yield();
+			continue;
+		}
+		int n = count - i < room ? count - i : room;
+		for(int j = 0; j < n; j++){
+			shard_slot* slot = &ring->slots[(tail + j) & SHARD_RING_MASK];
+			slot->to = to;
+			slot->msg = msgs[i + j];
+		}
+		atomic_store(&ring->tail, tail + n);
+		i += n;
+	}
+	sem_post(&ring->push_lock);
+	shard_wake(s);
+}
+
+/*
+	Wakes up the router of a shard if it is asleep.
+*/
+void shard_wake(shard* s){
+	if(atomic_exchange(&s->asleep, 0) == 1)
+		sem_post(&s->wake);
+}
@@ -0,0 +1,504 @@
+#define _GNU_SOURCE
+#include "shm.h"
+#include "protocol_ext.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+
+#define SHM_CLIENT_TO_SERVER 0
+#define SHM_SERVER_TO_CLIENT 1
+
+
+//HELPER FUNCTION DECLARATIONS
+int shm_attach(SHM_CONN*, int*, int);
+int shm_check_region(SHM_CONN*, int);
+int shm_is_eventfd(int);
+int shm_wait(SHM_CONN*, int, int);
+void shm_poke(int);
+void shm_drain(int);
+void shm_copy_in(SHM_CONN*, uint64_t, void*, size_t);
+void shm_copy_out(SHM_CONN*, uint64_t, void*, size_t);
+void shm_close_fds(int*, int);
+
+
+
+/*
+ * Client: creates a region and its eventfds.
+ */
+SHM_CONN *shm_create(int fd, uint32_t ring_size){
+	if(ring_size < BVD_SHM_MIN_RING || ring_size > BVD_SHM_MAX_RING || (ring_size & (ring_size - 1)) != 0){
+		errno = EINVAL;
+		return NULL;
+	}
+	size_t size = BVD_SHM_DATA_OFFSET + 2 * (size_t)ring_size;
+	int fds[BVD_SHM_FDS];
+	for(int i = 0; i < BVD_SHM_FDS; i++)
+		fds[i] = -1;
+	fds[0] = memfd_create("bvd_shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(fds[0] < 0 || ftruncate(fds[0], size) < 0
+		|| fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0){
+		shm_close_fds(fds, 1);
+		return NULL;
+	}
+	for(int i = 1; i < BVD_SHM_FDS; i++){
+		if((fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0){
+			shm_close_fds(fds, BVD_SHM_FDS);
+			return NULL;
+		}
+	}
+
+	SHM_CONN* conn = calloc(1, sizeof(SHM_CONN));
+	conn->fd = fd;
+	conn->size = size;
+	conn->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if(conn->base == MAP_FAILED){
+		shm_close_fds(fds, BVD_SHM_FDS);
+		free(conn);
+		return NULL;
+	}
+	//a new memfd is all zeroes, so the rings are empty with nobody waiting
+	SHM_HEADER* header = conn->base;
+	header->magic = BVD_SHM_MAGIC;
+	header->version = BVD_SHM_VERSION;
+	header->ring_size = ring_size;
+	conn->ring_size = ring_size;
+	shm_attach(conn, fds, 1);
+	return conn;
+}
+
+/*
+ * Client: sends the offer of the region.
+ */
+int shm_offer(SHM_CONN *conn, uint32_t msgid){
+	bvd_packet_header hdr;
+	proto_init_header(&hdr, BVD_SHM_PKT, msgid, 0);
+	proto_header_to_wire(&hdr);
+	int fds[BVD_SHM_FDS] = {conn->memfd, conn->out_ready, conn->out_room, conn->in_ready, conn->in_room};
+
+	union {
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {&hdr, sizeof(hdr)};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	ssize_t n;
+	while((n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+		;
+	if(n < 0)
+		return -1;
+	//the rest of the header, without the descriptors this time
+	if((size_t)n < sizeof(hdr) && proto_write_fully(conn->fd, (char*)&hdr + n, sizeof(hdr) - n) < 0)
+		return -1;
+	//the mapping is all this side needs of it
+	close(conn->memfd);
+	conn->memfd = -1;
+	return 0;
+}
+
+/*
+ * Server: takes an offer of a region, if that is what comes first.
+ */
+int shm_accept(int fd, bvd_packet_header *hdr, SHM_CONN **conn){
+	memset(hdr, 0, sizeof(bvd_packet_header));
+	*conn = NULL;
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	if(getsockname(fd, (struct sockaddr*)&addr, &addrlen) < 0 || addr.ss_family != AF_UNIX)
+		return 0;
+	//a v1 header starts with its type
+	uint8_t type;
+	ssize_t n;
+	while((n = recv(fd, &type, 1, MSG_PEEK)) < 0 && errno == EINTR)
+		;
+	if(n <= 0 || type != BVD_SHM_PKT)
+		return 0;
+
+	int fds[BVD_SHM_FDS];
+	union {
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {hdr, sizeof(bvd_packet_header)};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	while((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+		;
+	if(n <= 0)
+		return -1;
+	int nfds = 0;
+	int extra = 0;
+	for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int* received = (int*)CMSG_DATA(cmsg);
+		for(int i = 0; i < count; i++){
+			if(nfds < BVD_SHM_FDS)
+				fds[nfds++] = received[i];
+			else{
+				close(received[i]);
+				extra = 1;
+			}
+		}
+	}
+	if((size_t)n < sizeof(bvd_packet_header) && proto_read_fully(fd, (char*)hdr + n, sizeof(bvd_packet_header) - n) < 0){
+		shm_close_fds(fds, nfds);
+		memset(hdr, 0, sizeof(bvd_packet_header));
+		return -1;
+	}
+	hdr->payload_length = ntohl(hdr->payload_length);
+	hdr->msgid = ntohl(hdr->msgid);
+	hdr->timestamp_sec = ntohl(hdr->timestamp_sec);
+	hdr->timestamp_nsec = ntohl(hdr->timestamp_nsec);
+	if(nfds != BVD_SHM_FDS || extra || (msg.msg_flags & MSG_CTRUNC) || hdr->payload_length != 0){
+		debug("fd %d: malformed offer of shared memory, %d descriptors", fd, nfds);
+		shm_close_fds(fds, nfds);
+		errno = EPROTO;
+		return -1;
+	}
+
+	SHM_CONN* c = calloc(1, sizeof(SHM_CONN));
+	c->fd = fd;
+	shm_attach(c, fds, 0);
+	if(shm_check_region(c, fds[0]) < 0){
+		debug("fd %d: unusable offer of shared memory", fd);
+		c->memfd = fds[0];
+		shm_close(c);
+		errno = EPROTO;
+		return -1;
+	}
+	close(fds[0]);
+	c->memfd = -1;
+	*conn = c;
+	return 0;
+}
+
+/*
+ * Unmaps the region and closes the eventfds.
+ */
+void shm_close(SHM_CONN *conn){
+	if(conn->base != NULL)
+		munmap(conn->base, conn->size);
+	int fds[BVD_SHM_FDS] = {conn->memfd, conn->in_ready, conn->out_room, conn->in_room, conn->out_ready};
+	shm_close_fds(fds, BVD_SHM_FDS);
+	free(conn);
+}
+
+/*
+ * Copies as much of iov as there is room for into the outgoing ring.
+ */
+ssize_t shm_writev(SHM_CONN *conn, struct iovec *iov, int count){
+	uint64_t head = atomic_load_explicit(&conn->out->head, memory_order_acquire);
+	uint64_t used = conn->out_tail - head;
+	if(used > conn->ring_size){
+		errno = EPROTO;
+		return -1;
+	}
+	size_t room = conn->ring_size - used;
+	size_t done = 0;
+	for(int i = 0; i < count && done < room; i++){
+		size_t n = iov[i].iov_len < room - done ? iov[i].iov_len : room - done;
+		shm_copy_in(conn, conn->out_tail + done, iov[i].iov_base, n);
+		done += n;
+	}
+	if(done == 0){
+		errno = EAGAIN;
+		return -1;
+	}
+	conn->out_tail += done;
+	atomic_store_explicit(&conn->out->tail, conn->out_tail, memory_order_release);
+	//either the reader sees the new tail in shm_want_data(), or this
+	//sees that it went to sleep
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load_explicit(&conn->out->data_wanted, memory_order_relaxed)
+		&& atomic_exchange(&conn->out->data_wanted, 0))
+		shm_poke(conn->out_ready);
+	return done;
+}
+
+/*
+ * Writes length bytes to the outgoing ring, waiting for room.
+ */
+int shm_write_fully(SHM_CONN *conn, void *buf, size_t length){
+	char* ptr = buf;
+	while(length > 0){
+		struct iovec iov = {ptr, length};
+		ssize_t n = shm_writev(conn, &iov, 1);
+		if(n > 0){
+			ptr += n;
+			length -= n;
+			continue;
+		}
+		if(errno != EAGAIN || shm_wait_room(conn) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Waits for room in the outgoing ring.
+ */
+int shm_wait_room(SHM_CONN *conn){
+	while(!shm_want_room(conn)){
+		if(shm_wait(conn, conn->out_room, conn->write_timeout_ms) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Copies up to length bytes out of the incoming ring.
+ */
+ssize_t shm_read(SHM_CONN *conn, void *buf, size_t length){
+	uint64_t tail = atomic_load_explicit(&conn->in->tail, memory_order_acquire);
+	uint64_t avail = tail - conn->in_head;
+	if(avail > conn->ring_size){
+		errno = EPROTO;
+		return -1;
+	}
+	if(avail == 0){
+		errno = EAGAIN;
+		return -1;
+	}
+	size_t n = avail < length ? avail : length;
+	shm_copy_out(conn, conn->in_head, buf, n);
+	conn->in_head += n;
+	atomic_store_explicit(&conn->in->head, conn->in_head, memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load_explicit(&conn->in->room_wanted, memory_order_relaxed)
+		&& atomic_exchange(&conn->in->room_wanted, 0))
+		shm_poke(conn->in_room);
+	return n;
+}
+
+/*
+ * Reads length bytes from the incoming ring.
+ */
+int shm_read_fully(SHM_CONN *conn, void *buf, size_t length){
+	char* ptr = buf;
+	while(length > 0){
+		ssize_t n = shm_read(conn, ptr, length);
+		if(n > 0){
+			if(ptr != NULL)
+				ptr += n;
+			length -= n;
+			continue;
+		}
+		if(errno != EAGAIN)
+			return -1;
+		if(!shm_want_data(conn) && shm_wait(conn, conn->in_ready, conn->read_timeout_ms) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Whether there is something to read, or asks to be woken up when there is.
+ */
+int shm_want_data(SHM_CONN *conn){
+	if(atomic_load_explicit(&conn->in->tail, memory_order_acquire) != conn->in_head)
+		return 1;
+	//whatever woke us up before is over and done with
+	shm_drain(conn->in_ready);
+	atomic_store(&conn->in->data_wanted, 1);
+	if(atomic_load(&conn->in->tail) != conn->in_head){
+		atomic_store(&conn->in->data_wanted, 0);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Whether there is room to write, or asks to be woken up when there is.
+ */
+int shm_want_room(SHM_CONN *conn){
+	if(conn->out_tail - atomic_load_explicit(&conn->out->head, memory_order_acquire) != conn->ring_size)
+		return 1;
+	shm_drain(conn->out_room);
+	atomic_store(&conn->out->room_wanted, 1);
+	if(conn->out_tail - atomic_load(&conn->out->head) != conn->ring_size){
+		atomic_store(&conn->out->room_wanted, 0);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+	Points conn at the rings and eventfds, as the client or the server
+	sees them.  fds are in the order of the offer.
+*/
+int shm_attach(SHM_CONN* conn, int* fds, int client){
+	SHM_HEADER* header = conn->base;
+	int in = client ? SHM_SERVER_TO_CLIENT : SHM_CLIENT_TO_SERVER;
+	int out = client ? SHM_CLIENT_TO_SERVER : SHM_SERVER_TO_CLIENT;
+	conn->memfd = fds[0];
+	//each ring has its data and room eventfds, in that order
+	conn->in_ready = fds[1 + 2 * in];
+	conn->in_room = fds[2 + 2 * in];
+	conn->out_ready = fds[1 + 2 * out];
+	conn->out_room = fds[2 + 2 * out];
+	conn->stop_fd = -1;
+	conn->read_timeout_ms = -1;
+	conn->write_timeout_ms = -1;
+	if(header != NULL){
+		conn->in = &header->rings[in];
+		conn->out = &header->rings[out];
+		conn->in_data = (char*)conn->base + BVD_SHM_DATA_OFFSET + (size_t)in * conn->ring_size;
+		conn->out_data = (char*)conn->base + BVD_SHM_DATA_OFFSET + (size_t)out * conn->ring_size;
+		conn->in_head = atomic_load(&conn->in->head);
+		conn->out_tail = atomic_load(&conn->out->tail);
+	}
+	return 0;
+}
+
+/*
+	Server: maps the region of memfd if it is what an offer must be, and
+	points conn at its rings.  The sizes are taken from the header once
+	and never read from it again.
+*/
+int shm_check_region(SHM_CONN* conn, int memfd){
+	struct stat st;
+	int seals = fcntl(memfd, F_GET_SEALS);
+	if(fstat(memfd, &st) < 0 || seals < 0 || !(seals & F_SEAL_SHRINK) || st.st_size < BVD_SHM_DATA_OFFSET)
+		return -1;
+	SHM_HEADER header;
+	if(pread(memfd, &header, sizeof(header), 0) != sizeof(header))
+		return -1;
+	uint32_t ring_size = header.ring_size;
+	if(header.magic != BVD_SHM_MAGIC || header.version != BVD_SHM_VERSION
+		|| ring_size < BVD_SHM_MIN_RING || ring_size > BVD_SHM_MAX_RING || (ring_size & (ring_size - 1)) != 0
+		|| (size_t)st.st_size != BVD_SHM_DATA_OFFSET + 2 * (size_t)ring_size)
+		return -1;
+	int efds[4] = {conn->in_ready, conn->in_room, conn->out_ready, conn->out_room};
+	for(int i = 0; i < 4; i++){
+		if(!shm_is_eventfd(efds[i]) || fcntl(efds[i], F_SETFL, O_NONBLOCK) < 0)
+			return -1;
+	}
+
+	conn->size = st.st_size;
+	conn->base = mmap(NULL, conn->size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if(conn->base == MAP_FAILED){
+		conn->base = NULL;
+		return -1;
+	}
+	conn->ring_size = ring_size;
+	int fds[BVD_SHM_FDS] = {memfd, efds[0], efds[1], efds[2], efds[3]};
+	shm_attach(conn, fds, 0);
+	return 0;
+}
+
+/*
+	Whether fd is an eventfd, which is all the server ever writes or
+	reads 8 bytes to or from.
+*/
+int shm_is_eventfd(int fd){
+	char path[64], link[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	ssize_t n = readlink(path, link, sizeof(link) - 1);
+	if(n < 0)
+		return 0;
+	link[n] = '\0';
+	return strcmp(link, "anon_inode:[eventfd]") == 0;
+}
+
+/*
+	Sleeps until efd is written, for up to timeout_ms.  The socket only
+	ever becomes readable when the other side is gone, or the session is
+	shut down.
+	Returns 0 once woken up, -1 if the session is over or on timeout.
+*/
+int shm_wait(SHM_CONN* conn, int efd, int timeout_ms){
+	struct pollfd pfd[3] = {{efd, POLLIN, 0}, {conn->fd, POLLIN | POLLRDHUP, 0}, {conn->stop_fd, POLLIN, 0}};
+	int n = poll(pfd, conn->stop_fd >= 0 ? 3 : 2, timeout_ms);
+	if(n < 0)
+		return errno == EINTR ? 0 : -1;
+	if(n == 0){
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	if(pfd[1].revents || (conn->stop_fd >= 0 && pfd[2].revents)){
+		errno = ECONNRESET;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	Wakes up the other side.
+*/
+void shm_poke(int efd){
+	uint64_t one = 1;
+	if(write(efd, &one, sizeof(one)) < 0){
+		//the count is saturated, which wakes it up just as well
+	}
+}
+
+/*
+	Resets an eventfd of this side.
+*/
+void shm_drain(int efd){
+	uint64_t count;
+	if(read(efd, &count, sizeof(count)) < 0){
+		//it was not written, which is the usual case
+	}
+}
+
+/*
+	Copies into the outgoing ring at pos, wrapping around its end.
+*/
+void shm_copy_in(SHM_CONN* conn, uint64_t pos, void* buf, size_t length){
+	size_t offset = pos & (conn->ring_size - 1);
+	size_t first = conn->ring_size - offset < length ? conn->ring_size - offset : length;
+	memcpy(conn->out_data + offset, buf, first);
+	memcpy(conn->out_data, (char*)buf + first, length - first);
+}
+
+/*
+	Copies out of the incoming ring at pos, wrapping around its end,
+	or skips if buf is NULL.
+*/
+void shm_copy_out(SHM_CONN* conn, uint64_t pos, void* buf, size_t length){
+	if(buf == NULL)
+		return;
+	size_t offset = pos & (conn->ring_size - 1);
+	size_t first = conn->ring_size - offset < length ? conn->ring_size - offset : length;
+	memcpy(buf, conn->in_data + offset, first);
+	memcpy((char*)buf + first, conn->in_data, length - first);
+}
+
+/*
+	Closes those of count descriptors that are open.
+*/
+void shm_close_fds(int* fds, int count){
+	for(int i = 0; i < count; i++){
+		if(fds[i] >= 0)
+			close(fds[i]);
+	}
+}
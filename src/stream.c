@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include "stream.h"
+#include "protocol_ext.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+
+#define STREAM_CHUNK (64 * 1024)
+
+
+//HELPER FUNCTION DECLARATIONS
+int stream_copy(BVD_STREAM*, int, SHM_CONN*);
+void stream_finish(BVD_STREAM*);
+int stream_splice(BVD_STREAM*, int, int*);
+
+
+//GLOBAL VARIABLES
+uint32_t bvd_stream_min = BVD_DEFAULT_STREAM_MIN;
+
+
+/*
+ * Move length bytes from the stream's socket to to_fd, through the pipe
+ * in pipefd, which is created on first use.
+ */
+int stream_relay(BVD_STREAM *st, int to_fd, int *pipefd){
+	int ret;
+	if(pipefd[0] < 0 && pipe(pipefd) < 0){
+		pipefd[0] = pipefd[1] = -1;
+		ret = stream_copy(st, to_fd, NULL);
+	}
+	else{
+		ret = stream_splice(st, to_fd, pipefd);
+	}
+	stream_finish(st);
+	return ret;
+}
+
+/*
+ * Move length bytes from the stream's socket to the ring of a receiver
+ * on shared memory.
+ */
+int stream_relay_shm(BVD_STREAM *st, SHM_CONN *to){
+	int ret = stream_copy(st, -1, to);
+	stream_finish(st);
+	return ret;
+}
+
+/*
+	Whatever the receiver did not take is still on the sender's socket.
+*/
+void stream_finish(BVD_STREAM* st){
+	if(st->length > 0 && stream_drain(st->fd, st->length) == 0)
+		st->length = 0;
+	st->drained = 1;
+}
+
+/*
+	socket -> pipe -> socket without the bytes coming up to user space.
+	Falls back to copying if the descriptors do not support splice.
+*/
+int stream_splice(BVD_STREAM* st, int to_fd, int* pipefd){
+	while(st->length > 0){
+		ssize_t in = splice(st->fd, NULL, pipefd[1], NULL, st->length,
+			SPLICE_F_MOVE | SPLICE_F_MORE);
+		if(in < 0 && errno == EINTR)
+			continue;
+		if(in < 0 && errno == EINVAL)
+			return stream_copy(st, to_fd, NULL);
+		if(in <= 0)
+			return -1;
+		st->length -= in;
+
+		//empty the pipe before taking more, it is all we buffer
+		while(in > 0){
+			ssize_t out = splice(pipefd[0], NULL, to_fd, NULL, in,
+				SPLICE_F_MOVE | (st->length > 0 ? SPLICE_F_MORE : 0));
+			if(out < 0 && errno == EINTR)
+				continue;
+			if(out <= 0){
+				//throw away what is stuck in the pipe so it can be reused
+				char buf[STREAM_CHUNK];
+				while(in > 0){
+					ssize_t n = read(pipefd[0], buf, in < STREAM_CHUNK ? in : STREAM_CHUNK);
+					if(n <= 0)
+						break;
+					in -= n;
+				}
+				return -1;
+			}
+			in -= out;
+		}
+	}
+	return 0;
+}
+
+/*
+	The same through a user space buffer of bounded size, to to_fd or,
+	if it is not NULL, to the ring to_shm.
+*/
+int stream_copy(BVD_STREAM* st, int to_fd, SHM_CONN* to_shm){
+	char* buf = malloc(STREAM_CHUNK);
+	while(st->length > 0){
+		uint32_t n = st->length < STREAM_CHUNK ? st->length : STREAM_CHUNK;
+		if(proto_read_fully(st->fd, buf, n) < 0){
+			free(buf);
+			return -1;
+		}
+		st->length -= n;
+		if((to_shm != NULL ? shm_write_fully(to_shm, buf, n) : proto_write_fully(to_fd, buf, n)) < 0){
+			free(buf);
+			return -1;
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+/*
+ * Read and throw away length bytes from fd.
+ */
+int stream_drain(int fd, uint32_t length){
+	char buf[4096];
+	while(length > 0){
+		uint32_t n = length < sizeof(buf) ? length : sizeof(buf);
+		if(proto_read_fully(fd, buf, n) < 0)
+			return -1;
+		length -= n;
+	}
+	return 0;
+}
+
+/*
+ * Read a \r\n terminated line of at most max - 1 bytes from fd.
+ */
+int stream_read_line(int fd, char *buf, int max, uint32_t *consumed){
+	int len = 0;
+	while(len < max){
+		if(proto_read_fully(fd, buf + len, 1) < 0)
+			return -1;
+		*consumed += 1;
+		len++;
+		if(len >= 2 && buf[len - 2] == '\r' && buf[len - 1] == '\n'){
+			buf[len - 2] = '\0';
+			return 0;
+		}
+	}
+	errno = ENAMETOOLONG;
+	return -1;
+}
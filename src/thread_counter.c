@@ -1,6 +1,7 @@
 
 #include "thread_counter.h"
 #include "debug.h" 
+#include "lockprof.h"
 
 #include <pthread.h>
 #include <semaphore.h>
@@ -33,7 +34,7 @@ THREAD_COUNTER* tcnt_init(){
  * Increment a thread counter.
  */
 void tcnt_incr(THREAD_COUNTER *tc){
-	sem_wait(&tc->mutex);
+	BVD_LOCK(LOCK_THREAD_COUNTER, &tc->mutex);
 
 	int count = tc->cnt;
 	if(count == 0){
@@ -41,7 +42,7 @@ void tcnt_incr(THREAD_COUNTER *tc){
 	}
 	tc->cnt += 1;
 	debug("Thread Added: {%d -> %d}", count, count+1);
-	sem_post(&tc->mutex);
+	BVD_UNLOCK(LOCK_THREAD_COUNTER, &tc->mutex);
 }
 
 
@@ -50,15 +51,14 @@ void tcnt_incr(THREAD_COUNTER *tc){
  * if the thread count has dropped to zero.
  */
 void tcnt_decr(THREAD_COUNTER *tc){
-	sem_wait(&tc->mutex);
-	int count = tc->cnt;
+	BVD_LOCK(LOCK_THREAD_COUNTER, &tc->mutex);
 	tc->cnt -= 1;
-	debug("Thread removed: {%d -> %d}", count, count-1);
+	debug("Thread removed: {%d -> %d}", tc->cnt + 1, tc->cnt);
 	if(tc->cnt == 0){
 		sem_post(&tc->zero_mutex);
 		debug("No More Active Threads!");
 	}
-	sem_post(&tc->mutex);
+	BVD_UNLOCK(LOCK_THREAD_COUNTER, &tc->mutex);
 }
 
 
@@ -0,0 +1,330 @@
+#include "timer.h"
+#include "metrics.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/timerfd.h>
+
+
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_MASK(level) ((UINT64_C(1) << (TIMER_BITS * (level))) - 1)
+//the furthest a timer can be placed, a little under 12 days of ticks
+#define TIMER_MAX_DELTA TIMER_MASK(BVD_TIMER_LEVELS)
+#define TIMER_NEVER UINT64_MAX
+
+
+//HELPER FUNCTION DECLARATIONS
+uint64_t timer_tick_now(void);
+void timer_place(BVD_TIMER*);
+void timer_unlink(BVD_TIMER*);
+void timer_push(BVD_TIMER**, BVD_TIMER*);
+void timer_advance(uint64_t);
+void timer_splice(BVD_TIMER**, BVD_TIMER**);
+int timer_busy(void);
+uint64_t timer_next_tick(void);
+void timer_program(uint64_t);
+
+
+//GLOBAL VARIABLES
+sem_t timer_mutex;	//guards everything below
+BVD_TIMER* timer_wheel[BVD_TIMER_LEVELS][TIMER_SLOTS];
+uint64_t timer_occupied[BVD_TIMER_LEVELS];	//bit i: slot i is not empty
+BVD_TIMER* timer_due = NULL;	//expired, waiting for their callback
+BVD_TIMER* timer_moving[BVD_TIMER_LEVELS];	//cascaded, waiting to be placed again
+uint64_t timer_cur = 0;	//the wheel has been advanced up to this tick
+int timer_cur_expired = 1;	//and has put its level 0 slot on the due list
+uint64_t timer_armed = TIMER_NEVER;	//the tick the timerfd is set for
+long timer_base_ms;	//tick 0
+int timer_tfd = -1;
+BVD_TIMER* timer_running = NULL;	//whose callback is running
+pthread_t timer_runner;	//on which thread
+
+
+
+/*
+ * Sets up the wheel.
+ */
+int timer_init(void){
+	sem_init(&timer_mutex, 0, 1);
+	timer_base_ms = timer_now_ms();
+	timer_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	return timer_tfd < 0 ? -1 : 0;
+}
+
+/*
+ * A descriptor that becomes readable when timer_run() has work to do.
+ */
+int timer_fd(void){
+	return timer_tfd;
+}
+
+/*
+ * Runs the callbacks of expired timers.
+ */
+void timer_run(void){
+	uint64_t expirations;
+	if(read(timer_tfd, &expirations, sizeof(expirations)) < 0){
+		//not set off, but the caller wants the due timers run anyway
+	}
+
+	sem_wait(&timer_mutex);
+	//it is set once the callbacks are done, so they need not set it each time
+	timer_armed = 0;
+	timer_advance(timer_tick_now());
+	timer_runner = pthread_self();
+	int i;
+	for(i = 0; i < BVD_TIMER_BATCH && timer_due != NULL; i++){
+		BVD_TIMER* t = timer_due;
+		timer_unlink(t);
+		timer_running = t;
+		sem_post(&timer_mutex);
+		//t may be restarted, stopped or freed from here on
+		t->fn(t->arg);
+		sem_wait(&timer_mutex);
+		timer_running = NULL;
+	}
+	timer_program(timer_busy() ? timer_cur : timer_next_tick());
+	sem_post(&timer_mutex);
+	metrics_add(METRIC_TIMERS_FIRED, i);
+}
+
+long timer_now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Initializes a timer, not pending.
+ */
+void timer_setup(BVD_TIMER *t, BVD_TIMER_FN *fn, void *arg){
+	t->next = NULL;
+	t->pprev = NULL;
+	t->expires = 0;
+	t->slot = -1;
+	t->fn = fn;
+	t->arg = arg;
+}
+
+/*
+ * (Re)starts a timer to expire ms milliseconds from now.
+ */
+void timer_schedule(BVD_TIMER *t, long ms){
+	uint64_t now = timer_tick_now();
+	sem_wait(&timer_mutex);
+	if(t->pprev != NULL)
+		timer_unlink(t);
+	//the wheel may lag behind the clock, but never places a timer in its past
+	t->expires = now + (ms > 0 ? ms : 0);
+	if(t->expires <= timer_cur)
+		t->expires = timer_cur + 1;
+	timer_place(t);
+	if(t->expires < timer_armed)
+		timer_program(t->expires);
+	sem_post(&timer_mutex);
+}
+
+/*
+ * Stops a timer, waiting for its callback if that is running elsewhere.
+ */
+void timer_cancel(BVD_TIMER *t){
+	sem_wait(&timer_mutex);
+	while(1){
+		if(t->pprev != NULL)
+			timer_unlink(t);
+		if(timer_running != t || pthread_equal(timer_runner, pthread_self()))
+			break;
+		//the callback may restart it before it returns, hence the loop
+		sem_post(&timer_mutex);
+		sched_yield();
+		sem_wait(&timer_mutex);
+	}
+	sem_post(&timer_mutex);
+}
+
+/*
+	The tick the clock is at.
+*/
+uint64_t timer_tick_now(void){
+	long ms = timer_now_ms() - timer_base_ms;
+	return ms < 0 ? 0 : ms;
+}
+
+/*
+	Puts a pending timer in the slot for its expiry: the lowest level
+	whose slots still tell apart the ticks between now and then.
+	Caller must hold timer_mutex.
+*/
+void timer_place(BVD_TIMER* t){
+	uint64_t delta = t->expires - timer_cur;
+	uint64_t expires = t->expires;
+	if(delta > TIMER_MAX_DELTA){
+		//too far out: parked at the top, it is placed again from there
+		delta = TIMER_MAX_DELTA;
+		expires = timer_cur + delta;
+	}
+	int level = 0;
+	while(level < BVD_TIMER_LEVELS - 1 && delta > TIMER_MASK(level + 1))
+		level++;
+	int index = (expires >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+	t->slot = level * TIMER_SLOTS + index;
+	timer_push(&timer_wheel[level][index], t);
+	timer_occupied[level] |= UINT64_C(1) << index;
+}
+
+/*
+	Takes a timer off its slot, or off the due or a moving list.
+	Caller must hold timer_mutex.
+*/
+void timer_unlink(BVD_TIMER* t){
+	*t->pprev = t->next;
+	if(t->next != NULL)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+	if(t->slot >= 0){
+		int level = t->slot / TIMER_SLOTS;
+		int index = t->slot % TIMER_SLOTS;
+		if(timer_wheel[level][index] == NULL)
+			timer_occupied[level] &= ~(UINT64_C(1) << index);
+	}
+}
+
+/*
+	Links a timer in at the front of a list.
+*/
+void timer_push(BVD_TIMER** list, BVD_TIMER* t){
+	t->next = *list;
+	if(*list != NULL)
+		(*list)->pprev = &t->next;
+	*list = t;
+	t->pprev = list;
+}
+
+/*
+	Moves the wheel up to tick target, putting whatever expires on the
+	way on the due list.  A slot that comes up is moved as a whole, and
+	its timers are then placed again BVD_TIMER_BATCH at a time; the wheel
+	does not move on while any are left, or while any are due, so that
+	it never holds up the caller for long, however many timers came up
+	at once.  Stretches where no slot can come up are skipped, so that
+	catching up after a long sleep costs little.
+	Caller must hold timer_mutex.
+*/
+void timer_advance(uint64_t target){
+	int budget = BVD_TIMER_BATCH;
+	while(1){
+		for(int level = 1; level < BVD_TIMER_LEVELS; level++){
+			while(timer_moving[level] != NULL){
+				if(budget-- == 0)
+					return;
+				BVD_TIMER* t = timer_moving[level];
+				timer_unlink(t);
+				timer_place(t);
+			}
+		}
+		//only now, as some of those may have been due this very tick
+		if(!timer_cur_expired){
+			int index = timer_cur & (TIMER_SLOTS - 1);
+			timer_splice(&timer_wheel[0][index], &timer_due);
+			timer_occupied[0] &= ~(UINT64_C(1) << index);
+			timer_cur_expired = 1;
+		}
+		if(timer_due != NULL || timer_cur >= target)
+			return;
+
+		int level = 0;
+		while(level < BVD_TIMER_LEVELS && timer_occupied[level] == 0)
+			level++;
+		if(level == BVD_TIMER_LEVELS){
+			timer_cur = target;
+			return;
+		}
+		//nothing below this level: skip to the tick before its next slot
+		uint64_t skip = timer_cur | TIMER_MASK(level);
+		if(skip > timer_cur){
+			timer_cur = skip < target ? skip : target;
+			continue;
+		}
+
+		timer_cur++;
+		timer_cur_expired = 0;
+		for(int l = 1; l < BVD_TIMER_LEVELS && (timer_cur & TIMER_MASK(l)) == 0; l++){
+			int index = (timer_cur >> (TIMER_BITS * l)) & (TIMER_SLOTS - 1);
+			timer_splice(&timer_wheel[l][index], &timer_moving[l]);
+			timer_occupied[l] &= ~(UINT64_C(1) << index);
+		}
+	}
+}
+
+/*
+	Moves a whole list onto an empty one.  The timers keep their slot
+	numbers, which timer_unlink() only uses to see whether a slot has
+	gone empty, and so is harmless.  Caller must hold timer_mutex.
+*/
+void timer_splice(BVD_TIMER** from, BVD_TIMER** to){
+	*to = *from;
+	if(*to != NULL)
+		(*to)->pprev = to;
+	*from = NULL;
+}
+
+/*
+	Whether the wheel has work left over from the last round.
+	Caller must hold timer_mutex.
+*/
+int timer_busy(void){
+	if(timer_due != NULL)
+		return 1;
+	for(int level = 1; level < BVD_TIMER_LEVELS; level++){
+		if(timer_moving[level] != NULL)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	The first tick at which a slot comes up, either to expire (level 0)
+	or to move down a level.  Caller must hold timer_mutex.
+*/
+uint64_t timer_next_tick(void){
+	uint64_t next = TIMER_NEVER;
+	for(int level = 0; level < BVD_TIMER_LEVELS; level++){
+		uint64_t bits = timer_occupied[level];
+		if(bits == 0)
+			continue;
+		uint64_t pos = timer_cur >> (TIMER_BITS * level);
+		int from = (pos + 1) & (TIMER_SLOTS - 1);
+		//rotate so that the slot after the current one is bit 0
+		uint64_t rotated = from == 0 ? bits : (bits >> from) | (bits << (TIMER_SLOTS - from));
+		uint64_t tick = (pos + 1 + __builtin_ctzll(rotated)) << (TIMER_BITS * level);
+		if(tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+/*
+	Sets the timerfd off at a tick, or not at all.
+	Caller must hold timer_mutex.
+*/
+void timer_program(uint64_t tick){
+	struct itimerspec its = {{0, 0}, {0, 0}};
+	if(tick != TIMER_NEVER){
+		long ms = timer_base_ms + tick;
+		its.it_value.tv_sec = ms / 1000;
+		its.it_value.tv_nsec = (ms % 1000) * 1000000;
+		//0 would disarm it
+		if(its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;
+	}
+	timerfd_settime(timer_tfd, TFD_TIMER_ABSTIME, &its, NULL);
+	timer_armed = tick;
+}
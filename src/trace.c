@@ -0,0 +1,212 @@
+#include "trace.h"
+#include "intern.h"
+#include "protocol_ext.h"
+#include "metrics.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+
+//HELPER FUNCTION DECLARATIONS
+void* trace_writer(void*);
+void trace_append(BVD_TRACE_RECORD*, void*);
+void trace_swap(void);
+long trace_usec(void);
+
+
+//GLOBAL VARIABLES
+int trace_enabled = 0;
+int trace_first_lines;
+int trace_fd = -1;
+long trace_start;
+atomic_uint trace_conns = 0;
+sem_t trace_lock;	//guards the buffers
+sem_t trace_kick;	//a full buffer is waiting, or it is time to stop
+sem_t trace_done;
+char* trace_buf;	//being filled
+size_t trace_used;
+char* trace_out = NULL;	//handed to the writer
+size_t trace_out_used;
+char* trace_spare = NULL;	//free, NULL while the writer has it
+int trace_stop = 0;
+
+
+
+/*
+ * Starts writing a trace to path.
+ */
+int trace_open(char *path, int first_lines){
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(trace_fd < 0)
+		return -1;
+	if(proto_write_fully(trace_fd, BVD_TRACE_MAGIC, strlen(BVD_TRACE_MAGIC)) < 0)
+		return -1;
+	trace_first_lines = first_lines;
+	trace_start = trace_usec();
+	sem_init(&trace_lock, 0, 1);
+	sem_init(&trace_kick, 0, 0);
+	sem_init(&trace_done, 0, 0);
+	trace_buf = malloc(BVD_TRACE_BUFFER);
+	trace_spare = malloc(BVD_TRACE_BUFFER);
+	trace_used = 0;
+
+	pthread_t tid;
+	if(pthread_create(&tid, NULL, trace_writer, NULL) != 0)
+		return -1;
+	pthread_detach(tid);
+	trace_enabled = 1;
+	return 0;
+}
+
+/*
+ * A number for a new connection.
+ */
+uint32_t trace_new_conn(void){
+	return atomic_fetch_add_explicit(&trace_conns, 1, memory_order_relaxed) + 1;
+}
+
+/*
+ * Records a packet of connection conn.
+ */
+void trace_packet(uint32_t conn, bvd_packet_header *hdr, void *payload, uint32_t length){
+	BVD_TRACE_RECORD rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.conn = conn;
+	rec.kind = BVD_TRACE_PACKET;
+	rec.usec = trace_usec() - trace_start;
+	rec.hdr = *hdr;
+	rec.stored = length;
+	//a LOGIN is only a handle and capabilities, and is kept whole
+	if(trace_first_lines && length > 0 && hdr->type != BVD_LOGIN_PKT){
+		char* eol = memchr(payload, '\n', length);
+		rec.stored = eol == NULL ? 0 : eol - (char*)payload + 1;
+		rec.rest_hash = intern_hash((char*)payload + rec.stored, length - rec.stored);
+	}
+	trace_append(&rec, payload);
+}
+
+/*
+ * Records the end of connection conn.
+ */
+void trace_close(uint32_t conn){
+	BVD_TRACE_RECORD rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.conn = conn;
+	rec.kind = BVD_TRACE_CLOSE;
+	rec.usec = trace_usec() - trace_start;
+	trace_append(&rec, NULL);
+}
+
+/*
+ * Writes out whatever is buffered and stops.
+ */
+void trace_finish(void){
+	if(!trace_enabled)
+		return;
+	sem_wait(&trace_lock);
+	trace_stop = 1;
+	sem_post(&trace_lock);
+	sem_post(&trace_kick);
+	sem_wait(&trace_done);
+}
+
+/*
+	Thread function of the trace writer: writes out the buffers the
+	client service threads fill, when one is full or every so often.
+*/
+void* trace_writer(void* arg){
+	while(1){
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += BVD_TRACE_FLUSH_MS * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L){
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while(sem_timedwait(&trace_kick, &deadline) < 0 && errno == EINTR)
+			;
+
+		sem_wait(&trace_lock);
+		if(trace_out == NULL && trace_used > 0)
+			trace_swap();
+		char* out = trace_out;
+		size_t used = trace_out_used;
+		trace_out = NULL;
+		int stop = trace_stop;
+		sem_post(&trace_lock);
+
+		if(out != NULL){
+			if(proto_write_fully(trace_fd, out, used) < 0)
+				debug("trace: write failed");
+			sem_wait(&trace_lock);
+			trace_spare = out;
+			//what came in while it was written, if stopping
+			if(stop && trace_used > 0){
+				trace_swap();
+				out = trace_out;
+				used = trace_out_used;
+				trace_out = NULL;
+				sem_post(&trace_lock);
+				proto_write_fully(trace_fd, out, used);
+			}
+			else{
+				sem_post(&trace_lock);
+			}
+		}
+		if(stop){
+			close(trace_fd);
+			sem_post(&trace_done);
+			return NULL;
+		}
+	}
+}
+
+/*
+	Copies a record and its stored payload into the buffer, handing the
+	buffer to the writer if it is full.
+*/
+void trace_append(BVD_TRACE_RECORD* rec, void* payload){
+	size_t size = sizeof(*rec) + rec->stored;
+	sem_wait(&trace_lock);
+	if(trace_used + size > BVD_TRACE_BUFFER)
+		trace_swap();
+	if(trace_stop || trace_used + size > BVD_TRACE_BUFFER){
+		sem_post(&trace_lock);
+		metrics_add(METRIC_TRACE_DROPPED, 1);
+		return;
+	}
+	memcpy(trace_buf + trace_used, rec, sizeof(*rec));
+	if(rec->stored > 0)
+		memcpy(trace_buf + trace_used + sizeof(*rec), payload, rec->stored);
+	trace_used += size;
+	sem_post(&trace_lock);
+}
+
+/*
+	Hands the buffer being filled to the writer and starts on the spare,
+	unless the writer still has it.  Caller must hold trace_lock.
+*/
+void trace_swap(void){
+	if(trace_spare == NULL || trace_out != NULL)
+		return;
+	trace_out = trace_buf;
+	trace_out_used = trace_used;
+	trace_buf = trace_spare;
+	trace_spare = NULL;
+	trace_used = 0;
+	sem_post(&trace_kick);
+}
+
+long trace_usec(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
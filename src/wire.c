@@ -0,0 +1,253 @@
+#include "wire.h"
+#include "protocol_ext.h"
+#include "debug.h"
+
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+
+#define WIRE_LENGTH_MASK 0x1f
+#define WIRE_MIN_HEADER 4
+
+
+//HELPER FUNCTION DECLARATIONS
+uint8_t* wire_put_varint(uint8_t*, uint32_t);
+uint8_t* wire_get_varint(uint8_t*, uint8_t*, uint32_t*);
+
+
+
+/*
+ * Encode a header in the given format.
+ */
+int wire_encode_header(int wire, bvd_packet_header *hdr, int flags, uint32_t id, void *buf){
+	if(wire == BVD_WIRE_V1){
+		bvd_packet_header copy = *hdr;
+		proto_header_to_wire(&copy);
+		memcpy(buf, &copy, sizeof(copy));
+		return sizeof(copy);
+	}
+	uint8_t* start = buf;
+	uint8_t* ptr = start + 2;
+	start[1] = hdr->type;
+	ptr = wire_put_varint(ptr, hdr->msgid);
+	ptr = wire_put_varint(ptr, hdr->payload_length);
+	if(flags & BVD_WIRE_TIME){
+		ptr = wire_put_varint(ptr, hdr->timestamp_sec);
+		ptr = wire_put_varint(ptr, hdr->timestamp_nsec);
+	}
+	if(flags & BVD_WIRE_ID)
+		ptr = wire_put_varint(ptr, id);
+	start[0] = (flags & ~WIRE_LENGTH_MASK) | (ptr - start);
+	return ptr - start;
+}
+
+/*
+ * Decode a v2 header.
+ */
+int wire_decode_header(void *buf, size_t length, bvd_packet_header *hdr, int *flags, uint32_t *id){
+	uint8_t* start = buf;
+	if(length < 1)
+		return -1;
+	int hlen = start[0] & WIRE_LENGTH_MASK;
+	if(hlen < WIRE_MIN_HEADER || (size_t)hlen > length)
+		return -1;
+	uint8_t* end = start + hlen;
+	memset(hdr, 0, sizeof(bvd_packet_header));
+	*flags = start[0] & ~WIRE_LENGTH_MASK;
+	*id = 0;
+	hdr->type = start[1];
+	uint8_t* ptr = start + 2;
+	ptr = wire_get_varint(ptr, end, &hdr->msgid);
+	ptr = wire_get_varint(ptr, end, &hdr->payload_length);
+	if(*flags & BVD_WIRE_TIME){
+		ptr = wire_get_varint(ptr, end, &hdr->timestamp_sec);
+		ptr = wire_get_varint(ptr, end, &hdr->timestamp_nsec);
+	}
+	if(*flags & BVD_WIRE_ID)
+		ptr = wire_get_varint(ptr, end, id);
+	//every field has to end exactly where the header says it does
+	if(ptr != end)
+		return -1;
+	return hlen;
+}
+
+/*
+ * The length of a packet, from its encoded header.
+ */
+size_t wire_packet_length(int wire, void *buf){
+	if(wire == BVD_WIRE_V1){
+		bvd_packet_header hdr;
+		memcpy(&hdr, buf, sizeof(hdr));
+		return sizeof(hdr) + ntohl(hdr.payload_length);
+	}
+	bvd_packet_header hdr;
+	int flags;
+	uint32_t id;
+	//only ever asked about headers this side encoded
+	int hlen = wire_decode_header(buf, BVD_WIRE_MAX_HEADER, &hdr, &flags, &id);
+	return hlen + hdr.payload_length;
+}
+
+/*
+ * The length of the header that starts at buf.
+ */
+size_t wire_header_length(int wire, void *buf){
+	if(wire == BVD_WIRE_V1)
+		return sizeof(bvd_packet_header);
+	return *(uint8_t*)buf & WIRE_LENGTH_MASK;
+}
+
+/*
+ * Decode the v2 header fd has to read, leaving it there.
+ */
+int wire_peek_header(int fd, bvd_packet_header *hdr, int *flags, uint32_t *id){
+	uint8_t buf[BVD_WIRE_MAX_HEADER];
+	ssize_t n;
+	while((n = recv(fd, buf, sizeof(buf), MSG_PEEK)) < 0 && errno == EINTR)
+		;
+	if(n < 0)
+		return -1;
+	if(n == 0){
+		errno = ECONNRESET;
+		return -1;
+	}
+	int hlen = buf[0] & WIRE_LENGTH_MASK;
+	int left = hlen;
+	if(n < hlen){
+		//the first byte says how much more to wait for
+		if(proto_read_fully(fd, buf, hlen) < 0)
+			return -1;
+		left = 0;
+	}
+	if(wire_decode_header(buf, hlen, hdr, flags, id) < 0){
+		debug("malformed v2 header");
+		errno = EPROTO;
+		return -1;
+	}
+	return left;
+}
+
+/*
+ * Read and throw away skip bytes, then read length bytes into buf.
+ */
+int wire_read_rest(int fd, size_t skip, void *buf, size_t length){
+	uint8_t head[BVD_WIRE_MAX_HEADER];
+	char* ptr = buf;
+	while(skip + length > 0){
+		struct iovec iov[2] = {{head, skip}, {ptr, length}};
+		ssize_t n = skip > 0 ? readv(fd, iov, 2) : read(fd, ptr, length);
+		if(n < 0){
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		if(n == 0){
+			errno = ECONNRESET;
+			return -1;
+		}
+		size_t k = (size_t)n < skip ? (size_t)n : skip;
+		skip -= k;
+		ptr += n - k;
+		length -= n - k;
+	}
+	return 0;
+}
+
+/*
+ * Receive a packet in either format.
+ */
+int wire_recv_packet(int fd, int wire, bvd_packet_header *hdr, int *flags, uint32_t *id, void **payload){
+	if(wire == BVD_WIRE_V1){
+		*flags = 0;
+		*id = 0;
+		return proto_recv_packet(fd, hdr, payload);
+	}
+	int left = wire_peek_header(fd, hdr, flags, id);
+	if(left < 0)
+		return -1;
+	uint32_t size = hdr->payload_length;
+	if(size > proto_max_payload){
+		errno = EMSGSIZE;
+		return -1;
+	}
+	char* input = size > 0 ? malloc(size + 1) : NULL;
+	if(wire_read_rest(fd, left, input, size) < 0){
+		free(input);
+		return -1;
+	}
+	if(input != NULL)
+		input[size] = '\0';
+	*payload = input;
+	return 0;
+}
+
+/*
+ * Send a header in either format.
+ */
+int wire_send_header(int fd, int wire, bvd_packet_header *hdr, int flags, uint32_t id){
+	uint8_t buf[BVD_WIRE_MAX_HEADER];
+	int hlen = wire_encode_header(wire, hdr, flags, id, buf);
+	return proto_write_fully(fd, buf, hlen);
+}
+
+/*
+ * Send a packet in either format, header and payload in one go.
+ */
+int wire_send_packet(int fd, int wire, bvd_packet_header *hdr, int flags, uint32_t id, void *payload){
+	uint8_t buf[BVD_WIRE_MAX_HEADER];
+	size_t hlen = wire_encode_header(wire, hdr, flags, id, buf);
+	size_t length = hdr->payload_length;
+	struct iovec iov[2] = {{buf, hlen}, {payload, length}};
+	ssize_t n;
+	while((n = writev(fd, iov, length > 0 ? 2 : 1)) < 0 && errno == EINTR)
+		;
+	if(n < 0)
+		return -1;
+	//a short write is finished off the slow way
+	if((size_t)n < hlen){
+		if(proto_write_fully(fd, buf + n, hlen - n) < 0)
+			return -1;
+		n = hlen;
+	}
+	if((size_t)n < hlen + length)
+		return proto_write_fully(fd, (char*)payload + n - hlen, hlen + length - n);
+	return 0;
+}
+
+/*
+	Appends a varint, 7 bits at a time, least significant first.
+*/
+uint8_t* wire_put_varint(uint8_t* ptr, uint32_t value){
+	while(value >= 0x80){
+		*ptr++ = value | 0x80;
+		value >>= 7;
+	}
+	*ptr++ = value;
+	return ptr;
+}
+
+/*
+	Reads a varint that must end before end.  On a malformed one,
+	returns end + 1, which no header ends at.  So is one with bits past
+	the 32 of a field.
+*/
+uint8_t* wire_get_varint(uint8_t* ptr, uint8_t* end, uint32_t* value){
+	uint32_t v = 0;
+	for(int shift = 0; shift < 35; shift += 7){
+		if(ptr >= end)
+			return end + 1;
+		uint8_t byte = *ptr++;
+		if(shift == 28 && (byte & 0x70))
+			return end + 1;
+		v |= (uint32_t)(byte & 0x7f) << shift;
+		if(!(byte & 0x80)){
+			*value = v;
+			return ptr;
+		}
+	}
+	return end + 1;
+}
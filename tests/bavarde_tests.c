@@ -0,0 +1,1379 @@
+#define _GNU_SOURCE
+#include <criterion/criterion.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sched.h>
+#include <dirent.h>
+
+#include "thread_counter.h"
+#include "batch.h"
+#include "lz.h"
+#include "compress.h"
+#include "protocol_ext.h"
+#include "capability.h"
+#include "coalesce.h"
+#include "wire.h"
+#include "timer.h"
+#include "dedup.h"
+#include "ratelimit.h"
+#include "shm.h"
+#include "history.h"
+#include "hot.h"
+#include "intern.h"
+#include "directory.h"
+#include "mailbox_ext.h"
+#include "stream.h"
+#include "metrics.h"
+
+
+//defined by main.c, which the tests are not linked with
+THREAD_COUNTER *thread_counter;
+
+
+//SEND_BATCH payloads, see batch.h
+
+/*
+	A payload of the given records, built with bvd_batch_append().
+*/
+static char* batch_of(int count, char** handles, char** bodies, size_t* length){
+	char* buf = NULL;
+	size_t len = 0, cap = 0;
+	for(int i = 0; i < count; i++)
+		cr_assert_eq(bvd_batch_append(&buf, &len, &cap, 100 + i, handles[i], bodies[i], strlen(bodies[i])), 0);
+	*length = len;
+	return buf;
+}
+
+Test(batch, round_trip){
+	char* handles[] = {"alice", "bob", "carol"};
+	char* bodies[] = {"hello", "", "a\r\nbody\r\nwith lines"};
+	size_t length;
+	char* payload = batch_of(3, handles, bodies, &length);
+	BVD_BATCH_RECORD* recs = NULL;
+	cr_assert_eq(bvd_batch_parse(payload, length, &recs), 3);
+	for(int i = 0; i < 3; i++){
+		cr_assert_eq(recs[i].index, i);
+		cr_assert_eq(recs[i].msgid, 100 + i);
+		cr_assert_str_eq(recs[i].handle, handles[i]);
+		cr_assert_eq(recs[i].length, (int)strlen(bodies[i]));
+		cr_assert_arr_eq(recs[i].body, bodies[i], strlen(bodies[i]));
+	}
+	free(recs);
+	free(payload);
+}
+
+Test(batch, empty_payload){
+	BVD_BATCH_RECORD* recs = NULL;
+	char payload[1];
+	cr_assert_eq(bvd_batch_parse(payload, 0, &recs), -1);
+	cr_assert_null(recs);
+}
+
+Test(batch, truncated_record_header){
+	char* handles[] = {"alice"};
+	char* bodies[] = {"hello"};
+	size_t length;
+	char* payload = batch_of(1, handles, bodies, &length);
+	BVD_BATCH_RECORD* recs = NULL;
+	//a whole record, then half of another header
+	payload = realloc(payload, length + 4);
+	memset(payload + length, 0, 4);
+	cr_assert_eq(bvd_batch_parse(payload, length + 4, &recs), -1);
+	cr_assert_null(recs);
+	free(payload);
+}
+
+Test(batch, length_past_payload){
+	char* handles[] = {"alice"};
+	char* bodies[] = {"hello"};
+	size_t length;
+	char* payload = batch_of(1, handles, bodies, &length);
+	bvd_batch_record_header rh;
+	memcpy(&rh, payload, sizeof(rh));
+	BVD_BATCH_RECORD* recs = NULL;
+	rh.length = htonl(ntohl(rh.length) + 1);
+	memcpy(payload, &rh, sizeof(rh));
+	cr_assert_eq(bvd_batch_parse(payload, length, &recs), -1);
+	rh.length = htonl(UINT32_MAX);
+	memcpy(payload, &rh, sizeof(rh));
+	cr_assert_eq(bvd_batch_parse(payload, length, &recs), -1);
+	cr_assert_null(recs);
+	free(payload);
+}
+
+Test(batch, no_receiver){
+	BVD_BATCH_RECORD* recs = NULL;
+	char payload[64];
+	bvd_batch_record_header rh = {htonl(1), htonl(5)};
+	memcpy(payload, &rh, sizeof(rh));
+	//no \r\n at all
+	memcpy(payload + sizeof(rh), "alice", 5);
+	cr_assert_eq(bvd_batch_parse(payload, sizeof(rh) + 5, &recs), -1);
+	//an empty handle
+	memcpy(payload + sizeof(rh), "\r\nbob", 5);
+	cr_assert_eq(bvd_batch_parse(payload, sizeof(rh) + 5, &recs), -1);
+	//a lone \r at the very end
+	memcpy(payload + sizeof(rh), "bob\r\n", 5);
+	rh.length = htonl(4);
+	memcpy(payload, &rh, sizeof(rh));
+	cr_assert_eq(bvd_batch_parse(payload, sizeof(rh) + 4, &recs), -1);
+	cr_assert_null(recs);
+}
+
+Test(batch, too_many_records){
+	size_t length = (BVD_BATCH_MAX_RECORDS + 1) * (sizeof(bvd_batch_record_header) + 3);
+	char* payload = malloc(length);
+	for(int i = 0; i <= BVD_BATCH_MAX_RECORDS; i++){
+		char* rec = payload + i * (sizeof(bvd_batch_record_header) + 3);
+		bvd_batch_record_header rh = {htonl(i), htonl(3)};
+		memcpy(rec, &rh, sizeof(rh));
+		memcpy(rec + sizeof(rh), "a\r\n", 3);
+	}
+	BVD_BATCH_RECORD* recs = NULL;
+	cr_assert_eq(bvd_batch_parse(payload, length, &recs), -1);
+	cr_assert_null(recs);
+	//one fewer is fine
+	cr_assert_eq(bvd_batch_parse(payload, length - sizeof(bvd_batch_record_header) - 3, &recs), BVD_BATCH_MAX_RECORDS);
+	free(recs);
+	free(payload);
+}
+
+
+//Compressed bodies, see lz.h and compress.h
+
+/*
+	length bytes that compress well, but not to nothing.
+*/
+static char* compressible(int length){
+	static const char text[] = "{\"from\":\"alice\",\"text\":\"hello\"}";
+	char* data = malloc(length);
+	for(int i = 0; i < length; i++)
+		data[i] = text[i % (sizeof(text) - 1)] + (i / 997) % 3;
+	return data;
+}
+
+Test(lz, round_trip){
+	int lengths[] = {0, 1, 15, 16, 100, 4096, 1 << 20};
+	for(int k = 0; k < (int)(sizeof(lengths) / sizeof(lengths[0])); k++){
+		int length = lengths[k];
+		char* data = compressible(length);
+		char* packed = malloc(LZ_COMPRESS_BOUND(length));
+		int n = lz_compress(data, length, packed, LZ_COMPRESS_BOUND(length));
+		cr_assert(n > 0 || length == 0, "length %d", length);
+		char* out = malloc(length + 1);
+		cr_assert_eq(lz_decompress(packed, n, out, length), length, "length %d", length);
+		cr_assert_arr_eq(out, data, length);
+		free(data);
+		free(packed);
+		free(out);
+	}
+}
+
+Test(lz, wrong_raw_length){
+	char* data = compressible(4096);
+	char packed[LZ_COMPRESS_BOUND(4096)];
+	int n = lz_compress(data, 4096, packed, sizeof(packed));
+	char* out = malloc(8192);
+	cr_assert_eq(lz_decompress(packed, n, out, 4095), -1);
+	cr_assert_eq(lz_decompress(packed, n, out, 4097), -1);
+	free(out);
+	free(data);
+}
+
+Test(lz, truncated){
+	char* data = compressible(4096);
+	char packed[LZ_COMPRESS_BOUND(4096)];
+	int n = lz_compress(data, 4096, packed, sizeof(packed));
+	char out[4096];
+	for(int cut = 1; cut < n; cut++)
+		cr_assert_eq(lz_decompress(packed, n - cut, out, sizeof(out)), -1, "cut %d", cut);
+	free(data);
+}
+
+Test(lz, bad_offset){
+	char out[64];
+	//4 literals, then a match 5 back: before the start of the output
+	uint8_t before_start[] = {0x40, 'a', 'b', 'c', 'd', 5, 0, 0x00};
+	cr_assert_eq(lz_decompress(before_start, sizeof(before_start) - 1, out, 8), -1);
+	//offset 0
+	uint8_t zero[] = {0x40, 'a', 'b', 'c', 'd', 0, 0};
+	cr_assert_eq(lz_decompress(zero, sizeof(zero), out, 8), -1);
+	//a match running past the output
+	uint8_t too_long[] = {0x4f, 'a', 'b', 'c', 'd', 1, 0, 200};
+	cr_assert_eq(lz_decompress(too_long, sizeof(too_long), out, sizeof(out)), -1);
+	//and one that fits, overlapping what it produces
+	uint8_t overlap[] = {0x14, 'a', 1, 0, 0x00};
+	cr_assert_eq(lz_decompress(overlap, sizeof(overlap), out, 9), 9);
+	cr_assert_arr_eq(out, "aaaaaaaaa", 9);
+}
+
+Test(lz, long_length_runs){
+	//a literal length made of millions of 255s must not wrap around
+	int length = 9 * 1024 * 1024;
+	uint8_t* src = malloc(length);
+	src[0] = 0xf0;
+	memset(src + 1, 255, length - 2);
+	src[length - 1] = 0;
+	char out[16];
+	cr_assert_eq(lz_decompress(src, length, out, sizeof(out)), -1);
+	//the same for a match length
+	uint8_t head[] = {0x1f, 'a', 1, 0};
+	memcpy(src, head, sizeof(head));
+	memset(src + sizeof(head), 255, length - sizeof(head) - 1);
+	cr_assert_eq(lz_decompress(src, length, out, sizeof(out)), -1);
+	free(src);
+}
+
+Test(compress, frame_round_trip){
+	char* data = compressible(1000);
+	char frame[BVD_FRAME_BOUND(1000)];
+	char out[1000];
+	int raw_length;
+	//compressed
+	int n = bvd_frame_body(data, 1000, 1, frame);
+	cr_assert_lt(n, 1000);
+	cr_assert_eq(bvd_frame_check(frame, n, &raw_length), BVD_CODEC_LZ4);
+	cr_assert_eq(raw_length, 1000);
+	cr_assert_eq(bvd_unframe_body(frame, n, out), 1000);
+	cr_assert_arr_eq(out, data, 1000);
+	//and not
+	n = bvd_frame_body(data, 1000, 0, frame);
+	cr_assert_eq(n, BVD_FRAME_HEADER_SIZE + 1000);
+	cr_assert_eq(bvd_frame_check(frame, n, &raw_length), BVD_CODEC_RAW);
+	cr_assert_eq(bvd_unframe_body(frame, n, out), 1000);
+	cr_assert_arr_eq(out, data, 1000);
+	free(data);
+}
+
+/*
+	A frame header claiming raw bytes, followed by data_length zeros.
+*/
+static uint8_t* frame_of(uint8_t codec, uint32_t raw, int data_length){
+	uint8_t* frame = calloc(1, BVD_FRAME_HEADER_SIZE + data_length);
+	frame[0] = codec;
+	raw = htonl(raw);
+	memcpy(frame + 1, &raw, sizeof(raw));
+	return frame;
+}
+
+Test(compress, malformed_frames){
+	int raw_length;
+	uint8_t* frame = frame_of(BVD_CODEC_RAW, 10, 10);
+	cr_assert_eq(bvd_frame_check(frame, BVD_FRAME_HEADER_SIZE - 1, &raw_length), -1);
+	cr_assert_eq(bvd_frame_check(frame, BVD_FRAME_HEADER_SIZE + 10, &raw_length), BVD_CODEC_RAW);
+	//a raw frame that is not as long as it says
+	cr_assert_eq(bvd_frame_check(frame, BVD_FRAME_HEADER_SIZE + 9, &raw_length), -1);
+	frame[0] = 7;
+	cr_assert_eq(bvd_frame_check(frame, BVD_FRAME_HEADER_SIZE + 10, &raw_length), -1);
+	free(frame);
+	//more than the block format can expand to
+	frame = frame_of(BVD_CODEC_LZ4, 10 * 255 + 16, 10);
+	cr_assert_eq(bvd_frame_check(frame, BVD_FRAME_HEADER_SIZE + 10, &raw_length), -1);
+	free(frame);
+}
+
+Test(compress, raw_length_over_max_payload){
+	int raw_length;
+	//a small frame claiming just over the limit, which it could expand to
+	int data = proto_max_payload / 255 + 1;
+	uint8_t* frame = frame_of(BVD_CODEC_LZ4, proto_max_payload + 1, data);
+	cr_assert_eq(bvd_frame_check(frame, BVD_FRAME_HEADER_SIZE + data, &raw_length), -1);
+	free(frame);
+	frame = frame_of(BVD_CODEC_LZ4, proto_max_payload, data);
+	cr_assert_eq(bvd_frame_check(frame, BVD_FRAME_HEADER_SIZE + data, &raw_length), BVD_CODEC_LZ4);
+	cr_assert_eq(raw_length, (int)proto_max_payload);
+	free(frame);
+	//or near 2GiB
+	data = 0x7fffffff / 255;
+	frame = frame_of(BVD_CODEC_LZ4, 0x7fffffff, data);
+	cr_assert_eq(bvd_frame_check(frame, BVD_FRAME_HEADER_SIZE + data, &raw_length), -1);
+	free(frame);
+}
+
+
+//Capabilities and coalesced notices, see capability.h and coalesce.h
+
+Test(caps, parse){
+	char line[] = "lz4  bogus coalesce\r\n";
+	cr_assert_eq(bvd_caps_parse(line), BVD_CAP_LZ4 | BVD_CAP_COALESCE);
+	char empty[] = "";
+	cr_assert_eq(bvd_caps_parse(empty), 0);
+	char unknown[] = "LZ4 coalesc lz44";
+	cr_assert_eq(bvd_caps_parse(unknown), 0);
+}
+
+Test(caps, format_round_trip){
+	int length = -1;
+	cr_assert_null(bvd_caps_format(0, &length));
+	cr_assert_eq(length, 0);
+	char* names = bvd_caps_format(BVD_CAPS_SUPPORTED, &length);
+	cr_assert_not_null(names);
+	char* line = malloc(length + 1);
+	memcpy(line, names, length);
+	line[length] = '\0';
+	cr_assert_eq(bvd_caps_parse(line), BVD_CAPS_SUPPORTED);
+	free(line);
+	free(names);
+}
+
+Test(coalesce, ranges){
+	int fds[2];
+	cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	OUTQ* out = outq_open(fds[0], BVD_WIRE_V1);
+	COALESCER co;
+	coalesce_init(&co);
+	cr_assert_null(coalesce_deadline(&co));
+	uint32_t acks[] = {5, 6, 7, 10, 11, 3, UINT32_MAX, 0};
+	for(int i = 0; i < (int)(sizeof(acks) / sizeof(acks[0])); i++)
+		cr_assert_eq(coalesce_add(&co, out, ACK_NOTICE_TYPE, acks[i]), 0);
+	cr_assert_eq(coalesce_add(&co, out, RRCPT_NOTICE_TYPE, 42), 0);
+	cr_assert_not_null(coalesce_deadline(&co));
+	cr_assert_eq(coalesce_flush(&co, out), 0);
+	cr_assert_null(coalesce_deadline(&co));
+
+	//in the order they were added, a run going on past UINT32_MAX
+	uint32_t want[] = {5, 3, 10, 2, 3, 1, UINT32_MAX, 2};
+	bvd_packet_header hdr;
+	void* payload;
+	cr_assert_eq(proto_recv_packet(fds[1], &hdr, &payload), 0);
+	cr_assert_eq(hdr.type, BVD_ACK_RANGE_PKT);
+	cr_assert_eq(hdr.msgid, 5);
+	cr_assert_eq(hdr.payload_length, sizeof(want));
+	for(int i = 0; i < (int)(sizeof(want) / sizeof(want[0])); i++)
+		cr_assert_eq(ntohl(((uint32_t*)payload)[i]), want[i], "field %d", i);
+	free(payload);
+	cr_assert_eq(proto_recv_packet(fds[1], &hdr, &payload), 0);
+	cr_assert_eq(hdr.type, BVD_RRCPT_RANGE_PKT);
+	cr_assert_eq(ntohl(((uint32_t*)payload)[0]), 42);
+	cr_assert_eq(ntohl(((uint32_t*)payload)[1]), 1);
+	free(payload);
+}
+
+Test(coalesce, flush_when_full){
+	int fds[2];
+	cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	OUTQ* out = outq_open(fds[0], BVD_WIRE_V1);
+	COALESCER co;
+	coalesce_init(&co);
+	for(int i = 0; i < BVD_COALESCE_MAX; i++)
+		cr_assert_eq(coalesce_add(&co, out, ACK_NOTICE_TYPE, 1000 + i), 0);
+	//went out on its own, as a single range
+	cr_assert_null(coalesce_deadline(&co));
+	bvd_packet_header hdr;
+	void* payload;
+	cr_assert_eq(proto_recv_packet(fds[1], &hdr, &payload), 0);
+	cr_assert_eq(hdr.type, BVD_ACK_RANGE_PKT);
+	cr_assert_eq(hdr.payload_length, sizeof(bvd_msgid_range));
+	cr_assert_eq(ntohl(((uint32_t*)payload)[0]), 1000);
+	cr_assert_eq(ntohl(((uint32_t*)payload)[1]), BVD_COALESCE_MAX);
+	free(payload);
+}
+
+
+//The timing wheel, see timer.h
+
+typedef struct fired {
+	BVD_TIMER timer;
+	long delay;	//ms it was set for
+	long at;	//ms after the start it fired, -1 if it did not
+	int order;
+} FIRED;
+
+static long timers_start;
+static int timers_fired;
+
+static void note_fired(void* arg){
+	FIRED* f = arg;
+	f->at = timer_now_ms() - timers_start;
+	f->order = timers_fired++;
+}
+
+/*
+	Runs the wheel the way the writer thread of outq.c does, until count
+	timers have fired or for at most ms.
+*/
+static void run_timers(int count, long ms){
+	long until = timer_now_ms() + ms;
+	while(timers_fired < count && timer_now_ms() < until){
+		struct pollfd pfd = {timer_fd(), POLLIN, 0};
+		if(poll(&pfd, 1, 10) > 0)
+			timer_run();
+	}
+}
+
+Test(timer, fire_in_order_across_levels){
+	cr_assert_eq(timer_init(), 0);
+	//level 0, the edge of level 1, level 1, and two levels up
+	long delays[] = {4100, 1, 65, 63, 64, 130, 5, 700, 2};
+	int count = sizeof(delays) / sizeof(delays[0]);
+	FIRED fs[sizeof(delays) / sizeof(delays[0])];
+	timers_start = timer_now_ms();
+	for(int i = 0; i < count; i++){
+		fs[i].delay = delays[i];
+		fs[i].at = -1;
+		timer_setup(&fs[i].timer, note_fired, &fs[i]);
+		timer_schedule(&fs[i].timer, delays[i]);
+	}
+	run_timers(count, 10000);
+	cr_assert_eq(timers_fired, count);
+	for(int i = 0; i < count; i++){
+		cr_assert_geq(fs[i].at, fs[i].delay, "delay %ld", fs[i].delay);
+		cr_assert_lt(fs[i].at, fs[i].delay + 250, "delay %ld", fs[i].delay);
+		for(int j = 0; j < count; j++){
+			if(fs[j].delay < fs[i].delay)
+				cr_assert_lt(fs[j].order, fs[i].order, "%ld before %ld", fs[j].delay, fs[i].delay);
+		}
+	}
+}
+
+Test(timer, cancel_and_restart){
+	cr_assert_eq(timer_init(), 0);
+	FIRED fs[4];
+	long delays[] = {20, 70, 150, 300};
+	timers_start = timer_now_ms();
+	for(int i = 0; i < 4; i++){
+		fs[i].delay = delays[i];
+		fs[i].at = -1;
+		timer_setup(&fs[i].timer, note_fired, &fs[i]);
+		timer_schedule(&fs[i].timer, delays[i]);
+	}
+	//one in level 0 and one waiting to cascade
+	timer_cancel(&fs[0].timer);
+	timer_cancel(&fs[2].timer);
+	//cancelling one that is not pending does nothing
+	timer_cancel(&fs[2].timer);
+	//moved up, from level 1 to level 0
+	timer_schedule(&fs[3].timer, 40);
+	fs[3].delay = 40;
+	run_timers(2, 1000);
+	cr_assert_eq(timers_fired, 2);
+	cr_assert_eq(fs[3].order, 0);
+	cr_assert_eq(fs[1].order, 1);
+	cr_assert_geq(fs[3].at, 40);
+	cr_assert_geq(fs[1].at, 70);
+	//and nothing else comes
+	run_timers(3, 400);
+	cr_assert_eq(fs[0].at, -1);
+	cr_assert_eq(fs[2].at, -1);
+}
+
+Test(timer, more_than_a_batch){
+	cr_assert_eq(timer_init(), 0);
+	int count = 10 * BVD_TIMER_BATCH + 7;
+	FIRED* fs = calloc(count, sizeof(FIRED));
+	timers_start = timer_now_ms();
+	for(int i = 0; i < count; i++){
+		fs[i].at = -1;
+		timer_setup(&fs[i].timer, note_fired, &fs[i]);
+		//all in the same level 1 slot, which comes up at once
+		timer_schedule(&fs[i].timer, 100);
+	}
+	//and the wheel is late for them
+	usleep(200 * 1000);
+	struct pollfd pfd = {timer_fd(), POLLIN, 0};
+	cr_assert_eq(poll(&pfd, 1, 0), 1);
+	timer_run();
+	cr_assert_leq(timers_fired, BVD_TIMER_BATCH);
+	run_timers(count, 1000);
+	cr_assert_eq(timers_fired, count);
+	for(int i = 0; i < count; i++)
+		cr_assert_geq(fs[i].at, 100);
+	free(fs);
+}
+
+
+//The dedup window, see dedup.h
+
+/*
+	Records msgids[0..count), and checks that exactly the last
+	BVD_DEDUP_WINDOW of them are seen after each.
+*/
+static void record_all(DEDUP* d, uint32_t* msgids, int count){
+	for(int i = 0; i < count; i++){
+		dedup_record(d, msgids[i]);
+		int from = i + 1 > BVD_DEDUP_WINDOW ? i + 1 - BVD_DEDUP_WINDOW : 0;
+		//the ones just pushed out, and a sample of those still in
+		for(int j = from > 8 ? from - 8 : 0; j < from; j++)
+			cr_assert_not(dedup_seen(d, msgids[j]), "%d of %d", j, i);
+		for(int j = from; j <= i; j += 1 + (i - from) / 16)
+			cr_assert(dedup_seen(d, msgids[j]), "%d of %d", j, i);
+		cr_assert(dedup_seen(d, msgids[i]));
+	}
+}
+
+Test(dedup, window){
+	DEDUP* d = malloc(sizeof(DEDUP));
+	dedup_init(d);
+	cr_assert_not(dedup_seen(d, 0));
+	int count = 3 * BVD_DEDUP_WINDOW + 5;
+	uint32_t* msgids = malloc(count * sizeof(uint32_t));
+	for(int i = 0; i < count; i++)
+		msgids[i] = 1000 + i;
+	record_all(d, msgids, count);
+	//again, it does not move
+	dedup_record(d, msgids[count - BVD_DEDUP_WINDOW]);
+	cr_assert(dedup_seen(d, msgids[count - BVD_DEDUP_WINDOW]));
+	cr_assert(dedup_seen(d, msgids[count - BVD_DEDUP_WINDOW + 1]));
+	free(msgids);
+	free(d);
+}
+
+Test(dedup, colliding_msgids){
+	//these all start their search in the same slot, and those of
+	//different runs interleave, so every delete shifts entries back
+	DEDUP* d = malloc(sizeof(DEDUP));
+	dedup_init(d);
+	int count = 4 * BVD_DEDUP_WINDOW;
+	uint32_t* msgids = malloc(count * sizeof(uint32_t));
+	for(int i = 0; i < count; i++)
+		msgids[i] = (i % 3 == 0 ? 7 : i % 3) + 2 * BVD_DEDUP_WINDOW * (uint32_t)(i / 3);
+	record_all(d, msgids, count);
+	free(msgids);
+	free(d);
+}
+
+Test(dedup, take_back_last){
+	DEDUP* d = malloc(sizeof(DEDUP));
+	dedup_init(d);
+	//nothing to take back
+	dedup_unrecord(d, 5);
+	for(uint32_t m = 0; m < BVD_DEDUP_WINDOW + 3; m++)
+		dedup_record(d, m);
+	//not the last one
+	dedup_unrecord(d, BVD_DEDUP_WINDOW);
+	cr_assert(dedup_seen(d, BVD_DEDUP_WINDOW));
+	//the last three, newest first
+	for(uint32_t m = BVD_DEDUP_WINDOW + 2; m >= BVD_DEDUP_WINDOW; m--){
+		dedup_unrecord(d, m);
+		cr_assert_not(dedup_seen(d, m));
+	}
+	//what they pushed out stays out, the rest stays in
+	for(uint32_t m = 0; m < 3; m++)
+		cr_assert_not(dedup_seen(d, m));
+	for(uint32_t m = 3; m < BVD_DEDUP_WINDOW; m++)
+		cr_assert(dedup_seen(d, m), "%u", m);
+	//and the window fills up from there as before
+	for(uint32_t m = 5000; m < 5003; m++)
+		dedup_record(d, m);
+	cr_assert(dedup_seen(d, 3));
+	dedup_record(d, 6000);
+	cr_assert_not(dedup_seen(d, 3));
+	cr_assert(dedup_seen(d, 4));
+	cr_assert(dedup_seen(d, 6000));
+	free(d);
+}
+
+
+//Rate limits, see ratelimit.h
+
+Test(rate, parse){
+	RATE_LIMIT limit;
+	cr_assert_eq(rate_parse("100", &limit), 0);
+	cr_assert_eq(limit.packets, 100);
+	cr_assert_eq(limit.bytes, 0);
+	cr_assert_eq(rate_parse("100,65536", &limit), 0);
+	cr_assert_eq(limit.packets, 100);
+	cr_assert_eq(limit.bytes, 65536);
+	cr_assert_eq(rate_parse("0,0", &limit), 0);
+	char* malformed[] = {"", ",", "abc", "-1", "10,-1", "10,", "10,abc", "10x", "10,20,30", "10;20"};
+	for(int i = 0; i < (int)(sizeof(malformed) / sizeof(malformed[0])); i++)
+		cr_assert_eq(rate_parse(malformed[i], &limit), -1, "\"%s\"", malformed[i]);
+}
+
+Test(rate, packets_burst_then_refill){
+	RATE_BUCKET conn;
+	rate_bucket_init(&conn);
+	//none set: nothing is refused
+	for(int i = 0; i < 1000; i++)
+		cr_assert_eq(rate_take(&conn, NULL, 1), 0);
+	//10ms a packet, so a full bucket gives BVD_RATE_BURST_MS / 10 at once
+	rate_conn_limit.packets = 100;
+	int burst = BVD_RATE_BURST_MS / 10;
+	for(int i = 0; i < burst; i++)
+		cr_assert_eq(rate_take(&conn, NULL, 1), 0, "packet %d", i);
+	cr_assert_eq(rate_take(&conn, NULL, 1), -1);
+	cr_assert_eq(rate_take(&conn, NULL, 1), -1);
+	//refused ones do not count, so one more comes back in 10ms
+	usleep(15 * 1000);
+	cr_assert_eq(rate_take(&conn, NULL, 1), 0);
+	cr_assert_eq(rate_take(&conn, NULL, 1), -1);
+}
+
+Test(rate, both_or_neither){
+	RATE_BUCKET conn, handle;
+	rate_bucket_init(&conn);
+	rate_bucket_init(&handle);
+	rate_conn_limit.packets = 100;
+	rate_handle_limit.packets = 50;
+	int burst = BVD_RATE_BURST_MS / 20;
+	for(int i = 0; i < burst; i++)
+		cr_assert_eq(rate_take(&conn, &handle, 1), 0);
+	//the handle is out, and the connection gets back what it gave
+	for(int i = 0; i < 100; i++)
+		cr_assert_eq(rate_take(&conn, &handle, 1), -1);
+	for(int i = burst; i < BVD_RATE_BURST_MS / 10; i++)
+		cr_assert_eq(rate_take(&conn, NULL, 1), 0, "packet %d", i);
+	cr_assert_eq(rate_take(&conn, NULL, 1), -1);
+}
+
+Test(rate, bytes){
+	RATE_BUCKET conn;
+	rate_bucket_init(&conn);
+	//a burst of 1000 bytes
+	rate_conn_limit.bytes = 1000 * 1000 / BVD_RATE_BURST_MS;
+	cr_assert_eq(rate_take(&conn, NULL, 600), 0);
+	cr_assert_eq(rate_take(&conn, NULL, 600), -1);
+	cr_assert_eq(rate_take(&conn, NULL, 300), 0);
+	//a full bucket lets a packet over the burst through, and is empty for longer
+	RATE_BUCKET big;
+	rate_bucket_init(&big);
+	cr_assert_eq(rate_take(&big, NULL, 5000), 0);
+	cr_assert_eq(rate_take(&big, NULL, 1), -1);
+}
+
+
+//Wire formats, see wire.h
+
+/*
+	Encodes hdr in v2 and checks that it decodes to the same.
+*/
+static int v2_round_trip(bvd_packet_header* hdr, int flags, uint32_t id){
+	uint8_t buf[BVD_WIRE_MAX_HEADER];
+	int hlen = wire_encode_header(BVD_WIRE_V2, hdr, flags, id, buf);
+	cr_assert_leq(hlen, BVD_WIRE_MAX_HEADER);
+	cr_assert_eq(wire_header_length(BVD_WIRE_V2, buf), (size_t)hlen);
+	cr_assert_eq(wire_packet_length(BVD_WIRE_V2, buf), hlen + hdr->payload_length);
+	bvd_packet_header out;
+	int out_flags;
+	uint32_t out_id;
+	cr_assert_eq(wire_decode_header(buf, hlen, &out, &out_flags, &out_id), hlen);
+	cr_assert_eq(out.type, hdr->type);
+	cr_assert_eq(out.msgid, hdr->msgid);
+	cr_assert_eq(out.payload_length, hdr->payload_length);
+	cr_assert_eq(out_flags, flags);
+	cr_assert_eq(out.timestamp_sec, flags & BVD_WIRE_TIME ? hdr->timestamp_sec : 0);
+	cr_assert_eq(out.timestamp_nsec, flags & BVD_WIRE_TIME ? hdr->timestamp_nsec : 0);
+	cr_assert_eq(out_id, flags & BVD_WIRE_ID ? id : 0);
+	//and it needs every byte
+	cr_assert_eq(wire_decode_header(buf, hlen - 1, &out, &out_flags, &out_id), -1);
+	return hlen;
+}
+
+Test(wire, v2_round_trip){
+	uint32_t values[] = {0, 1, 127, 128, 16383, 16384, 1u << 28, UINT32_MAX};
+	int count = sizeof(values) / sizeof(values[0]);
+	int all[] = {0, BVD_WIRE_TIME, BVD_WIRE_ID, BVD_WIRE_ID | BVD_WIRE_NAMED, BVD_WIRE_TIME | BVD_WIRE_ID | BVD_WIRE_NAMED};
+	for(int f = 0; f < (int)(sizeof(all) / sizeof(all[0])); f++){
+		for(int i = 0; i < count; i++){
+			bvd_packet_header hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.type = BVD_SEND_PKT;
+			hdr.msgid = values[i];
+			hdr.payload_length = values[(i + 3) % count];
+			hdr.timestamp_sec = values[(i + 5) % count];
+			hdr.timestamp_nsec = values[(i + 7) % count];
+			v2_round_trip(&hdr, all[f], values[(i + 1) % count]);
+		}
+	}
+	//a bare ACK
+	bvd_packet_header ack;
+	memset(&ack, 0, sizeof(ack));
+	ack.type = BVD_ACK_PKT;
+	ack.msgid = 5;
+	cr_assert_eq(v2_round_trip(&ack, 0, 0), 4);
+}
+
+Test(wire, v1_lengths){
+	bvd_packet_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = BVD_SEND_PKT;
+	hdr.msgid = 7;
+	hdr.payload_length = 300;
+	uint8_t buf[BVD_WIRE_MAX_HEADER];
+	cr_assert_eq(wire_encode_header(BVD_WIRE_V1, &hdr, BVD_WIRE_ID, 3, buf), (int)sizeof(bvd_packet_header));
+	cr_assert_eq(wire_header_length(BVD_WIRE_V1, buf), sizeof(bvd_packet_header));
+	cr_assert_eq(wire_packet_length(BVD_WIRE_V1, buf), sizeof(bvd_packet_header) + 300);
+}
+
+Test(wire, malformed_v2_headers){
+	bvd_packet_header hdr;
+	int flags;
+	uint32_t id;
+	//nothing there
+	uint8_t buf[BVD_WIRE_MAX_HEADER] = {4, BVD_ACK_PKT, 5, 0};
+	cr_assert_eq(wire_decode_header(buf, 0, &hdr, &flags, &id), -1);
+	cr_assert_eq(wire_decode_header(buf, 4, &hdr, &flags, &id), 4);
+	//shorter than any header can be
+	for(uint8_t hlen = 0; hlen < 4; hlen++){
+		buf[0] = hlen;
+		cr_assert_eq(wire_decode_header(buf, sizeof(buf), &hdr, &flags, &id), -1, "length %d", hlen);
+	}
+	//a varint running past the end of the header
+	uint8_t past[] = {4, BVD_ACK_PKT, 0x85, 0x01, 0};
+	cr_assert_eq(wire_decode_header(past, sizeof(past), &hdr, &flags, &id), -1);
+	//bytes left over after the last field
+	uint8_t over[] = {5, BVD_ACK_PKT, 5, 0, 0};
+	cr_assert_eq(wire_decode_header(over, sizeof(over), &hdr, &flags, &id), -1);
+	//a field the flags say is there, but is not
+	uint8_t missing[] = {BVD_WIRE_ID | 4, BVD_SEND_PKT, 5, 0};
+	cr_assert_eq(wire_decode_header(missing, sizeof(missing), &hdr, &flags, &id), -1);
+	uint8_t no_time[] = {BVD_WIRE_TIME | 5, BVD_SEND_PKT, 5, 0, 1};
+	cr_assert_eq(wire_decode_header(no_time, sizeof(no_time), &hdr, &flags, &id), -1);
+}
+
+Test(wire, malformed_varints){
+	bvd_packet_header hdr;
+	int flags;
+	uint32_t id;
+	//UINT32_MAX as a msgid takes 5 bytes, the last one 0x0f
+	uint8_t max[] = {8, BVD_ACK_PKT, 0xff, 0xff, 0xff, 0xff, 0x0f, 0};
+	cr_assert_eq(wire_decode_header(max, sizeof(max), &hdr, &flags, &id), 8);
+	cr_assert_eq(hdr.msgid, UINT32_MAX);
+	//any more bits than that do not fit
+	uint8_t wide[] = {8, BVD_ACK_PKT, 0xff, 0xff, 0xff, 0xff, 0x1f, 0};
+	cr_assert_eq(wire_decode_header(wide, sizeof(wide), &hdr, &flags, &id), -1);
+	uint8_t wider[] = {8, BVD_ACK_PKT, 0x80, 0x80, 0x80, 0x80, 0x70, 0};
+	cr_assert_eq(wire_decode_header(wider, sizeof(wider), &hdr, &flags, &id), -1);
+	//nor does a sixth byte
+	uint8_t six[] = {9, BVD_ACK_PKT, 0xff, 0xff, 0xff, 0xff, 0x8f, 0x00, 0};
+	cr_assert_eq(wire_decode_header(six, sizeof(six), &hdr, &flags, &id), -1);
+	//padded out with zeros is not canonical, but fits
+	uint8_t padded[] = {5, BVD_ACK_PKT, 0x85, 0x00, 0};
+	cr_assert_eq(wire_decode_header(padded, sizeof(padded), &hdr, &flags, &id), 5);
+	cr_assert_eq(hdr.msgid, 5);
+}
+
+Test(wire, recv_v2){
+	int fds[2];
+	cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	bvd_packet_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = BVD_SEND_PKT;
+	hdr.msgid = 300;
+	hdr.payload_length = 5;
+	cr_assert_eq(wire_send_packet(fds[0], BVD_WIRE_V2, &hdr, BVD_WIRE_ID, 9, "hello"), 0);
+	bvd_packet_header in;
+	int flags;
+	uint32_t id;
+	void* payload = NULL;
+	cr_assert_eq(wire_recv_packet(fds[1], BVD_WIRE_V2, &in, &flags, &id, &payload), 0);
+	cr_assert_eq(in.msgid, 300);
+	cr_assert_eq(id, 9);
+	cr_assert_str_eq(payload, "hello");
+	free(payload);
+	//one claiming more than the server will take
+	hdr.payload_length = proto_max_payload + 1;
+	uint8_t buf[BVD_WIRE_MAX_HEADER];
+	int hlen = wire_encode_header(BVD_WIRE_V2, &hdr, 0, 0, buf);
+	cr_assert_eq(write(fds[0], buf, hlen), hlen);
+	cr_assert_eq(wire_recv_packet(fds[1], BVD_WIRE_V2, &in, &flags, &id, &payload), -1);
+	//and garbage
+	uint8_t junk[] = {2, 0xff, 0xff};
+	cr_assert_eq(write(fds[1], junk, sizeof(junk)), (ssize_t)sizeof(junk));
+	cr_assert_eq(wire_recv_packet(fds[0], BVD_WIRE_V2, &in, &flags, &id, &payload), -1);
+}
+
+
+//Shared-memory offers, see shm.h
+
+/*
+	Offers the region of client over a socket pair, after letting
+	spoil change it, and returns what shm_accept() made of it.
+*/
+static int shm_offer_with(void (*spoil)(SHM_CONN*), SHM_CONN** server){
+	int fds[2];
+	cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	SHM_CONN* client = shm_create(fds[0], BVD_SHM_MIN_RING);
+	cr_assert_not_null(client);
+	if(spoil != NULL)
+		spoil(client);
+	cr_assert_eq(shm_offer(client, 77), 0);
+	bvd_packet_header hdr;
+	errno = 0;
+	int ret = shm_accept(fds[1], &hdr, server);
+	if(ret < 0)
+		cr_assert_eq(*server, NULL);
+	else
+		cr_assert_eq(hdr.msgid, 77);
+	return ret;
+}
+
+Test(shm, offer_taken){
+	SHM_CONN* server;
+	cr_assert_eq(shm_offer_with(NULL, &server), 0);
+	cr_assert_not_null(server);
+	cr_assert_eq(server->ring_size, BVD_SHM_MIN_RING);
+	shm_close(server);
+}
+
+Test(shm, not_an_offer){
+	int fds[2];
+	cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	bvd_packet_header hdr;
+	proto_init_header(&hdr, BVD_LOGIN_PKT, 1, 0);
+	cr_assert_eq(proto_send_packet(fds[0], &hdr, NULL), 0);
+	SHM_CONN* server = (SHM_CONN*)&hdr;
+	cr_assert_eq(shm_accept(fds[1], &hdr, &server), 0);
+	cr_assert_null(server);
+	//which is left for the caller to read
+	void* payload;
+	cr_assert_eq(proto_recv_packet(fds[1], &hdr, &payload), 0);
+	cr_assert_eq(hdr.type, BVD_LOGIN_PKT);
+}
+
+static void bad_magic(SHM_CONN* c){ ((SHM_HEADER*)c->base)->magic++; }
+static void bad_version(SHM_CONN* c){ ((SHM_HEADER*)c->base)->version++; }
+static void ring_not_power_of_2(SHM_CONN* c){ ((SHM_HEADER*)c->base)->ring_size += 4096; }
+static void ring_too_big(SHM_CONN* c){ ((SHM_HEADER*)c->base)->ring_size *= 2; }
+static void ring_too_small(SHM_CONN* c){ ((SHM_HEADER*)c->base)->ring_size = BVD_SHM_MIN_RING / 2; }
+
+/*
+	Swaps the memfd for a copy of it that is not sealed.
+*/
+static void not_sealed(SHM_CONN* c){
+	int memfd = memfd_create("bvd_test", MFD_CLOEXEC);
+	cr_assert_geq(memfd, 0);
+	cr_assert_eq(ftruncate(memfd, c->size), 0);
+	cr_assert_eq(pwrite(memfd, c->base, sizeof(SHM_HEADER), 0), (ssize_t)sizeof(SHM_HEADER));
+	close(c->memfd);
+	c->memfd = memfd;
+}
+
+static void not_an_eventfd(SHM_CONN* c){
+	int p[2];
+	cr_assert_eq(pipe(p), 0);
+	close(c->out_ready);
+	c->out_ready = p[0];
+}
+
+Test(shm, unusable_offers){
+	void (*spoil[])(SHM_CONN*) = {bad_magic, bad_version, ring_not_power_of_2, ring_too_big, ring_too_small, not_sealed, not_an_eventfd};
+	for(int i = 0; i < (int)(sizeof(spoil) / sizeof(spoil[0])); i++){
+		SHM_CONN* server;
+		cr_assert_eq(shm_offer_with(spoil[i], &server), -1, "offer %d", i);
+		cr_assert_eq(errno, EPROTO, "offer %d", i);
+	}
+}
+
+Test(shm, rings){
+	int fds[2];
+	cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	SHM_CONN* client = shm_create(fds[0], BVD_SHM_MIN_RING);
+	cr_assert_eq(shm_offer(client, 1), 0);
+	bvd_packet_header hdr;
+	SHM_CONN* server;
+	cr_assert_eq(shm_accept(fds[1], &hdr, &server), 0);
+	char buf[16];
+	cr_assert_eq(shm_read(server, buf, sizeof(buf)), -1);
+	cr_assert_eq(errno, EAGAIN);
+	cr_assert_eq(shm_write_fully(client, "hello", 5), 0);
+	cr_assert_eq(shm_read(server, buf, sizeof(buf)), 5);
+	cr_assert_arr_eq(buf, "hello", 5);
+	cr_assert_eq(shm_write_fully(server, "world", 5), 0);
+	cr_assert_eq(shm_read(client, buf, sizeof(buf)), 5);
+	cr_assert_arr_eq(buf, "world", 5);
+	//the client claims more than the ring holds, or takes back what it wrote
+	SHM_HEADER* header = client->base;
+	atomic_store(&header->rings[0].tail, 5 + BVD_SHM_MIN_RING + 1);
+	cr_assert_eq(shm_read(server, buf, sizeof(buf)), -1);
+	cr_assert_eq(errno, EPROTO);
+	atomic_store(&header->rings[0].tail, 4);
+	cr_assert_eq(shm_read(server, buf, sizeof(buf)), -1);
+	cr_assert_eq(errno, EPROTO);
+	//or reads what was never written
+	atomic_store(&header->rings[1].head, 6);
+	struct iovec iov = {"x", 1};
+	cr_assert_eq(shm_writev(server, &iov, 1), -1);
+	cr_assert_eq(errno, EPROTO);
+}
+
+
+//Spilling mailboxes, see mailbox_ext.h
+
+/*
+	A budget of 1 MB, spilled to /tmp, and a mailbox to spill.
+*/
+static MAILBOX* spill_setup(void){
+	dir_init();
+	cr_assert_eq(timer_init(), 0);
+	mb_budget_mb = 1;
+	mb_spill_dir = "/tmp";
+	return mb_init("spilled");
+}
+
+/*
+	The length of the body of a message: every third one is big.
+*/
+static int spill_length(int msgid, int small, int big){
+	return msgid % 3 == 0 ? big : small;
+}
+
+/*
+	Adds the messages first to first + count - 1, each with a body of
+	spill_length() bytes that all hold its msgid.
+*/
+static void spill_add(MAILBOX* mb, int first, int count, int small, int big){
+	for(int i = first; i < first + count; i++){
+		int length = spill_length(i, small, big);
+		char* body = malloc(length);
+		memset(body, (char)i, length);
+		MB_BATCH_MESSAGE msg = {i, NULL, body, length};
+		cr_assert_eq(mb_add_messages(mb, &msg, 1), 0);
+	}
+}
+
+/*
+	Takes everything out of the mailbox and checks that it is the
+	messages 1 to last in order with their bodies, of spill_length()
+	bytes but for the one at msgid stream_at, which is the stream st.
+*/
+static void spill_drain(MAILBOX* mb, int last, int small, int big, BVD_STREAM* st, int stream_at){
+	MAILBOX_ENTRY* entries[64];
+	int next = 1;
+	int n;
+	while((n = mb_take_entries(mb, entries, 64)) > 0){
+		for(int i = 0; i < n; i++, next++){
+			MAILBOX_ENTRY* entry = entries[i];
+			cr_assert_eq(entry->content.message.msgid, next);
+			if(next == stream_at){
+				cr_assert(BVD_IS_STREAM(entry));
+				cr_assert_eq(entry->body, st);
+			}
+			else{
+				int length = spill_length(next, small, big);
+				cr_assert_eq(entry->length, length);
+				char* body = entry->body;
+				for(int j = 0; j < length; j++)
+					cr_assert_eq(body[j], (char)next);
+				free(body);
+			}
+			free(entry);
+		}
+	}
+	cr_assert_eq(next, last + 1);
+}
+
+Test(spill, read_back_in_order){
+	MAILBOX* mb = spill_setup();
+	spill_add(mb, 1, 400, 8192, 8192);
+	cr_assert_leq(mb_resident_bytes(), 1048576);
+	spill_drain(mb, 400, 8192, 8192, NULL, 0);
+	cr_assert_eq(mb_resident_bytes(), 0);
+	mb_unref(mb);
+}
+
+Test(spill, records_over_the_chunk){
+	MAILBOX* mb = spill_setup();
+	//a big body does not fit in a chunk after a small one, nor on its own
+	spill_add(mb, 1, 90, 100, BVD_MB_SPILL_CHUNK + 4000);
+	cr_assert_leq(mb_resident_bytes(), 1048576);
+	spill_drain(mb, 90, 100, BVD_MB_SPILL_CHUNK + 4000, NULL, 0);
+	cr_assert_eq(mb_resident_bytes(), 0);
+	mb_unref(mb);
+}
+
+Test(spill, disk_full){
+	MAILBOX* mb = spill_setup();
+	mb_spill_dir = "/nonexistent";
+	spill_add(mb, 1, 200, 8192, 8192);
+	cr_assert_gt(mb_resident_bytes(), 1048576);
+	spill_drain(mb, 200, 8192, 8192, NULL, 0);
+	cr_assert_eq(mb_resident_bytes(), 0);
+	mb_unref(mb);
+}
+
+Test(spill, looks_again_after_backing_off){
+	MAILBOX* full = spill_setup();
+	MAILBOX* mb = mb_init("cold");
+	//no more than BVD_MB_SPILL_KEEP messages, which are not spilled
+	spill_add(full, 1, BVD_MB_SPILL_KEEP, 100000, 100000);
+	cr_assert_gt(mb_resident_bytes(), 1048576);
+	//so the scan found nothing, and the next one waits
+	spill_add(mb, 1, 100, 1000, 1000);
+	long before = mb_resident_bytes();
+	long until = timer_now_ms() + 2000;
+	while(mb_resident_bytes() == before && timer_now_ms() < until){
+		struct pollfd pfd = {timer_fd(), POLLIN, 0};
+		if(poll(&pfd, 1, 10) > 0)
+			timer_run();
+	}
+	cr_assert_lt(mb_resident_bytes(), before);
+	spill_drain(mb, 100, 1000, 1000, NULL, 0);
+	spill_drain(full, BVD_MB_SPILL_KEEP, 100000, 100000, NULL, 0);
+	cr_assert_eq(mb_resident_bytes(), 0);
+	mb_unref(mb);
+	mb_unref(full);
+}
+
+/*
+	Adds messages 1 to 4000 from another thread while they are taken out.
+*/
+static void* spill_sender(void* arg){
+	spill_add(arg, 1, 4000, 1000, 20000);
+	return NULL;
+}
+
+Test(spill, add_while_taking){
+	MAILBOX* mb = spill_setup();
+	pthread_t sender;
+	pthread_create(&sender, NULL, spill_sender, mb);
+	//the lane spills before anything is taken out
+	while(metrics_get(METRIC_MB_SPILLED) == 0)
+		sched_yield();
+	int next = 1;
+	while(next <= 4000){
+		MAILBOX_ENTRY* entries[64];
+		int n = mb_next_entries(mb, entries, 64, LONG_MAX, NULL);
+		cr_assert_gt(n, 0);
+		for(int i = 0; i < n; i++, next++){
+			cr_assert_eq(entries[i]->content.message.msgid, next);
+			cr_assert_eq(entries[i]->length, spill_length(next, 1000, 20000));
+			cr_assert_eq(((char*)entries[i]->body)[entries[i]->length - 1], (char)next);
+			free(entries[i]->body);
+			free(entries[i]);
+		}
+	}
+	pthread_join(sender, NULL);
+	cr_assert_eq(mb_resident_bytes(), 0);
+	mb_unref(mb);
+}
+
+Test(spill, stream_in_the_tail){
+	MAILBOX* mb = spill_setup();
+	BVD_STREAM st;
+	spill_add(mb, 1, 20, 8192, 8192);
+	MB_BATCH_MESSAGE msg = {21, NULL, &st, BVD_STREAM_LENGTH};
+	cr_assert_eq(mb_add_messages(mb, &msg, 1), 0);
+	spill_add(mb, 22, 179, 8192, 8192);
+	cr_assert_leq(mb_resident_bytes(), 1048576);
+	spill_drain(mb, 200, 8192, 8192, &st, 21);
+	cr_assert_eq(mb_resident_bytes(), 0);
+	mb_unref(mb);
+}
+
+Test(spill, stream_after_spilling){
+	MAILBOX* mb = spill_setup();
+	BVD_STREAM st;
+	spill_add(mb, 1, 200, 8192, 8192);
+	cr_assert_leq(mb_resident_bytes(), 1048576);
+	MB_BATCH_MESSAGE msg = {201, NULL, &st, BVD_STREAM_LENGTH};
+	cr_assert_eq(mb_add_messages(mb, &msg, 1), 0);
+	spill_add(mb, 202, 10, 8192, 8192);
+	spill_drain(mb, 211, 8192, 8192, &st, 201);
+	cr_assert_eq(mb_resident_bytes(), 0);
+	mb_unref(mb);
+}
+
+
+//HISTORY requests, see history.h
+
+/*
+	The payload of a request, with the handle of peer if it is not NULL.
+*/
+static uint32_t history_request(char* buf, uint64_t since, uint64_t until, uint32_t max, char* peer){
+	since = htobe64(since);
+	until = htobe64(until);
+	max = htonl(max);
+	memcpy(buf, &since, 8);
+	memcpy(buf + 8, &until, 8);
+	memcpy(buf + 16, &max, 4);
+	if(peer == NULL)
+		return BVD_HISTORY_REQUEST_SIZE;
+	memcpy(buf + BVD_HISTORY_REQUEST_SIZE, peer, strlen(peer));
+	return BVD_HISTORY_REQUEST_SIZE + strlen(peer);
+}
+
+Test(history, parse){
+	char buf[64];
+	HISTORY_QUERY q;
+	uint32_t length = history_request(buf, 1700000000123ULL, UINT64_MAX, 50, NULL);
+	cr_assert_eq(history_parse(buf, length, &q), 0);
+	cr_assert_eq(q.since_ms, 1700000000123ULL);
+	cr_assert_eq(q.until_ms, UINT64_MAX);
+	cr_assert_eq(q.max, 50);
+	cr_assert_null(q.peer);
+	length = history_request(buf, 0, 0, 0, "bob");
+	cr_assert_eq(history_parse(buf, length, &q), 0);
+	cr_assert_eq(q.max, BVD_HISTORY_MAX_RANGE);
+	cr_assert_eq(q.peer_length, 3);
+	cr_assert_arr_eq(q.peer, "bob", 3);
+	//more than a range can have
+	length = history_request(buf, 0, 0, BVD_HISTORY_MAX_RANGE + 1, NULL);
+	cr_assert_eq(history_parse(buf, length, &q), 0);
+	cr_assert_eq(q.max, BVD_HISTORY_MAX_RANGE);
+}
+
+Test(history, parse_malformed){
+	char buf[64];
+	HISTORY_QUERY q;
+	history_request(buf, 1, 2, 3, NULL);
+	cr_assert_eq(history_parse(NULL, 0, &q), -1);
+	cr_assert_eq(history_parse(NULL, BVD_HISTORY_REQUEST_SIZE, &q), -1);
+	for(uint32_t length = 0; length < BVD_HISTORY_REQUEST_SIZE; length++)
+		cr_assert_eq(history_parse(buf, length, &q), -1, "length %u", length);
+}
+
+
+/*
+	Asks for the last messages of id until there are count of them, or
+	for at most a second, as the appender writes them in its own time.
+*/
+static void history_wait(uint32_t id, int count, HISTORY_RANGE* range){
+	HISTORY_QUERY q = {0, 0, BVD_HISTORY_MAX_RANGE, NULL, 0};
+	for(int i = 0; i < 100; i++){
+		history_range(id, &q, range);
+		if(range->count >= count)
+			return;
+		history_release(range);
+		usleep(10000);
+	}
+	history_range(id, &q, range);
+}
+
+Test(history, only_what_was_taken){
+	char dir[] = "/tmp/bvd_history_XXXXXX";
+	cr_assert_not_null(mkdtemp(dir));
+	intern_init();
+	cr_assert_eq(history_init(dir), 0);
+	uint32_t alice = intern_handle("alice");
+	uint32_t bob = intern_handle("bob");
+	char dlvr[] = "alice\r\nhello";
+	void* taken = history_record(alice, bob, "bob", 1, dlvr, strlen(dlvr));
+	void* refused = history_record(alice, bob, "bob", 2, dlvr, strlen(dlvr));
+	void* late = history_record(alice, bob, "bob", 3, dlvr, strlen(dlvr));
+	cr_assert(taken != NULL && refused != NULL && late != NULL);
+	history_settle(taken, 1);
+	history_settle(refused, 0);
+	//the appender waits for it meanwhile
+	usleep(BVD_HISTORY_FLUSH_MS * 5000);
+	history_settle(late, 1);
+
+	HISTORY_RANGE range;
+	history_wait(bob, 2, &range);
+	cr_assert_eq(range.count, 2);
+	cr_assert_eq(range.items[0].msgid, 1);
+	cr_assert_eq(range.items[1].msgid, 3);
+	cr_assert_eq(range.items[1].frame_length, 5);
+	cr_assert_arr_eq(range.items[1].frame, "hello", 5);
+	history_release(&range);
+
+	DIR* d = opendir(dir);
+	struct dirent* e;
+	while((e = readdir(d)) != NULL){
+		if(e->d_name[0] != '.')
+			unlinkat(dirfd(d), e->d_name, 0);
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+//Heavy hitters, see hot.h
+
+typedef struct hot_row {
+	char handle[16];
+	unsigned long count;
+	unsigned long error;
+} HOT_ROW;
+
+static void hot_setup(void){
+	cr_assert_eq(timer_init(), 0);
+	intern_init();
+	hot_init();
+}
+
+/*
+	The handle with a number, interned.
+*/
+static uint32_t hot_id(int n){
+	char handle[16];
+	snprintf(handle, sizeof(handle), "h%d", n);
+	return intern_handle(handle);
+}
+
+/*
+	The rows of a table in the report, highest first.  Returns how many.
+*/
+static int hot_rows(char* table, HOT_ROW* rows){
+	char* report;
+	size_t size;
+	FILE* out = open_memstream(&report, &size);
+	hot_report(out);
+	fclose(out);
+	char* line = report;
+	while(strncmp(line, table, strlen(table)) != 0 || line[strlen(table)] != ' '){
+		line = strstr(line, "\r\n");
+		cr_assert_not_null(line, "%s", table);
+		line += 2;
+	}
+	line += strlen(table);
+	int count = 0, used;
+	while(count < BVD_HOT_TOP && sscanf(line, " %15[^:]:%lu:%lu%n", rows[count].handle, &rows[count].count, &rows[count].error, &used) == 3){
+		line += used;
+		count++;
+	}
+	if(count == 0)
+		cr_assert_eq(strncmp(line, " -\r\n", 4), 0);
+	free(report);
+	return count;
+}
+
+Test(hot, empty){
+	hot_setup();
+	char* names[] = {"hot_senders", "hot_sent_bytes", "hot_receivers", "hot_received_bytes"};
+	HOT_ROW rows[BVD_HOT_TOP];
+	for(int i = 0; i < 4; i++)
+		cr_assert_eq(hot_rows(names[i], rows), 0, "%s", names[i]);
+	//a connection that counted nothing has nothing to merge
+	HOT_LOCAL local;
+	hot_local_init(&local);
+	hot_flush(&local);
+	cr_assert_eq(hot_rows("hot_senders", rows), 0);
+}
+
+Test(hot, exact_when_few){
+	hot_setup();
+	HOT_LOCAL local;
+	hot_local_init(&local);
+	uint32_t a = hot_id(0), b = hot_id(1), c = hot_id(2);
+	for(int i = 0; i < 150; i++)
+		hot_count(&local, a, i % 3 == 0 ? c : b, 10);
+	//to no one here: only the sender counts
+	hot_count(&local, a, BVD_NO_ID, 10);
+	hot_flush(&local);
+	HOT_ROW rows[BVD_HOT_TOP];
+	cr_assert_eq(hot_rows("hot_senders", rows), 1);
+	cr_assert_str_eq(rows[0].handle, "h0");
+	cr_assert_eq(rows[0].count, 151);
+	cr_assert_eq(rows[0].error, 0);
+	cr_assert_eq(hot_rows("hot_sent_bytes", rows), 1);
+	cr_assert_eq(rows[0].count, 1510);
+	cr_assert_eq(hot_rows("hot_receivers", rows), 2);
+	cr_assert_str_eq(rows[0].handle, "h1");
+	cr_assert_eq(rows[0].count, 100);
+	cr_assert_str_eq(rows[1].handle, "h2");
+	cr_assert_eq(rows[1].count, 50);
+	cr_assert_eq(hot_rows("hot_received_bytes", rows), 2);
+	cr_assert_eq(rows[0].count, 1000);
+	cr_assert_eq(rows[1].count, 500);
+}
+
+Test(hot, heavy_among_many){
+	hot_setup();
+	//the heavy ones are h1..h10, with 2000 + 100 * n messages each, and
+	//thousands of others get a few each, all in one stream from several
+	//senders, so that slots, the aside buffer and the heap all turn over
+	int light = 5000;
+	uint32_t* ids = malloc(sizeof(uint32_t) * (light + 11));
+	for(int n = 0; n <= light + 10; n++)
+		ids[n] = hot_id(n);
+	int want[11] = {0};
+	HOT_LOCAL local;
+	hot_local_init(&local);
+	unsigned seed = 1;
+	for(int round = 0; round < 4000; round++){
+		uint32_t from = ids[round % 7];
+		for(int n = 1; n <= 10; n++){
+			if(want[n] < 2000 + 100 * n && rand_r(&seed) % 2 == 0){
+				hot_count(&local, from, ids[n], 1);
+				want[n]++;
+			}
+		}
+		for(int k = 0; k < 3; k++)
+			hot_count(&local, from, ids[11 + rand_r(&seed) % light], 1);
+	}
+	for(int n = 1; n <= 10; n++){
+		while(want[n] < 2000 + 100 * n){
+			hot_count(&local, ids[0], ids[n], 1);
+			want[n]++;
+		}
+	}
+	hot_flush(&local);
+
+	HOT_ROW rows[BVD_HOT_TOP];
+	cr_assert_eq(hot_rows("hot_receivers", rows), BVD_HOT_TOP);
+	for(int i = 0; i < BVD_HOT_TOP; i++){
+		int n = 10 - i;
+		char handle[16];
+		snprintf(handle, sizeof(handle), "h%d", n);
+		cr_assert_str_eq(rows[i].handle, handle, "row %d", i);
+		//never under, and over by no more than the error it reports
+		cr_assert_geq(rows[i].count, (unsigned long)want[n], "%s", handle);
+		cr_assert_leq(rows[i].count - rows[i].error, (unsigned long)want[n], "%s", handle);
+	}
+	free(ids);
+}
+
+Test(hot, decay){
+	hot_setup();
+	HOT_LOCAL local;
+	hot_local_init(&local);
+	for(int i = 0; i < 100; i++)
+		hot_count(&local, hot_id(0), hot_id(1), 1);
+	hot_flush(&local);
+	//the first merge period ends, once
+	usleep((BVD_HOT_MERGE_MS + 50) * 1000);
+	struct pollfd pfd = {timer_fd(), POLLIN, 0};
+	cr_assert_eq(poll(&pfd, 1, 1000), 1);
+	timer_run();
+	HOT_ROW rows[BVD_HOT_TOP];
+	cr_assert_eq(hot_rows("hot_receivers", rows), 1);
+	cr_assert_eq(rows[0].count, 100 - (100 + BVD_HOT_DECAY - 1) / BVD_HOT_DECAY);
+	//and what is counted from then on goes in after a merge of its own
+	hot_count(&local, hot_id(0), hot_id(1), 1);
+	hot_flush(&local);
+	cr_assert_eq(hot_rows("hot_receivers", rows), 1);
+	cr_assert_eq(rows[0].count, 100 - (100 + BVD_HOT_DECAY - 1) / BVD_HOT_DECAY + 1);
+}
+
+Test(hot, turnover){
+	hot_setup();
+	//more handles than the heap holds, close enough that the lowest keep
+	//changing places with those outside it, and all of them hashed to a
+	//few slots of the index (see hot_lookup()), so that most take a
+	//probe to find and every handle pushed out shifts others back
+	int handles = 3 * BVD_HOT_TRACKED;
+	uint32_t* ids = malloc(sizeof(uint32_t) * (handles + 1));
+	unsigned long* want = calloc(handles + 1, sizeof(unsigned long));
+	for(int n = 0, found = 0; found <= handles; n++){
+		uint32_t id = hot_id(n);
+		if((id * 2654435761u) >> 28 == 0)
+			ids[found++] = id;
+	}
+	HOT_LOCAL local;
+	hot_local_init(&local);
+	unsigned seed = 7;
+	for(int round = 0; round < 2000; round++){
+		for(int k = 0; k < 50; k++){
+			int n = 1 + rand_r(&seed) % handles;
+			//the higher the number, the more often
+			if(rand_r(&seed) % (2 * handles) < (unsigned)(n + handles)){
+				hot_count(&local, ids[0], ids[n], 1);
+				want[n]++;
+			}
+		}
+		hot_flush(&local);
+	}
+	HOT_ROW rows[BVD_HOT_TOP];
+	cr_assert_eq(hot_rows("hot_receivers", rows), BVD_HOT_TOP);
+	for(int i = 0; i < BVD_HOT_TOP; i++){
+		for(int j = 0; j < i; j++)
+			cr_assert_str_neq(rows[i].handle, rows[j].handle, "row %d", i);
+		int n = 1;
+		while(n <= handles && strcmp(intern_name(ids[n]), rows[i].handle) != 0)
+			n++;
+		cr_assert_leq(n, handles, "%s", rows[i].handle);
+		cr_assert_geq(rows[i].count, want[n], "%s", rows[i].handle);
+		cr_assert_leq(rows[i].count - rows[i].error, want[n], "%s", rows[i].handle);
+	}
+	free(want);
+	free(ids);
+}
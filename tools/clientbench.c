@@ -0,0 +1,177 @@
+/*
+ * Benchmark of libbvdclient (see client.h).
+ *
+ * Opens a sender and a receiver client, queues messages from one to the
+ * other as fast as client_send() takes them and reports delivered
+ * msgs/sec once every message has its outcome, and the percentiles of
+ * the time from client_send() to the DLVR at the receiver.
+ *
+ *   bvd_clientbench -p <port> [-h host] [-n messages] [-s size] [-b max_batch]
+ *                   [-w window] [-c capabilities] [-l] [-u path [-m]]
+ *
+ * -l waits for the ACK of each message before sending the next, the
+ * lockstep of a blocking client, to compare against.  -b 1 sends no
+ * SEND_BATCHes.  -c "" asks for no capabilities.  -u connects to the
+ * server's Unix-domain socket instead of the port, and -m on top of it
+ * has the connections carried over shared memory (see shm.h).
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "client.h"
+#include "shm.h"
+
+
+//GLOBAL VARIABLES
+atomic_long acked = 0;
+atomic_long delivered = 0;	//RRCPTs
+atomic_long bounced = 0;
+atomic_long nacked = 0;
+atomic_long lost = 0;
+atomic_long dlvrs = 0;	//at the receiver
+sem_t answered;	//for -l
+double* latencies;	//of each DLVR, when the body is big enough to carry its send time
+long num_latencies = 0;
+long max_latencies = 0;
+
+
+void result(BVD_CLIENT* c, uint32_t msgid, int outcome, void* arg){
+	if(outcome == CLIENT_ACKED)
+		acked++;
+	if(outcome == CLIENT_DELIVERED)
+		delivered++;
+	if(outcome == CLIENT_BOUNCED)
+		bounced++;
+	if(outcome == CLIENT_NACKED)
+		nacked++;
+	if(outcome == CLIENT_LOST)
+		lost++;
+	if(arg != NULL && (outcome == CLIENT_ACKED || outcome == CLIENT_NACKED))
+		sem_post(&answered);
+}
+
+double now_sec();
+
+void dlvr(BVD_CLIENT* c, char* from, void* body, size_t length, void* arg){
+	//only the receiver's I/O thread gets here
+	double sent;
+	if(length >= sizeof(sent) && num_latencies < max_latencies){
+		memcpy(&sent, body, sizeof(sent));
+		latencies[num_latencies++] = now_sec() - sent;
+	}
+	dlvrs++;
+}
+
+int cmp_double(const void* a, const void* b){
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+void state(BVD_CLIENT* c, int up, void* arg){
+	fprintf(stderr, "%s: connection %s\n", (char*)arg, up ? "back" : "lost");
+}
+
+double now_sec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]){
+	char* host = "127.0.0.1";
+	int port = -1;
+	long total = 100000;
+	int size = 32;
+	int max_batch = 0;
+	int window = 0;
+	char* caps = NULL;
+	int lockstep = 0;
+	char* path = NULL;
+	int shm = 0;
+	int c;
+	while((c = getopt(argc, argv, "p:h:n:s:b:w:c:lu:m")) != -1){
+		if(c == 'p')
+			port = atoi(optarg);
+		if(c == 'h')
+			host = optarg;
+		if(c == 'n')
+			total = atol(optarg);
+		if(c == 's')
+			size = atoi(optarg);
+		if(c == 'b')
+			max_batch = atoi(optarg);
+		if(c == 'w')
+			window = atoi(optarg);
+		if(c == 'c')
+			caps = optarg;
+		if(c == 'l')
+			lockstep = 1;
+		if(c == 'u')
+			path = optarg;
+		if(c == 'm')
+			shm = 1;
+	}
+	if((port < 0 && path == NULL) || total < 1 || size < 0 || (shm && path == NULL)){
+		fprintf(stderr, "usage: %s -p port [-h host] [-n messages] [-s size] [-b max_batch] [-w window] [-c capabilities] [-l] [-u path [-m]]\n", argv[0]);
+		return 1;
+	}
+	sem_init(&answered, 0, 0);
+	latencies = malloc(sizeof(double) * total);
+	max_latencies = total;
+
+	char snd_handle[64], rcv_handle[64];
+	snprintf(snd_handle, sizeof(snd_handle), "cb_snd_%d", getpid());
+	snprintf(rcv_handle, sizeof(rcv_handle), "cb_rcv_%d", getpid());
+	BVD_CLIENT_CONFIG config = {host, port, rcv_handle, caps, window, max_batch, dlvr, state, rcv_handle,
+		path, shm ? BVD_SHM_RING_SIZE : 0};
+	BVD_CLIENT* rcv = client_open(&config);
+	config.handle = snd_handle;
+	config.arg = snd_handle;
+	BVD_CLIENT* snd = client_open(&config);
+	if(rcv == NULL || snd == NULL){
+		perror("client_open");
+		return 1;
+	}
+
+	char* body = malloc(size + 1);
+	memset(body, 'x', size);
+	double start = now_sec();
+	for(long i = 0; i < total; i++){
+		if(size >= (int)sizeof(double)){
+			double sent = now_sec();
+			memcpy(body, &sent, sizeof(sent));
+		}
+		if(client_send(snd, rcv_handle, body, size, result, lockstep ? body : NULL) < 0){
+			perror("client_send");
+			return 1;
+		}
+		if(lockstep)
+			sem_wait(&answered);
+	}
+	double queued = now_sec() - start;
+	client_flush(snd);
+	//the RRCPT can come back before the DLVR has been read
+	while(dlvrs < delivered)
+		usleep(100);
+	double elapsed = now_sec() - start;
+
+	printf("messages=%ld size=%d elapsed=%.3fs rate=%.0f msgs/sec queued_in=%.3fs acks=%ld rrcpts=%ld bounces=%ld nacks=%ld lost=%ld dlvrs=%ld\n",
+		total, size, elapsed, total / elapsed, queued, (long)acked, (long)delivered, (long)bounced, (long)nacked, (long)lost, (long)dlvrs);
+	if(num_latencies > 0){
+		qsort(latencies, num_latencies, sizeof(double), cmp_double);
+		printf("latency_us p50=%.1f p99=%.1f max=%.1f\n", latencies[num_latencies / 2] * 1e6,
+			latencies[num_latencies * 99 / 100] * 1e6, latencies[num_latencies - 1] * 1e6);
+	}
+
+	client_close(snd);
+	client_close(rcv);
+	free(body);
+	free(latencies);
+	return 0;
+}
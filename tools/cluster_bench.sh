@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Scaling benchmark for cluster mode (see include/cluster.h).
+#
+# For each cluster size, starts that many nodes on loopback and runs one
+# load generator per node, whose sender logs in at node i and receiver at
+# node i+1, so that with more than one node every message crosses a link.
+# Prints the total delivered msgs/sec per cluster size.
+#
+#   tools/cluster_bench.sh [base port] [messages per generator] [loadgen options...]
+#
+# Run from the top of the tree after "make bavarde tools".
+
+BASE=${1:-9400}
+COUNT=${2:-200000}
+shift 2 2>/dev/null
+OPTS="$@"
+
+for NODES in 1 2 4; do
+	LIST=""
+	for i in $(seq 0 $((NODES - 1))); do
+		LIST="$LIST${LIST:+,}127.0.0.1:$((BASE + i))"
+	done
+	PIDS=""
+	for i in $(seq 0 $((NODES - 1))); do
+		./bin/bavarde -p $((BASE + i)) -C "$LIST" -N $i 2>/dev/null &
+		PIDS="$PIDS $!"
+	done
+	sleep 0.5
+
+	OUT=$(mktemp)
+	GENS=""
+	for i in $(seq 0 $((NODES - 1))); do
+		./bin/bvd_loadgen -p $((BASE + i)) -r $((BASE + (i + 1) % NODES)) -n $COUNT $OPTS >> "$OUT" &
+		GENS="$GENS $!"
+	done
+	wait $GENS
+	TOTAL=$(sed -n 's/.* rate=\([0-9]*\) .*/\1/p' "$OUT" | awk '{s += $1} END {print s}')
+	echo "nodes=$NODES generators=$NODES total_rate=$TOTAL msgs/sec"
+	cat "$OUT" | sed 's/^/  /'
+	rm -f "$OUT"
+
+	kill $PIDS 2>/dev/null
+	wait 2>/dev/null
+	BASE=$((BASE + NODES))
+done
@@ -0,0 +1,82 @@
+/*
+ * Directory micro-benchmark.
+ *
+ * Registers n handles, then times lookups of registered handles (hits),
+ * of handles that were never registered (misses), and the registering
+ * and unregistering themselves.
+ *
+ *   bvd_dirbench [-n handles] [-l lookups]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "directory.h"
+#include "mailbox.h"
+
+
+double now_nsec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char* argv[]){
+	int n = 100000;
+	long lookups = 1000000;
+	int c;
+	while((c = getopt(argc, argv, "n:l:")) != -1){
+		if(c == 'n')
+			n = atoi(optarg);
+		if(c == 'l')
+			lookups = atol(optarg);
+	}
+
+	char** handles = malloc(sizeof(char*) * n);
+	char** missing = malloc(sizeof(char*) * n);
+	for(int i = 0; i < n; i++){
+		char buf[64];
+		snprintf(buf, sizeof(buf), "user_%d@example.org", i);
+		handles[i] = strdup(buf);
+		snprintf(buf, sizeof(buf), "nobody_%d@example.org", i);
+		missing[i] = strdup(buf);
+	}
+
+	dir_init();
+	double start = now_nsec();
+	for(int i = 0; i < n; i++){
+		MAILBOX* mb = dir_register(handles[i], -1);
+		if(mb == NULL){
+			fprintf(stderr, "cannot register %s\n", handles[i]);
+			return 1;
+		}
+		mb_unref(mb);
+	}
+	double reg = (now_nsec() - start) / n;
+
+	unsigned seed = 1;
+	start = now_nsec();
+	for(long i = 0; i < lookups; i++){
+		MAILBOX* mb = dir_lookup(handles[rand_r(&seed) % n]);
+		mb_unref(mb);
+	}
+	double hit = (now_nsec() - start) / lookups;
+
+	start = now_nsec();
+	for(long i = 0; i < lookups; i++){
+		if(dir_lookup(missing[rand_r(&seed) % n]) != NULL)
+			return 1;
+	}
+	double miss = (now_nsec() - start) / lookups;
+
+	start = now_nsec();
+	for(int i = 0; i < n; i++)
+		dir_unregister(handles[i]);
+	double unreg = (now_nsec() - start) / n;
+
+	printf("handles=%d lookups=%ld register=%.0fns lookup_hit=%.0fns lookup_miss=%.0fns unregister=%.0fns\n",
+		n, lookups, reg, hit, miss, unreg);
+	return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * What an idle client costs the Bavarde server.
+ *
+ * Opens n connections, logs each one in and leaves them all idle, then
+ * reads the server's resident memory and thread count from /proc and
+ * reports how much they grew per connection.
+ *
+ *   bvd_idleconns -p <port> -P <server pid> [-h host] [-n connections]
+ *
+ * The server has to run on the same machine, and the process needs
+ * enough file descriptors for n connections (ulimit -n).
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+
+
+int open_clientfd(char* host, int port){
+	struct addrinfo hints, *list, *p;
+	char service[16];
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+	if(getaddrinfo(host, service, &hints, &list) != 0)
+		return -1;
+	for(p = list; p != NULL; p = p->ai_next){
+		if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+			continue;
+		if(connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(list);
+	return fd;
+}
+
+int login(int fd, char* handle){
+	bvd_packet_header hdr;
+	void* payload = NULL;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = BVD_LOGIN_PKT;
+	hdr.msgid = 1;
+	hdr.payload_length = strlen(handle);
+	if(proto_send_packet(fd, &hdr, handle) < 0)
+		return -1;
+	if(proto_recv_packet(fd, &hdr, &payload) < 0)
+		return -1;
+	free(payload);
+	return hdr.type == BVD_ACK_PKT ? 0 : -1;
+}
+
+/*
+	Reads VmRSS (in kB) and Threads from /proc/<pid>/status.
+*/
+int read_status(int pid, long* rss_kb, long* threads){
+	char path[64], line[256];
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	FILE* f = fopen(path, "r");
+	if(f == NULL)
+		return -1;
+	*rss_kb = *threads = -1;
+	while(fgets(line, sizeof(line), f) != NULL){
+		sscanf(line, "VmRSS: %ld", rss_kb);
+		sscanf(line, "Threads: %ld", threads);
+	}
+	fclose(f);
+	return *rss_kb < 0 || *threads < 0 ? -1 : 0;
+}
+
+int main(int argc, char* argv[]){
+	char* host = "127.0.0.1";
+	int port = -1;
+	int pid = -1;
+	int n = 1000;
+	int c;
+	while((c = getopt(argc, argv, "p:P:h:n:")) != -1){
+		if(c == 'p')
+			port = atoi(optarg);
+		if(c == 'P')
+			pid = atoi(optarg);
+		if(c == 'h')
+			host = optarg;
+		if(c == 'n')
+			n = atoi(optarg);
+	}
+	if(port < 0 || pid < 0 || n < 1){
+		fprintf(stderr, "usage: %s -p port -P server_pid [-h host] [-n connections]\n", argv[0]);
+		return 1;
+	}
+
+	long rss_before, threads_before, rss_after, threads_after;
+	if(read_status(pid, &rss_before, &threads_before) < 0){
+		fprintf(stderr, "cannot read /proc/%d/status\n", pid);
+		return 1;
+	}
+
+	int* fds = malloc(n * sizeof(int));
+	for(int i = 0; i < n; i++){
+		char handle[64];
+		snprintf(handle, sizeof(handle), "idle_%d_%d", getpid(), i);
+		fds[i] = open_clientfd(host, port);
+		if(fds[i] < 0 || login(fds[i], handle) < 0){
+			fprintf(stderr, "connection %d: cannot connect and log in\n", i);
+			return 1;
+		}
+	}
+	//let the server's threads settle
+	sleep(1);
+	if(read_status(pid, &rss_after, &threads_after) < 0){
+		fprintf(stderr, "cannot read /proc/%d/status\n", pid);
+		return 1;
+	}
+
+	printf("connections=%d rss_delta=%ldkB rss_per_conn=%.1fkB threads_delta=%ld threads_per_conn=%.2f\n",
+		n, rss_after - rss_before, (double)(rss_after - rss_before) / n,
+		threads_after - threads_before, (double)(threads_after - threads_before) / n);
+
+	for(int i = 0; i < n; i++)
+		close(fds[i]);
+	free(fds);
+	return 0;
+}
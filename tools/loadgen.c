@@ -0,0 +1,505 @@
+/*
+ * Load generator for the Bavarde server.
+ *
+ * Logs in a sender and a receiver, pushes messages from one to the other
+ * as fast as the server takes them and reports delivered msgs/sec.
+ *
+ *   bvd_loadgen -p <port> [-h host] [-r port] [-n messages] [-b batch] [-s size]
+ *               [-w window] [-c capabilities] [-S] [-a] [-Y reads]
+ *
+ * With -b 0 (the default) every message is a plain SEND; otherwise
+ * messages are packed b at a time into SEND_BATCH packets.
+ * Bodies are chatty JSON, s bytes long.
+ * -c asks for capabilities at LOGIN, e.g. -c "coalesce lz4".
+ * -S prints the server's STATS report at the end.
+ * -r logs the receiver in at another port, e.g. another node of a cluster.
+ * The longest wait between two deliveries is reported as max_gap, which
+ * is the service gap if the server is hot restarted during the run.
+ * lat_p50 and lat_p99 are the time from handing a message to the socket
+ * to its DLVR coming back, which counts the window's queueing too; run
+ * with -w 1 for the latency of a lone message.
+ * -a has the receiver send a USERS request every millisecond while the
+ * messages flow, and reports the time to its ACK as ack_p50 and ack_p99:
+ * how long an answer waits behind the deliveries queued for a client.
+ * With -c v2 both connections switch to the compact framing of wire.h,
+ * and the sender names the receiver by ID after the first message.
+ * out_per_msg and in_per_msg are the bytes of the SENDs (or batches) and
+ * of the DLVRs, headers included, per message.
+ * -Y, against a server keeping history (see history.h), has the receiver
+ * log in again after the run and send that many HISTORY requests, one
+ * after the other, each for the BVD_HISTORY_MAX_RANGE messages up to
+ * the oldest the last one got back (from the newest again once none
+ * are left), and reports the messages read back per second.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "batch.h"
+#include "coalesce.h"
+#include "compress.h"
+#include "metrics.h"
+#include "wire.h"
+#include "history.h"
+
+
+//GLOBAL VARIABLES
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t progress = PTHREAD_COND_INITIALIZER;
+long delivered = 0;
+long acked = 0;
+long nacked = 0;
+long rrcpts = 0;
+long bounced = 0;
+long packets_in = 0;
+double last_dlvr = 0;
+double max_gap = 0;
+double* sent_at = NULL;	//sent_at[msgid - 1]: when the message went out
+double* latency = NULL;
+long num_latencies = 0;
+long total = 100000;
+#define PROBE_BASE 0x80000000u	//msgids of the -a requests
+#define PROBE_MAX (1 << 20)
+double* probe_at = NULL;	//probe_at[msgid - PROBE_BASE]: when the request went out
+double* ack_latency = NULL;
+long num_ack_latencies = 0;
+int probing = 0;
+int wire = BVD_WIRE_V1;	//of both connections, once logged in
+long bytes_in = 0;	//of the DLVRs
+
+
+int open_clientfd(char* host, int port){
+	struct addrinfo hints, *list, *p;
+	char service[16];
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+	if(getaddrinfo(host, service, &hints, &list) != 0)
+		return -1;
+	for(p = list; p != NULL; p = p->ai_next){
+		if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+			continue;
+		if(connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(list);
+
+	int one = 1;
+	if(fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+/*
+	Sends a packet with the v2 flags and ID, see wire.h.
+	Returns the bytes it took, or -1 on error.
+*/
+int send_named(int fd, int format, uint8_t type, uint32_t msgid, int flags, uint32_t id, void* payload, uint32_t length){
+	bvd_packet_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = type;
+	hdr.msgid = msgid;
+	hdr.payload_length = length;
+	if(format == BVD_WIRE_V1)
+		return proto_send_packet(fd, &hdr, payload) < 0 ? -1 : (int)(sizeof(hdr) + length);
+	uint8_t head[BVD_WIRE_MAX_HEADER];
+	int hlen = wire_encode_header(format, &hdr, flags, id, head);
+	return wire_send_packet(fd, format, &hdr, flags, id, payload) < 0 ? -1 : hlen + (int)length;
+}
+
+int send_simple(int fd, int format, uint8_t type, uint32_t msgid, void* payload, uint32_t length){
+	return send_named(fd, format, type, msgid, 0, 0, payload, length);
+}
+
+/*
+	Logs in, and returns the wire format the connection has from now on.
+*/
+int login(int fd, char* handle, char* caps){
+	bvd_packet_header hdr;
+	void* payload = NULL;
+	char line[256];
+	if(caps != NULL)
+		snprintf(line, sizeof(line), "%s\r\n%s", handle, caps);
+	else
+		snprintf(line, sizeof(line), "%s", handle);
+	if(send_simple(fd, BVD_WIRE_V1, BVD_LOGIN_PKT, 1, line, strlen(line)) < 0)
+		return -1;
+	if(proto_recv_packet(fd, &hdr, &payload) < 0)
+		return -1;
+	int format = payload != NULL && strstr(payload, "v2") != NULL ? BVD_WIRE_V2 : BVD_WIRE_V1;
+	free(payload);
+	return hdr.type == BVD_ACK_PKT ? format : -1;
+}
+
+/*
+	Number of msgids covered by a ranged notice.
+*/
+long range_count(void* payload, uint32_t length){
+	long count = 0;
+	bvd_msgid_range* ranges = payload;
+	for(uint32_t i = 0; i < length / sizeof(bvd_msgid_range); i++)
+		count += ntohl(ranges[i].count);
+	return count;
+}
+
+/*
+	Drains one connection, counting what comes back.
+*/
+double now_sec();
+
+void* reader(void* arg){
+	int fd = *((int*)arg);
+	bvd_packet_header hdr;
+	void* payload;
+	int flags;
+	uint32_t id;
+	while(wire_recv_packet(fd, wire, &hdr, &flags, &id, &payload) == 0){
+		pthread_mutex_lock(&lock);
+		packets_in += 1;
+		if(hdr.type == BVD_DLVR_PKT){
+			uint8_t head[BVD_WIRE_MAX_HEADER];
+			bytes_in += wire_encode_header(wire, &hdr, flags, id, head) + hdr.payload_length;
+			double now = now_sec();
+			if(delivered > 0 && now - last_dlvr > max_gap)
+				max_gap = now - last_dlvr;
+			last_dlvr = now;
+			delivered += 1;
+			if(hdr.msgid >= 1 && hdr.msgid <= total)
+				latency[num_latencies++] = now - sent_at[hdr.msgid - 1];
+		}
+		else if(hdr.type == BVD_ACK_PKT && hdr.msgid >= PROBE_BASE)
+			ack_latency[num_ack_latencies++] = now_sec() - probe_at[hdr.msgid - PROBE_BASE];
+		else if(hdr.type == BVD_ACK_PKT)
+			acked += 1;
+		else if(hdr.type == BVD_NACK_PKT)
+			nacked += 1;
+		else if(hdr.type == BVD_RRCPT_PKT)
+			rrcpts += 1;
+		else if(hdr.type == BVD_BOUNCE_PKT)
+			bounced += 1;
+		else if(hdr.type == BVD_ACK_RANGE_PKT)
+			acked += range_count(payload, hdr.payload_length);
+		else if(hdr.type == BVD_RRCPT_RANGE_PKT)
+			rrcpts += range_count(payload, hdr.payload_length);
+		pthread_cond_broadcast(&progress);
+		pthread_mutex_unlock(&lock);
+		free(payload);
+	}
+	return NULL;
+}
+
+/*
+	Sends the -a requests on the receiver's connection until told to stop.
+*/
+void* prober(void* arg){
+	int fd = *((int*)arg);
+	for(long i = 0; i < PROBE_MAX; i++){
+		pthread_mutex_lock(&lock);
+		int go_on = probing;
+		probe_at[i] = now_sec();
+		pthread_mutex_unlock(&lock);
+		if(!go_on)
+			break;
+		send_simple(fd, wire, BVD_USERS_PKT, PROBE_BASE + i, NULL, 0);
+		usleep(1000);
+	}
+	return NULL;
+}
+
+/*
+	Fills body with JSON records until it is size bytes long.
+*/
+void make_body(char* body, int size){
+	char record[128];
+	int len = 0;
+	for(int seq = 0; len < size; seq++){
+		int n = snprintf(record, sizeof(record),
+			"{\"seq\":%d,\"user\":\"loadgen\",\"type\":\"chat\",\"text\":\"lorem ipsum dolor sit amet\"},", seq);
+		if(n > size - len)
+			n = size - len;
+		memcpy(body + len, record, n);
+		len += n;
+	}
+}
+
+void print_stats(char* host, int port){
+	int fd = open_clientfd(host, port);
+	char handle[64];
+	snprintf(handle, sizeof(handle), "lg_stats_%d", getpid());
+	if(fd < 0 || login(fd, handle, NULL) < 0)
+		return;
+
+	bvd_packet_header hdr;
+	void* payload = NULL;
+	if(send_simple(fd, BVD_WIRE_V1, BVD_STATS_PKT, 2, NULL, 0) >= 0 && proto_recv_packet(fd, &hdr, &payload) == 0){
+		if(payload != NULL)
+			printf("%s", (char*)payload);
+		free(payload);
+	}
+	send_simple(fd, BVD_WIRE_V1, BVD_LOGOUT_PKT, 3, NULL, 0);
+	close(fd);
+}
+
+/*
+	Logs handle in again and pages back through its history, reads
+	times, then reports how fast it came.
+*/
+void read_history(char* host, int port, char* handle, char* caps, int reads){
+	int fd = open_clientfd(host, port);
+	int format;
+	if(fd < 0 || (format = login(fd, handle, caps)) < 0){
+		fprintf(stderr, "cannot log in again to read the history\n");
+		return;
+	}
+	long messages = 0;
+	long bytes = 0;
+	uint64_t until = 0;
+	double start = now_sec();
+	for(int i = 0; i < reads; i++){
+		char request[BVD_HISTORY_REQUEST_SIZE];
+		uint64_t since_be = 0;
+		uint64_t until_be = htobe64(until);
+		uint32_t max_be = htonl(BVD_HISTORY_MAX_RANGE);
+		memcpy(request, &since_be, 8);
+		memcpy(request + 8, &until_be, 8);
+		memcpy(request + 16, &max_be, 4);
+		if(send_simple(fd, format, BVD_HISTORY_PKT, i + 1, request, sizeof(request)) < 0)
+			break;
+
+		bvd_packet_header hdr;
+		void* payload;
+		int flags;
+		uint32_t id;
+		uint64_t oldest = 0;
+		while(wire_recv_packet(fd, format, &hdr, &flags, &id, &payload) == 0){
+			if(hdr.type == BVD_HISTORY_PKT && hdr.payload_length >= BVD_HISTORY_TIME_SIZE){
+				uint64_t time_be;
+				memcpy(&time_be, payload, sizeof(time_be));
+				if(oldest == 0)
+					oldest = be64toh(time_be);
+				messages += 1;
+				bytes += hdr.payload_length;
+			}
+			free(payload);
+			if(hdr.type == BVD_NACK_PKT){
+				fprintf(stderr, "HISTORY NACKed, is the server keeping history?\n");
+				reads = i;
+			}
+			if(hdr.type == BVD_ACK_PKT || hdr.type == BVD_NACK_PKT)
+				break;
+		}
+		//the oldest millisecond again, see history.h, or back from the
+		//newest once there is nothing older
+		until = oldest == 0 ? 0 : oldest + 1;
+	}
+	double elapsed = now_sec() - start;
+	printf("history_reads=%d history_msgs=%ld elapsed=%.3fs rate=%.0f msgs/sec %.1f MB/sec\n",
+		reads, messages, elapsed, messages / elapsed, bytes / elapsed / 1048576);
+	send_simple(fd, format, BVD_LOGOUT_PKT, 0, NULL, 0);
+	close(fd);
+}
+
+int compare_double(const void* a, const void* b){
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+	The p-th percentile of n latencies, in microseconds.  Sorts them.
+*/
+double latency_percentile(double* latencies, long n, double p){
+	if(n == 0)
+		return 0;
+	qsort(latencies, n, sizeof(double), compare_double);
+	long i = (long)(p / 100 * n);
+	if(i >= n)
+		i = n - 1;
+	return latencies[i] * 1e6;
+}
+
+double now_sec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]){
+	char* host = "127.0.0.1";
+	int port = -1;
+	int rcv_port = -1;
+	int batch = 0;
+	int size = 32;
+	long window = 8192;
+	char* caps = NULL;
+	int stats = 0;
+	int probe = 0;
+	int history_reads = 0;
+	int c;
+	while((c = getopt(argc, argv, "p:h:r:n:b:s:w:c:SaY:")) != -1){
+		if(c == 'p')
+			port = atoi(optarg);
+		if(c == 'h')
+			host = optarg;
+		if(c == 'r')
+			rcv_port = atoi(optarg);
+		if(c == 'n')
+			total = atol(optarg);
+		if(c == 'b')
+			batch = atoi(optarg);
+		if(c == 's')
+			size = atoi(optarg);
+		if(c == 'w')
+			window = atol(optarg);
+		if(c == 'c')
+			caps = optarg;
+		if(c == 'S')
+			stats = 1;
+		if(c == 'a')
+			probe = 1;
+		if(c == 'Y')
+			history_reads = atoi(optarg);
+	}
+	if(rcv_port < 0)
+		rcv_port = port;
+	if(port < 0 || batch < 0 || batch > BVD_BATCH_MAX_RECORDS){
+		fprintf(stderr, "usage: %s -p port [-h host] [-r port] [-n messages] [-b batch] [-s size] [-w window] [-c capabilities] [-S] [-a] [-Y reads]\n", argv[0]);
+		return 1;
+	}
+
+	char snd_handle[64], rcv_handle[64];
+	snprintf(snd_handle, sizeof(snd_handle), "lg_snd_%d", getpid());
+	snprintf(rcv_handle, sizeof(rcv_handle), "lg_rcv_%d", getpid());
+
+	int snd = open_clientfd(host, port);
+	int rcv = open_clientfd(host, rcv_port);
+	if(snd < 0 || rcv < 0 || (wire = login(snd, snd_handle, caps)) < 0 || login(rcv, rcv_handle, caps) < 0){
+		fprintf(stderr, "cannot connect and log in to %s:%d\n", host, port);
+		return 1;
+	}
+	if(rcv_port != port){
+		//give the receiver's LOGIN time to reach the rest of the cluster
+		usleep(100000);
+	}
+
+	sent_at = calloc(total, sizeof(double));
+	latency = calloc(total, sizeof(double));
+	probe_at = calloc(PROBE_MAX, sizeof(double));
+	ack_latency = calloc(PROBE_MAX, sizeof(double));
+
+	pthread_t snd_tid, rcv_tid, probe_tid;
+	pthread_create(&snd_tid, NULL, reader, &snd);
+	pthread_create(&rcv_tid, NULL, reader, &rcv);
+	if(probe){
+		probing = 1;
+		pthread_create(&probe_tid, NULL, prober, &rcv);
+	}
+
+	char* body = malloc(BVD_FRAME_BOUND(size));
+	int body_len = size;
+	make_body(body, size);
+	if(caps != NULL && strstr(caps, "lz4") != NULL){
+		//a client with the capability sends framed bodies
+		char* framed = malloc(BVD_FRAME_BOUND(size));
+		body_len = bvd_frame_body(body, size, 1, framed);
+		free(body);
+		body = framed;
+	}
+	int send_len = strlen(rcv_handle) + 2 + body_len;
+	char* send_payload = malloc(send_len);
+	sprintf(send_payload, "%s\r\n", rcv_handle);
+	memcpy(send_payload + strlen(rcv_handle) + 2, body, body_len);
+
+	char* buf = NULL;
+	size_t len = 0, cap = 0;
+	long packets_out = 0;
+	long bytes_out = 0;
+	//with v2, the receiver is bound to ID 1 by the first message, see wire.h
+	int rcv_line = strlen(rcv_handle) + 2;
+
+	double start = now_sec();
+	long sent = 0;
+	while(sent < total){
+		//keep at most window messages in flight
+		pthread_mutex_lock(&lock);
+		while(sent - delivered - bounced - nacked >= window)
+			pthread_cond_wait(&progress, &lock);
+		pthread_mutex_unlock(&lock);
+
+		if(batch == 0){
+			sent_at[sent] = now_sec();
+			if(wire == BVD_WIRE_V1)
+				bytes_out += send_simple(snd, wire, BVD_SEND_PKT, sent + 1, send_payload, send_len);
+			else if(sent == 0)
+				bytes_out += send_named(snd, wire, BVD_SEND_PKT, sent + 1, BVD_WIRE_ID | BVD_WIRE_NAMED, 1, send_payload, send_len);
+			else
+				bytes_out += send_named(snd, wire, BVD_SEND_PKT, sent + 1, BVD_WIRE_ID, 1, send_payload + rcv_line, send_len - rcv_line);
+			sent += 1;
+		}
+		else{
+			len = 0;
+			int n = 0;
+			for(; n < batch && sent + n < total; n++)
+				bvd_batch_append(&buf, &len, &cap, sent + n + 1, rcv_handle, body, body_len);
+			double now = now_sec();
+			for(int i = 0; i < n; i++)
+				sent_at[sent + i] = now;
+			bytes_out += send_simple(snd, wire, BVD_SEND_BATCH_PKT, sent + 1, buf, len);
+			sent += n;
+		}
+		packets_out += 1;
+	}
+
+	pthread_mutex_lock(&lock);
+	//a NACKed message is done with too, e.g. with a rate limit
+	while(delivered + bounced + nacked < total)
+		pthread_cond_wait(&progress, &lock);
+	double elapsed = now_sec() - start;
+	probing = 0;
+	printf("messages=%ld batch=%d size=%d elapsed=%.3fs rate=%.0f msgs/sec "
+		"packets_out=%ld packets_in=%ld acks=%ld nacks=%ld rrcpts=%ld bounces=%ld max_gap=%.1fms "
+		"out_per_msg=%.1fB in_per_msg=%.1fB lat_p50=%.0fus lat_p99=%.0fus",
+		total, batch, size, elapsed, total / elapsed,
+		packets_out, packets_in, acked, nacked, rrcpts, bounced, max_gap * 1000,
+		(double)bytes_out / total, delivered > 0 ? (double)bytes_in / delivered : 0,
+		latency_percentile(latency, num_latencies, 50), latency_percentile(latency, num_latencies, 99));
+	if(probe)
+		printf(" probes=%ld ack_p50=%.0fus ack_p99=%.0fus", num_ack_latencies,
+			latency_percentile(ack_latency, num_ack_latencies, 50), latency_percentile(ack_latency, num_ack_latencies, 99));
+	printf("\n");
+	pthread_mutex_unlock(&lock);
+	if(probe)
+		pthread_join(probe_tid, NULL);
+
+	send_simple(snd, wire, BVD_LOGOUT_PKT, 0, NULL, 0);
+	send_simple(rcv, wire, BVD_LOGOUT_PKT, 0, NULL, 0);
+	if(history_reads > 0){
+		//the handle is free again once the server has closed the connection
+		pthread_join(rcv_tid, NULL);
+		read_history(host, rcv_port, rcv_handle, caps, history_reads);
+	}
+	if(stats)
+		print_stats(host, port);
+	close(snd);
+	close(rcv);
+	free(buf);
+	free(body);
+	free(send_payload);
+	free(sent_at);
+	free(latency);
+	free(probe_at);
+	free(ack_latency);
+	return 0;
+}
@@ -0,0 +1,265 @@
+/*
+ * Replays a packet trace (see trace.h) against a Bavarde server.
+ *
+ * Every connection of the trace is opened at its first packet and
+ * closed where it ended, and every packet is sent as it was recorded,
+ * with filler in place of the payload bytes the trace does not have.
+ * By default packets go out when they did in the trace (-s 2: twice as
+ * fast); with -f they go out as fast as the server takes them, in the
+ * same order but without the gaps, so a client may log out before what
+ * was sent to it arrives.  What the server sends back is read and
+ * counted, nothing more.  The replay speaks v1 (see wire.h) whatever
+ * the recorded clients did: the trace has their packets in v1 form, and
+ * "v2" is struck from the capabilities they logged in with.
+ *
+ *   bvd_replay -p <port> [-h host] [-f] [-s speed] <trace>
+ *
+ * lag is how late packets went out compared to the trace, which is how
+ * far the server (or the replay) fell behind the recorded traffic.  The
+ * handles of the trace must not be logged in on the server already.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "trace.h"
+
+
+//GLOBAL VARIABLES
+int epfd;
+atomic_long bytes_in = 0;
+int* conn_fds = NULL;	//conn_fds[conn]: -1 if not open
+uint32_t num_conns = 0;
+char filler[65536];
+
+
+int open_clientfd(char* host, int port){
+	struct addrinfo hints, *list, *p;
+	char service[16];
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+	if(getaddrinfo(host, service, &hints, &list) != 0)
+		return -1;
+	for(p = list; p != NULL; p = p->ai_next){
+		if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+			continue;
+		if(connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(list);
+
+	int one = 1;
+	if(fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+double now_sec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+	Reads and drops whatever the server sends on any connection.
+*/
+void* drainer(void* arg){
+	struct epoll_event events[64];
+	char buf[65536];
+	while(1){
+		int n = epoll_wait(epfd, events, 64, -1);
+		for(int i = 0; i < n; i++){
+			ssize_t got = recv(events[i].data.fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if(got > 0)
+				atomic_fetch_add(&bytes_in, got);
+			else if(got == 0)
+				epoll_ctl(epfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+		}
+	}
+	return NULL;
+}
+
+/*
+	The socket of a connection of the trace, opened on first use.
+*/
+int conn_fd(uint32_t conn, char* host, int port){
+	if(conn >= num_conns){
+		uint32_t n = num_conns == 0 ? 64 : num_conns;
+		while(n <= conn)
+			n *= 2;
+		conn_fds = realloc(conn_fds, n * sizeof(int));
+		for(uint32_t i = num_conns; i < n; i++)
+			conn_fds[i] = -1;
+		num_conns = n;
+	}
+	if(conn_fds[conn] < 0){
+		int fd = open_clientfd(host, port);
+		if(fd < 0)
+			return -1;
+		struct epoll_event ev = {EPOLLIN, {.fd = fd}};
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+		conn_fds[conn] = fd;
+	}
+	return conn_fds[conn];
+}
+
+/*
+	Blanks out the "v2" capability of a LOGIN payload, which keeps its
+	length and is still parsed the same, v2 aside.
+*/
+void strip_v2(char* payload, uint32_t length){
+	char* eol = memchr(payload, '\n', length);
+	if(eol == NULL)
+		return;
+	for(char* p = eol + 1; p + 2 <= payload + length; p++){
+		if(memcmp(p, "v2", 2) == 0 && (p == eol + 1 || p[-1] == ' ') && (p + 2 == payload + length || p[2] == ' ' || p[2] == '\r' || p[2] == '\n'))
+			memset(p, ' ', 2);
+	}
+}
+
+/*
+	Sends a packet of the trace: the stored payload bytes, then filler.
+*/
+int send_record(int fd, BVD_TRACE_RECORD* rec, char* stored){
+	bvd_packet_header hdr = rec->hdr;
+	if(proto_send_header(fd, &hdr) < 0)
+		return -1;
+	if(rec->stored > 0 && proto_write_fully(fd, stored, rec->stored) < 0)
+		return -1;
+	uint32_t rest = rec->hdr.payload_length - rec->stored;
+	while(rest > 0){
+		uint32_t n = rest < sizeof(filler) ? rest : sizeof(filler);
+		if(proto_write_fully(fd, filler, n) < 0)
+			return -1;
+		rest -= n;
+	}
+	return 0;
+}
+
+int compare_double(const void* a, const void* b){
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char* argv[]){
+	char* host = "127.0.0.1";
+	int port = -1;
+	int fast = 0;
+	double speed = 1;
+	int c;
+	while((c = getopt(argc, argv, "p:h:fs:")) != -1){
+		if(c == 'p')
+			port = atoi(optarg);
+		if(c == 'h')
+			host = optarg;
+		if(c == 'f')
+			fast = 1;
+		if(c == 's')
+			speed = atof(optarg);
+	}
+	if(port < 0 || optind != argc - 1 || speed <= 0){
+		fprintf(stderr, "usage: %s -p port [-h host] [-f] [-s speed] trace\n", argv[0]);
+		return 1;
+	}
+
+	FILE* f = fopen(argv[optind], "r");
+	struct stat st;
+	if(f == NULL || fstat(fileno(f), &st) < 0){
+		perror(argv[optind]);
+		return 1;
+	}
+	char* trace = malloc(st.st_size);
+	size_t size = fread(trace, 1, st.st_size, f);
+	fclose(f);
+	size_t magic = strlen(BVD_TRACE_MAGIC);
+	if(size < magic || memcmp(trace, BVD_TRACE_MAGIC, magic) != 0){
+		fprintf(stderr, "%s: not a trace\n", argv[optind]);
+		return 1;
+	}
+	memset(filler, 'x', sizeof(filler));
+
+	epfd = epoll_create1(0);
+	pthread_t tid;
+	pthread_create(&tid, NULL, drainer, NULL);
+
+	long count = 0;
+	for(size_t pos = magic; pos + sizeof(BVD_TRACE_RECORD) <= size; pos += sizeof(BVD_TRACE_RECORD) + ((BVD_TRACE_RECORD*)(trace + pos))->stored)
+		count++;
+	double* lag = malloc(sizeof(double) * (count > 0 ? count : 1));
+	long packets = 0, conns = 0, failed = 0;
+	double recorded = 0;
+
+	double start = now_sec();
+	size_t pos = magic;
+	while(pos + sizeof(BVD_TRACE_RECORD) <= size){
+		BVD_TRACE_RECORD rec;
+		memcpy(&rec, trace + pos, sizeof(rec));
+		char* stored = trace + pos + sizeof(rec);
+		pos += sizeof(rec) + rec.stored;
+		if(pos > size)
+			break; //cut short
+
+		recorded = rec.usec / 1e6;
+		double due = start + recorded / speed;
+		if(!fast){
+			double wait = due - now_sec();
+			if(wait > 0)
+				usleep(wait * 1e6);
+		}
+
+		if(rec.kind == BVD_TRACE_CLOSE){
+			if(rec.conn < num_conns && conn_fds[rec.conn] >= 0){
+				close(conn_fds[rec.conn]);
+				conn_fds[rec.conn] = -1;
+			}
+			continue;
+		}
+		if(rec.hdr.type == BVD_LOGIN_PKT && rec.stored == rec.hdr.payload_length)
+			strip_v2(stored, rec.stored);
+		int opened = rec.conn >= num_conns || conn_fds[rec.conn] < 0;
+		int fd = conn_fd(rec.conn, host, port);
+		if(fd < 0 || send_record(fd, &rec, stored) < 0){
+			failed++;
+			continue;
+		}
+		conns += opened;
+		if(!fast)
+			lag[packets] = now_sec() - due;
+		packets++;
+	}
+	double elapsed = now_sec() - start;
+	//give the answers time to come in
+	long last;
+	do{
+		last = atomic_load(&bytes_in);
+		usleep(200000);
+	}while(atomic_load(&bytes_in) != last);
+
+	printf("packets=%ld connections=%ld failed=%ld recorded=%.3fs elapsed=%.3fs rate=%.0f pkts/sec bytes_in=%ld",
+		packets, conns, failed, recorded, elapsed, packets / elapsed, atomic_load(&bytes_in));
+	if(!fast && packets > 0){
+		qsort(lag, packets, sizeof(double), compare_double);
+		printf(" lag_p50=%.0fus lag_p99=%.0fus lag_max=%.0fus",
+			lag[packets / 2] * 1e6, lag[packets * 99 / 100] * 1e6, lag[packets - 1] * 1e6);
+	}
+	printf("\n");
+	free(lag);
+	free(trace);
+	return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Scaling benchmark for the sharded runtime (see include/shard.h).
+#
+# For each shard count, starts a server with that many shards and runs
+# as many load generators against it at once.  The sender and receiver
+# of a generator get consecutive handle IDs, so with more than one shard
+# they live on different shards and every message crosses a queue.
+# Prints the total delivered msgs/sec per shard count.
+#
+#   tools/shard_bench.sh [port] [messages per generator] [loadgen options...]
+#
+# Run from the top of the tree after "make bavarde tools".
+
+PORT=${1:-9500}
+COUNT=${2:-200000}
+shift 2 2>/dev/null
+OPTS="$@"
+
+for SHARDS in 1 2 4 8; do
+	./bin/bavarde -p $PORT -S $SHARDS 2>/dev/null &
+	PID=$!
+	sleep 0.5
+
+	OUT=$(mktemp)
+	GENS=""
+	for i in $(seq 1 $SHARDS); do
+		./bin/bvd_loadgen -p $PORT -n $COUNT $OPTS >> "$OUT" &
+		GENS="$GENS $!"
+	done
+	wait $GENS
+	TOTAL=$(sed -n 's/.* rate=\([0-9]*\) .*/\1/p' "$OUT" | awk '{s += $1} END {print s}')
+	echo "shards=$SHARDS generators=$SHARDS total_rate=$TOTAL msgs/sec"
+	cat "$OUT" | sed 's/^/  /'
+	rm -f "$OUT"
+
+	kill $PID 2>/dev/null
+	wait 2>/dev/null
+	PORT=$((PORT + 1))
+done
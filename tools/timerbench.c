@@ -0,0 +1,123 @@
+/*
+ * Timing wheel micro-benchmark.
+ *
+ * Times starting and stopping n timers spread over s seconds, then lets
+ * n timers run out: first spread over s seconds, then all in the same
+ * millisecond.  For those it reports how late the callbacks ran and the
+ * longest single timer_run(), which is how long the loop driving the
+ * wheel (the server's writer thread) would be kept from anything else.
+ *
+ *   bvd_timerbench [-n timers] [-s seconds]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+
+#include "timer.h"
+
+
+//GLOBAL VARIABLES
+long* late_ms;
+long num_fired = 0;
+long* due_ms;
+
+
+double now_nsec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void fired(void* arg){
+	long i = (long)arg;
+	late_ms[num_fired++] = timer_now_ms() - due_ms[i];
+}
+
+int compare_long(const void* a, const void* b){
+	long x = *(const long*)a, y = *(const long*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+	Drives the wheel until n callbacks have run, the way the writer
+	thread does, and reports on them.
+*/
+void run_out(char* what, long n){
+	double longest = 0;
+	double start = now_nsec();
+	num_fired = 0;
+	while(num_fired < n){
+		struct pollfd pfd = {timer_fd(), POLLIN, 0};
+		poll(&pfd, 1, -1);
+		double t = now_nsec();
+		timer_run();
+		if(now_nsec() - t > longest)
+			longest = now_nsec() - t;
+	}
+	double elapsed = now_nsec() - start;
+	qsort(late_ms, n, sizeof(long), compare_long);
+	printf("%s: %ld timers in %.0f ms, late p50=%ldms p99=%ldms max=%ldms, longest timer_run=%.2fms\n",
+		what, n, elapsed / 1e6, late_ms[n / 2], late_ms[n * 99 / 100], late_ms[n - 1], longest / 1e6);
+}
+
+int main(int argc, char* argv[]){
+	long n = 1000000;
+	int seconds = 2;
+	int c;
+	while((c = getopt(argc, argv, "n:s:")) != -1){
+		if(c == 'n')
+			n = atol(optarg);
+		if(c == 's')
+			seconds = atoi(optarg);
+	}
+	if(n < 1 || seconds < 1){
+		fprintf(stderr, "usage: %s [-n timers] [-s seconds]\n", argv[0]);
+		return 1;
+	}
+	if(timer_init() < 0){
+		perror("timer_init");
+		return 1;
+	}
+
+	BVD_TIMER* timers = malloc(sizeof(BVD_TIMER) * n);
+	late_ms = malloc(sizeof(long) * n);
+	due_ms = malloc(sizeof(long) * n);
+	long* after = malloc(sizeof(long) * n);
+	unsigned seed = 1;
+	for(long i = 0; i < n; i++){
+		timer_setup(&timers[i], fired, (void*)i);
+		after[i] = rand_r(&seed) % (seconds * 1000);
+	}
+
+	double start = now_nsec();
+	for(long i = 0; i < n; i++)
+		timer_schedule(&timers[i], after[i]);
+	double schedule = (now_nsec() - start) / n;
+	start = now_nsec();
+	for(long i = 0; i < n; i++)
+		timer_cancel(&timers[i]);
+	double cancel = (now_nsec() - start) / n;
+	printf("schedule=%.0fns/timer cancel=%.0fns/timer\n", schedule, cancel);
+
+	for(long i = 0; i < n; i++){
+		due_ms[i] = timer_now_ms() + after[i];
+		timer_schedule(&timers[i], after[i]);
+	}
+	run_out("spread", n);
+
+	//they are all set for the same moment, however long setting them takes
+	long when = timer_now_ms() + 1000;
+	for(long i = 0; i < n; i++){
+		due_ms[i] = when;
+		timer_schedule(&timers[i], when - timer_now_ms());
+	}
+	run_out("at once", n);
+
+	free(timers);
+	free(late_ms);
+	free(due_ms);
+	free(after);
+	return 0;
+}